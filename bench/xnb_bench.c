@@ -0,0 +1,745 @@
+/* XNB decoder benchmark
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ *
+ * Generates synthetic XNB containers in memory, and times decoding,
+ * printing and exporting them separately, using libxnb directly.
+ *
+ * With --serve, also compares starting xnbdec once per file with sending
+ * the same files to a single xnbdec --serve.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xnb.h"
+
+#define BENCH_VERSION 1
+
+#define SOUND_EFFECT_READER "Microsoft.Xna.Framework.Content.SoundEffectReader"
+
+/* A growable output buffer for building containers */
+struct buf {
+	uint8_t *data;
+	size_t len;
+	size_t cap;
+};
+
+static void buf_reserve(struct buf *b, size_t len)
+{
+	if (b->len + len <= b->cap)
+		return;
+
+	while (b->len + len > b->cap)
+		b->cap = b->cap ? b->cap * 2 : 4096;
+	b->data = realloc(b->data, b->cap);
+	if (!b->data) {
+		fprintf(stderr, "Out of memory building corpus\n");
+		exit(1);
+	}
+}
+
+static void put_bytes(struct buf *b, const void *p, size_t len)
+{
+	buf_reserve(b, len);
+	memcpy(b->data + b->len, p, len);
+	b->len += len;
+}
+
+static void put_u8(struct buf *b, uint8_t v)
+{
+	put_bytes(b, &v, 1);
+}
+
+static void put_u16(struct buf *b, uint16_t v)
+{
+	uint8_t p[2];
+	put_le16(p, v);
+	put_bytes(b, p, sizeof(p));
+}
+
+static void put_u32(struct buf *b, uint32_t v)
+{
+	uint8_t p[4];
+	put_le32(p, v);
+	put_bytes(b, p, sizeof(p));
+}
+
+static void put_7bit(struct buf *b, uint32_t v)
+{
+	while (v >= 0x80) {
+		put_u8(b, v | 0x80);
+		v >>= 7;
+	}
+	put_u8(b, v);
+}
+
+static void put_string(struct buf *b, const char *s)
+{
+	size_t len = strlen(s);
+	put_7bit(b, len);
+	put_bytes(b, s, len);
+}
+
+/* 16-bit mono PCM, with data_size bytes of noise */
+static void put_sound_effect(struct buf *b, uint32_t data_size, uint32_t *seed)
+{
+	uint32_t i;
+
+	put_u32(b, 18);
+	put_u16(b, 1);
+	put_u16(b, 1);
+	put_u32(b, 22050);
+	put_u32(b, 44100);
+	put_u16(b, 2);
+	put_u16(b, 16);
+	put_u16(b, 0);
+
+	put_u32(b, data_size);
+	buf_reserve(b, data_size);
+	for (i = 0; i < data_size; i++) {
+		*seed = *seed * 1103515245 + 12345;
+		b->data[b->len + i] = *seed >> 16;
+	}
+	b->len += data_size;
+
+	put_u32(b, 0);
+	put_u32(b, data_size / 2);
+	put_u32(b, data_size * 1000 / 44100);
+}
+
+/*
+ * Readers in the table which nothing uses. A mix of unknown readers and
+ * ones which need generic plans building, like real games' tables.
+ */
+static void put_filler_reader(struct buf *b, int i)
+{
+	char name[MAX_NAME_LEN];
+
+	switch (i % 3) {
+	case 0:
+		snprintf(name, sizeof(name), "Game.Content.Reader%d, Game", i);
+		break;
+	case 1:
+		snprintf(name, sizeof(name),
+				"Microsoft.Xna.Framework.Content.ListReader`1"
+				"[[System.Int32, mscorlib, Version=4.0.0.0]]");
+		break;
+	default:
+		snprintf(name, sizeof(name),
+				"Microsoft.Xna.Framework.Content.DictionaryReader`2"
+				"[[System.String, mscorlib],"
+				"[System.Collections.Generic.List`1[[System.Single, mscorlib]], mscorlib]]");
+		break;
+	}
+
+	put_string(b, name);
+	put_u32(b, 0);
+}
+
+/*
+ * A container with a SoundEffect primary asset, n_shared SoundEffect shared
+ * resources, and n_filler unused readers before the SoundEffect's
+ */
+static void build_container(struct buf *out, uint32_t primary_size,
+		int n_shared, uint32_t shared_size, int n_filler, uint32_t *seed)
+{
+	struct buf body = { 0 };
+	int i;
+
+	put_7bit(&body, n_filler + 1);
+	for (i = 0; i < n_filler; i++)
+		put_filler_reader(&body, i);
+	put_string(&body, SOUND_EFFECT_READER);
+	put_u32(&body, 0);
+
+	put_7bit(&body, n_shared);
+	put_7bit(&body, n_filler + 1);
+	put_sound_effect(&body, primary_size, seed);
+	for (i = 0; i < n_shared; i++) {
+		put_7bit(&body, n_filler + 1);
+		put_sound_effect(&body, shared_size, seed);
+	}
+
+	out->len = 0;
+	put_bytes(out, "XNBw", 4);
+	put_u8(out, 5);
+	put_u8(out, 0);
+	put_u32(out, body.len + 10);
+	put_bytes(out, body.data, body.len);
+	free(body.data);
+}
+
+struct corpus_desc {
+	const char *name;
+	int n_files;
+	uint32_t primary_size;
+	int n_shared;
+	uint32_t shared_size;
+	int n_filler;
+};
+
+static const struct corpus_desc corpora[] = {
+	/* name              files   primary  shared  size  readers */
+	{ "tiny_sounds",      4000,      256,      0,    0,      0 },
+	{ "huge_sounds",         4, 16 << 20,      0,    0,      0 },
+	{ "shared_resources",  200,     1024,     64, 1024,      0 },
+	{ "reader_tables",     500,      256,      0,    0,    256 },
+};
+#define N_CORPORA (sizeof(corpora) / sizeof(corpora[0]))
+
+struct corpus {
+	const struct corpus_desc *desc;
+	struct buf *files;
+	uint64_t bytes;
+};
+
+enum phase {
+	PHASE_READ,
+	PHASE_DUMP,
+	PHASE_EXPORT,
+	N_PHASES,
+};
+
+static const char *phase_names[N_PHASES] = {
+	[PHASE_READ] = "read_container",
+	[PHASE_DUMP] = "dump_container",
+	[PHASE_EXPORT] = "export_object",
+};
+
+struct result {
+	/* Best of all the iterations */
+	double seconds[N_PHASES];
+	uint64_t bytes_written;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void build_corpus(struct corpus *c, const struct corpus_desc *desc)
+{
+	uint32_t seed = 1;
+	int i;
+
+	c->desc = desc;
+	c->bytes = 0;
+	c->files = calloc(desc->n_files, sizeof(*c->files));
+	if (!c->files) {
+		fprintf(stderr, "Out of memory building corpus\n");
+		exit(1);
+	}
+
+	for (i = 0; i < desc->n_files; i++) {
+		build_container(&c->files[i], desc->primary_size, desc->n_shared,
+				desc->shared_size, desc->n_filler, &seed);
+		c->bytes += c->files[i].len;
+	}
+}
+
+static void free_corpus(struct corpus *c)
+{
+	int i;
+
+	for (i = 0; i < c->desc->n_files; i++)
+		free(c->files[i].data);
+	free(c->files);
+}
+
+/* Export obj into dir, then delete what it wrote, adding up its size */
+static int export_one(struct xnb_object_head *obj, const char *dir, int file,
+		int asset, uint64_t *bytes, double *t)
+{
+	struct xnb_output_list outputs = { 0 };
+	struct xnb_export_opts opts = {
+		.texture_format = XNB_TEXTURE_DDS,
+		.sample_format = AUDIO_S16,
+		.threads = 1,
+		.outputs = &outputs,
+	};
+	char base[MAX_NAME_LEN];
+	struct stat st;
+	double start;
+	int i, res;
+
+	snprintf(base, sizeof(base), "%s/%d_%d", dir, file, asset);
+
+	start = now();
+	res = export_object(obj, &opts, base);
+	*t += now() - start;
+
+	for (i = 0; i < outputs.count; i++) {
+		if (!stat(outputs.names[i], &st))
+			*bytes += st.st_size;
+		unlink(outputs.names[i]);
+	}
+	output_list_free(&outputs);
+
+	return res;
+}
+
+static int run_corpus(const struct corpus *c, struct xnb_arena *arena,
+		FILE *devnull, const char *dir, struct result *r)
+{
+	double t[N_PHASES] = { 0 };
+	double start;
+	int i, j, res;
+
+	r->bytes_written = 0;
+	for (i = 0; i < c->desc->n_files; i++) {
+		struct xnb_container *cont;
+
+		start = now();
+		cont = xnb_decode_buffer(c->files[i].data, c->files[i].len, arena, 0);
+		t[PHASE_READ] += now() - start;
+		if (!cont) {
+			fprintf(stderr, "Couldn't decode %s file %d\n", c->desc->name, i);
+			return -1;
+		}
+
+		start = now();
+		dump_container(cont, devnull);
+		t[PHASE_DUMP] += now() - start;
+
+		res = export_one(cont->primary_asset, dir, i, 0, &r->bytes_written,
+				&t[PHASE_EXPORT]);
+		for (j = 0; !res && j < cont->shared_resource_count; j++)
+			res = export_one(cont->shared_resources[j], dir, i, j + 1,
+					&r->bytes_written, &t[PHASE_EXPORT]);
+
+		destroy_container(cont);
+		if (res) {
+			fprintf(stderr, "Couldn't export %s file %d\n", c->desc->name, i);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < N_PHASES; i++) {
+		if (r->seconds[i] == 0 || t[i] < r->seconds[i])
+			r->seconds[i] = t[i];
+	}
+
+	return 0;
+}
+
+/* Starting xnbdec is slow, so only use the start of tiny_sounds */
+#define SERVE_FILES 500
+
+enum serve_mode {
+	SERVE_SPAWN,
+	SERVE_PATH,
+	SERVE_DATA,
+	N_SERVE_MODES,
+};
+
+static const char *serve_mode_names[N_SERVE_MODES] = {
+	[SERVE_SPAWN] = "spawn_per_file",
+	[SERVE_PATH] = "serve_path",
+	[SERVE_DATA] = "serve_data",
+};
+
+struct serve_result {
+	int n_files;
+	/* Best of all the iterations */
+	double seconds[N_SERVE_MODES];
+};
+
+static int write_serve_inputs(const struct corpus *c, const char *dir,
+		int n_files)
+{
+	char name[MAX_NAME_LEN];
+	int i;
+
+	for (i = 0; i < n_files; i++) {
+		FILE *fp;
+
+		snprintf(name, sizeof(name), "%s/in_%04d.xnb", dir, i);
+		fp = fopen(name, "wb");
+		if (!fp || fwrite(c->files[i].data, 1, c->files[i].len, fp)
+				!= c->files[i].len) {
+			fprintf(stderr, "Couldn't write '%s'\n", name);
+			if (fp)
+				fclose(fp);
+			return -1;
+		}
+		fclose(fp);
+	}
+
+	return 0;
+}
+
+static void remove_serve_inputs(const char *dir, int n_files)
+{
+	char name[MAX_NAME_LEN];
+	int i;
+
+	for (i = 0; i < n_files; i++) {
+		snprintf(name, sizeof(name), "%s/in_%04d.xnb", dir, i);
+		unlink(name);
+	}
+}
+
+/* What a build system calling xnbdec for each changed file would do */
+static int run_spawn(const char *xnbdec, const char *dir, int n_files)
+{
+	char in[MAX_NAME_LEN], export[MAX_NAME_LEN + 16], out[MAX_NAME_LEN];
+	int i;
+
+	for (i = 0; i < n_files; i++) {
+		char *argv[] = { (char *)xnbdec, "-q", export, in, NULL };
+		int status;
+		pid_t pid;
+
+		snprintf(in, sizeof(in), "%s/in_%04d.xnb", dir, i);
+		snprintf(export, sizeof(export), "--export=%s/out_%04d", dir, i);
+
+		pid = fork();
+		if (pid < 0) {
+			fprintf(stderr, "Couldn't fork: %s\n", strerror(errno));
+			return -1;
+		} else if (pid == 0) {
+			execv(xnbdec, argv);
+			_exit(127);
+		}
+
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+				WEXITSTATUS(status)) {
+			fprintf(stderr, "'%s' failed on '%s'\n", xnbdec, in);
+			return -1;
+		}
+
+		snprintf(out, sizeof(out), "%s/out_%04d.wav", dir, i);
+		unlink(out);
+	}
+
+	return 0;
+}
+
+static int run_served(const char *xnbdec, const char *dir, int n_files,
+		const struct corpus *c, bool data)
+{
+	char *argv[] = { (char *)xnbdec, "-q", "--serve", NULL };
+	char in[MAX_NAME_LEN], name[MAX_NAME_LEN];
+	struct serve_request req = {
+		.actions = SERVE_EXPORT,
+		.name = name,
+	};
+	FILE *to, *from;
+	int i, status, res = -1;
+	pid_t pid;
+
+	pid = serve_spawn(argv, &to, &from);
+	if (pid < 0)
+		return -1;
+
+	for (i = 0; i < n_files; i++) {
+		struct serve_reply reply;
+		int j;
+
+		snprintf(in, sizeof(in), "%s/in_%04d.xnb", dir, i);
+		snprintf(name, sizeof(name), "%s/out_%04d", dir, i);
+		if (data) {
+			req.data = c->files[i].data;
+			req.size = c->files[i].len;
+		} else {
+			req.path = in;
+		}
+
+		if (serve_write_request(to, &req) || serve_read_reply(from, &reply))
+			goto done;
+
+		for (j = 0; j < reply.outputs.count; j++)
+			unlink(reply.outputs.names[j]);
+		status = reply.status;
+		serve_reply_free(&reply);
+		if (status) {
+			fprintf(stderr, "'%s --serve' failed on '%s'\n", xnbdec, in);
+			goto done;
+		}
+	}
+	res = 0;
+
+done:
+	fclose(to);
+	fclose(from);
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+			WEXITSTATUS(status))
+		res = -1;
+
+	return res;
+}
+
+static int run_serve(const struct corpus *c, const char *xnbdec,
+		const char *dir, struct serve_result *r)
+{
+	double t[N_SERVE_MODES];
+	double start;
+	int i, res = -1;
+
+	r->n_files = c->desc->n_files < SERVE_FILES ?
+		c->desc->n_files : SERVE_FILES;
+	if (write_serve_inputs(c, dir, r->n_files))
+		goto done;
+
+	start = now();
+	if (run_spawn(xnbdec, dir, r->n_files))
+		goto done;
+	t[SERVE_SPAWN] = now() - start;
+
+	start = now();
+	if (run_served(xnbdec, dir, r->n_files, c, false))
+		goto done;
+	t[SERVE_PATH] = now() - start;
+
+	start = now();
+	if (run_served(xnbdec, dir, r->n_files, c, true))
+		goto done;
+	t[SERVE_DATA] = now() - start;
+
+	for (i = 0; i < N_SERVE_MODES; i++) {
+		if (r->seconds[i] == 0 || t[i] < r->seconds[i])
+			r->seconds[i] = t[i];
+	}
+	res = 0;
+
+done:
+	remove_serve_inputs(dir, r->n_files);
+	return res;
+}
+
+static double rate(double amount, double seconds)
+{
+	return seconds > 0 ? amount / seconds : 0;
+}
+
+static void print_text(const struct corpus *c, const struct result *r,
+		FILE *out)
+{
+	int i;
+
+	fprintf(out, "%s: %d files, %.1f MB\n", c->desc->name, c->desc->n_files,
+			c->bytes / 1e6);
+	for (i = 0; i < N_PHASES; i++) {
+		fprintf(out, "  %-16s %10.3f ms %10.1f MB/s %12.0f files/s\n",
+				phase_names[i], r->seconds[i] * 1e3,
+				rate(c->bytes / 1e6, r->seconds[i]),
+				rate(c->desc->n_files, r->seconds[i]));
+	}
+}
+
+static void print_serve_text(const struct corpus *c,
+		const struct serve_result *r, FILE *out)
+{
+	int i;
+
+	fprintf(out, "serve: %d %s files\n", r->n_files, c->desc->name);
+	for (i = 0; i < N_SERVE_MODES; i++) {
+		fprintf(out, "  %-16s %10.3f ms %12.0f files/s\n",
+				serve_mode_names[i], r->seconds[i] * 1e3,
+				rate(r->n_files, r->seconds[i]));
+	}
+}
+
+static void print_json(const struct corpus *cs, const struct result *rs,
+		const struct serve_result *serve, int iterations, FILE *out)
+{
+	size_t i;
+	int j;
+
+	fprintf(out, "{\n  \"version\": %d,\n  \"iterations\": %d,\n",
+			BENCH_VERSION, iterations);
+	fprintf(out, "  \"corpora\": [\n");
+	for (i = 0; i < N_CORPORA; i++) {
+		const struct corpus *c = &cs[i];
+		const struct result *r = &rs[i];
+
+		fprintf(out, "    {\n      \"name\": \"%s\",\n", c->desc->name);
+		fprintf(out, "      \"files\": %d,\n", c->desc->n_files);
+		fprintf(out, "      \"bytes\": %llu,\n",
+				(unsigned long long)c->bytes);
+		fprintf(out, "      \"bytes_written\": %llu,\n",
+				(unsigned long long)r->bytes_written);
+		fprintf(out, "      \"phases\": {\n");
+		for (j = 0; j < N_PHASES; j++) {
+			fprintf(out, "        \"%s\": { \"seconds\": %.6f, "
+					"\"mb_per_s\": %.3f, \"files_per_s\": %.1f }%s\n",
+					phase_names[j], r->seconds[j],
+					rate(c->bytes / 1e6, r->seconds[j]),
+					rate(c->desc->n_files, r->seconds[j]),
+					j == N_PHASES - 1 ? "" : ",");
+		}
+		fprintf(out, "      }\n    }%s\n", i == N_CORPORA - 1 ? "" : ",");
+	}
+	fprintf(out, "  ]");
+
+	if (serve) {
+		fprintf(out, ",\n  \"serve\": {\n");
+		fprintf(out, "    \"files\": %d,\n", serve->n_files);
+		fprintf(out, "    \"modes\": {\n");
+		for (j = 0; j < N_SERVE_MODES; j++) {
+			fprintf(out, "      \"%s\": { \"seconds\": %.6f, "
+					"\"files_per_s\": %.1f }%s\n",
+					serve_mode_names[j], serve->seconds[j],
+					rate(serve->n_files, serve->seconds[j]),
+					j == N_SERVE_MODES - 1 ? "" : ",");
+		}
+		fprintf(out, "    }\n  }");
+	}
+	fprintf(out, "\n}\n");
+}
+
+static void print_usage(const char *argv0)
+{
+	printf("Usage: %s [OPTION]...\n"
+	"\n"
+	"Time decoding, printing and exporting synthetic XNB files\n"
+	"\n"
+	" -n --iterations=N Run each corpus N times, keeping the best (default 3)\n"
+	" -j --json=FILE Also write the results to FILE as JSON\n"
+	" -w --write-corpus=DIR Write the corpus to DIR as .xnb files and exit\n"
+	" -s --serve=XNBDEC Also compare running XNBDEC once per file with\n"
+	"         sending the files to XNBDEC --serve\n",
+	argv0);
+}
+
+static int write_corpus(const struct corpus *cs, const char *dir)
+{
+	char name[MAX_NAME_LEN];
+	size_t i;
+	int j;
+
+	for (i = 0; i < N_CORPORA; i++) {
+		for (j = 0; j < cs[i].desc->n_files; j++) {
+			FILE *fp;
+
+			snprintf(name, sizeof(name), "%s/%s_%04d.xnb", dir,
+					cs[i].desc->name, j);
+			fp = fopen(name, "wb");
+			if (!fp || fwrite(cs[i].files[j].data, 1, cs[i].files[j].len, fp)
+					!= cs[i].files[j].len) {
+				fprintf(stderr, "Couldn't write '%s'\n", name);
+				if (fp)
+					fclose(fp);
+				return -1;
+			}
+			fclose(fp);
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"iterations",   required_argument, NULL, 'n' },
+		{"json",         required_argument, NULL, 'j' },
+		{"write-corpus", required_argument, NULL, 'w' },
+		{"serve",        required_argument, NULL, 's' },
+		{"help",         no_argument,       NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+	struct corpus cs[N_CORPORA];
+	struct result rs[N_CORPORA] = { 0 };
+	struct serve_result serve = { 0 };
+	const char *xnbdec = NULL;
+	struct xnb_arena *arena = NULL;
+	const char *json = NULL, *corpus_dir = NULL;
+	char dir[] = "/tmp/xnb_bench.XXXXXX";
+	FILE *devnull = NULL;
+	int iterations = 3;
+	int opt, res = 1;
+	size_t i;
+	int n;
+
+	while ((opt = getopt_long(argc, argv, "n:j:w:s:h", long_options,
+					NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = atoi(optarg);
+			if (iterations < 1) {
+				fprintf(stderr, "Invalid iteration count '%s'\n", optarg);
+				return 1;
+			}
+			break;
+		case 'j':
+			json = optarg;
+			break;
+		case 'w':
+			corpus_dir = optarg;
+			break;
+		case 's':
+			xnbdec = optarg;
+			break;
+		default:
+			print_usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	for (i = 0; i < N_CORPORA; i++)
+		build_corpus(&cs[i], &corpora[i]);
+
+	if (corpus_dir) {
+		res = write_corpus(cs, corpus_dir) ? 1 : 0;
+		goto free_corpora;
+	}
+
+	arena = arena_create();
+	devnull = fopen("/dev/null", "w");
+	if (!arena || !devnull || !mkdtemp(dir)) {
+		fprintf(stderr, "Couldn't set up: %s\n", strerror(errno));
+		goto done;
+	}
+
+	for (n = 0; n < iterations; n++) {
+		for (i = 0; i < N_CORPORA; i++) {
+			if (run_corpus(&cs[i], arena, devnull, dir, &rs[i]))
+				goto rmdir;
+		}
+		if (xnbdec && run_serve(&cs[0], xnbdec, dir, &serve))
+			goto rmdir;
+	}
+
+	for (i = 0; i < N_CORPORA; i++)
+		print_text(&cs[i], &rs[i], stdout);
+	if (xnbdec)
+		print_serve_text(&cs[0], &serve, stdout);
+
+	if (json) {
+		FILE *fp = fopen(json, "w");
+		if (!fp) {
+			fprintf(stderr, "Couldn't open '%s' for writing\n", json);
+			goto rmdir;
+		}
+		print_json(cs, rs, xnbdec ? &serve : NULL, iterations, fp);
+		fclose(fp);
+	}
+
+	res = 0;
+
+rmdir:
+	rmdir(dir);
+done:
+	if (devnull)
+		fclose(devnull);
+	if (arena)
+		arena_destroy(arena);
+free_corpora:
+	for (i = 0; i < N_CORPORA; i++)
+		free_corpus(&cs[i]);
+	return res;
+}
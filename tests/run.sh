@@ -0,0 +1,192 @@
+#!/bin/sh
+# Regression checks, run by "make check"
+# Copyright Brian Starkey 2014 <stark3y@gmail.com>
+#
+# Usage: tests/run.sh XNBDEC XAR_CAT XNBCLIENT
+#
+# Exports the small files in tests/data, and compares what was written with
+# the hashes in tests/expected.sha256. The broken ones in there, called
+# bad_*, have to fail instead. The other checks compare runs with each
+# other: the same exports with more threads or async I/O, from a directory,
+# with --dedupe, in an archive, with the manifest and through --serve.
+#
+# With UPDATE=1, the hashes are rewritten instead. Only do that once any
+# differences have been checked to be fixes.
+
+set -u
+
+here=$(cd "$(dirname "$0")" && pwd)
+xnbdec=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+xar_cat=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+xnbclient=$(cd "$(dirname "$3")" && pwd)/$(basename "$3")
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/xnbdec-check.XXXXXX") || exit 1
+trap 'rm -rf "$work"' EXIT
+cd "$work" || exit 1
+
+failed=0
+fail() {
+	echo "FAIL: $*"
+	failed=$((failed + 1))
+}
+
+# Decoded fine, apart from the deliberately broken ones
+cp "$here"/data/*.xnb .
+mkdir bad
+mv bad_*.xnb bad/
+inputs=$(ls *.xnb)
+n_inputs=$(echo "$inputs" | wc -l)
+
+# Hashes of everything exported under dir, by path
+hash_tree() {
+	(cd "$1" && find . -type f ! -name .xnbdec-cache | sort |
+		xargs sha256sum)
+}
+
+# Export, then check the result against the expected hashes for name
+check_export() {
+	name=$1
+	shift
+	if ! "$xnbdec" -q -e -o "out/$name" "$@" >log 2>&1; then
+		cat log
+		fail "exporting $name"
+	fi
+	hash_tree "out/$name" | sed "s|  \./|  $name/|" >>actual.sha256
+}
+
+: >actual.sha256
+check_export default $inputs
+check_export rgba -t rgba texture_dxt.xnb sprite_font.xnb
+check_export png -t png texture_dxt.xnb sprite_font.xnb
+check_export resampled -r 32000 -c 2 adpcm_ima.xnb lz4.xnb
+check_export float -s f32 -c mono adpcm_ms.xnb
+
+if [ "${UPDATE:-}" = 1 ]; then
+	cp actual.sha256 "$here/expected.sha256"
+	echo "Updated $here/expected.sha256"
+elif ! diff -u "$here/expected.sha256" actual.sha256; then
+	fail "exported files differ from tests/expected.sha256"
+fi
+
+# Threads and async I/O mustn't change anything
+for opts in "-j 4" "--io=threads" "--io=auto -j 3"; do
+	rm -rf out/par
+	"$xnbdec" -q -e -o out/par $opts $inputs >log 2>&1 || fail "export with $opts"
+	diff -r -x .xnbdec-cache out/default out/par >/dev/null ||
+		fail "export with $opts differs"
+done
+
+# A directory is walked, upper-case names and all, but not through
+# symlinks to directories. With -o its tree is mirrored there, and without
+# it the files go next to their inputs.
+mkdir -p tree/a/b
+cp lzx_verbatim.xnb tree/a/
+cp lz4.xnb tree/a/b/LZ4.XNB
+cp generic_list.xnb tree/
+ln -s a tree/link
+"$xnbdec" -q -e -o out/tree tree >log 2>&1 || fail "directory export"
+"$xnbdec" -q -e tree >log 2>&1 || fail "directory export without -o"
+for f in a/lzx_verbatim.xnb.wav:lzx_verbatim.xnb.wav \
+		a/lzx_verbatim.xnb_shared_1.wav:lzx_verbatim.xnb_shared_1.wav \
+		a/b/LZ4.XNB.wav:lz4.xnb.wav \
+		a/b/LZ4.XNB_shared_1.wav:lz4.xnb_shared_1.wav \
+		generic_list.xnb.json:generic_list.xnb.json; do
+	walked=${f%%:*}
+	cmp -s "out/tree/$walked" "out/default/${f#*:}" ||
+		fail "walked '$walked' differs"
+	cmp -s "tree/$walked" "out/default/${f#*:}" ||
+		fail "walked '$walked' differs without -o"
+done
+[ "$(find out/tree -type f ! -name .xnbdec-cache | wc -l)" -eq 5 ] ||
+	fail "directory export wrote the wrong number of files"
+[ "$(find tree -type f ! -iname '*.xnb' | wc -l)" -eq 5 ] && [ ! -e a ] ||
+	fail "directory export without -o wrote the wrong files"
+
+# With --dedupe, copies of an object are hardlinked to the first one, but
+# objects of different types aren't, even with the same bytes. Exporting a
+# linked copy again mustn't change the file it was linked to.
+inode() {
+	stat -c %i "out/dedupe/$1"
+}
+cp lzx_verbatim.xnb dup.xnb
+"$xnbdec" -e -o out/dedupe --dedupe lzx_verbatim.xnb dup.xnb \
+	generic_list.xnb generic_list_single.xnb >log 2>&1 || fail "dedupe export"
+grep -q '^Linked 2 duplicate object(s) to earlier copies, saving [1-9]' log ||
+	fail "duplicates weren't reported"
+[ "$(inode dup.xnb.wav)" = "$(inode lzx_verbatim.xnb.wav)" ] &&
+	[ "$(inode dup.xnb_shared_1.wav)" = \
+		"$(inode lzx_verbatim.xnb_shared_1.wav)" ] ||
+	fail "duplicates weren't linked"
+[ "$(inode generic_list.xnb.json)" != \
+		"$(inode generic_list_single.xnb.json)" ] ||
+	fail "objects of different types were linked"
+cp pcm_odd.xnb dup.xnb
+"$xnbdec" -q -e -o out/dedupe --dedupe dup.xnb >log 2>&1 ||
+	fail "dedupe export"
+cmp -s out/dedupe/dup.xnb.wav out/default/pcm_odd.xnb.wav &&
+	cmp -s out/dedupe/lzx_verbatim.xnb.wav \
+		out/default/lzx_verbatim.xnb.wav ||
+	fail "exporting a linked copy changed the file it was linked to"
+
+# Everything in an archive should come back out the same
+"$xnbdec" -q -e -j 2 -a out.xar $inputs >log 2>&1 || fail "archive export"
+for f in $(cd out/default && find . -type f ! -name .xnbdec-cache); do
+	f=${f#./}
+	"$xar_cat" out.xar "$f" >extracted 2>log &&
+		cmp -s extracted "out/default/$f" || fail "archived '$f' differs"
+done
+
+# A second run should skip every file, unless its contents changed
+"$xnbdec" -e -o out/default $inputs >log 2>&1 || fail "cached export"
+[ "$(grep -c '^Skipping unchanged' log)" -eq "$n_inputs" ] ||
+	fail "unchanged files weren't skipped"
+touch lz4.xnb
+cp lzx_mixed.xnb lzx_verbatim.xnb
+"$xnbdec" -e -o out/default $inputs >log 2>&1 || fail "cached export"
+[ "$(grep -c '^Skipping unchanged' log)" -eq $((n_inputs - 1)) ] &&
+	grep -q '^Loading file .*lzx_verbatim.xnb' log ||
+	fail "changed file wasn't exported"
+cp "$here/data/lzx_verbatim.xnb" .
+
+# Served over a pipe, by path and with the data sent, then over a socket
+"$xnbclient" -q -x "$xnbdec" -e -o out/served $inputs >log 2>&1 ||
+	fail "serve by path"
+diff -r -x .xnbdec-cache out/default out/served >/dev/null ||
+	fail "served export differs"
+"$xnbclient" -q -d -x "$xnbdec" -e -o out/data $inputs >log 2>&1 ||
+	fail "serve with data"
+diff -r -x .xnbdec-cache out/default out/data >/dev/null ||
+	fail "served data export differs"
+
+"$xnbdec" --serve="$work/sock" >/dev/null 2>&1 &
+server=$!
+tries=0
+while [ ! -S sock ] && [ $tries -lt 50 ]; do
+	sleep 0.1
+	tries=$((tries + 1))
+done
+"$xnbclient" -q -S sock -e -o out/socket $inputs >log 2>&1 ||
+	fail "serve over a socket"
+diff -r -x .xnbdec-cache out/default out/socket >/dev/null ||
+	fail "socket export differs"
+kill -TERM $server
+wait $server || fail "server didn't exit cleanly"
+
+# Broken files should fail, without leaving a half-written export behind
+head -c 2000 lzx_mixed.xnb >bad/truncated.xnb
+for f in bad/*.xnb; do
+	rm -rf out/bad
+	if "$xnbdec" -q -e -o out/bad "$f" >log 2>&1; then
+		fail "'$f' should have failed"
+	fi
+	[ -z "$(find out/bad -name '*.wav' 2>/dev/null)" ] ||
+		fail "'$f' left a file behind"
+done
+
+"$xnbdec" --self-test >log 2>&1 || fail "self test"
+
+if [ $failed -ne 0 ]; then
+	echo "$failed check(s) failed"
+	exit 1
+fi
+echo "All checks passed"
@@ -0,0 +1,42 @@
+/* Archive extractor, for the regression checks
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ *
+ * Writes the file called NAME, from an archive written by xnbdec --archive,
+ * to standard output.
+ */
+
+#include <stdio.h>
+
+#include "xnb.h"
+
+int main(int argc, char *argv[])
+{
+	struct xnb_archive *ar;
+	const void *data;
+	size_t size;
+	int res = 1;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s ARCHIVE NAME\n", argv[0]);
+		return 1;
+	}
+
+	ar = archive_open(argv[1]);
+	if (!ar)
+		return 1;
+
+	if (archive_find(ar, argv[2], &data, &size)) {
+		fprintf(stderr, "'%s' isn't in '%s'\n", argv[2], argv[1]);
+		goto done;
+	}
+
+	if (fwrite(data, 1, size, stdout) != size) {
+		fprintf(stderr, "Couldn't write '%s'\n", argv[2]);
+		goto done;
+	}
+	res = 0;
+
+done:
+	archive_close(ar);
+	return res;
+}
@@ -0,0 +1,41 @@
+/* libxnb
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#ifndef __XNB_H__
+#define __XNB_H__
+
+/*
+ * Everything needed to decode XNB files, and print or export what's in them.
+ *
+ * Decoding allocates everything from an xnb_arena, which belongs to the
+ * caller. Any number of threads can decode at once, as long as each is
+ * using its own arena. Otherwise, the library keeps no state between calls,
+ * except for the run statistics in xnb_stats.h, which are process-wide and
+ * do nothing until stats_enable() is called.
+ */
+
+#include <stddef.h>
+
+#include "xnb_archive.h"
+#include "xnb_arena.h"
+#include "xnb_container.h"
+#include "xnb_cursor.h"
+#include "xnb_dedupe.h"
+#include "xnb_io.h"
+#include "xnb_object.h"
+#include "xnb_serve.h"
+
+/*
+ * Decode the XNB file in buf, which is size bytes long. flags are the
+ * XNB_READ_* flags for read_container().
+ *
+ * Nothing is copied out of buf unless it has to be (e.g. to decompress it),
+ * so objects in the container can point straight into it, and buf must stay
+ * valid until the container is destroyed with destroy_container(), or the
+ * arena is reset. Returns NULL on error.
+ */
+struct xnb_container *xnb_decode_buffer(const void *buf, size_t size,
+		struct xnb_arena *arena, unsigned int flags);
+
+#endif /* __XNB_H__ */
@@ -0,0 +1,300 @@
+/* MS-ADPCM and IMA-ADPCM decoding
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ *
+ * Each sample's predictor depends on the previous one (and, for IMA, so
+ * does the step size), so there's no parallelism within a channel. Blocks
+ * restart the predictor, which is what callers should parallelize over.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "xnb_adpcm.h"
+
+/* Offsets into WAVEFORMATEX and its ADPCM extensions */
+#define WFX_TAG         0
+#define WFX_CHANNELS    2
+#define WFX_BLOCK_ALIGN 12
+#define WFX_CB_SIZE     16
+#define WFX_SIZE        18
+
+#define MS_HEADER_SIZE  7
+#define IMA_HEADER_SIZE 4
+
+#define MS_MAX_DELTA    (INT32_MAX / 768)
+
+static const int16_t ms_default_coefs[7][2] = {
+	{ 256, 0 }, { 512, -256 }, { 0, 0 }, { 192, 64 },
+	{ 240, 0 }, { 460, -208 }, { 392, -232 },
+};
+
+static const int16_t ms_adapt[16] = {
+	230, 230, 230, 230, 307, 409, 512, 614,
+	768, 614, 512, 409, 307, 230, 230, 230,
+};
+
+static const int8_t ima_index[16] = {
+	-1, -1, -1, -1, 2, 4, 6, 8,
+	-1, -1, -1, -1, 2, 4, 6, 8,
+};
+
+static const int16_t ima_step[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+	19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+	130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+	337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+	876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+	2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+	5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767,
+};
+
+static inline uint16_t get_le16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline int16_t clamp16(int32_t v)
+{
+	return v < -32768 ? -32768 : v > 32767 ? 32767 : v;
+}
+
+int adpcm_parse_format(const uint8_t *fmt, size_t size,
+		struct adpcm_format *f)
+{
+	size_t ext_size = 0;
+	uint32_t max_frames;
+	uint16_t i;
+
+	memset(f, 0, sizeof(*f));
+	if (size < WFX_BLOCK_ALIGN + 2)
+		return -1;
+
+	f->tag = get_le16(fmt + WFX_TAG);
+	f->channels = get_le16(fmt + WFX_CHANNELS);
+	f->block_align = get_le16(fmt + WFX_BLOCK_ALIGN);
+	if (size >= WFX_SIZE) {
+		ext_size = get_le16(fmt + WFX_CB_SIZE);
+		if (ext_size > size - WFX_SIZE)
+			ext_size = size - WFX_SIZE;
+	}
+	fmt += WFX_SIZE;
+
+	if (!f->channels)
+		return -1;
+
+	switch (f->tag) {
+	case WAVE_FORMAT_ADPCM:
+		/* The block header only has room for stereo */
+		if (f->channels > 2 ||
+				f->block_align < MS_HEADER_SIZE * f->channels)
+			return -1;
+		max_frames = 2 + (f->block_align - MS_HEADER_SIZE * f->channels) *
+			2 / f->channels;
+
+		if (ext_size >= 4 && get_le16(fmt + 2)) {
+			f->n_coefs = get_le16(fmt + 2);
+			if (f->n_coefs > ADPCM_MAX_COEFS ||
+					ext_size < 4 + 4 * (size_t)f->n_coefs)
+				return -1;
+			for (i = 0; i < f->n_coefs; i++) {
+				f->coefs[i][0] = get_le16(fmt + 4 + 4 * i);
+				f->coefs[i][1] = get_le16(fmt + 6 + 4 * i);
+			}
+		} else {
+			f->n_coefs = 7;
+			memcpy(f->coefs, ms_default_coefs, sizeof(ms_default_coefs));
+		}
+		break;
+	case WAVE_FORMAT_IMA_ADPCM:
+		/* Each channel's data comes in interleaved runs of 4 bytes */
+		if (f->block_align < IMA_HEADER_SIZE * f->channels ||
+				f->block_align % (4 * f->channels))
+			return -1;
+		max_frames = 1 + (f->block_align - IMA_HEADER_SIZE * f->channels) *
+			2 / f->channels;
+		break;
+	default:
+		return -1;
+	}
+
+	/* wSamplesPerBlock can be smaller than the block would allow */
+	f->frames_per_block = max_frames;
+	if (ext_size >= 2 && get_le16(fmt) && get_le16(fmt) < max_frames)
+		f->frames_per_block = get_le16(fmt);
+	/* An MS-ADPCM block header alone holds two */
+	if (f->tag == WAVE_FORMAT_ADPCM && f->frames_per_block < 2)
+		return -1;
+
+	return 0;
+}
+
+uint32_t adpcm_block_frames(const struct adpcm_format *f, size_t len)
+{
+	uint32_t frames;
+
+	if (len >= f->block_align)
+		return f->frames_per_block;
+
+	if (f->tag == WAVE_FORMAT_ADPCM) {
+		if (len < MS_HEADER_SIZE * f->channels)
+			return 0;
+		frames = 2 + (len - MS_HEADER_SIZE * f->channels) * 2 / f->channels;
+	} else {
+		if (len < IMA_HEADER_SIZE * f->channels)
+			return 0;
+		/* Only whole runs of 4 bytes per channel */
+		frames = 1 + (len - IMA_HEADER_SIZE * f->channels) /
+			(4 * f->channels) * 8;
+	}
+
+	return frames < f->frames_per_block ? frames : f->frames_per_block;
+}
+
+struct ms_state {
+	int32_t coef1, coef2;
+	int32_t delta;
+	int32_t s1, s2;
+};
+
+static inline int16_t ms_sample(struct ms_state *st, int nibble)
+{
+	int32_t signed_nibble = nibble >= 8 ? nibble - 16 : nibble;
+	int32_t pred = (st->s1 * st->coef1 + st->s2 * st->coef2) >> 8;
+	int16_t s = clamp16(pred + signed_nibble * st->delta);
+
+	st->delta = (ms_adapt[nibble] * st->delta) >> 8;
+	if (st->delta < 16)
+		st->delta = 16;
+	/* Random data can grow it without bound. Cap it like other decoders */
+	else if (st->delta > MS_MAX_DELTA)
+		st->delta = MS_MAX_DELTA;
+	st->s2 = st->s1;
+	st->s1 = s;
+
+	return s;
+}
+
+static int ms_decode_block(const struct adpcm_format *f, const uint8_t *src,
+		uint32_t frames, int16_t *dst)
+{
+	struct ms_state states[2];
+	int ch, channels = f->channels;
+	uint32_t i, n;
+
+	/* Mono and stereo cover everything XNA produces */
+	if (channels > 2) {
+		fprintf(stderr, "Can't decode %d channel MS-ADPCM\n", channels);
+		return -1;
+	}
+	if (frames < 2) {
+		fprintf(stderr, "MS-ADPCM block too short\n");
+		return -1;
+	}
+
+	for (ch = 0; ch < channels; ch++) {
+		uint8_t pred = src[ch];
+		if (pred >= f->n_coefs) {
+			fprintf(stderr, "Bad MS-ADPCM predictor %d\n", pred);
+			return -1;
+		}
+		states[ch].coef1 = f->coefs[pred][0];
+		states[ch].coef2 = f->coefs[pred][1];
+		states[ch].delta = (int16_t)get_le16(src + channels + 2 * ch);
+		states[ch].s1 = (int16_t)get_le16(src + 3 * channels + 2 * ch);
+		states[ch].s2 = (int16_t)get_le16(src + 5 * channels + 2 * ch);
+	}
+	src += MS_HEADER_SIZE * channels;
+
+	/* The header holds the first two samples, oldest second */
+	for (ch = 0; ch < channels; ch++) {
+		dst[ch] = states[ch].s2;
+		dst[channels + ch] = states[ch].s1;
+	}
+	dst += 2 * channels;
+
+	/* High nibble first, alternating channels if stereo */
+	n = (frames - 2) * channels;
+	for (i = 0; i < n; i++) {
+		int nibble = (i & 1) ? src[i / 2] & 0xf : src[i / 2] >> 4;
+		dst[i] = ms_sample(&states[i % channels], nibble);
+	}
+
+	return 0;
+}
+
+struct ima_state {
+	int32_t sample;
+	int32_t index;
+};
+
+static inline int16_t ima_sample(struct ima_state *st, int nibble)
+{
+	int32_t step = ima_step[st->index];
+	int32_t diff = step >> 3;
+
+	if (nibble & 4)
+		diff += step;
+	if (nibble & 2)
+		diff += step >> 1;
+	if (nibble & 1)
+		diff += step >> 2;
+	if (nibble & 8)
+		diff = -diff;
+
+	st->sample = clamp16(st->sample + diff);
+	st->index += ima_index[nibble];
+	if (st->index < 0)
+		st->index = 0;
+	else if (st->index > 88)
+		st->index = 88;
+
+	return st->sample;
+}
+
+static int ima_decode_block(const struct adpcm_format *f, const uint8_t *src,
+		uint32_t frames, int16_t *dst)
+{
+	int ch, channels = f->channels;
+	uint32_t run, runs = (frames - 1) / 8;
+
+	for (ch = 0; ch < channels; ch++) {
+		const uint8_t *hdr = src + IMA_HEADER_SIZE * ch;
+		struct ima_state st = {
+			.sample = (int16_t)get_le16(hdr),
+			.index = hdr[2] > 88 ? 88 : hdr[2],
+		};
+		const uint8_t *p = src + IMA_HEADER_SIZE * channels + 4 * ch;
+		int16_t *out = dst + ch;
+		uint32_t left = frames - 1;
+
+		*out = st.sample;
+		out += channels;
+
+		/* 8 samples per 4-byte run, low nibble first */
+		for (run = 0; run <= runs && left; run++, p += 4 * channels) {
+			int i;
+			for (i = 0; i < 8 && left; i++, left--) {
+				int nibble = (i & 1) ? p[i / 2] >> 4 : p[i / 2] & 0xf;
+				*out = ima_sample(&st, nibble);
+				out += channels;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int adpcm_decode_block(const struct adpcm_format *f, const uint8_t *src,
+		size_t len, int16_t *dst)
+{
+	uint32_t frames = adpcm_block_frames(f, len);
+
+	if (!frames)
+		return -1;
+
+	if (f->tag == WAVE_FORMAT_ADPCM)
+		return ms_decode_block(f, src, frames, dst);
+	return ima_decode_block(f, src, frames, dst);
+}
@@ -0,0 +1,47 @@
+/* MS-ADPCM and IMA-ADPCM decoding
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#ifndef __XNB_ADPCM_H__
+#define __XNB_ADPCM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WAVE_FORMAT_PCM       0x0001
+#define WAVE_FORMAT_ADPCM     0x0002
+#define WAVE_FORMAT_IMA_ADPCM 0x0011
+
+#define ADPCM_MAX_COEFS 256
+
+struct adpcm_format {
+	uint16_t tag;
+	uint16_t channels;
+	uint16_t block_align;
+	/* Frames (samples per channel) in a full block */
+	uint32_t frames_per_block;
+	/* MS-ADPCM predictor coefficient pairs */
+	uint16_t n_coefs;
+	int16_t coefs[ADPCM_MAX_COEFS][2];
+};
+
+/*
+ * Fill in f from a (possibly extended) WAVEFORMATEX of size bytes.
+ * Returns 0 if it's an ADPCM format we can decode.
+ */
+int adpcm_parse_format(const uint8_t *fmt, size_t size,
+		struct adpcm_format *f);
+
+/* Number of frames in a block of len bytes (the last one may be short) */
+uint32_t adpcm_block_frames(const struct adpcm_format *f, size_t len);
+
+/*
+ * Decode one block of len bytes into interleaved 16-bit PCM. dst must have
+ * room for adpcm_block_frames(f, len) frames.
+ * Blocks are independent, so they can be decoded in any order, on any
+ * thread. Returns 0 on success.
+ */
+int adpcm_decode_block(const struct adpcm_format *f, const uint8_t *src,
+		size_t len, int16_t *dst);
+
+#endif /* __XNB_ADPCM_H__ */
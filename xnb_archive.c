@@ -0,0 +1,580 @@
+/* Packed output archives
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "xnb_archive.h"
+#include "xnb_hash.h"
+
+#define INDEX_MAGIC   "XNBAIDX1"
+#define TRAILER_MAGIC "XNBARCH1"
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((uint64_t)(a) - 1))
+
+/*
+ * Each thread exporting at the same time gets a segment to itself, so files
+ * can be written sequentially through an fd, just like a normal file.
+ */
+struct segment {
+	int fd;
+	bool busy;
+	/* Where the file being written started */
+	uint64_t start;
+	/* End of the last complete file */
+	uint64_t end;
+	/* Name of the file being written */
+	char *name;
+};
+
+struct pending_entry {
+	char *name;
+	uint32_t segment;
+	uint64_t offset;
+	uint64_t size;
+};
+
+struct archive_sink {
+	struct xnb_sink sink;
+	char *path;
+
+	pthread_mutex_t lock;
+	struct segment *segments;
+	int n_segments;
+	struct pending_entry *entries;
+	size_t n_entries;
+	size_t cap_entries;
+};
+
+static char *segment_path(const char *path, int idx)
+{
+	size_t len = strlen(path) + 16;
+	char *name = malloc(len);
+
+	if (!name)
+		return NULL;
+
+	if (idx == 0)
+		snprintf(name, len, "%s", path);
+	else
+		snprintf(name, len, "%s.%d", path, idx);
+
+	return name;
+}
+
+/* Called with the lock held */
+static struct segment *get_segment(struct archive_sink *ar)
+{
+	struct segment *segs;
+	char *name;
+	int i;
+
+	for (i = 0; i < ar->n_segments; i++) {
+		if (!ar->segments[i].busy)
+			return &ar->segments[i];
+	}
+
+	segs = realloc(ar->segments, sizeof(*segs) * (ar->n_segments + 1));
+	if (!segs)
+		return NULL;
+	ar->segments = segs;
+
+	name = segment_path(ar->path, ar->n_segments);
+	if (!name)
+		return NULL;
+
+	segs[i].fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (segs[i].fd < 0) {
+		fprintf(stderr, "Couldn't open '%s' for writing: %s\n", name,
+				strerror(errno));
+		free(name);
+		return NULL;
+	}
+	free(name);
+
+	segs[i].busy = false;
+	segs[i].start = segs[i].end = 0;
+	segs[i].name = NULL;
+	ar->n_segments++;
+
+	return &segs[i];
+}
+
+static int archive_create(struct xnb_sink *sink, const char *name)
+{
+	struct archive_sink *ar = (struct archive_sink *)sink;
+	struct segment *seg;
+	int fd = -1;
+
+	pthread_mutex_lock(&ar->lock);
+
+	seg = get_segment(ar);
+	if (!seg)
+		goto done;
+
+	seg->name = strdup(name);
+	if (!seg->name)
+		goto done;
+
+	/* The gap is left as a hole */
+	seg->start = ALIGN_UP(seg->end, ARCHIVE_ALIGN);
+	if (lseek(seg->fd, seg->start, SEEK_SET) < 0) {
+		fprintf(stderr, "Couldn't seek archive: %s\n", strerror(errno));
+		free(seg->name);
+		seg->name = NULL;
+		goto done;
+	}
+
+	seg->busy = true;
+	fd = seg->fd;
+
+done:
+	pthread_mutex_unlock(&ar->lock);
+	return fd;
+}
+
+static int archive_close_file(struct xnb_sink *sink, int fd, bool failed)
+{
+	struct archive_sink *ar = (struct archive_sink *)sink;
+	struct pending_entry *e;
+	struct segment *seg = NULL;
+	off_t end;
+	int i, res = -1;
+
+	pthread_mutex_lock(&ar->lock);
+
+	for (i = 0; i < ar->n_segments; i++) {
+		if (ar->segments[i].busy && ar->segments[i].fd == fd) {
+			seg = &ar->segments[i];
+			break;
+		}
+	}
+	if (!seg) {
+		fprintf(stderr, "Closing an fd which isn't in the archive\n");
+		goto done;
+	}
+
+	/* Leave it out of the index, and let the next file overwrite it */
+	if (failed) {
+		free(seg->name);
+		res = 0;
+		goto release;
+	}
+
+	end = lseek(fd, 0, SEEK_CUR);
+	if (end < 0 || (uint64_t)end < seg->start) {
+		fprintf(stderr, "Couldn't find end of '%s' in archive\n", seg->name);
+		free(seg->name);
+		goto release;
+	}
+
+	if (ar->n_entries == ar->cap_entries) {
+		size_t cap = ar->cap_entries ? ar->cap_entries * 2 : 256;
+		e = realloc(ar->entries, sizeof(*e) * cap);
+		if (!e) {
+			fprintf(stderr, "Couldn't allocate archive entry\n");
+			free(seg->name);
+			goto release;
+		}
+		ar->entries = e;
+		ar->cap_entries = cap;
+	}
+
+	e = &ar->entries[ar->n_entries++];
+	e->name = seg->name;
+	e->segment = i;
+	e->offset = seg->start;
+	e->size = end - seg->start;
+	seg->end = end;
+	res = 0;
+
+release:
+	seg->name = NULL;
+	seg->busy = false;
+done:
+	pthread_mutex_unlock(&ar->lock);
+	return res;
+}
+
+struct xnb_sink *archive_sink_create(const char *path)
+{
+	struct archive_sink *ar;
+
+	ar = calloc(1, sizeof(*ar));
+	if (!ar)
+		goto fail;
+
+	ar->path = strdup(path);
+	if (!ar->path)
+		goto fail;
+
+	ar->sink.create = archive_create;
+	ar->sink.close = archive_close_file;
+	pthread_mutex_init(&ar->lock, NULL);
+
+	/* Always have the first segment, for the index */
+	if (!get_segment(ar)) {
+		pthread_mutex_destroy(&ar->lock);
+		goto fail;
+	}
+
+	return &ar->sink;
+
+fail:
+	fprintf(stderr, "Couldn't create archive '%s'\n", path);
+	if (ar)
+		free(ar->path);
+	free(ar);
+	return NULL;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int write_index(struct archive_sink *ar)
+{
+	struct archive_index_header hdr = { .version = ARCHIVE_VERSION };
+	struct archive_trailer trailer = { 0 };
+	struct archive_entry *entries = NULL;
+	struct segment *seg = &ar->segments[0];
+	uint32_t *buckets = NULL;
+	uint32_t n_buckets = 2;
+	uint64_t names_size = 0;
+	static const uint8_t pad[8];
+	char *names = NULL;
+	size_t i;
+	int res = -1;
+
+	/* At most half full, so probes stay short */
+	while (n_buckets < ar->n_entries * 2)
+		n_buckets *= 2;
+
+	for (i = 0; i < ar->n_entries; i++)
+		names_size += strlen(ar->entries[i].name);
+
+	buckets = calloc(n_buckets, sizeof(*buckets));
+	entries = calloc(ar->n_entries ? ar->n_entries : 1, sizeof(*entries));
+	names = malloc(names_size ? names_size : 1);
+	if (!buckets || !entries || !names) {
+		fprintf(stderr, "Couldn't allocate archive index\n");
+		goto done;
+	}
+
+	names_size = 0;
+	for (i = 0; i < ar->n_entries; i++) {
+		struct pending_entry *p = &ar->entries[i];
+		struct archive_entry *e = &entries[i];
+		size_t len = strlen(p->name);
+		uint32_t b;
+
+		memcpy(names + names_size, p->name, len);
+		e->hash = xxh64(p->name, len, 0);
+		e->offset = p->offset;
+		e->size = p->size;
+		e->name_offset = names_size;
+		e->name_len = len;
+		e->segment = p->segment;
+		names_size += len;
+
+		/* A later file with the same name replaces the earlier one */
+		for (b = e->hash & (n_buckets - 1); buckets[b];
+				b = (b + 1) & (n_buckets - 1)) {
+			struct archive_entry *o = &entries[buckets[b] - 1];
+			if (o->hash == e->hash && o->name_len == e->name_len &&
+					!memcmp(names + o->name_offset, p->name, len))
+				break;
+		}
+		buckets[b] = i + 1;
+	}
+
+	memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.n_segments = ar->n_segments;
+	hdr.n_entries = ar->n_entries;
+	hdr.n_buckets = n_buckets;
+	hdr.names_size = names_size;
+
+	trailer.index_offset = ALIGN_UP(seg->end, ARCHIVE_ALIGN);
+	trailer.index_size = sizeof(hdr) + sizeof(*buckets) * n_buckets +
+		sizeof(*entries) * ar->n_entries + names_size;
+	memcpy(trailer.magic, TRAILER_MAGIC, sizeof(trailer.magic));
+
+	if (lseek(seg->fd, trailer.index_offset, SEEK_SET) < 0 ||
+			write_all(seg->fd, &hdr, sizeof(hdr)) ||
+			write_all(seg->fd, buckets, sizeof(*buckets) * n_buckets) ||
+			write_all(seg->fd, entries, sizeof(*entries) * ar->n_entries) ||
+			write_all(seg->fd, names, names_size) ||
+			write_all(seg->fd, pad, ALIGN_UP(names_size, 8) - names_size) ||
+			write_all(seg->fd, &trailer, sizeof(trailer)) ||
+			ftruncate(seg->fd, trailer.index_offset + ALIGN_UP(
+					trailer.index_size, 8) + sizeof(trailer))) {
+		fprintf(stderr, "Couldn't write archive index: %s\n",
+				strerror(errno));
+		goto done;
+	}
+
+	res = 0;
+
+done:
+	free(names);
+	free(entries);
+	free(buckets);
+	return res;
+}
+
+int archive_sink_finish(struct xnb_sink *sink)
+{
+	struct archive_sink *ar = (struct archive_sink *)sink;
+	size_t i;
+	int j, res;
+
+	res = write_index(ar);
+
+	for (j = 0; j < ar->n_segments; j++) {
+		/* Drop anything a failed file left after the last good one */
+		if (j && ftruncate(ar->segments[j].fd, ar->segments[j].end)) {
+			fprintf(stderr, "Couldn't truncate archive: %s\n",
+					strerror(errno));
+			res = -1;
+		}
+		if (close(ar->segments[j].fd)) {
+			fprintf(stderr, "Couldn't close archive: %s\n", strerror(errno));
+			res = -1;
+		}
+	}
+	for (i = 0; i < ar->n_entries; i++)
+		free(ar->entries[i].name);
+	free(ar->entries);
+	free(ar->segments);
+	pthread_mutex_destroy(&ar->lock);
+	free(ar->path);
+	free(ar);
+
+	return res;
+}
+
+struct mapped_segment {
+	const uint8_t *addr;
+	size_t size;
+};
+
+struct xnb_archive {
+	struct mapped_segment *segments;
+	uint32_t n_segments;
+
+	/* Pointers into segments[0] */
+	const struct archive_index_header *hdr;
+	const uint32_t *buckets;
+	const struct archive_entry *entries;
+	const char *names;
+};
+
+static int map_segment(const char *path, struct mapped_segment *seg)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't open '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+
+	seg->size = st.st_size;
+	seg->addr = NULL;
+	if (seg->size) {
+		void *addr = mmap(NULL, seg->size, PROT_READ, MAP_SHARED, fd, 0);
+		if (addr == MAP_FAILED) {
+			fprintf(stderr, "Couldn't map '%s': %s\n", path, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		seg->addr = addr;
+	}
+	close(fd);
+
+	return 0;
+}
+
+static int check_index(struct xnb_archive *ar)
+{
+	const struct mapped_segment *seg = &ar->segments[0];
+	const struct archive_trailer *trailer;
+	const struct archive_index_header *hdr;
+	uint64_t need;
+	uint32_t i;
+
+	if (seg->size < sizeof(*trailer) || seg->size % 8)
+		return -1;
+	trailer = (const void *)(seg->addr + seg->size - sizeof(*trailer));
+	if (memcmp(trailer->magic, TRAILER_MAGIC, sizeof(trailer->magic)) ||
+			trailer->index_offset % ARCHIVE_ALIGN ||
+			trailer->index_offset > seg->size - sizeof(*trailer) ||
+			trailer->index_size < sizeof(*hdr) ||
+			trailer->index_size > seg->size - sizeof(*trailer) -
+				trailer->index_offset)
+		return -1;
+
+	hdr = (const void *)(seg->addr + trailer->index_offset);
+	if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) ||
+			hdr->version != ARCHIVE_VERSION || !hdr->n_segments ||
+			!hdr->n_buckets || (hdr->n_buckets & (hdr->n_buckets - 1)) ||
+			hdr->n_buckets < hdr->n_entries)
+		return -1;
+
+	need = sizeof(*hdr) + (uint64_t)hdr->n_buckets * sizeof(*ar->buckets) +
+		(uint64_t)hdr->n_entries * sizeof(*ar->entries) + hdr->names_size;
+	if (need != trailer->index_size)
+		return -1;
+
+	ar->hdr = hdr;
+	ar->buckets = (const void *)(hdr + 1);
+	ar->entries = (const void *)(ar->buckets + hdr->n_buckets);
+	ar->names = (const void *)(ar->entries + hdr->n_entries);
+
+	for (i = 0; i < hdr->n_buckets; i++) {
+		if (ar->buckets[i] > hdr->n_entries)
+			return -1;
+	}
+
+	return 0;
+}
+
+struct xnb_archive *archive_open(const char *path)
+{
+	struct xnb_archive *ar;
+	uint32_t i;
+
+	ar = calloc(1, sizeof(*ar));
+	if (!ar)
+		return NULL;
+
+	ar->segments = calloc(1, sizeof(*ar->segments));
+	if (!ar->segments)
+		goto fail;
+	if (map_segment(path, &ar->segments[0]))
+		goto fail;
+	ar->n_segments = 1;
+
+	if (check_index(ar)) {
+		fprintf(stderr, "'%s' isn't a valid archive\n", path);
+		goto fail;
+	}
+
+	if (ar->hdr->n_segments > 1) {
+		struct mapped_segment *segs;
+
+		segs = realloc(ar->segments, sizeof(*segs) * ar->hdr->n_segments);
+		if (!segs)
+			goto fail;
+		ar->segments = segs;
+
+		for (i = 1; i < ar->hdr->n_segments; i++) {
+			char *name = segment_path(path, i);
+			int res;
+
+			if (!name)
+				goto fail;
+			res = map_segment(name, &ar->segments[i]);
+			free(name);
+			if (res)
+				goto fail;
+			ar->n_segments++;
+		}
+	}
+
+	return ar;
+
+fail:
+	archive_close(ar);
+	return NULL;
+}
+
+void archive_close(struct xnb_archive *ar)
+{
+	uint32_t i;
+
+	if (!ar)
+		return;
+
+	for (i = 0; i < ar->n_segments; i++) {
+		if (ar->segments[i].addr)
+			munmap((void *)ar->segments[i].addr, ar->segments[i].size);
+	}
+	free(ar->segments);
+	free(ar);
+}
+
+int archive_find(const struct xnb_archive *ar, const char *name,
+		const void **data, size_t *size)
+{
+	size_t len = strlen(name);
+	uint64_t hash = xxh64(name, len, 0);
+	uint32_t mask = ar->hdr->n_buckets - 1;
+	uint32_t b, probes;
+
+	for (b = hash & mask, probes = 0; ar->buckets[b] && probes <= mask;
+			b = (b + 1) & mask, probes++) {
+		const struct archive_entry *e = &ar->entries[ar->buckets[b] - 1];
+		const struct mapped_segment *seg;
+
+		if (e->hash != hash || e->name_len != len ||
+				(uint64_t)e->name_offset + len > ar->hdr->names_size ||
+				memcmp(ar->names + e->name_offset, name, len))
+			continue;
+
+		if (e->segment >= ar->n_segments)
+			return -1;
+		seg = &ar->segments[e->segment];
+		if (e->offset > seg->size || e->size > seg->size - e->offset)
+			return -1;
+
+		*data = seg->addr + e->offset;
+		*size = e->size;
+		return 0;
+	}
+
+	return -1;
+}
+
+int archive_find_asset(const struct xnb_archive *ar, const char *input,
+		int asset, const char *ext, const void **data, size_t *size)
+{
+	char name[MAX_NAME_LEN];
+
+	if (asset == 0)
+		snprintf(name, sizeof(name), "%s.%s", input, ext);
+	else
+		snprintf(name, sizeof(name), "%s_shared_%d.%s", input, asset, ext);
+
+	return archive_find(ar, name, data, size);
+}
@@ -0,0 +1,88 @@
+/* Packed output archives
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#ifndef __XNB_ARCHIVE_H__
+#define __XNB_ARCHIVE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "xnb_object.h"
+
+/*
+ * Instead of one file per export, everything can be appended to a few large
+ * files, which is much kinder to network filesystems.
+ *
+ * An archive "out.xar" is the file out.xar, plus out.xar.1, out.xar.2 etc.
+ * if more than one thread was exporting at once. Each file written is
+ * stored contiguously in one of them, at an ARCHIVE_ALIGN aligned offset.
+ * The end of out.xar holds an index of every file by name, which can be
+ * mapped and searched in place.
+ *
+ * Values are in the writer's native byte order, so that the index can be
+ * used in place. A reader with the other byte order sees the wrong version,
+ * and rejects the archive. The index is laid out as:
+ *   struct archive_index_header
+ *   uint32_t buckets[n_buckets]    - entry index + 1, or 0 if empty
+ *   struct archive_entry entries[n_entries]
+ *   char names[]                   - not NUL terminated
+ * then padding to 8 bytes, and the struct archive_trailer ending the file.
+ */
+#define ARCHIVE_ALIGN   64
+#define ARCHIVE_VERSION 1
+
+struct archive_index_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t n_segments;
+	uint32_t n_entries;
+	uint32_t n_buckets;
+	uint64_t names_size;
+};
+
+struct archive_entry {
+	/* xxh64() of the name */
+	uint64_t hash;
+	uint64_t offset;
+	uint64_t size;
+	/* Offset of the name in names[] */
+	uint32_t name_offset;
+	uint32_t name_len;
+	uint32_t segment;
+	uint32_t reserved;
+};
+
+struct archive_trailer {
+	uint64_t index_offset;
+	uint64_t index_size;
+	char magic[8];
+};
+
+/*
+ * A sink writing to the archive at path, for xnb_export_opts. Safe to use
+ * from many threads at once. Returns NULL on error.
+ */
+struct xnb_sink *archive_sink_create(const char *path);
+/* Write the index and free the sink. Returns 0 on success */
+int archive_sink_finish(struct xnb_sink *sink);
+
+/* Reading an archive back */
+struct xnb_archive;
+
+struct xnb_archive *archive_open(const char *path);
+void archive_close(struct xnb_archive *ar);
+/*
+ * Find the file called name. On success, *data points into the archive's
+ * mapping, and stays valid until archive_close(). Returns 0 if found.
+ */
+int archive_find(const struct xnb_archive *ar, const char *name,
+		const void **data, size_t *size);
+/*
+ * Find a file by the input it was exported from, asset (0 for the primary
+ * asset, N for shared resource N) and extension, named as xnbdec names them.
+ */
+int archive_find_asset(const struct xnb_archive *ar, const char *input,
+		int asset, const char *ext, const void **data, size_t *size);
+
+#endif /* __XNB_ARCHIVE_H__ */
@@ -0,0 +1,178 @@
+/* Arena allocator for container contents
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xnb_arena.h"
+#include "xnb_stats.h"
+
+#define ARENA_ALIGN      16
+#define ARENA_CHUNK_SIZE (64 * 1024)
+/* Anything bigger than this gets a chunk to itself */
+#define ARENA_LARGE      (ARENA_CHUNK_SIZE / 4)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	/* Keep data aligned */
+	uint8_t pad[ARENA_ALIGN - (2 * sizeof(size_t) + sizeof(void *)) %
+		ARENA_ALIGN];
+	uint8_t data[];
+};
+
+struct xnb_arena {
+	/* Regular chunks, all kept across resets */
+	struct arena_chunk *chunks;
+	/* The one currently being allocated from */
+	struct arena_chunk *current;
+	/* Large allocations, freed on reset */
+	struct arena_chunk *large;
+	/* The biggest large chunk from last time, kept for reuse */
+	struct arena_chunk *spare;
+	/* Allocated since the last reset, while stats were enabled */
+	size_t counted;
+};
+
+static struct arena_chunk *chunk_new(size_t size)
+{
+	struct arena_chunk *c = malloc(sizeof(*c) + size);
+
+	if (!c)
+		return NULL;
+	if (stats_enabled)
+		stats_add_chunk();
+	c->next = NULL;
+	c->size = size;
+	c->used = 0;
+	return c;
+}
+
+static void chunk_free_list(struct arena_chunk *c)
+{
+	while (c) {
+		struct arena_chunk *next = c->next;
+		free(c);
+		c = next;
+	}
+}
+
+struct xnb_arena *arena_create(void)
+{
+	struct xnb_arena *arena = calloc(1, sizeof(*arena));
+
+	if (!arena) {
+		fprintf(stderr, "Couldn't alloc arena\n");
+		return NULL;
+	}
+
+	return arena;
+}
+
+void arena_destroy(struct xnb_arena *arena)
+{
+	if (!arena)
+		return;
+	if (arena->counted)
+		stats_release(arena->counted);
+	chunk_free_list(arena->chunks);
+	chunk_free_list(arena->large);
+	free(arena->spare);
+	free(arena);
+}
+
+static void *arena_alloc_large(struct xnb_arena *arena, size_t size)
+{
+	struct arena_chunk *c;
+
+	if (arena->spare && arena->spare->size >= size) {
+		c = arena->spare;
+		arena->spare = NULL;
+	} else {
+		c = chunk_new(size);
+		if (!c)
+			return NULL;
+	}
+
+	c->used = size;
+	c->next = arena->large;
+	arena->large = c;
+	return c->data;
+}
+
+void *arena_alloc(struct xnb_arena *arena, size_t size)
+{
+	struct arena_chunk *c = arena->current, *next;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (stats_enabled) {
+		arena->counted += size;
+		stats_add_alloc(size);
+	}
+	if (size > ARENA_LARGE)
+		return arena_alloc_large(arena, size);
+
+	while (!c || c->size - c->used < size) {
+		if (c && c->next) {
+			/* Left over from before a reset */
+			c = c->next;
+			c->used = 0;
+			continue;
+		}
+
+		next = chunk_new(ARENA_CHUNK_SIZE);
+		if (!next)
+			return NULL;
+		if (c)
+			c->next = next;
+		else
+			arena->chunks = next;
+		c = next;
+	}
+	arena->current = c;
+
+	p = c->data + c->used;
+	c->used += size;
+	return p;
+}
+
+void *arena_zalloc(struct xnb_arena *arena, size_t size)
+{
+	void *p = arena_alloc(arena, size);
+
+	if (p)
+		memset(p, 0, size);
+	return p;
+}
+
+void arena_reset(struct xnb_arena *arena)
+{
+	struct arena_chunk *c = arena->large;
+
+	/* Keep whichever large chunk is biggest, in case the next file is similar */
+	while (c) {
+		struct arena_chunk *next = c->next;
+		if (!arena->spare || c->size > arena->spare->size) {
+			free(arena->spare);
+			arena->spare = c;
+		} else {
+			free(c);
+		}
+		c = next;
+	}
+	arena->large = NULL;
+
+	if (arena->counted) {
+		stats_release(arena->counted);
+		arena->counted = 0;
+	}
+
+	if (arena->chunks)
+		arena->chunks->used = 0;
+	arena->current = arena->chunks;
+}
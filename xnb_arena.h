@@ -0,0 +1,29 @@
+/* Arena allocator for container contents
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#ifndef __XNB_ARENA_H__
+#define __XNB_ARENA_H__
+
+#include <stddef.h>
+
+/*
+ * Everything read from a container is allocated from one of these, and
+ * freed all at once with arena_reset(). The memory is kept for the next
+ * container, so a batch run settles down to no malloc() calls at all.
+ * An arena must only be used by one thread at a time.
+ */
+struct xnb_arena;
+
+struct xnb_arena *arena_create(void);
+void arena_destroy(struct xnb_arena *arena);
+
+/* Returns 16-byte aligned memory, or NULL if out of memory */
+void *arena_alloc(struct xnb_arena *arena, size_t size);
+/* Same, but zeroed */
+void *arena_zalloc(struct xnb_arena *arena, size_t size);
+
+/* Release everything allocated so far, keeping the memory for reuse */
+void arena_reset(struct xnb_arena *arena);
+
+#endif /* __XNB_ARENA_H__ */
@@ -0,0 +1,436 @@
+/* Sample format, channel and rate conversion for audio export
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ *
+ * Everything happens in one pass over each chunk of input: 16-bit samples
+ * are converted to float and mixed to the output channel count into planar
+ * buffers, which the resampler reads to produce interleaved output in the
+ * final sample format. Only a filter's worth of history is kept between
+ * chunks.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define AUDIO_SSE2 1
+#endif
+
+#include "xnb_audio.h"
+#include "xnb_object.h"
+
+#define PI 3.14159265358979323846
+
+/* Input frames converted per pass */
+#define IN_CHUNK  4096
+/* Output frames staged before each write */
+#define OUT_CHUNK 4096
+
+/* Filter zero crossings either side of the centre, at the cutoff */
+#define ZERO_CROSSINGS 16
+/* Keep the cutoff a little under Nyquist, for the transition band */
+#define CUTOFF 0.95
+/* Sanity limit on the polyphase table (up * taps floats) */
+#define MAX_FILTER_SIZE (1 << 22)
+
+#define MAX_CHANNELS 8
+
+struct audio_conv {
+	int in_channels;
+	int out_channels;
+	enum audio_sample_format format;
+
+	/* Resample by up / down, with taps taps for each of up phases */
+	uint32_t up, down;
+	int taps;
+	/* Input samples before the output position that each filter covers */
+	int center;
+	float *filter;
+
+	uint64_t in_frames, in_done;
+	uint64_t out_frames, out_done;
+
+	/* Input history, planar. planar[ch][0] is input frame first */
+	float *planar[MAX_CHANNELS];
+	int64_t first;
+	size_t avail, cap;
+
+	/* Scratch for a chunk of converted input, interleaved */
+	float *in_buf;
+	/* Output staging, interleaved, in the output format */
+	float *out_buf;
+};
+
+static uint32_t gcd(uint32_t a, uint32_t b)
+{
+	while (b) {
+		uint32_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* Windowed sinc at x input samples from the centre */
+static double kernel(double x, double fc, double half_width)
+{
+	double s, w;
+
+	if (fabs(x) >= half_width)
+		return 0;
+
+	s = x == 0 ? 1 : sin(PI * fc * x) / (PI * fc * x);
+	/* Blackman */
+	w = 0.42 + 0.5 * cos(PI * x / half_width) +
+		0.08 * cos(2 * PI * x / half_width);
+
+	return fc * s * w;
+}
+
+/*
+ * Phase p of the filter gives the output at p / up of the way from input
+ * sample base to base + 1, as a dot product with input samples
+ * [base - center, base - center + taps)
+ */
+static int build_filter(struct audio_conv *c)
+{
+	double fc, sum;
+	uint32_t p;
+	int j;
+
+	if (c->up == c->down) {
+		c->taps = 1;
+		c->center = 0;
+	} else {
+		fc = c->up < c->down ? (double)c->up / c->down : 1.0;
+		fc *= CUTOFF;
+		c->taps = 2 * (int)ceil(ZERO_CROSSINGS / fc);
+		/* Whole vectors */
+		c->taps = (c->taps + 3) & ~3;
+		c->center = c->taps / 2 - 1;
+	}
+
+	if ((uint64_t)c->up * c->taps > MAX_FILTER_SIZE)
+		return -1;
+
+	c->filter = malloc(sizeof(*c->filter) * c->up * c->taps);
+	if (!c->filter)
+		return -1;
+
+	if (c->taps == 1) {
+		c->filter[0] = 1.0f;
+		return 0;
+	}
+
+	for (p = 0; p < c->up; p++) {
+		float *h = c->filter + (size_t)p * c->taps;
+		double frac = (double)p / c->up;
+
+		sum = 0;
+		for (j = 0; j < c->taps; j++)
+			sum += kernel(frac + c->center - j, fc, c->taps / 2);
+		/* Normalise each phase for unity gain at DC */
+		for (j = 0; j < c->taps; j++)
+			h[j] = kernel(frac + c->center - j, fc, c->taps / 2) / sum;
+	}
+
+	return 0;
+}
+
+struct audio_conv *audio_conv_create(const struct audio_conv_params *p)
+{
+	struct audio_conv *c;
+	uint32_t div;
+	int ch;
+
+	if (!p->in_rate || !p->out_rate || p->in_channels < 1 ||
+			p->in_channels > MAX_CHANNELS || p->out_channels < 1 ||
+			p->out_channels > MAX_CHANNELS) {
+		fprintf(stderr, "Can't convert %d channels at %u Hz to %d at %u Hz\n",
+				p->in_channels, p->in_rate, p->out_channels, p->out_rate);
+		return NULL;
+	}
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+
+	c->in_channels = p->in_channels;
+	c->out_channels = p->out_channels;
+	c->format = p->out_format;
+	c->in_frames = p->in_frames;
+
+	div = gcd(p->in_rate, p->out_rate);
+	c->up = p->out_rate / div;
+	c->down = p->in_rate / div;
+	if (build_filter(c)) {
+		fprintf(stderr, "Can't resample from %u to %u Hz\n", p->in_rate,
+				p->out_rate);
+		goto fail;
+	}
+
+	/* ceil(in_frames * L / M), without overflowing */
+	c->out_frames = c->in_frames / c->down * c->up +
+		((c->in_frames % c->down) * c->up + c->down - 1) / c->down;
+
+	/* History, a chunk of input, and whatever one output step skips */
+	c->cap = c->taps + IN_CHUNK + c->down / c->up + 1;
+	for (ch = 0; ch < c->out_channels; ch++) {
+		c->planar[ch] = calloc(c->cap, sizeof(float));
+		if (!c->planar[ch])
+			goto fail;
+	}
+	/* The filter reads center samples of silence before the start */
+	c->first = -c->center;
+	c->avail = c->center;
+
+	c->in_buf = malloc(sizeof(float) * IN_CHUNK * c->in_channels);
+	c->out_buf = malloc(sizeof(float) * OUT_CHUNK * c->out_channels);
+	if (!c->in_buf || !c->out_buf)
+		goto fail;
+
+	return c;
+
+fail:
+	audio_conv_destroy(c);
+	return NULL;
+}
+
+void audio_conv_destroy(struct audio_conv *c)
+{
+	int ch;
+
+	if (!c)
+		return;
+	for (ch = 0; ch < MAX_CHANNELS; ch++)
+		free(c->planar[ch]);
+	free(c->filter);
+	free(c->in_buf);
+	free(c->out_buf);
+	free(c);
+}
+
+uint64_t audio_conv_out_frames(const struct audio_conv *c)
+{
+	return c->out_frames;
+}
+
+static void s16_to_float(const uint8_t *in, float *out, size_t n)
+{
+	const float scale = 1.0f / 32768;
+	size_t i = 0;
+
+#ifdef AUDIO_SSE2
+	const __m128 vscale = _mm_set1_ps(scale);
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + 2 * i));
+		/* Sign-extend by putting each sample in the top half */
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), vscale));
+		_mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), vscale));
+	}
+#endif
+	for (; i < n; i++)
+		out[i] = (int16_t)(in[2 * i] | (in[2 * i + 1] << 8)) * scale;
+}
+
+/* Round to nearest and saturate */
+static void float_to_s16(const float *in, int16_t *out, size_t n)
+{
+	size_t i = 0;
+
+#ifdef AUDIO_SSE2
+	const __m128 vscale = _mm_set1_ps(32768.0f);
+	for (; i + 8 <= n; i += 8) {
+		__m128i lo = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i),
+					vscale));
+		__m128i hi = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i + 4),
+					vscale));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(lo, hi));
+	}
+#endif
+	for (; i < n; i++) {
+		float v = nearbyintf(in[i] * 32768.0f);
+		out[i] = v < -32768 ? -32768 : v > 32767 ? 32767 : v;
+	}
+}
+
+static inline float dot(const float *h, const float *x, int n)
+{
+	float sum = 0;
+	int i = 0;
+
+#ifdef AUDIO_SSE2
+	__m128 acc = _mm_setzero_ps();
+	for (; i + 4 <= n; i += 4)
+		acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(h + i),
+					_mm_loadu_ps(x + i)));
+	acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+	acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+	sum = _mm_cvtss_f32(acc);
+#endif
+	for (; i < n; i++)
+		sum += h[i] * x[i];
+
+	return sum;
+}
+
+/*
+ * Append frames of input (or silence, if in is NULL) to the planar history,
+ * mixing to the output channel count
+ */
+static void append_input(struct audio_conv *c, const uint8_t *in,
+		size_t frames)
+{
+	int ich = c->in_channels, och = c->out_channels, ch;
+	size_t i;
+
+	if (!in) {
+		for (ch = 0; ch < och; ch++)
+			memset(c->planar[ch] + c->avail, 0, frames * sizeof(float));
+		c->avail += frames;
+		return;
+	}
+
+	s16_to_float(in, c->in_buf, frames * ich);
+
+	if (ich == och) {
+		for (ch = 0; ch < och; ch++) {
+			float *dst = c->planar[ch] + c->avail;
+			for (i = 0; i < frames; i++)
+				dst[i] = c->in_buf[i * ich + ch];
+		}
+	} else if (och == 1) {
+		/* Downmix everything equally */
+		float scale = 1.0f / ich;
+		float *dst = c->planar[0] + c->avail;
+		for (i = 0; i < frames; i++) {
+			float sum = 0;
+			for (ch = 0; ch < ich; ch++)
+				sum += c->in_buf[i * ich + ch];
+			dst[i] = sum * scale;
+		}
+	} else {
+		/*
+		 * Extra inputs are dropped, and extra outputs repeat the last
+		 * input, so mono is copied to every output
+		 */
+		for (ch = 0; ch < och; ch++) {
+			float *dst = c->planar[ch] + c->avail;
+			int src = ch < ich ? ch : ich - 1;
+			for (i = 0; i < frames; i++)
+				dst[i] = c->in_buf[i * ich + src];
+		}
+	}
+
+	c->avail += frames;
+}
+
+static int flush_output(struct audio_conv *c, int fd, size_t frames)
+{
+	size_t n = frames * c->out_channels;
+
+	if (c->format == AUDIO_F32)
+		return export_write(fd, c->out_buf, n * sizeof(float));
+
+	/* Safe in place, as the int16s are smaller */
+	float_to_s16(c->out_buf, (int16_t *)c->out_buf, n);
+	return export_write(fd, c->out_buf, n * sizeof(int16_t));
+}
+
+/* Produce all of the output that the buffered input allows */
+static int run_filter(struct audio_conv *c, int fd)
+{
+	int och = c->out_channels, ch;
+	int64_t start;
+	size_t drop, n = 0;
+
+	while (c->out_done < c->out_frames) {
+		uint64_t pos = c->out_done * c->down;
+		uint64_t base = pos / c->up;
+		const float *h = c->filter + (size_t)(pos % c->up) * c->taps;
+
+		start = (int64_t)base - c->center - c->first;
+		if (start + c->taps > (int64_t)c->avail)
+			break;
+
+		for (ch = 0; ch < och; ch++)
+			c->out_buf[n * och + ch] = dot(h, c->planar[ch] + start,
+					c->taps);
+		c->out_done++;
+
+		if (++n == OUT_CHUNK) {
+			if (flush_output(c, fd, n))
+				return -1;
+			n = 0;
+		}
+	}
+	if (n && flush_output(c, fd, n))
+		return -1;
+
+	/* Drop whatever the next output doesn't need */
+	start = (int64_t)(c->out_done * c->down / c->up) - c->center - c->first;
+	drop = start < 0 ? 0 : (size_t)start > c->avail ? c->avail : (size_t)start;
+	if (drop) {
+		for (ch = 0; ch < och; ch++)
+			memmove(c->planar[ch], c->planar[ch] + drop,
+					(c->avail - drop) * sizeof(float));
+		c->avail -= drop;
+		c->first += drop;
+	}
+
+	return 0;
+}
+
+int audio_conv_write(struct audio_conv *c, int fd, const void *in,
+		size_t frames)
+{
+	const uint8_t *p = in;
+
+	while (frames) {
+		size_t n = c->cap - c->avail;
+
+		if (n > IN_CHUNK)
+			n = IN_CHUNK;
+		if (n > frames)
+			n = frames;
+		/* Don't go past what the output length was worked out for */
+		if (c->in_done + n > c->in_frames)
+			n = c->in_frames - c->in_done;
+		if (!n)
+			break;
+
+		append_input(c, p, n);
+		p += n * c->in_channels * 2;
+		frames -= n;
+		c->in_done += n;
+
+		if (run_filter(c, fd))
+			return -1;
+	}
+
+	return 0;
+}
+
+int audio_conv_finish(struct audio_conv *c, int fd)
+{
+	/* Pad with silence until the last output can be computed */
+	while (c->out_done < c->out_frames) {
+		size_t n = c->cap - c->avail;
+
+		if (n > IN_CHUNK)
+			n = IN_CHUNK;
+		if (!n) {
+			fprintf(stderr, "Resampler stalled\n");
+			return -1;
+		}
+		append_input(c, NULL, n);
+		if (run_filter(c, fd))
+			return -1;
+	}
+
+	return 0;
+}
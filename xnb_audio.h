@@ -0,0 +1,52 @@
+/* Sample format, channel and rate conversion for audio export
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#ifndef __XNB_AUDIO_H__
+#define __XNB_AUDIO_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+
+enum audio_sample_format {
+	AUDIO_S16,
+	AUDIO_F32,
+};
+
+struct audio_conv_params {
+	uint32_t in_rate;
+	int in_channels;
+	/* Total input frames, so the output length is known up front */
+	uint64_t in_frames;
+
+	uint32_t out_rate;
+	int out_channels;
+	enum audio_sample_format out_format;
+};
+
+struct audio_conv;
+
+/*
+ * Set up a converter from interleaved 16-bit PCM. Rate changes use a
+ * polyphase windowed-sinc filter with the exact L/M ratio between the rates.
+ * Returns NULL on error.
+ */
+struct audio_conv *audio_conv_create(const struct audio_conv_params *p);
+void audio_conv_destroy(struct audio_conv *c);
+
+/* Exactly how many frames will be written, ceil(in_frames * L / M) */
+uint64_t audio_conv_out_frames(const struct audio_conv *c);
+
+/*
+ * Convert frames of little-endian 16-bit input, which needn't be aligned,
+ * and append as much output as is ready to fd. Memory use doesn't depend on
+ * how much is passed in. Returns 0 on success.
+ */
+int audio_conv_write(struct audio_conv *c, int fd, const void *in,
+		size_t frames);
+/* Write out the rest, after all of the input has been passed in */
+int audio_conv_finish(struct audio_conv *c, int fd);
+
+#endif /* __XNB_AUDIO_H__ */
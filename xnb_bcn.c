@@ -0,0 +1,481 @@
+/* BC1/BC2/BC3 (DXT1/DXT3/DXT5) texture decoding
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ *
+ * Block palettes are always worked out by the scalar code, so every
+ * implementation interpolates identically. The vectorized versions differ
+ * in how they turn the 2- and 3-bit indices into pixels:
+ *  - SSE2 compares each row's indices against 0-3 and selects palette
+ *    entries with the resulting masks
+ *  - AVX2 shifts each pixel's index into its own lane and looks it up with
+ *    a single permute, 8 pixels at a time
+ * The best one the CPU supports is picked on first use.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "xnb_bcn.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BCN_X86 1
+#include <immintrin.h>
+#endif
+
+struct bcn_impl {
+	const char *name;
+	/* Decode a whole 4x4 block to dst */
+	void (*bc1)(const uint8_t *blk, uint8_t *dst, size_t stride);
+	void (*bc2)(const uint8_t *blk, uint8_t *dst, size_t stride);
+	void (*bc3)(const uint8_t *blk, uint8_t *dst, size_t stride);
+};
+
+size_t bcn_block_size(enum bcn_format fmt)
+{
+	return fmt == BCN_BC1 ? 8 : 16;
+}
+
+static inline uint32_t pack_rgba(uint32_t r, uint32_t g, uint32_t b,
+		uint32_t a)
+{
+	return r | (g << 8) | (b << 16) | (a << 24);
+}
+
+static inline uint32_t load_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Opaque palette of an 8-byte color block */
+static void color_palette(const uint8_t *blk, int bc1, uint32_t pal[4])
+{
+	uint16_t c0 = blk[0] | (blk[1] << 8);
+	uint16_t c1 = blk[2] | (blk[3] << 8);
+	uint32_t r0 = (c0 >> 11) & 0x1f, g0 = (c0 >> 5) & 0x3f, b0 = c0 & 0x1f;
+	uint32_t r1 = (c1 >> 11) & 0x1f, g1 = (c1 >> 5) & 0x3f, b1 = c1 & 0x1f;
+
+	r0 = (r0 << 3) | (r0 >> 2);
+	g0 = (g0 << 2) | (g0 >> 4);
+	b0 = (b0 << 3) | (b0 >> 2);
+	r1 = (r1 << 3) | (r1 >> 2);
+	g1 = (g1 << 2) | (g1 >> 4);
+	b1 = (b1 << 3) | (b1 >> 2);
+
+	pal[0] = pack_rgba(r0, g0, b0, 255);
+	pal[1] = pack_rgba(r1, g1, b1, 255);
+	/* BC2 and BC3 always use the four-color mode */
+	if (c0 > c1 || !bc1) {
+		pal[2] = pack_rgba((2 * r0 + r1) / 3, (2 * g0 + g1) / 3,
+				(2 * b0 + b1) / 3, 255);
+		pal[3] = pack_rgba((r0 + 2 * r1) / 3, (g0 + 2 * g1) / 3,
+				(b0 + 2 * b1) / 3, 255);
+	} else {
+		pal[2] = pack_rgba((r0 + r1) / 2, (g0 + g1) / 2, (b0 + b1) / 2, 255);
+		pal[3] = 0;
+	}
+}
+
+static void bc3_alpha_palette(const uint8_t *blk, uint32_t a[8])
+{
+	uint32_t a0 = blk[0], a1 = blk[1];
+	int i;
+
+	a[0] = a0;
+	a[1] = a1;
+	if (a0 > a1) {
+		for (i = 1; i < 7; i++)
+			a[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+	} else {
+		for (i = 1; i < 5; i++)
+			a[i + 1] = ((5 - i) * a0 + i * a1) / 5;
+		a[6] = 0;
+		a[7] = 255;
+	}
+}
+
+/* 48 bits of 3-bit indices */
+static inline uint64_t bc3_alpha_bits(const uint8_t *blk)
+{
+	return (uint64_t)load_le32(blk + 2) | ((uint64_t)blk[6] << 32) |
+		((uint64_t)blk[7] << 40);
+}
+
+/* Scalar */
+
+static void scalar_color(const uint8_t *blk, int bc1, const uint32_t *alpha,
+		uint8_t *dst, size_t stride)
+{
+	uint32_t pal[4], bits = load_le32(blk + 4);
+	int x, y;
+
+	color_palette(blk, bc1, pal);
+	for (y = 0; y < 4; y++) {
+		uint32_t *row = (uint32_t *)(dst + y * stride);
+		for (x = 0; x < 4; x++) {
+			int i = y * 4 + x;
+			uint32_t px = pal[(bits >> (2 * i)) & 3];
+			if (alpha)
+				px = (px & 0x00ffffff) | (alpha[i] << 24);
+			memcpy(&row[x], &px, sizeof(px));
+		}
+	}
+}
+
+static void scalar_bc1(const uint8_t *blk, uint8_t *dst, size_t stride)
+{
+	scalar_color(blk, 1, NULL, dst, stride);
+}
+
+static void scalar_bc2(const uint8_t *blk, uint8_t *dst, size_t stride)
+{
+	uint32_t alpha[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		alpha[i] = ((blk[i / 2] >> (4 * (i & 1))) & 0xf) * 17;
+	scalar_color(blk + 8, 0, alpha, dst, stride);
+}
+
+static void scalar_bc3(const uint8_t *blk, uint8_t *dst, size_t stride)
+{
+	uint32_t apal[8], alpha[16];
+	uint64_t bits = bc3_alpha_bits(blk);
+	int i;
+
+	bc3_alpha_palette(blk, apal);
+	for (i = 0; i < 16; i++)
+		alpha[i] = apal[(bits >> (3 * i)) & 7];
+	scalar_color(blk + 8, 0, alpha, dst, stride);
+}
+
+static const struct bcn_impl scalar_impl = {
+	.name = "scalar",
+	.bc1 = scalar_bc1,
+	.bc2 = scalar_bc2,
+	.bc3 = scalar_bc3,
+};
+
+#ifdef BCN_X86
+
+/* SSE2 */
+
+/*
+ * Select palette entries for the 4 pixels of each row. The masks are
+ * disjoint, so XORing in the differences from entry 0 picks the right one.
+ * alpha, if given, replaces the top byte of each pixel.
+ */
+__attribute__((target("sse2")))
+static inline void sse2_color(const uint8_t *blk, int bc1,
+		const __m128i *alpha, uint8_t *dst, size_t stride)
+{
+	const __m128i mask = _mm_setr_epi32(3 << 0, 3 << 2, 3 << 4, 3 << 6);
+	const __m128i one = _mm_setr_epi32(1 << 0, 1 << 2, 1 << 4, 1 << 6);
+	const __m128i two = _mm_setr_epi32(2 << 0, 2 << 2, 2 << 4, 2 << 6);
+	uint32_t pal[4], bits = load_le32(blk + 4);
+	__m128i p0, d1, d2, d3;
+	int y;
+
+	color_palette(blk, bc1, pal);
+	p0 = _mm_set1_epi32(pal[0]);
+	d1 = _mm_xor_si128(p0, _mm_set1_epi32(pal[1]));
+	d2 = _mm_xor_si128(p0, _mm_set1_epi32(pal[2]));
+	d3 = _mm_xor_si128(p0, _mm_set1_epi32(pal[3]));
+
+	for (y = 0; y < 4; y++) {
+		__m128i idx = _mm_and_si128(_mm_set1_epi32(bits >> (8 * y)), mask);
+		__m128i px = p0;
+		px = _mm_xor_si128(px, _mm_and_si128(_mm_cmpeq_epi32(idx, one), d1));
+		px = _mm_xor_si128(px, _mm_and_si128(_mm_cmpeq_epi32(idx, two), d2));
+		px = _mm_xor_si128(px, _mm_and_si128(_mm_cmpeq_epi32(idx, mask), d3));
+		if (alpha)
+			px = _mm_or_si128(_mm_and_si128(px,
+						_mm_set1_epi32(0x00ffffff)), alpha[y]);
+		_mm_storeu_si128((__m128i *)(dst + y * stride), px);
+	}
+}
+
+/* Expand BC2's 4-bit alphas into the top byte of 16 pixels */
+__attribute__((target("sse2")))
+static inline void sse2_bc2_alpha(const uint8_t *blk, __m128i alpha[4])
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a = _mm_loadl_epi64((const __m128i *)blk);
+	__m128i lo = _mm_and_si128(a, _mm_set1_epi8(0xf));
+	__m128i hi = _mm_and_si128(_mm_srli_epi16(a, 4), _mm_set1_epi8(0xf));
+	__m128i a8 = _mm_unpacklo_epi8(lo, hi);
+	__m128i a16;
+
+	/* n * 17 == (n << 4) | n, for 4-bit n */
+	a8 = _mm_or_si128(a8, _mm_slli_epi16(a8, 4));
+
+	a16 = _mm_unpacklo_epi8(zero, a8);
+	alpha[0] = _mm_unpacklo_epi16(zero, a16);
+	alpha[1] = _mm_unpackhi_epi16(zero, a16);
+	a16 = _mm_unpackhi_epi8(zero, a8);
+	alpha[2] = _mm_unpacklo_epi16(zero, a16);
+	alpha[3] = _mm_unpackhi_epi16(zero, a16);
+}
+
+__attribute__((target("sse2")))
+static void sse2_bc1(const uint8_t *blk, uint8_t *dst, size_t stride)
+{
+	sse2_color(blk, 1, NULL, dst, stride);
+}
+
+__attribute__((target("sse2")))
+static void sse2_bc2(const uint8_t *blk, uint8_t *dst, size_t stride)
+{
+	__m128i alpha[4];
+
+	sse2_bc2_alpha(blk, alpha);
+	sse2_color(blk + 8, 0, alpha, dst, stride);
+}
+
+__attribute__((target("sse2")))
+static void sse2_bc3(const uint8_t *blk, uint8_t *dst, size_t stride)
+{
+	uint32_t apal[8], alpha[16];
+	uint64_t bits = bc3_alpha_bits(blk);
+	__m128i av[4];
+	int i;
+
+	/* No variable shifts or permutes in SSE2, so the lookup stays scalar */
+	bc3_alpha_palette(blk, apal);
+	for (i = 0; i < 16; i++)
+		alpha[i] = apal[(bits >> (3 * i)) & 7] << 24;
+	for (i = 0; i < 4; i++)
+		av[i] = _mm_loadu_si128((const __m128i *)&alpha[i * 4]);
+	sse2_color(blk + 8, 0, av, dst, stride);
+}
+
+static const struct bcn_impl sse2_impl = {
+	.name = "sse2",
+	.bc1 = sse2_bc1,
+	.bc2 = sse2_bc2,
+	.bc3 = sse2_bc3,
+};
+
+/* AVX2 */
+
+/* Look up 8 pixels at a time; alpha replaces the top bytes if given */
+__attribute__((target("avx2")))
+static inline void avx2_color(const uint8_t *blk, int bc1,
+		const __m256i *alpha, uint8_t *dst, size_t stride)
+{
+	const __m256i shift = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+	const __m256i three = _mm256_set1_epi32(3);
+	uint32_t pal[4], bits = load_le32(blk + 4);
+	__m256i vpal, idx, px;
+	int half;
+
+	color_palette(blk, bc1, pal);
+	vpal = _mm256_setr_epi32(pal[0], pal[1], pal[2], pal[3],
+			pal[0], pal[1], pal[2], pal[3]);
+
+	/* Rows 0-1, then rows 2-3 */
+	for (half = 0; half < 2; half++) {
+		idx = _mm256_srlv_epi32(_mm256_set1_epi32(bits >> (16 * half)),
+				shift);
+		idx = _mm256_and_si256(idx, three);
+		px = _mm256_permutevar8x32_epi32(vpal, idx);
+		if (alpha)
+			px = _mm256_or_si256(_mm256_and_si256(px,
+						_mm256_set1_epi32(0x00ffffff)), alpha[half]);
+		_mm_storeu_si128((__m128i *)(dst + (2 * half) * stride),
+				_mm256_castsi256_si128(px));
+		_mm_storeu_si128((__m128i *)(dst + (2 * half + 1) * stride),
+				_mm256_extracti128_si256(px, 1));
+	}
+}
+
+__attribute__((target("avx2")))
+static void avx2_bc1(const uint8_t *blk, uint8_t *dst, size_t stride)
+{
+	avx2_color(blk, 1, NULL, dst, stride);
+}
+
+__attribute__((target("avx2")))
+static void avx2_bc2(const uint8_t *blk, uint8_t *dst, size_t stride)
+{
+	__m128i a[4];
+	__m256i alpha[2];
+
+	sse2_bc2_alpha(blk, a);
+	alpha[0] = _mm256_inserti128_si256(_mm256_castsi128_si256(a[0]), a[1], 1);
+	alpha[1] = _mm256_inserti128_si256(_mm256_castsi128_si256(a[2]), a[3], 1);
+	avx2_color(blk + 8, 0, alpha, dst, stride);
+}
+
+__attribute__((target("avx2")))
+static void avx2_bc3(const uint8_t *blk, uint8_t *dst, size_t stride)
+{
+	const __m256i shift = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+	const __m256i seven = _mm256_set1_epi32(7);
+	uint32_t apal[8];
+	uint64_t bits = bc3_alpha_bits(blk);
+	__m256i vapal, idx, alpha[2];
+	int half;
+
+	bc3_alpha_palette(blk, apal);
+	vapal = _mm256_slli_epi32(_mm256_loadu_si256((const __m256i *)apal), 24);
+
+	/* 8 pixels use 24 bits of indices */
+	for (half = 0; half < 2; half++) {
+		uint32_t b = (bits >> (24 * half)) & 0xffffff;
+		idx = _mm256_srlv_epi32(_mm256_set1_epi32(b), shift);
+		idx = _mm256_and_si256(idx, seven);
+		alpha[half] = _mm256_permutevar8x32_epi32(vapal, idx);
+	}
+
+	avx2_color(blk + 8, 0, alpha, dst, stride);
+}
+
+static const struct bcn_impl avx2_impl = {
+	.name = "avx2",
+	.bc1 = avx2_bc1,
+	.bc2 = avx2_bc2,
+	.bc3 = avx2_bc3,
+};
+
+#endif /* BCN_X86 */
+
+static const struct bcn_impl *impl = &scalar_impl;
+static pthread_once_t impl_once = PTHREAD_ONCE_INIT;
+
+static void pick_impl(void)
+{
+#ifdef BCN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		impl = &avx2_impl;
+	else if (__builtin_cpu_supports("sse2"))
+		impl = &sse2_impl;
+#endif
+}
+
+const char *bcn_impl_name(void)
+{
+	pthread_once(&impl_once, pick_impl);
+	return impl->name;
+}
+
+static void decode_row_with(const struct bcn_impl *im, enum bcn_format fmt,
+		const uint8_t *src, uint32_t width, uint32_t rows, uint8_t *dst,
+		size_t stride)
+{
+	void (*block)(const uint8_t *, uint8_t *, size_t);
+	size_t bsize = bcn_block_size(fmt);
+	uint32_t x;
+
+	switch (fmt) {
+	case BCN_BC1:
+		block = im->bc1;
+		break;
+	case BCN_BC2:
+		block = im->bc2;
+		break;
+	default:
+		block = im->bc3;
+		break;
+	}
+
+	for (x = 0; x < width; x += 4, src += bsize) {
+		uint8_t tmp[4 * 4 * 4];
+		uint32_t w = width - x < 4 ? width - x : 4;
+		uint32_t y;
+
+		if (w == 4 && rows == 4) {
+			block(src, dst + x * 4, stride);
+			continue;
+		}
+
+		/* Edge block - decode it aside and copy the part that's inside */
+		block(src, tmp, 16);
+		for (y = 0; y < rows; y++)
+			memcpy(dst + y * stride + x * 4, tmp + y * 16, w * 4);
+	}
+}
+
+void bcn_decode_row(enum bcn_format fmt, const uint8_t *src, uint32_t width,
+		uint32_t rows, uint8_t *dst, size_t stride)
+{
+	pthread_once(&impl_once, pick_impl);
+	decode_row_with(impl, fmt, src, width, rows, dst, stride);
+}
+
+/* Self test */
+
+static int test_impl(const struct bcn_impl *im)
+{
+	/* Odd width to exercise the edge path too */
+	enum { WIDTH = 4 * 63 + 3, BLOCKS = (WIDTH + 3) / 4, ITERS = 64 };
+	static uint8_t src[BLOCKS * 16];
+	static uint8_t ref[4][WIDTH * 4], out[4][WIDTH * 4];
+	uint32_t seed = 0x12345678;
+	enum bcn_format fmt;
+	int iter, fails = 0;
+	size_t i;
+
+	for (fmt = BCN_BC1; fmt <= BCN_BC3; fmt++) {
+		size_t bsize = bcn_block_size(fmt);
+
+		for (iter = 0; iter < ITERS; iter++) {
+			uint32_t rows = (iter % 4) + 1;
+
+			for (i = 0; i < sizeof(src); i++) {
+				seed = seed * 1103515245 + 12345;
+				src[i] = seed >> 16;
+			}
+			/* Make sure both color and alpha modes get covered */
+			for (i = 0; i < BLOCKS; i += 2) {
+				uint8_t *c = &src[i * bsize + (bsize - 8)];
+				uint8_t t0 = c[0], t1 = c[1];
+				c[0] = c[2];
+				c[1] = c[3];
+				c[2] = t0;
+				c[3] = t1;
+				if (fmt == BCN_BC3) {
+					uint8_t t = src[i * bsize];
+					src[i * bsize] = src[i * bsize + 1];
+					src[i * bsize + 1] = t;
+				}
+			}
+
+			memset(ref, 0, sizeof(ref));
+			memset(out, 0, sizeof(out));
+			decode_row_with(&scalar_impl, fmt, src, WIDTH, rows,
+					ref[0], sizeof(ref[0]));
+			decode_row_with(im, fmt, src, WIDTH, rows, out[0],
+					sizeof(out[0]));
+			if (memcmp(ref, out, sizeof(ref))) {
+				fprintf(stderr, "BCn self-test: %s differs from scalar for"
+						" BC%d\n", im->name, fmt + 1);
+				fails++;
+				break;
+			}
+		}
+	}
+
+	return fails;
+}
+
+int bcn_self_test(void)
+{
+	int fails = 0;
+
+#ifdef BCN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		fails += test_impl(&sse2_impl);
+		printf("BCn self-test: sse2 %s\n", fails ? "FAILED" : "ok");
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		int f = test_impl(&avx2_impl);
+		printf("BCn self-test: avx2 %s\n", f ? "FAILED" : "ok");
+		fails += f;
+	}
+#endif
+	printf("BCn self-test: using %s\n", bcn_impl_name());
+
+	return fails ? -1 : 0;
+}
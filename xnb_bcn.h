@@ -0,0 +1,37 @@
+/* BC1/BC2/BC3 (DXT1/DXT3/DXT5) texture decoding
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#ifndef __XNB_BCN_H__
+#define __XNB_BCN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum bcn_format {
+	BCN_BC1,
+	BCN_BC2,
+	BCN_BC3,
+};
+
+/* Bytes per 4x4 block */
+size_t bcn_block_size(enum bcn_format fmt);
+
+/*
+ * Decode one row of blocks (4 rows of pixels, fewer at the bottom edge) to
+ * RGBA8. src must hold (width + 3) / 4 blocks. dst rows are stride bytes
+ * apart, and only the first rows rows are written.
+ */
+void bcn_decode_row(enum bcn_format fmt, const uint8_t *src, uint32_t width,
+		uint32_t rows, uint8_t *dst, size_t stride);
+
+/* Name of the implementation picked for this CPU */
+const char *bcn_impl_name(void);
+
+/*
+ * Check every vectorized implementation this CPU supports against the
+ * scalar one. Returns 0 if they all match.
+ */
+int bcn_self_test(void);
+
+#endif /* __XNB_BCN_H__ */
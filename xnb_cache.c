@@ -0,0 +1,471 @@
+/* Incremental export cache
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "xnb_cache.h"
+#include "xnb_hash.h"
+
+/*
+ * The manifest is text, so it can be inspected and fixed up by hand:
+ *
+ *   xnbdec-cache <version> <options hash>
+ *   <size> <mtime sec> <mtime nsec> <hash> <n outputs> <input path>
+ *   <output path>
+ *   ...
+ *
+ * Paths can't contain newlines. Inputs with one just aren't cached.
+ * Bump the version whenever an exporter's output changes.
+ */
+#define CACHE_MAGIC   "xnbdec-cache"
+#define CACHE_VERSION 1
+#define CACHE_FILE    ".xnbdec-cache"
+
+#define INITIAL_BUCKETS 1024
+
+struct cache_entry {
+	struct cache_entry *next;
+	uint64_t path_hash;
+	char *path;
+	struct cache_key key;
+	int n_outputs;
+	char **outputs;
+};
+
+struct xnb_cache {
+	char *filename;
+	uint64_t opts_hash;
+	/* Set if the manifest needs writing back */
+	bool dirty;
+
+	pthread_mutex_t lock;
+	struct cache_entry **buckets;
+	size_t n_buckets;
+	size_t count;
+};
+
+static uint64_t path_hash(const char *path)
+{
+	return xxh64(path, strlen(path), 0);
+}
+
+static void free_entry(struct cache_entry *e)
+{
+	int i;
+
+	for (i = 0; i < e->n_outputs; i++)
+		free(e->outputs[i]);
+	free(e->outputs);
+	free(e->path);
+	free(e);
+}
+
+static struct cache_entry **find_slot(struct xnb_cache *cache,
+		const char *path, uint64_t hash)
+{
+	struct cache_entry **slot;
+
+	slot = &cache->buckets[hash & (cache->n_buckets - 1)];
+	for (; *slot; slot = &(*slot)->next) {
+		if ((*slot)->path_hash == hash && !strcmp((*slot)->path, path))
+			break;
+	}
+
+	return slot;
+}
+
+static void grow(struct xnb_cache *cache)
+{
+	size_t n_buckets = cache->n_buckets * 2;
+	struct cache_entry **buckets;
+	size_t i;
+
+	buckets = calloc(n_buckets, sizeof(*buckets));
+	if (!buckets)
+		return;
+
+	for (i = 0; i < cache->n_buckets; i++) {
+		struct cache_entry *e = cache->buckets[i], *next;
+		for (; e; e = next) {
+			size_t b = e->path_hash & (n_buckets - 1);
+			next = e->next;
+			e->next = buckets[b];
+			buckets[b] = e;
+		}
+	}
+
+	free(cache->buckets);
+	cache->buckets = buckets;
+	cache->n_buckets = n_buckets;
+}
+
+/* Takes ownership of e, replacing any existing entry for the same path */
+static void insert(struct xnb_cache *cache, struct cache_entry *e)
+{
+	struct cache_entry **slot = find_slot(cache, e->path, e->path_hash);
+
+	if (*slot) {
+		e->next = (*slot)->next;
+		free_entry(*slot);
+		*slot = e;
+		return;
+	}
+
+	e->next = NULL;
+	*slot = e;
+	if (++cache->count > cache->n_buckets)
+		grow(cache);
+}
+
+static struct cache_entry *new_entry(const char *path)
+{
+	struct cache_entry *e = calloc(1, sizeof(*e));
+	if (!e)
+		return NULL;
+
+	e->path = strdup(path);
+	if (!e->path) {
+		free(e);
+		return NULL;
+	}
+	e->path_hash = path_hash(path);
+
+	return e;
+}
+
+static void chomp(char *line, ssize_t *len)
+{
+	if (*len > 0 && line[*len - 1] == '\n')
+		line[--*len] = '\0';
+}
+
+/* Returns 0 on success, or -1 if the manifest is malformed */
+static int load_manifest(struct xnb_cache *cache, FILE *fp)
+{
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	int version, res = -1;
+	uint64_t opts_hash;
+
+	len = getline(&line, &cap, fp);
+	if (len < 0 ||
+			sscanf(line, CACHE_MAGIC " %d %" SCNx64, &version, &opts_hash) != 2)
+		goto done;
+
+	/* Not an error, just nothing we can use */
+	if (version != CACHE_VERSION || opts_hash != cache->opts_hash) {
+		res = 0;
+		cache->dirty = true;
+		goto done;
+	}
+
+	while ((len = getline(&line, &cap, fp)) >= 0) {
+		struct cache_entry *e;
+		struct cache_key key = { .has_hash = true };
+		int n_outputs, path_off = 0, i;
+
+		chomp(line, &len);
+		if (sscanf(line, "%" SCNu64 " %" SCNd64 " %ld %" SCNx64 " %d %n",
+					&key.size, &key.mtime_sec, &key.mtime_nsec, &key.hash,
+					&n_outputs, &path_off) != 5 || !path_off ||
+				n_outputs < 0)
+			goto done;
+
+		e = new_entry(line + path_off);
+		if (!e)
+			goto done;
+		e->key = key;
+		e->outputs = calloc(n_outputs ? n_outputs : 1, sizeof(*e->outputs));
+		if (!e->outputs) {
+			free_entry(e);
+			goto done;
+		}
+
+		for (i = 0; i < n_outputs; i++) {
+			len = getline(&line, &cap, fp);
+			if (len < 0)
+				break;
+			chomp(line, &len);
+			e->outputs[i] = strdup(line);
+			if (!e->outputs[i])
+				break;
+			e->n_outputs++;
+		}
+		if (i != n_outputs) {
+			free_entry(e);
+			goto done;
+		}
+
+		insert(cache, e);
+	}
+
+	res = 0;
+
+done:
+	free(line);
+	return res;
+}
+
+struct xnb_cache *cache_open(const char *dir, uint64_t opts_hash)
+{
+	struct xnb_cache *cache;
+	size_t len;
+	FILE *fp;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		goto fail;
+
+	len = strlen(dir) + sizeof("/" CACHE_FILE);
+	cache->filename = malloc(len);
+	cache->n_buckets = INITIAL_BUCKETS;
+	cache->buckets = calloc(cache->n_buckets, sizeof(*cache->buckets));
+	if (!cache->filename || !cache->buckets)
+		goto fail;
+	snprintf(cache->filename, len, "%s/" CACHE_FILE, dir);
+	cache->opts_hash = opts_hash;
+	pthread_mutex_init(&cache->lock, NULL);
+
+	fp = fopen(cache->filename, "r");
+	if (!fp) {
+		if (errno != ENOENT)
+			fprintf(stderr, "Couldn't open '%s': %s\n", cache->filename,
+					strerror(errno));
+		return cache;
+	}
+
+	if (load_manifest(cache, fp)) {
+		size_t i;
+
+		fprintf(stderr, "Ignoring corrupt cache manifest '%s'\n",
+				cache->filename);
+		for (i = 0; i < cache->n_buckets; i++) {
+			while (cache->buckets[i]) {
+				struct cache_entry *e = cache->buckets[i];
+				cache->buckets[i] = e->next;
+				free_entry(e);
+			}
+		}
+		cache->count = 0;
+		cache->dirty = true;
+	}
+	fclose(fp);
+
+	return cache;
+
+fail:
+	fprintf(stderr, "Couldn't allocate cache\n");
+	if (cache) {
+		free(cache->filename);
+		free(cache->buckets);
+		free(cache);
+	}
+	return NULL;
+}
+
+static int save_manifest(struct xnb_cache *cache)
+{
+	char *tmp;
+	size_t len, i;
+	FILE *fp;
+	int j, res = -1;
+
+	len = strlen(cache->filename) + sizeof(".tmp");
+	tmp = malloc(len);
+	if (!tmp)
+		return -1;
+	snprintf(tmp, len, "%s.tmp", cache->filename);
+
+	/* Write it alongside, then rename, so it's never half written */
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		fprintf(stderr, "Couldn't open '%s' for writing: %s\n", tmp,
+				strerror(errno));
+		goto done;
+	}
+
+	fprintf(fp, CACHE_MAGIC " %d %016" PRIx64 "\n", CACHE_VERSION,
+			cache->opts_hash);
+	for (i = 0; i < cache->n_buckets; i++) {
+		struct cache_entry *e;
+		for (e = cache->buckets[i]; e; e = e->next) {
+			fprintf(fp, "%" PRIu64 " %" PRId64 " %ld %016" PRIx64 " %d %s\n",
+					e->key.size, e->key.mtime_sec, e->key.mtime_nsec,
+					e->key.hash, e->n_outputs, e->path);
+			for (j = 0; j < e->n_outputs; j++)
+				fprintf(fp, "%s\n", e->outputs[j]);
+		}
+	}
+
+	if (fclose(fp)) {
+		fprintf(stderr, "Couldn't write '%s': %s\n", tmp, strerror(errno));
+		remove(tmp);
+		goto done;
+	}
+
+	if (rename(tmp, cache->filename)) {
+		fprintf(stderr, "Couldn't rename '%s': %s\n", tmp, strerror(errno));
+		remove(tmp);
+		goto done;
+	}
+
+	res = 0;
+
+done:
+	free(tmp);
+	return res;
+}
+
+int cache_close(struct xnb_cache *cache)
+{
+	size_t i;
+	int res = 0;
+
+	if (cache->dirty)
+		res = save_manifest(cache);
+
+	for (i = 0; i < cache->n_buckets; i++) {
+		while (cache->buckets[i]) {
+			struct cache_entry *e = cache->buckets[i];
+			cache->buckets[i] = e->next;
+			free_entry(e);
+		}
+	}
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->buckets);
+	free(cache->filename);
+	free(cache);
+
+	return res;
+}
+
+int cache_stat(const char *path, struct cache_key *key)
+{
+	struct stat st;
+
+	if (stat(path, &st) || !S_ISREG(st.st_mode))
+		return -1;
+
+	key->size = st.st_size;
+	key->mtime_sec = st.st_mtim.tv_sec;
+	key->mtime_nsec = st.st_mtim.tv_nsec;
+	key->has_hash = false;
+
+	return 0;
+}
+
+bool cache_lookup(struct xnb_cache *cache, const char *path,
+		const struct cache_key *key)
+{
+	struct cache_entry *e;
+	bool hit = false;
+	struct stat st;
+	int i;
+
+	pthread_mutex_lock(&cache->lock);
+
+	e = *find_slot(cache, path, path_hash(path));
+	if (!e || e->key.size != key->size)
+		goto done;
+
+	if (key->has_hash) {
+		if (e->key.hash != key->hash)
+			goto done;
+	} else if (e->key.mtime_sec != key->mtime_sec ||
+			e->key.mtime_nsec != key->mtime_nsec) {
+		goto done;
+	}
+
+	for (i = 0; i < e->n_outputs; i++) {
+		if (stat(e->outputs[i], &st))
+			goto done;
+	}
+
+	/* Only touched, so save rehashing it next time */
+	if (e->key.mtime_sec != key->mtime_sec ||
+			e->key.mtime_nsec != key->mtime_nsec) {
+		e->key.mtime_sec = key->mtime_sec;
+		e->key.mtime_nsec = key->mtime_nsec;
+		cache->dirty = true;
+	}
+	hit = true;
+
+done:
+	pthread_mutex_unlock(&cache->lock);
+	return hit;
+}
+
+int cache_update(struct xnb_cache *cache, const char *path,
+		const struct cache_key *key, const struct xnb_output_list *outputs)
+{
+	struct cache_entry *e;
+	int i;
+
+	if (!key->has_hash)
+		return -1;
+
+	if (strchr(path, '\n')) {
+		cache_remove(cache, path);
+		return 0;
+	}
+	for (i = 0; i < outputs->count; i++) {
+		if (strchr(outputs->names[i], '\n')) {
+			cache_remove(cache, path);
+			return 0;
+		}
+	}
+
+	e = new_entry(path);
+	if (!e)
+		goto fail;
+	e->key = *key;
+	e->outputs = calloc(outputs->count ? outputs->count : 1,
+			sizeof(*e->outputs));
+	if (!e->outputs)
+		goto fail;
+	for (i = 0; i < outputs->count; i++) {
+		e->outputs[i] = strdup(outputs->names[i]);
+		if (!e->outputs[i])
+			goto fail;
+		e->n_outputs++;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	insert(cache, e);
+	cache->dirty = true;
+	pthread_mutex_unlock(&cache->lock);
+
+	return 0;
+
+fail:
+	fprintf(stderr, "Couldn't allocate cache entry for '%s'\n", path);
+	if (e)
+		free_entry(e);
+	return -1;
+}
+
+void cache_remove(struct xnb_cache *cache, const char *path)
+{
+	struct cache_entry **slot, *e;
+
+	pthread_mutex_lock(&cache->lock);
+	slot = find_slot(cache, path, path_hash(path));
+	e = *slot;
+	if (e) {
+		*slot = e->next;
+		free_entry(e);
+		cache->count--;
+		cache->dirty = true;
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,54 @@
+/* Incremental export cache
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#ifndef __XNB_CACHE_H__
+#define __XNB_CACHE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "xnb_object.h"
+
+/*
+ * A manifest kept in the output directory, recording what each input looked
+ * like when it was last exported, and which files that produced. Inputs
+ * which haven't changed since can be skipped without decoding them.
+ * All of the functions can be called from any thread.
+ */
+struct xnb_cache;
+
+struct cache_key {
+	uint64_t size;
+	int64_t mtime_sec;
+	long mtime_nsec;
+	/* xxh64() of the whole file, only valid if has_hash */
+	uint64_t hash;
+	bool has_hash;
+};
+
+/*
+ * Load the manifest from dir, or start an empty one if there isn't one yet.
+ * Entries written with a different opts_hash are dropped, as the outputs
+ * would be different. Returns NULL on error.
+ */
+struct xnb_cache *cache_open(const char *dir, uint64_t opts_hash);
+/* Write the manifest back if anything changed, and free the cache */
+int cache_close(struct xnb_cache *cache);
+
+/* Fill in size and mtime for a regular file. Returns 0 on success */
+int cache_stat(const char *path, struct cache_key *key);
+/*
+ * Returns true if path can be skipped: it matches its entry, and everything
+ * it produced last time is still there. Without a hash, size and mtime
+ * have to match. With one, size and hash do, and a stale mtime is updated.
+ */
+bool cache_lookup(struct xnb_cache *cache, const char *path,
+		const struct cache_key *key);
+/* Record a successful export of path. key must have a hash */
+int cache_update(struct xnb_cache *cache, const char *path,
+		const struct cache_key *key, const struct xnb_output_list *outputs);
+/* Forget path, e.g. because exporting it failed */
+void cache_remove(struct xnb_cache *cache, const char *path);
+
+#endif /* __XNB_CACHE_H__ */
@@ -0,0 +1,288 @@
+/* XNB Container
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "xnb.h"
+#include "xnb_lz4.h"
+#include "xnb_lzx.h"
+#include "xnb_object.h"
+#include "xnb_stats.h"
+
+static void dump_header(struct xnb_header *hdr, FILE *out)
+{
+	fprintf(out, "[XNB Container Header]\n");
+	fprintf(out, "Magic: %.*s\n", 4, hdr->magic);
+	fprintf(out, "Version: %d\n", hdr->version);
+	fprintf(out, "Flags: 0x%02x\n", hdr->flags);
+	fprintf(out, "File Size: %d (0x%08x)\n", hdr->file_size, hdr->file_size);
+	if (hdr->flags & FLAG_COMPRESSION_MASK)
+		fprintf(out, "Decompressed Size: %d (0x%08x)\n",
+				hdr->decompressed_size, hdr->decompressed_size);
+	fprintf(out, "----------------------\n");
+}
+
+static void dump_reader(struct type_reader_desc *rdr, FILE *out)
+{
+	fprintf(out, "[Type Reader]\n");
+	fprintf(out, "Name: %s\n", rdr->name);
+	fprintf(out, "Version: %d\n", rdr->version);
+	fprintf(out, "-------------\n");
+}
+
+void dump_container(struct xnb_container *cont, FILE *out)
+{
+	int i;
+	fprintf(out, "XNB Container\n");
+	fprintf(out, "=============\n");
+	dump_header(&cont->hdr, out);
+	fprintf(out, "\n");
+	for (i = 0; i < cont->type_reader_count; i++) {
+		dump_reader(&cont->readers[i], out);
+	}
+	fprintf(out, "\n");
+	fprintf(out, "Shared resource count: %d\n", cont->shared_resource_count);
+
+	fprintf(out, "Primary Asset:\n");
+	if (cont->primary_asset) {
+		dump_object(cont->primary_asset, out);
+	} else {
+		fprintf(out, "[NULL]\n");
+	}
+
+	if (cont->shared_resource_count) {
+		fprintf(out, "Shared Assets:\n");
+		for (i = 0; i < cont->shared_resource_count; i++) {
+			if (cont->shared_resources[i]) {
+				dump_object(cont->shared_resources[i], out);
+			} else {
+				fprintf(out, "[NULL]\n");
+			}
+		}
+	}
+}
+
+static int read_header(struct xnb_header *hdr, struct xnb_cursor *cur)
+{
+	size_t size;
+	char magic[] = "XNB";
+
+	size = sizeof(*hdr) - sizeof(hdr->decompressed_size);
+	if (cursor_read(cur, hdr, size))
+		return -1;
+
+	if (memcmp(hdr->magic, magic, 3))
+		return -1;
+
+	if (hdr->flags & FLAG_COMPRESSION_MASK) {
+		size = sizeof(hdr->decompressed_size);
+		if (cursor_read(cur, &hdr->decompressed_size, size))
+			return -1;
+	} else {
+		hdr->decompressed_size = hdr->file_size;
+	}
+
+	return 0;
+}
+
+void destroy_container(struct xnb_container *cont)
+{
+	int i;
+	if (cont->shared_resources) {
+		for (i = 0; i < cont->shared_resource_count; i++) {
+			destroy_object(cont->shared_resources[i]);
+		}
+	}
+	destroy_object(cont->primary_asset);
+	arena_reset(cont->arena);
+}
+
+/*
+ * Decompress everything after the header into a single buffer owned by the
+ * container, and point dcur at it
+ */
+static int decompress_container(struct xnb_container *cont,
+		struct xnb_cursor *cur, struct xnb_cursor *dcur)
+{
+	size_t len = cur->size - cur->pos;
+	size_t hdr_len = cur->pos;
+	int res;
+
+	if (cont->hdr.file_size < hdr_len || cont->hdr.file_size - hdr_len > len) {
+		fprintf(stderr, "File size %d doesn't match the data\n",
+				cont->hdr.file_size);
+		return -1;
+	}
+	len = cont->hdr.file_size - hdr_len;
+
+	cont->decompressed = arena_alloc(cont->arena, cont->hdr.decompressed_size);
+	if (!cont->decompressed && cont->hdr.decompressed_size) {
+		fprintf(stderr, "Out-of-memory allocating decompression buffer\n");
+		return -1;
+	}
+
+	switch (cont->hdr.flags & FLAG_COMPRESSION_MASK) {
+	case FLAG_COMPRESSED:
+		res = lzx_decompress(cursor_view(cur, len), len, cont->decompressed,
+				cont->hdr.decompressed_size);
+		break;
+	case FLAG_COMPRESSED_LZ4:
+		res = lz4_decompress(cursor_view(cur, len), len, cont->decompressed,
+				cont->hdr.decompressed_size);
+		break;
+	default:
+		fprintf(stderr, "Unknown compression flags 0x%02x\n",
+				cont->hdr.flags);
+		return -1;
+	}
+	if (res) {
+		fprintf(stderr, "Decompression failed\n");
+		return -1;
+	}
+
+	cursor_init(dcur, cont->decompressed, cont->hdr.decompressed_size);
+	return 0;
+}
+
+/*
+ * Objects in the returned container may refer directly to the data in cur,
+ * so it must stay valid until the container is destroyed
+ */
+struct xnb_container *read_container(struct xnb_cursor *cur,
+		struct xnb_arena *arena, unsigned int flags)
+{
+	struct xnb_cursor dcur;
+	struct stats_timer t;
+	int res, i;
+	struct xnb_container *cont = arena_zalloc(arena, sizeof(*cont));
+	if (!cont)
+		return NULL;
+	cont->arena = arena;
+	cont->read_flags = flags;
+	stats_add_read(cur->size - cur->pos);
+
+	res = read_header(&cont->hdr, cur);
+	if (res) {
+		fprintf(stderr, "Couldn't read header\n");
+		goto fail;
+	}
+
+	if (cont->hdr.flags & FLAG_COMPRESSION_MASK) {
+		stats_start(&t);
+		res = decompress_container(cont, cur, &dcur);
+		if (res)
+			goto fail;
+		stats_end_phase(&t, STATS_DECOMPRESS);
+		cur = &dcur;
+	}
+
+	stats_start(&t);
+
+	cont->type_reader_count = cursor_read_7bit(cur);
+	if (cont->type_reader_count < 0) {
+		fprintf(stderr, "Couldn't get type reader count\n");
+		goto fail;
+	}
+
+	cont->readers = arena_alloc(arena,
+			sizeof(*cont->readers) * cont->type_reader_count);
+	if (!cont->readers) {
+		fprintf(stderr, "Out-of-memory allocating readers\n");
+		goto fail;
+	}
+
+	for (i = 0; i < cont->type_reader_count; i++) {
+		size_t len;
+		const uint8_t *name;
+		struct type_reader_desc *r = &cont->readers[i];
+		name = cursor_view_string(cur, &len);
+		if (!name) {
+			fprintf(stderr, "Couldn't read name of reader %d\n", i);
+			goto fail;
+		}
+		/* Nested generic names can be very long, so don't truncate them */
+		r->name = arena_alloc(arena, len + 1);
+		if (!r->name) {
+			fprintf(stderr, "Out-of-memory allocating reader name\n");
+			goto fail;
+		}
+		memcpy(r->name, name, len);
+		r->name[len] = '\0';
+		/* Unknown readers are only an error if something uses them */
+		bind_reader(cont, r);
+		res = cursor_read(cur, &r->version, sizeof(r->version));
+		if (res) {
+			fprintf(stderr, "Couldn't read version of reader %d\n", i);
+			goto fail;
+		}
+	}
+
+	cont->shared_resource_count = cursor_read_7bit(cur);
+	if (cont->shared_resource_count < 0) {
+		fprintf(stderr, "Couldn't read shared resource count\n");
+		goto fail;
+	}
+
+	cont->shared_resources = arena_zalloc(arena,
+			sizeof(*cont->shared_resources) * cont->shared_resource_count);
+	if (cont->shared_resource_count && !cont->shared_resources) {
+		fprintf(stderr, "Out-of-memory allocating shared resources\n");
+		goto fail;
+	}
+	stats_end_phase(&t, STATS_HEADER);
+
+	stats_start(&t);
+
+	i = cursor_read_7bit(cur);
+	if (i < 0) {
+		fprintf(stderr, "Couldn't read primary asset type\n");
+		goto fail;
+	} else if (i > cont->type_reader_count) {
+		fprintf(stderr, "Bad primary asset type %d\n", i);
+		goto fail;
+	} else if (i > 0) {
+		cont->primary_asset = read_object(cont, &cont->readers[i - 1], cur);
+		if (!cont->primary_asset) {
+			fprintf(stderr, "Couldn't read primary asset\n");
+			goto fail;
+		}
+	}
+
+	for (i = 0; i < cont->shared_resource_count; i++) {
+		int type_idx = cursor_read_7bit(cur);
+		if (type_idx < 0) {
+			fprintf(stderr, "Couldn't read shared asset %d type\n",
+					type_idx);
+			goto fail;
+		} else if (type_idx > cont->type_reader_count) {
+			fprintf(stderr, "Bad shared asset type %d\n", type_idx);
+			goto fail;
+		} else if (type_idx > 0) {
+			cont->shared_resources[i] =
+				read_object(cont, &cont->readers[type_idx - 1],
+						cur);
+			if (!cont->shared_resources[i]) {
+				fprintf(stderr, "Couldn't read shared asset %d\n", type_idx);
+				goto fail;
+			}
+		}
+	}
+	stats_end_phase(&t, STATS_OBJECTS);
+
+	return cont;
+
+fail:
+	destroy_container(cont);
+	return NULL;
+}
+
+struct xnb_container *xnb_decode_buffer(const void *buf, size_t size,
+		struct xnb_arena *arena, unsigned int flags)
+{
+	struct xnb_cursor cur;
+
+	cursor_init(&cur, buf, size);
+	return read_container(&cur, arena, flags);
+}
@@ -0,0 +1,63 @@
+/* XNB Container
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#ifndef __XNB_CONTAINER_H__
+#define __XNB_CONTAINER_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "xnb_arena.h"
+#include "xnb_cursor.h"
+
+struct xnb_object_head;
+struct type_reader_desc;
+
+struct xnb_header {
+	char magic[3];
+	char platform;
+	uint8_t version;
+#define FLAG_HIDEF          0x01
+/* MonoGame only */
+#define FLAG_COMPRESSED_LZ4 0x40
+/* LZX */
+#define FLAG_COMPRESSED     0x80
+#define FLAG_COMPRESSION_MASK (FLAG_COMPRESSED | FLAG_COMPRESSED_LZ4)
+	uint8_t flags;
+	uint32_t file_size;
+	uint32_t decompressed_size;
+} __attribute__((packed)) ;
+
+/* Flags for read_container() */
+/*
+ * Only read what's needed to describe the objects. Large payloads are
+ * skipped over (their size and offset are still recorded), so the objects
+ * can be printed but not necessarily exported.
+ */
+#define XNB_READ_METADATA (1 << 0)
+
+/* Lives in, and owns everything in, the arena it was read into */
+struct xnb_container {
+	struct xnb_arena *arena;
+	struct xnb_header hdr;
+	int32_t type_reader_count;
+	struct type_reader_desc *readers;
+	int32_t shared_resource_count;
+	struct xnb_object_head *primary_asset;
+	struct xnb_object_head **shared_resources;
+	/* For compressed files, objects point into this */
+	uint8_t *decompressed;
+	/* XNB_READ_* flags this container is being read with */
+	unsigned int read_flags;
+	/* How deeply read_nested_object() calls are nested */
+	int depth;
+};
+
+struct xnb_container *read_container(struct xnb_cursor *cur,
+		struct xnb_arena *arena, unsigned int flags);
+/* Also resets the container's arena */
+void destroy_container(struct xnb_container *cont);
+void dump_container(struct xnb_container *cont, FILE *out);
+
+#endif /* __XNB_CONTAINER_H__ */
@@ -0,0 +1,254 @@
+/* XNB input buffers
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "xnb_cursor.h"
+
+/* For things we can't mmap (pipes etc.), just read the whole lot */
+static int read_whole_file(int fd, struct xnb_mapping *map)
+{
+	size_t size = 0, alloc = 1 << 16;
+	uint8_t *buf = malloc(alloc);
+
+	if (!buf)
+		return -1;
+
+	while (1) {
+		ssize_t n;
+		if (size == alloc) {
+			uint8_t *tmp = realloc(buf, alloc * 2);
+			if (!tmp) {
+				free(buf);
+				return -1;
+			}
+			buf = tmp;
+			alloc *= 2;
+		}
+		n = read(fd, buf + size, alloc - size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			free(buf);
+			return -1;
+		} else if (n == 0) {
+			break;
+		}
+		size += n;
+	}
+
+	map->addr = buf;
+	map->size = size;
+	map->mapped = 0;
+	return 0;
+}
+
+int map_file(const char *filename, struct xnb_mapping *map)
+{
+	struct stat st;
+	void *addr;
+
+	memset(map, 0, sizeof(*map));
+	map->fd = open(filename, O_RDONLY);
+	if (map->fd < 0)
+		return -1;
+
+	if (fstat(map->fd, &st) || !S_ISREG(st.st_mode) || st.st_size == 0)
+		goto fallback;
+
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, map->fd, 0);
+	if (addr == MAP_FAILED)
+		goto fallback;
+
+	map->addr = addr;
+	map->size = st.st_size;
+	map->mapped = 1;
+	return 0;
+
+fallback:
+	if (read_whole_file(map->fd, map)) {
+		close(map->fd);
+		map->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+void map_advise_sparse(struct xnb_mapping *map)
+{
+	/* Don't let readahead pull in the payloads we're skipping */
+	if (map->mapped)
+		posix_madvise((void *)map->addr, map->size, POSIX_MADV_RANDOM);
+}
+
+void unmap_file(struct xnb_mapping *map)
+{
+	if (map->mapped)
+		munmap((void *)map->addr, map->size);
+	else
+		free((void *)map->addr);
+	if (map->fd >= 0)
+		close(map->fd);
+	memset(map, 0, sizeof(*map));
+	map->fd = -1;
+}
+
+void cursor_init(struct xnb_cursor *cur, const void *buf, size_t size)
+{
+	cur->base = buf;
+	cur->size = size;
+	cur->pos = 0;
+	cur->fd = -1;
+}
+
+void cursor_init_mapping(struct xnb_cursor *cur, struct xnb_mapping *map)
+{
+	cursor_init(cur, map->addr, map->size);
+	/* A buffer we read() ourselves might not match the file (or pipe) */
+	if (map->mapped)
+		cur->fd = map->fd;
+}
+
+const uint8_t *cursor_view(struct xnb_cursor *cur, size_t len)
+{
+	const uint8_t *p;
+
+	if (len > cur->size - cur->pos)
+		return NULL;
+
+	p = cur->base + cur->pos;
+	cur->pos += len;
+	return p;
+}
+
+int cursor_read(struct xnb_cursor *cur, void *dst, size_t len)
+{
+	const uint8_t *p = cursor_view(cur, len);
+	if (!p)
+		return -1;
+	memcpy(dst, p, len);
+	return 0;
+}
+
+/*
+ * .NET 7-bit encoded ints are at most 5 bytes. We only accept values which
+ * fit in a non-negative int, so the 5th byte can only hold 3 bits.
+ */
+#define VARINT_MAX_LEN 5
+
+static int read_7bit_slow(struct xnb_cursor *cur)
+{
+	uint32_t result = 0;
+	const uint8_t *p = cur->base + cur->pos;
+	size_t left = cur->size - cur->pos;
+	int i;
+
+	for (i = 0; i < VARINT_MAX_LEN && (size_t)i < left; i++) {
+		result |= (uint32_t)(p[i] & 0x7f) << (7 * i);
+		if (!(p[i] & 0x80)) {
+			if (i == VARINT_MAX_LEN - 1 && p[i] > 0x07)
+				return -1;
+			cur->pos += i + 1;
+			return result;
+		}
+	}
+
+	/* Truncated, or too long */
+	return -1;
+}
+
+int cursor_read_7bit(struct xnb_cursor *cur)
+{
+	const uint8_t *p = cur->base + cur->pos;
+	uint32_t result;
+
+	if (cur->size - cur->pos < VARINT_MAX_LEN)
+		return read_7bit_slow(cur);
+
+	/* Nearly everything is a type index or a short length */
+	if (!(p[0] & 0x80)) {
+		cur->pos += 1;
+		return p[0];
+	}
+
+	result = (p[0] & 0x7f) | (uint32_t)(p[1] & 0x7f) << 7;
+	if (!(p[1] & 0x80)) {
+		cur->pos += 2;
+		return result;
+	}
+
+	result |= (uint32_t)(p[2] & 0x7f) << 14;
+	if (!(p[2] & 0x80)) {
+		cur->pos += 3;
+		return result;
+	}
+
+	result |= (uint32_t)(p[3] & 0x7f) << 21;
+	if (!(p[3] & 0x80)) {
+		cur->pos += 4;
+		return result;
+	}
+
+	if (p[4] > 0x07)
+		return -1;
+	cur->pos += 5;
+	return result | (uint32_t)p[4] << 28;
+}
+
+const uint8_t *cursor_view_string(struct xnb_cursor *cur, size_t *len)
+{
+	size_t pos = cur->pos;
+	const uint8_t *p;
+	int n;
+
+	n = cursor_read_7bit(cur);
+	if (n < 0)
+		return NULL;
+
+	p = cursor_view(cur, n);
+	if (!p) {
+		cur->pos = pos;
+		return NULL;
+	}
+
+	*len = n;
+	return p;
+}
+
+int cursor_blob(struct xnb_cursor *cur, size_t len, struct xnb_blob *blob)
+{
+	off_t offset = cur->pos;
+
+	blob->data = cursor_view(cur, len);
+	if (!blob->data)
+		return -1;
+
+	blob->size = len;
+	blob->fd = cur->fd;
+	blob->offset = offset;
+	return 0;
+}
+
+int cursor_skip_blob(struct xnb_cursor *cur, size_t len,
+		struct xnb_blob *blob)
+{
+	if (len > cur->size - cur->pos)
+		return -1;
+
+	blob->data = NULL;
+	blob->size = len;
+	blob->fd = cur->fd;
+	blob->offset = cur->pos;
+	cur->pos += len;
+	return 0;
+}
@@ -0,0 +1,72 @@
+/* XNB input buffers
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#ifndef __XNB_CURSOR_H__
+#define __XNB_CURSOR_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* An input file, mapped into memory if possible */
+struct xnb_mapping {
+	const uint8_t *addr;
+	size_t size;
+	int fd;
+	/* true if addr came from mmap(), false if it was read into a buffer */
+	int mapped;
+};
+
+int map_file(const char *filename, struct xnb_mapping *map);
+void unmap_file(struct xnb_mapping *map);
+/* Hint that only small parts of the mapping will be touched */
+void map_advise_sparse(struct xnb_mapping *map);
+
+/*
+ * Read position in an in-memory buffer. Anything handed out by cursor_view()
+ * points straight into the buffer, so it's only valid for as long as the
+ * buffer is.
+ */
+struct xnb_cursor {
+	const uint8_t *base;
+	size_t size;
+	size_t pos;
+	/* If base is a mapping of a whole file, its fd. Otherwise -1 */
+	int fd;
+};
+
+/*
+ * A range of the input. If fd >= 0, the same bytes can also be found at
+ * offset in fd, which lets exporters copy them without touching them.
+ */
+struct xnb_blob {
+	const uint8_t *data;
+	size_t size;
+	int fd;
+	off_t offset;
+};
+
+void cursor_init(struct xnb_cursor *cur, const void *buf, size_t size);
+void cursor_init_mapping(struct xnb_cursor *cur, struct xnb_mapping *map);
+/* Copy len bytes out and advance. Returns 0 on success, -1 if short */
+int cursor_read(struct xnb_cursor *cur, void *dst, size_t len);
+/* Return a pointer to the next len bytes and advance, or NULL if short */
+const uint8_t *cursor_view(struct xnb_cursor *cur, size_t len);
+/*
+ * Read a .NET 7-bit encoded int. Returns < 0 on error, including values
+ * which don't fit in an int
+ */
+int cursor_read_7bit(struct xnb_cursor *cur);
+/*
+ * Read a length-prefixed string, returning a view of its len bytes (which
+ * aren't NUL terminated), or NULL if short. Doesn't advance on error.
+ */
+const uint8_t *cursor_view_string(struct xnb_cursor *cur, size_t *len);
+/* Like cursor_view(), but also records where the data is in the file */
+int cursor_blob(struct xnb_cursor *cur, size_t len, struct xnb_blob *blob);
+/* Skip over len bytes, recording only their size and location in blob */
+int cursor_skip_blob(struct xnb_cursor *cur, size_t len,
+		struct xnb_blob *blob);
+
+#endif /* __XNB_CURSOR_H__ */
@@ -0,0 +1,343 @@
+/* Deduplication of exported objects
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "xnb_dedupe.h"
+#include "xnb_hash.h"
+#include "xnb_object.h"
+
+#define INITIAL_BUCKETS 1024
+
+struct dedupe_entry {
+	struct dedupe_entry *next;
+	/*
+	 * The key: what it was read from, and its type. Generic objects are
+	 * exported according to their type, so the reader isn't enough.
+	 * Only hashes of the bytes are kept, so there are two, with different
+	 * seeds, to make a false match vanishingly unlikely.
+	 */
+	uint64_t hash;
+	uint64_t check;
+	size_t size;
+	char *type_name;
+	/* Set once the first copy has been exported */
+	bool done;
+	/* Set if exporting it failed, so the next copy should try again */
+	bool failed;
+	char *basename;
+	struct xnb_output_list outputs;
+	int links;
+};
+
+struct xnb_dedupe {
+	enum xnb_link_mode mode;
+
+	pthread_mutex_t lock;
+	struct dedupe_entry **buckets;
+	size_t n_buckets;
+	size_t count;
+};
+
+struct xnb_dedupe *dedupe_create(enum xnb_link_mode mode)
+{
+	struct xnb_dedupe *d = calloc(1, sizeof(*d));
+	if (!d)
+		goto fail;
+
+	d->buckets = calloc(INITIAL_BUCKETS, sizeof(*d->buckets));
+	if (!d->buckets)
+		goto fail;
+	d->n_buckets = INITIAL_BUCKETS;
+	d->mode = mode;
+	pthread_mutex_init(&d->lock, NULL);
+
+	return d;
+
+fail:
+	fprintf(stderr, "Couldn't alloc dedupe table\n");
+	free(d);
+	return NULL;
+}
+
+void dedupe_destroy(struct xnb_dedupe *d)
+{
+	size_t i;
+
+	if (!d)
+		return;
+
+	for (i = 0; i < d->n_buckets; i++) {
+		struct dedupe_entry *e = d->buckets[i], *next;
+		for (; e; e = next) {
+			next = e->next;
+			output_list_free(&e->outputs);
+			free(e->basename);
+			free(e->type_name);
+			free(e);
+		}
+	}
+
+	pthread_mutex_destroy(&d->lock);
+	free(d->buckets);
+	free(d);
+}
+
+int dedupe_reflinks(struct xnb_dedupe *d)
+{
+	return __atomic_load_n(&d->mode, __ATOMIC_RELAXED) == XNB_LINK_REFLINK;
+}
+
+static struct dedupe_entry **find_slot(struct xnb_dedupe *d, uint64_t hash,
+		uint64_t check, size_t size, const char *type_name)
+{
+	struct dedupe_entry **slot;
+
+	slot = &d->buckets[hash & (d->n_buckets - 1)];
+	for (; *slot; slot = &(*slot)->next) {
+		if ((*slot)->hash == hash && (*slot)->check == check &&
+				(*slot)->size == size &&
+				!strcmp((*slot)->type_name, type_name))
+			break;
+	}
+
+	return slot;
+}
+
+static void grow(struct xnb_dedupe *d)
+{
+	size_t n_buckets = d->n_buckets * 2;
+	struct dedupe_entry **buckets;
+	size_t i;
+
+	buckets = calloc(n_buckets, sizeof(*buckets));
+	if (!buckets)
+		return;
+
+	for (i = 0; i < d->n_buckets; i++) {
+		struct dedupe_entry *e = d->buckets[i], *next;
+		for (; e; e = next) {
+			size_t b = e->hash & (n_buckets - 1);
+			next = e->next;
+			e->next = buckets[b];
+			buckets[b] = e;
+		}
+	}
+
+	free(d->buckets);
+	d->buckets = buckets;
+	d->n_buckets = n_buckets;
+}
+
+static int clone_file(const char *src, const char *dst)
+{
+	int sfd, dfd, res = -1;
+
+	sfd = open(src, O_RDONLY);
+	if (sfd < 0)
+		return -1;
+
+	dfd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (dfd >= 0) {
+		res = ioctl(dfd, FICLONE, sfd);
+		if (res) {
+			int err = errno;
+			unlink(dst);
+			errno = err;
+		}
+		close(dfd);
+	}
+	close(sfd);
+
+	return res;
+}
+
+/* Make dst a link to src, replacing anything already there */
+static int link_file(struct xnb_dedupe *d, const char *src, const char *dst)
+{
+	/* dst might be a hardlink from last time, which mustn't be touched */
+	if (unlink(dst) && errno != ENOENT)
+		return -1;
+
+	if (dedupe_reflinks(d)) {
+		if (!clone_file(src, dst))
+			return 0;
+		if (errno != EOPNOTSUPP && errno != EXDEV && errno != EINVAL &&
+				errno != ENOTTY)
+			return -1;
+
+		/* Only say so once, whichever thread gets here first */
+		if (__atomic_exchange_n(&d->mode, XNB_LINK_HARD, __ATOMIC_RELAXED) ==
+				XNB_LINK_REFLINK)
+			fprintf(stderr, "Reflinks aren't supported for '%s', using "
+					"hardlinks instead\n", dst);
+	}
+
+	return link(src, dst);
+}
+
+/* Link all of e's files as basename's */
+static int link_outputs(struct xnb_dedupe *d, struct dedupe_entry *e,
+		const char *basename, struct xnb_output_list *outputs)
+{
+	size_t base_len = strlen(e->basename);
+	char dst[MAX_NAME_LEN];
+	int i;
+
+	for (i = 0; i < e->outputs.count; i++) {
+		const char *src = e->outputs.names[i];
+
+		snprintf(dst, MAX_NAME_LEN, "%s%s", basename, src + base_len);
+		/* The same file decoded twice already has its outputs */
+		if (strcmp(src, dst) && link_file(d, src, dst))
+			return -1;
+
+		if (outputs && output_list_add(outputs, dst)) {
+			fprintf(stderr, "Couldn't record output '%s'\n", dst);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int dedupe_begin(struct xnb_dedupe *d, const struct xnb_object_head *obj,
+		const char *basename, struct xnb_output_list *outputs,
+		struct dedupe_entry **claim)
+{
+	struct dedupe_entry **slot, *e;
+	uint64_t hash, check, seed;
+
+	*claim = NULL;
+	if (!obj->src || !obj->type_name)
+		return 0;
+
+	/* Same bytes, different type could mean a different export */
+	seed = xxh64(obj->type_name, strlen(obj->type_name), 0);
+	hash = xxh64(obj->src, obj->src_len, seed);
+	check = xxh64(obj->src, obj->src_len, ~seed);
+
+	pthread_mutex_lock(&d->lock);
+	slot = find_slot(d, hash, check, obj->src_len, obj->type_name);
+	e = *slot;
+	if (!e) {
+		/* Nothing to link to, so this one will be exported */
+		e = calloc(1, sizeof(*e));
+		if (e && !(e->type_name = strdup(obj->type_name))) {
+			free(e);
+			e = NULL;
+		}
+		if (e) {
+			e->hash = hash;
+			e->check = check;
+			e->size = obj->src_len;
+			*slot = e;
+			if (++d->count > d->n_buckets)
+				grow(d);
+		}
+		*claim = e;
+		pthread_mutex_unlock(&d->lock);
+		return 0;
+	} else if (e->failed) {
+		e->failed = false;
+		*claim = e;
+		pthread_mutex_unlock(&d->lock);
+		return 0;
+	} else if (!e->done) {
+		/*
+		 * Another thread is exporting it right now. Waiting could only
+		 * save a little, so just export it again.
+		 */
+		pthread_mutex_unlock(&d->lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	/* Once it's done, the entry doesn't change, so can be used unlocked */
+	if (link_outputs(d, e, basename, outputs)) {
+		fprintf(stderr, "Couldn't link '%s' to an earlier copy: %s\n",
+				basename, strerror(errno));
+		return 0;
+	}
+
+	pthread_mutex_lock(&d->lock);
+	e->links++;
+	pthread_mutex_unlock(&d->lock);
+
+	return 1;
+}
+
+void dedupe_finish(struct xnb_dedupe *d, struct dedupe_entry *claim,
+		const char *basename, const struct xnb_output_list *outputs,
+		int res)
+{
+	struct xnb_output_list copy = { 0 };
+	char *base = NULL;
+	int i;
+
+	if (!claim)
+		return;
+
+	if (!res) {
+		base = strdup(basename);
+		res = base ? 0 : -1;
+		for (i = 0; !res && i < outputs->count; i++)
+			res = output_list_add(&copy, outputs->names[i]);
+	}
+
+	pthread_mutex_lock(&d->lock);
+	if (res) {
+		claim->failed = true;
+	} else {
+		claim->basename = base;
+		claim->outputs = copy;
+		claim->done = true;
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	if (res) {
+		free(base);
+		output_list_free(&copy);
+	}
+}
+
+void dedupe_print(struct xnb_dedupe *d, FILE *out)
+{
+	unsigned long long saved = 0;
+	int linked = 0;
+	size_t i;
+
+	pthread_mutex_lock(&d->lock);
+	for (i = 0; i < d->n_buckets; i++) {
+		struct dedupe_entry *e;
+
+		for (e = d->buckets[i]; e; e = e->next) {
+			int j;
+
+			if (!e->links)
+				continue;
+
+			linked += e->links;
+			for (j = 0; j < e->outputs.count; j++) {
+				struct stat st;
+				if (!stat(e->outputs.names[j], &st))
+					saved += (unsigned long long)st.st_size * e->links;
+			}
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	fprintf(out, "Linked %d duplicate object(s) to earlier copies, "
+			"saving %llu bytes\n", linked, saved);
+}
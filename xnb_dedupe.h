@@ -0,0 +1,55 @@
+/* Deduplication of exported objects
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#ifndef __XNB_DEDUPE_H__
+#define __XNB_DEDUPE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Remembers what each object exported during a run was written as, keyed
+ * by hashes of the bytes it was read from and its type. When an identical
+ * object is exported again, its files are linked to the first one's instead
+ * of being converted and written again. Safe to share between threads.
+ */
+enum xnb_link_mode {
+	/* Cheapest, but the files share an inode, so changing one changes all */
+	XNB_LINK_HARD,
+	/* Copy-on-write clones, where the filesystem supports them */
+	XNB_LINK_REFLINK,
+};
+
+struct xnb_dedupe;
+struct dedupe_entry;
+struct xnb_object_head;
+struct xnb_output_list;
+
+struct xnb_dedupe *dedupe_create(enum xnb_link_mode mode);
+void dedupe_destroy(struct xnb_dedupe *d);
+
+/*
+ * Reflinked files have to be complete before they're cloned, so they can't
+ * be written asynchronously.
+ */
+int dedupe_reflinks(struct xnb_dedupe *d);
+
+/*
+ * Look obj up. If an identical object has been exported, link its files
+ * as basename's, add them to outputs (if set) and return 1.
+ * Otherwise return 0, and the caller should export obj itself. If *claim
+ * is set, it should then pass the result to dedupe_finish().
+ */
+int dedupe_begin(struct xnb_dedupe *d, const struct xnb_object_head *obj,
+		const char *basename, struct xnb_output_list *outputs,
+		struct dedupe_entry **claim);
+/* Record what a claimed object was exported as, if res is 0 */
+void dedupe_finish(struct xnb_dedupe *d, struct dedupe_entry *claim,
+		const char *basename, const struct xnb_output_list *outputs,
+		int res);
+
+/* How many objects were linked, and how many bytes that saved writing */
+void dedupe_print(struct xnb_dedupe *d, FILE *out);
+
+#endif /* __XNB_DEDUPE_H__ */
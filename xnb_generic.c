@@ -0,0 +1,889 @@
+/* XNB generic (primitive and collection) object implementation
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ *
+ * The content pipeline's built-in readers for primitives, maths types and
+ * generic collections all have simple, regular formats. Rather than an
+ * object reader for each, reader names are parsed once, when the reader
+ * table is bound, into a tree of plan nodes (rdr->plan), and one engine
+ * walks the plan to read values.
+ *
+ * Lists of fixed-size value types are kept as a view of the packed
+ * elements, so they're read in one go however long they are.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xnb_object.h"
+#include "xnb_stats.h"
+
+#define CONTENT_NS "Microsoft.Xna.Framework.Content."
+
+/* How many collection elements to print when listing */
+#define PRINT_MAX_ITEMS 16
+
+enum plan_op {
+	/* A fixed number of scalar fields */
+	PLAN_FIXED,
+	/* One UTF-8 encoded character */
+	PLAN_CHAR,
+	/* 7-bit encoded length, then UTF-8 */
+	PLAN_STRING,
+	/* Int32 count, then that many elements (List and Array) */
+	PLAN_LIST,
+	/* Int32 count, then that many keys and values */
+	PLAN_DICT,
+	/* Boolean, then the value if it's true */
+	PLAN_NULLABLE,
+	/* A reference type - a nested object with its own type id */
+	PLAN_OBJECT,
+};
+
+enum scalar_kind {
+	SCALAR_BOOL,
+	SCALAR_U8,
+	SCALAR_I8,
+	SCALAR_I16,
+	SCALAR_U16,
+	SCALAR_I32,
+	SCALAR_U32,
+	SCALAR_I64,
+	SCALAR_U64,
+	SCALAR_F32,
+	SCALAR_F64,
+};
+
+static const uint8_t scalar_size[] = {
+	[SCALAR_BOOL] = 1,
+	[SCALAR_U8] = 1,
+	[SCALAR_I8] = 1,
+	[SCALAR_I16] = 2,
+	[SCALAR_U16] = 2,
+	[SCALAR_I32] = 4,
+	[SCALAR_U32] = 4,
+	[SCALAR_I64] = 8,
+	[SCALAR_U64] = 8,
+	[SCALAR_F32] = 4,
+	[SCALAR_F64] = 8,
+};
+
+struct xnb_plan {
+	enum plan_op op;
+	const char *name;
+	/* PLAN_FIXED: fields of kind, size bytes in all */
+	enum scalar_kind kind;
+	uint8_t fields;
+	uint32_t size;
+	/* Element plan, or key and value plans */
+	const struct xnb_plan *args[2];
+};
+
+#define FIXED(_name, _kind, _fields, _size) \
+	{ .op = PLAN_FIXED, .name = _name, .kind = _kind, .fields = _fields, \
+	  .size = _size }
+
+/* Types with built-in readers, by target type and reader name */
+static const struct known_type {
+	const char *type;
+	const char *reader;
+	/* Reference types are nested objects when they're collection elements */
+	bool reference;
+	struct xnb_plan plan;
+} known_types[] = {
+	{ "System.Boolean", "BooleanReader", false,
+		FIXED("Boolean", SCALAR_BOOL, 1, 1) },
+	{ "System.Byte", "ByteReader", false, FIXED("Byte", SCALAR_U8, 1, 1) },
+	{ "System.SByte", "SByteReader", false,
+		FIXED("SByte", SCALAR_I8, 1, 1) },
+	{ "System.Int16", "Int16Reader", false,
+		FIXED("Int16", SCALAR_I16, 1, 2) },
+	{ "System.UInt16", "UInt16Reader", false,
+		FIXED("UInt16", SCALAR_U16, 1, 2) },
+	{ "System.Int32", "Int32Reader", false,
+		FIXED("Int32", SCALAR_I32, 1, 4) },
+	{ "System.UInt32", "UInt32Reader", false,
+		FIXED("UInt32", SCALAR_U32, 1, 4) },
+	{ "System.Int64", "Int64Reader", false,
+		FIXED("Int64", SCALAR_I64, 1, 8) },
+	{ "System.UInt64", "UInt64Reader", false,
+		FIXED("UInt64", SCALAR_U64, 1, 8) },
+	{ "System.Single", "SingleReader", false,
+		FIXED("Single", SCALAR_F32, 1, 4) },
+	{ "System.Double", "DoubleReader", false,
+		FIXED("Double", SCALAR_F64, 1, 8) },
+	/* Ticks */
+	{ "System.TimeSpan", "TimeSpanReader", false,
+		FIXED("TimeSpan", SCALAR_I64, 1, 8) },
+	{ "System.DateTime", "DateTimeReader", false,
+		FIXED("DateTime", SCALAR_U64, 1, 8) },
+	{ "System.Char", "CharReader", false,
+		{ .op = PLAN_CHAR, .name = "Char" } },
+	{ "System.String", "StringReader", true,
+		{ .op = PLAN_STRING, .name = "String" } },
+	{ "Microsoft.Xna.Framework.Vector2", "Vector2Reader", false,
+		FIXED("Vector2", SCALAR_F32, 2, 8) },
+	{ "Microsoft.Xna.Framework.Vector3", "Vector3Reader", false,
+		FIXED("Vector3", SCALAR_F32, 3, 12) },
+	{ "Microsoft.Xna.Framework.Vector4", "Vector4Reader", false,
+		FIXED("Vector4", SCALAR_F32, 4, 16) },
+	{ "Microsoft.Xna.Framework.Quaternion", "QuaternionReader", false,
+		FIXED("Quaternion", SCALAR_F32, 4, 16) },
+	{ "Microsoft.Xna.Framework.Matrix", "MatrixReader", false,
+		FIXED("Matrix", SCALAR_F32, 16, 64) },
+	{ "Microsoft.Xna.Framework.Plane", "PlaneReader", false,
+		FIXED("Plane", SCALAR_F32, 4, 16) },
+	{ "Microsoft.Xna.Framework.BoundingBox", "BoundingBoxReader", false,
+		FIXED("BoundingBox", SCALAR_F32, 6, 24) },
+	{ "Microsoft.Xna.Framework.BoundingSphere", "BoundingSphereReader", false,
+		FIXED("BoundingSphere", SCALAR_F32, 4, 16) },
+	{ "Microsoft.Xna.Framework.Ray", "RayReader", false,
+		FIXED("Ray", SCALAR_F32, 6, 24) },
+	{ "Microsoft.Xna.Framework.Point", "PointReader", false,
+		FIXED("Point", SCALAR_I32, 2, 8) },
+	{ "Microsoft.Xna.Framework.Rectangle", "RectangleReader", false,
+		FIXED("Rectangle", SCALAR_I32, 4, 16) },
+	{ "Microsoft.Xna.Framework.Color", "ColorReader", false,
+		FIXED("Color", SCALAR_U8, 4, 4) },
+};
+
+#define N_KNOWN_TYPES (sizeof(known_types) / sizeof(known_types[0]))
+
+struct xnb_value {
+	const struct xnb_plan *plan;
+	/* Elements in a list or dictionary, bytes in a string */
+	uint32_t count;
+	union {
+		/* PLAN_FIXED, PLAN_STRING, and lists of PLAN_FIXED (packed) */
+		const uint8_t *raw;
+		/* PLAN_CHAR */
+		uint32_t ch;
+		/* Other lists, dictionaries (key, value, ...) and nullables */
+		struct xnb_value *items;
+		/* PLAN_OBJECT */
+		struct xnb_object_head *obj;
+	} u;
+};
+
+struct xnb_obj_generic {
+	struct xnb_object_head head;
+
+	const struct type_reader_desc *rdr;
+	struct xnb_value value;
+};
+
+/* Plan building */
+
+static const struct known_type *find_known_type(const char *name, size_t len,
+		bool by_reader)
+{
+	size_t i;
+
+	for (i = 0; i < N_KNOWN_TYPES; i++) {
+		const char *n = by_reader ? known_types[i].reader :
+			known_types[i].type;
+		if (!strncmp(n, name, len) && n[len] == '\0')
+			return &known_types[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Split the "[[A],[B]]" that follows a generic type's name into its
+ * arguments. Returns how many there are, or -1 if it doesn't parse.
+ */
+static int split_args(const char *p, const char *end, const char **args,
+		size_t *lens, int max)
+{
+	int n = 0;
+
+	if (p == end || *p++ != '[')
+		return -1;
+
+	while (p < end && *p == '[') {
+		const char *start = ++p;
+		int depth = 1;
+
+		for (; p < end && depth; p++) {
+			if (*p == '[')
+				depth++;
+			else if (*p == ']')
+				depth--;
+		}
+		if (depth || n == max)
+			return -1;
+
+		args[n] = start;
+		lens[n] = p - 1 - start;
+		n++;
+
+		if (p < end && *p == ',')
+			p++;
+	}
+
+	if (p + 1 != end || *p != ']')
+		return -1;
+
+	return n;
+}
+
+static struct xnb_plan *new_plan(struct xnb_arena *arena, enum plan_op op,
+		const char *name)
+{
+	struct xnb_plan *plan = arena_zalloc(arena, sizeof(*plan));
+
+	if (plan) {
+		plan->op = op;
+		plan->name = name;
+	}
+	return plan;
+}
+
+/* A nested object, named after the last part of its type name */
+static const struct xnb_plan *object_plan(struct xnb_arena *arena,
+		const char *name, size_t len)
+{
+	const char *end = memchr(name, '`', len);
+	const char *start = name;
+	struct xnb_plan *plan;
+	char *short_name;
+	const char *p;
+
+	if (!end)
+		end = name + len;
+	for (p = name; p < end; p++)
+		if (*p == '.' || *p == '+')
+			start = p + 1;
+
+	short_name = arena_alloc(arena, end - start + 1);
+	plan = new_plan(arena, PLAN_OBJECT, short_name);
+	if (!short_name || !plan)
+		return NULL;
+	memcpy(short_name, start, end - start);
+	short_name[end - start] = '\0';
+
+	return plan;
+}
+
+/*
+ * Plan for an element of target type name. Anything we don't know to be a
+ * value type is assumed to be a reference type, so it's a nested object.
+ */
+static const struct xnb_plan *element_plan(struct xnb_arena *arena,
+		const char *name, size_t len)
+{
+	static const char nullable[] = "System.Nullable`1";
+	const struct known_type *kt = find_known_type(name, len, false);
+	struct xnb_plan *plan;
+	const char *arg;
+	size_t arg_len;
+
+	if (kt)
+		return kt->reference ? object_plan(arena, name, len) : &kt->plan;
+
+	/* Nullable<T> is the only generic value type with a built-in reader */
+	if (len > sizeof(nullable) - 1 &&
+			!strncmp(name, nullable, sizeof(nullable) - 1)) {
+		if (split_args(name + sizeof(nullable) - 1, name + len, &arg,
+					&arg_len, 1) != 1)
+			return NULL;
+		plan = new_plan(arena, PLAN_NULLABLE, "Nullable");
+		if (!plan)
+			return NULL;
+		plan->args[0] = element_plan(arena, arg, arg_len);
+		return plan->args[0] ? plan : NULL;
+	}
+
+	return object_plan(arena, name, len);
+}
+
+static const struct generic_reader_type {
+	const char *reader;
+	const char *name;
+	enum plan_op op;
+	int n_args;
+} generic_types[] = {
+	{ "ListReader`1", "List", PLAN_LIST, 1 },
+	{ "ArrayReader`1", "Array", PLAN_LIST, 1 },
+	{ "DictionaryReader`2", "Dictionary", PLAN_DICT, 2 },
+	{ "NullableReader`1", "Nullable", PLAN_NULLABLE, 1 },
+	/* Enums are read as their underlying type, almost always Int32 */
+	{ "EnumReader`1", "Enum", PLAN_FIXED, 0 },
+};
+
+/* Plan for the object read by the reader called name */
+static const struct xnb_plan *reader_plan(struct xnb_arena *arena,
+		const char *name)
+{
+	const struct known_type *kt;
+	const char *args[2];
+	size_t lens[2];
+	const char *end;
+	struct xnb_plan *plan;
+	size_t i;
+	int j;
+
+	if (strncmp(name, CONTENT_NS, sizeof(CONTENT_NS) - 1))
+		return NULL;
+	name += sizeof(CONTENT_NS) - 1;
+	end = name + strlen(name);
+
+	kt = find_known_type(name, end - name, true);
+	if (kt)
+		return &kt->plan;
+
+	for (i = 0; i < sizeof(generic_types) / sizeof(generic_types[0]); i++) {
+		const struct generic_reader_type *g = &generic_types[i];
+		size_t len = strlen(g->reader);
+
+		if (strncmp(name, g->reader, len))
+			continue;
+
+		if (g->op == PLAN_FIXED)
+			return &find_known_type("Int32Reader", 11, true)->plan;
+
+		if (split_args(name + len, end, args, lens, 2) != g->n_args)
+			return NULL;
+
+		plan = new_plan(arena, g->op, g->name);
+		if (!plan)
+			return NULL;
+
+		for (j = 0; j < g->n_args; j++) {
+			plan->args[j] = element_plan(arena, args[j], lens[j]);
+			if (!plan->args[j])
+				return NULL;
+		}
+		return plan;
+	}
+
+	return NULL;
+}
+
+int generic_bind(struct xnb_container *cont, struct type_reader_desc *rdr,
+		const char *name)
+{
+	rdr->plan = reader_plan(cont->arena, name);
+	return rdr->plan ? 0 : -1;
+}
+
+/* Reading */
+
+static int read_utf8_char(struct xnb_cursor *cur, uint32_t *ch)
+{
+	uint8_t b;
+	int i, n;
+
+	if (cursor_read(cur, &b, 1))
+		return -1;
+
+	if (b < 0x80) {
+		*ch = b;
+		return 0;
+	} else if ((b & 0xe0) == 0xc0) {
+		n = 1;
+		*ch = b & 0x1f;
+	} else if ((b & 0xf0) == 0xe0) {
+		n = 2;
+		*ch = b & 0x0f;
+	} else if ((b & 0xf8) == 0xf0) {
+		n = 3;
+		*ch = b & 0x07;
+	} else {
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (cursor_read(cur, &b, 1) || (b & 0xc0) != 0x80)
+			return -1;
+		*ch = (*ch << 6) | (b & 0x3f);
+	}
+
+	return 0;
+}
+
+/*
+ * Every element takes at least min_size bytes, so a count bigger than
+ * what's left must be corrupt - catch it before allocating anything
+ */
+static int read_count(struct xnb_cursor *cur, size_t min_size,
+		uint32_t *count)
+{
+	int32_t n;
+
+	if (cursor_read(cur, &n, sizeof(n)) || n < 0)
+		return -1;
+	if ((size_t)n > (cur->size - cur->pos) / min_size)
+		return -1;
+
+	*count = n;
+	return 0;
+}
+
+static int plan_read(struct xnb_container *cont, const struct xnb_plan *plan,
+		struct xnb_cursor *cur, struct xnb_value *val);
+
+static int read_items(struct xnb_container *cont, const struct xnb_plan *plan,
+		struct xnb_cursor *cur, struct xnb_value *val, uint32_t n)
+{
+	uint32_t i;
+
+	val->u.items = arena_alloc(cont->arena, sizeof(*val->u.items) * n);
+	if (!val->u.items && n)
+		return -1;
+
+	for (i = 0; i < n; i++)
+		if (plan_read(cont, plan->args[plan->op == PLAN_DICT ? i & 1 : 0],
+					cur, &val->u.items[i]))
+			return -1;
+
+	return 0;
+}
+
+static int plan_read(struct xnb_container *cont, const struct xnb_plan *plan,
+		struct xnb_cursor *cur, struct xnb_value *val)
+{
+	const struct xnb_plan *elem;
+	size_t len;
+	uint8_t has_value;
+
+	val->plan = plan;
+	val->count = 0;
+
+	switch (plan->op) {
+	case PLAN_FIXED:
+		val->u.raw = cursor_view(cur, plan->size);
+		return val->u.raw ? 0 : -1;
+	case PLAN_CHAR:
+		return read_utf8_char(cur, &val->u.ch);
+	case PLAN_STRING:
+		val->u.raw = cursor_view_string(cur, &len);
+		if (!val->u.raw)
+			return -1;
+		val->count = len;
+		return 0;
+	case PLAN_LIST:
+		elem = plan->args[0];
+		if (elem->op == PLAN_FIXED) {
+			/* Packed, so take them all at once */
+			if (read_count(cur, elem->size, &val->count))
+				return -1;
+			val->u.raw = cursor_view(cur, (size_t)val->count * elem->size);
+			return val->u.raw ? 0 : -1;
+		}
+		if (read_count(cur, 1, &val->count))
+			return -1;
+		return read_items(cont, plan, cur, val, val->count);
+	case PLAN_DICT:
+		if (read_count(cur, 2, &val->count))
+			return -1;
+		return read_items(cont, plan, cur, val, val->count * 2);
+	case PLAN_NULLABLE:
+		if (cursor_read(cur, &has_value, 1))
+			return -1;
+		val->count = !!has_value;
+		val->u.items = NULL;
+		return val->count ? read_items(cont, plan, cur, val, 1) : 0;
+	case PLAN_OBJECT:
+		return read_nested_object(cont, cur, &val->u.obj);
+	}
+
+	return -1;
+}
+
+static struct xnb_object_head *generic_read(struct xnb_container *cont,
+		const struct type_reader_desc *rdr, struct xnb_cursor *cur)
+{
+	struct xnb_obj_generic *gen;
+
+	assert(rdr->plan != NULL);
+
+	gen = arena_zalloc(cont->arena, sizeof(*gen));
+	if (!gen) {
+		fprintf(stderr, "Couldn't alloc generic object\n");
+		return NULL;
+	}
+	gen->head.type = XNB_OBJ_GENERIC;
+	gen->head.reader = &generic_reader;
+	gen->rdr = rdr;
+
+	if (plan_read(cont, rdr->plan, cur, &gen->value)) {
+		fprintf(stderr, "Couldn't read '%s'\n", rdr->name);
+		return NULL;
+	}
+
+	return (struct xnb_object_head *)gen;
+}
+
+/* Output, as JSON */
+
+static void describe_plan(const struct xnb_plan *plan, FILE *out)
+{
+	fputs(plan->name, out);
+	if (plan->op == PLAN_LIST || plan->op == PLAN_NULLABLE) {
+		fputc('<', out);
+		describe_plan(plan->args[0], out);
+		fputc('>', out);
+	} else if (plan->op == PLAN_DICT) {
+		fputc('<', out);
+		describe_plan(plan->args[0], out);
+		fputs(", ", out);
+		describe_plan(plan->args[1], out);
+		fputc('>', out);
+	}
+}
+
+static void write_utf8(uint32_t ch, FILE *out)
+{
+	if (ch < 0x80) {
+		fputc(ch, out);
+	} else if (ch < 0x800) {
+		fputc(0xc0 | (ch >> 6), out);
+		fputc(0x80 | (ch & 0x3f), out);
+	} else if (ch < 0x10000) {
+		fputc(0xe0 | (ch >> 12), out);
+		fputc(0x80 | ((ch >> 6) & 0x3f), out);
+		fputc(0x80 | (ch & 0x3f), out);
+	} else {
+		fputc(0xf0 | (ch >> 18), out);
+		fputc(0x80 | ((ch >> 12) & 0x3f), out);
+		fputc(0x80 | ((ch >> 6) & 0x3f), out);
+		fputc(0x80 | (ch & 0x3f), out);
+	}
+}
+
+static void write_string(const uint8_t *s, size_t len, FILE *out)
+{
+	size_t i;
+
+	fputc('"', out);
+	for (i = 0; i < len; i++) {
+		if (s[i] == '"' || s[i] == '\\')
+			fprintf(out, "\\%c", s[i]);
+		else if (s[i] < 0x20)
+			fprintf(out, "\\u%04x", s[i]);
+		else
+			fputc(s[i], out);
+	}
+	fputc('"', out);
+}
+
+static void write_scalar(enum scalar_kind kind, const uint8_t *p, FILE *out)
+{
+	uint64_t v = 0;
+	double d;
+	float f;
+	int i;
+
+	for (i = scalar_size[kind] - 1; i >= 0; i--)
+		v = (v << 8) | p[i];
+
+	switch (kind) {
+	case SCALAR_BOOL:
+		fputs(v ? "true" : "false", out);
+		return;
+	case SCALAR_I8:
+		fprintf(out, "%d", (int8_t)v);
+		return;
+	case SCALAR_I16:
+		fprintf(out, "%d", (int16_t)v);
+		return;
+	case SCALAR_I32:
+		fprintf(out, "%d", (int32_t)v);
+		return;
+	case SCALAR_I64:
+		fprintf(out, "%lld", (long long)(int64_t)v);
+		return;
+	case SCALAR_F32:
+		memcpy(&f, p, sizeof(f));
+		d = f;
+		break;
+	case SCALAR_F64:
+		memcpy(&d, p, sizeof(d));
+		break;
+	default:
+		fprintf(out, "%llu", (unsigned long long)v);
+		return;
+	}
+
+	/* JSON has no NaN or infinity */
+	if (isfinite(d))
+		fprintf(out, kind == SCALAR_F32 ? "%.9g" : "%.17g", d);
+	else
+		fputs("null", out);
+}
+
+static void write_fixed(const struct xnb_plan *plan, const uint8_t *p,
+		FILE *out)
+{
+	int i;
+
+	if (plan->fields == 1) {
+		write_scalar(plan->kind, p, out);
+		return;
+	}
+
+	fputc('[', out);
+	for (i = 0; i < plan->fields; i++) {
+		if (i)
+			fputs(", ", out);
+		write_scalar(plan->kind, p + i * scalar_size[plan->kind], out);
+	}
+	fputc(']', out);
+}
+
+/* max_items < 0 means no limit */
+static void write_value(const struct xnb_value *val, long max_items,
+		FILE *out);
+
+static void write_object(struct xnb_object_head *obj, long max_items,
+		FILE *out)
+{
+	if (!obj)
+		fputs("null", out);
+	else if (obj->reader == &generic_reader)
+		write_value(&((struct xnb_obj_generic *)obj)->value, max_items, out);
+	else
+		fprintf(out, "{\"$type\": \"%s\"}", obj->reader->name);
+}
+
+static void write_value(const struct xnb_value *val, long max_items,
+		FILE *out)
+{
+	const struct xnb_plan *plan = val->plan;
+	const struct xnb_plan *elem = plan->args[0];
+	uint32_t i, n = val->count;
+
+	if (max_items >= 0 && n > max_items)
+		n = max_items;
+
+	switch (plan->op) {
+	case PLAN_FIXED:
+		write_fixed(plan, val->u.raw, out);
+		break;
+	case PLAN_CHAR:
+		fputc('"', out);
+		if (val->u.ch == '"' || val->u.ch == '\\')
+			fprintf(out, "\\%c", val->u.ch);
+		else if (val->u.ch < 0x20)
+			fprintf(out, "\\u%04x", val->u.ch);
+		else
+			write_utf8(val->u.ch, out);
+		fputc('"', out);
+		break;
+	case PLAN_STRING:
+		write_string(val->u.raw, val->count, out);
+		break;
+	case PLAN_LIST:
+		fputc('[', out);
+		for (i = 0; i < n; i++) {
+			if (i)
+				fputs(", ", out);
+			if (elem->op == PLAN_FIXED)
+				write_fixed(elem, val->u.raw + (size_t)i * elem->size, out);
+			else
+				write_value(&val->u.items[i], max_items, out);
+		}
+		if (n < val->count)
+			fputs(", ...", out);
+		fputc(']', out);
+		break;
+	case PLAN_DICT:
+		/* Keys needn't be strings, so write pairs */
+		fputc('[', out);
+		for (i = 0; i < n; i++) {
+			fputs(i ? ", [" : "[", out);
+			write_value(&val->u.items[2 * i], max_items, out);
+			fputs(", ", out);
+			write_value(&val->u.items[2 * i + 1], max_items, out);
+			fputc(']', out);
+		}
+		if (n < val->count)
+			fputs(", ...", out);
+		fputc(']', out);
+		break;
+	case PLAN_NULLABLE:
+		if (val->count)
+			write_value(&val->u.items[0], max_items, out);
+		else
+			fputs("null", out);
+		break;
+	case PLAN_OBJECT:
+		write_object(val->u.obj, max_items, out);
+		break;
+	}
+}
+
+static void generic_print(struct xnb_object_head *obj, FILE *out)
+{
+	struct xnb_obj_generic *gen = (struct xnb_obj_generic *)obj;
+	const struct xnb_plan *plan;
+	if (obj == NULL)
+		return;
+	assert(obj->type == XNB_OBJ_GENERIC);
+
+	plan = gen->value.plan;
+
+	fprintf(out, "[Generic]\n");
+	fprintf(out, "Type: ");
+	describe_plan(plan, out);
+	fprintf(out, "\n");
+	if (plan->op == PLAN_LIST || plan->op == PLAN_DICT)
+		fprintf(out, "Count: %u\n", gen->value.count);
+	fprintf(out, "Value: ");
+	write_value(&gen->value, PRINT_MAX_ITEMS, out);
+	fprintf(out, "\n");
+	fprintf(out, "-------------\n");
+}
+
+static int generic_export(struct xnb_object_head *obj,
+		const struct xnb_export_opts *opts, char *basename)
+{
+	struct xnb_obj_generic *gen = (struct xnb_obj_generic *)obj;
+	FILE *fp;
+	long start;
+	int fd, res = -1;
+
+	assert(obj->type == XNB_OBJ_GENERIC);
+
+	fd = export_create(opts, basename, "json");
+	if (fd < 0)
+		return -1;
+
+	/* fclose() closes the fd it's given, but fd has to go to export_close() */
+	fp = fdopen(dup(fd), "w");
+	if (!fp) {
+		fprintf(stderr, "Couldn't open JSON output\n");
+		goto done;
+	}
+
+	start = ftell(fp);
+	write_value(&gen->value, -1, fp);
+	fputc('\n', fp);
+	stats_add_written(ftell(fp) - start);
+
+	if (fclose(fp)) {
+		fprintf(stderr, "Couldn't write JSON\n");
+		goto done;
+	}
+
+	res = 0;
+
+done:
+	res = export_close(opts, fd, res);
+	return res;
+}
+
+const struct xnb_object_reader generic_reader = {
+	.name = "Generic",
+	.type = XNB_OBJ_GENERIC,
+	.deserialize = generic_read,
+	.print = generic_print,
+	.export = generic_export,
+};
+
+/* Helpers for readers with nested collections */
+
+/* The generic plan for the reader of the nested object at cur, if any */
+static const struct xnb_plan *nested_plan(struct xnb_container *cont,
+		struct xnb_cursor *cur, int *type_idx)
+{
+	const struct type_reader_desc *rdr;
+
+	*type_idx = cursor_read_7bit(cur);
+	if (*type_idx <= 0 || *type_idx > cont->type_reader_count)
+		return NULL;
+
+	rdr = &cont->readers[*type_idx - 1];
+	return rdr->reader == &generic_reader ? rdr->plan : NULL;
+}
+
+int read_packed_list(struct xnb_container *cont, struct xnb_cursor *cur,
+		const char *elem_type, const uint8_t **data, uint32_t *count)
+{
+	const struct xnb_plan *plan;
+	int type_idx;
+
+	plan = nested_plan(cont, cur, &type_idx);
+	if (!plan || plan->op != PLAN_LIST || plan->args[0]->op != PLAN_FIXED ||
+			strcmp(plan->args[0]->name, elem_type)) {
+		fprintf(stderr, "Expected a List<%s>, got type %d\n", elem_type,
+				type_idx);
+		return -1;
+	}
+
+	if (read_count(cur, plan->args[0]->size, count))
+		return -1;
+	*data = cursor_view(cur, (size_t)*count * plan->args[0]->size);
+
+	return *data ? 0 : -1;
+}
+
+int read_char_list(struct xnb_container *cont, struct xnb_cursor *cur,
+		uint32_t **chars, uint32_t *count)
+{
+	const struct xnb_plan *plan;
+	const uint8_t *p;
+	size_t left;
+	uint32_t i = 0;
+	int type_idx;
+
+	plan = nested_plan(cont, cur, &type_idx);
+	if (!plan || plan->op != PLAN_LIST || plan->args[0]->op != PLAN_CHAR) {
+		fprintf(stderr, "Expected a List<Char>, got type %d\n", type_idx);
+		return -1;
+	}
+
+	if (read_count(cur, 1, count))
+		return -1;
+	*chars = arena_alloc(cont->arena, sizeof(**chars) * *count);
+	if (!*chars && *count)
+		return -1;
+
+	/* Nearly always ASCII, which can be taken without any decoding */
+	p = cur->base + cur->pos;
+	left = cur->size - cur->pos;
+	while (i < *count && i < left && p[i] < 0x80) {
+		(*chars)[i] = p[i];
+		i++;
+	}
+	cur->pos += i;
+
+	for (; i < *count; i++)
+		if (read_utf8_char(cur, &(*chars)[i]))
+			return -1;
+
+	return 0;
+}
+
+int read_nullable_char(struct xnb_container *cont, struct xnb_cursor *cur,
+		uint32_t *ch, bool *has_value)
+{
+	struct xnb_object_head *obj;
+	const struct xnb_value *val;
+
+	*has_value = false;
+	if (read_nested_object(cont, cur, &obj))
+		return -1;
+	if (!obj)
+		return 0;
+
+	val = &((struct xnb_obj_generic *)obj)->value;
+	if (obj->reader != &generic_reader || val->plan->op != PLAN_NULLABLE ||
+			val->plan->args[0]->op != PLAN_CHAR) {
+		fprintf(stderr, "Expected a Nullable<Char>\n");
+		return -1;
+	}
+
+	if (val->count) {
+		*ch = val->u.items[0].u.ch;
+		*has_value = true;
+	}
+
+	return 0;
+}
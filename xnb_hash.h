@@ -0,0 +1,17 @@
+/* Content hashing
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#ifndef __XNB_HASH_H__
+#define __XNB_HASH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * XXH64 of len bytes at data. Fast enough to hash whole inputs at close to
+ * memory bandwidth, but not suitable for anything security related.
+ */
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+#endif /* __XNB_HASH_H__ */
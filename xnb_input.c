@@ -0,0 +1,559 @@
+/* Input file lists
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "xnb_input.h"
+
+/*
+ * Entries live in fixed-size blocks, found through a table which is big
+ * enough to never need resizing, so nothing has to move as the list grows.
+ */
+#define BLOCK_SHIFT  12
+#define BLOCK_SIZE   (1 << BLOCK_SHIFT)
+#define MAX_BLOCKS   (1 << 15)
+
+/* Read size when the list isn't a regular file */
+#define STREAM_CHUNK (64 * 1024)
+
+/* Buffer for getdents64() */
+#define DIRENT_BUF   (32 * 1024)
+#define MAX_WALKERS  64
+
+/* Storage for names. Chunks are never resized, only added */
+struct name_chunk {
+	struct name_chunk *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+struct input_list {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int count;
+	bool finished;
+	struct input_file *blocks[MAX_BLOCKS];
+	/* Newest first. Only the head is used for input_list_add() copies */
+	struct name_chunk *chunks;
+};
+
+struct input_list *input_list_create(void)
+{
+	struct input_list *list = calloc(1, sizeof(*list));
+	if (!list) {
+		fprintf(stderr, "Couldn't alloc input list\n");
+		return NULL;
+	}
+
+	pthread_mutex_init(&list->lock, NULL);
+	pthread_cond_init(&list->cond, NULL);
+	return list;
+}
+
+void input_list_destroy(struct input_list *list)
+{
+	int i;
+
+	if (!list)
+		return;
+
+	for (i = 0; i < MAX_BLOCKS && list->blocks[i]; i++) {
+		int j;
+		for (j = 0; j < BLOCK_SIZE; j++)
+			free(list->blocks[i][j].out);
+		free(list->blocks[i]);
+	}
+
+	while (list->chunks) {
+		struct name_chunk *next = list->chunks->next;
+		free(list->chunks);
+		list->chunks = next;
+	}
+
+	pthread_cond_destroy(&list->cond);
+	pthread_mutex_destroy(&list->lock);
+	free(list);
+}
+
+/* Must hold the lock. Adds a chunk with room for at least size bytes */
+static struct name_chunk *chunk_new(struct input_list *list, size_t size)
+{
+	struct name_chunk *chunk = malloc(sizeof(*chunk) + size);
+	if (!chunk) {
+		fprintf(stderr, "Couldn't alloc space for input names\n");
+		return NULL;
+	}
+
+	chunk->size = size;
+	chunk->used = 0;
+	chunk->next = list->chunks;
+	list->chunks = chunk;
+	return chunk;
+}
+
+/* Must hold the lock. name (and rel, which is part of it) isn't copied */
+static int add_entry(struct input_list *list, const char *name,
+		const char *rel)
+{
+	int block = list->count >> BLOCK_SHIFT;
+	struct input_file *f;
+
+	if (block >= MAX_BLOCKS) {
+		fprintf(stderr, "Too many input files\n");
+		return -1;
+	}
+
+	if (!list->blocks[block]) {
+		list->blocks[block] = calloc(BLOCK_SIZE, sizeof(struct input_file));
+		if (!list->blocks[block]) {
+			fprintf(stderr, "Couldn't alloc space for input files\n");
+			return -1;
+		}
+	}
+
+	f = &list->blocks[block][list->count & (BLOCK_SIZE - 1)];
+	f->name = name;
+	f->rel = rel;
+	list->count++;
+	return 0;
+}
+
+/* Add a copy of name, to be exported as the part from rel_off on */
+static int add_copy(struct input_list *list, const char *name, size_t rel_off)
+{
+	struct name_chunk *chunk;
+	size_t len = strlen(name) + 1;
+	char *copy;
+	int res = -1;
+
+	pthread_mutex_lock(&list->lock);
+
+	chunk = list->chunks;
+	if (!chunk || chunk->size - chunk->used < len) {
+		chunk = chunk_new(list,
+				len > STREAM_CHUNK ? len : STREAM_CHUNK);
+		if (!chunk)
+			goto done;
+	}
+
+	copy = chunk->data + chunk->used;
+	memcpy(copy, name, len);
+	chunk->used += len;
+
+	res = add_entry(list, copy, copy + rel_off);
+	if (!res)
+		pthread_cond_broadcast(&list->cond);
+
+done:
+	pthread_mutex_unlock(&list->lock);
+	return res;
+}
+
+int input_list_add(struct input_list *list, const char *name)
+{
+	return add_copy(list, name, 0);
+}
+
+/*
+ * Start a new chunk for reading into, carrying over the partial name at the
+ * end of the old one (if any). The chunk is marked as full so that
+ * input_list_add() won't use it.
+ */
+static struct name_chunk *read_chunk(struct input_list *list,
+		struct name_chunk *old, size_t *start, size_t *len, size_t size)
+{
+	size_t partial = old ? *len - *start : 0;
+	struct name_chunk *chunk;
+
+	if (size < partial * 2 + 1)
+		size = partial * 2 + 1;
+
+	pthread_mutex_lock(&list->lock);
+	chunk = chunk_new(list, size);
+	if (chunk)
+		chunk->used = size;
+	pthread_mutex_unlock(&list->lock);
+	if (!chunk)
+		return NULL;
+
+	if (partial)
+		memcpy(chunk->data, old->data + *start, partial);
+	*start = 0;
+	*len = partial;
+	return chunk;
+}
+
+/* Must hold the lock. Terminates the name at [start, end) and adds it */
+static int add_read_name(struct input_list *list, char *start, char *end,
+		char delim)
+{
+	*end = '\0';
+	if (delim == '\n' && end > start && end[-1] == '\r')
+		end[-1] = '\0';
+	if (!*start)
+		return 0;
+
+	return add_entry(list, start, start);
+}
+
+int input_list_read(struct input_list *list, int fd, char delim)
+{
+	struct name_chunk *chunk;
+	size_t size = STREAM_CHUNK;
+	size_t start = 0, len = 0;
+	struct stat st;
+	int res = 0;
+
+	/* One buffer for everything, with room to terminate the last name */
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode))
+		size = st.st_size + 1;
+
+	chunk = read_chunk(list, NULL, &start, &len, size);
+	if (!chunk)
+		return -1;
+
+	while (1) {
+		ssize_t n;
+		char *p, *end;
+
+		if (len == chunk->size) {
+			chunk = read_chunk(list, chunk, &start, &len, STREAM_CHUNK);
+			if (!chunk)
+				return -1;
+		}
+
+		n = read(fd, chunk->data + len, chunk->size - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			fprintf(stderr, "Couldn't read input list: %s\n",
+					strerror(errno));
+			return -1;
+		} else if (n == 0) {
+			break;
+		}
+
+		p = chunk->data + len;
+		end = p + n;
+		len += n;
+
+		/* Publish everything from this read at once */
+		pthread_mutex_lock(&list->lock);
+		while ((p = memchr(p, delim, end - p))) {
+			res = add_read_name(list, chunk->data + start, p, delim);
+			if (res)
+				break;
+			start = ++p - chunk->data;
+		}
+		pthread_cond_broadcast(&list->cond);
+		pthread_mutex_unlock(&list->lock);
+		if (res)
+			return res;
+	}
+
+	/* The last name might not have had a delimiter */
+	if (start < len) {
+		if (len == chunk->size) {
+			chunk = read_chunk(list, chunk, &start, &len, len - start + 1);
+			if (!chunk)
+				return -1;
+		}
+
+		pthread_mutex_lock(&list->lock);
+		res = add_read_name(list, chunk->data + start, chunk->data + len,
+				delim);
+		pthread_cond_broadcast(&list->cond);
+		pthread_mutex_unlock(&list->lock);
+	}
+
+	return res;
+}
+
+void input_list_finish(struct input_list *list)
+{
+	pthread_mutex_lock(&list->lock);
+	list->finished = true;
+	pthread_cond_broadcast(&list->cond);
+	pthread_mutex_unlock(&list->lock);
+}
+
+int input_list_wait(struct input_list *list, int n)
+{
+	int count;
+
+	pthread_mutex_lock(&list->lock);
+	while (list->count <= n && !list->finished)
+		pthread_cond_wait(&list->cond, &list->lock);
+	count = list->count;
+	pthread_mutex_unlock(&list->lock);
+
+	return count;
+}
+
+int input_list_count(struct input_list *list, bool *finished)
+{
+	int count;
+
+	pthread_mutex_lock(&list->lock);
+	count = list->count;
+	if (finished)
+		*finished = list->finished;
+	pthread_mutex_unlock(&list->lock);
+
+	return count;
+}
+
+struct input_file *input_list_get(struct input_list *list, int idx)
+{
+	return &list->blocks[idx >> BLOCK_SHIFT][idx & (BLOCK_SIZE - 1)];
+}
+
+/*
+ * Directories waiting to be read are shared between the walker threads, and
+ * the walk is over when there are none left and nobody is reading one
+ * (which could find more).
+ */
+struct walk_dir {
+	struct walk_dir *next;
+	char path[];
+};
+
+struct walk {
+	struct input_list *list;
+	/* Length of the top directory's path, and the '/' after it */
+	size_t rel_off;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Newest first, so the walk stays mostly depth first */
+	struct walk_dir *dirs;
+	int busy;
+	int err;
+};
+
+/* The layout getdents64() fills in */
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+static int walk_push(struct walk *w, const char *dir, const char *name)
+{
+	size_t dlen = strlen(dir), nlen = name ? strlen(name) : 0;
+	struct walk_dir *d = malloc(sizeof(*d) + dlen + nlen + 2);
+	if (!d) {
+		fprintf(stderr, "Couldn't alloc space for a directory name\n");
+		return -1;
+	}
+
+	memcpy(d->path, dir, dlen);
+	if (name) {
+		if (dir[dlen - 1] != '/')
+			d->path[dlen++] = '/';
+		memcpy(d->path + dlen, name, nlen);
+	}
+	d->path[dlen + nlen] = '\0';
+
+	pthread_mutex_lock(&w->lock);
+	d->next = w->dirs;
+	w->dirs = d;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	return 0;
+}
+
+static bool is_xnb(const char *name)
+{
+	size_t len = strlen(name);
+
+	return len > 4 && !strcasecmp(name + len - 4, ".xnb");
+}
+
+/* Read one directory, adding its files and queueing its subdirectories */
+static int walk_dir(struct walk *w, const char *path)
+{
+	char *buf, *name = NULL;
+	size_t name_cap = 0;
+	int fd, res = 0;
+
+	fd = openat(AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't open directory '%s': %s\n", path,
+				strerror(errno));
+		return -1;
+	}
+
+	buf = malloc(DIRENT_BUF);
+	if (!buf) {
+		fprintf(stderr, "Couldn't alloc space for reading '%s'\n", path);
+		close(fd);
+		return -1;
+	}
+
+	while (!res) {
+		long n = syscall(SYS_getdents64, fd, buf, DIRENT_BUF);
+		long pos;
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			fprintf(stderr, "Couldn't read directory '%s': %s\n", path,
+					strerror(errno));
+			res = -1;
+			break;
+		} else if (n == 0) {
+			break;
+		}
+
+		for (pos = 0; pos < n && !res; ) {
+			struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + pos);
+			unsigned char type = d->d_type;
+			struct stat st;
+			size_t len;
+
+			pos += d->d_reclen;
+			if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+				continue;
+
+			/* Not every filesystem fills in the type */
+			if (type == DT_UNKNOWN) {
+				if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW))
+					continue;
+				type = S_ISDIR(st.st_mode) ? DT_DIR :
+					S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+			}
+
+			if (type == DT_DIR) {
+				res = walk_push(w, path, d->d_name);
+				continue;
+			}
+
+			if (!is_xnb(d->d_name))
+				continue;
+			if (type == DT_LNK && (fstatat(fd, d->d_name, &st, 0) ||
+						!S_ISREG(st.st_mode)))
+				continue;
+			else if (type != DT_LNK && type != DT_REG)
+				continue;
+
+			len = strlen(path) + strlen(d->d_name) + 2;
+			if (len > name_cap) {
+				char *p = realloc(name, len * 2);
+				if (!p) {
+					fprintf(stderr, "Couldn't alloc space for a name\n");
+					res = -1;
+					break;
+				}
+				name = p;
+				name_cap = len * 2;
+			}
+			snprintf(name, len, "%s%s%s", path,
+					path[strlen(path) - 1] == '/' ? "" : "/", d->d_name);
+			res = add_copy(w->list, name, w->rel_off);
+		}
+	}
+
+	free(name);
+	free(buf);
+	close(fd);
+	return res;
+}
+
+static void *walk_main(void *data)
+{
+	struct walk *w = data;
+
+	pthread_mutex_lock(&w->lock);
+	while (1) {
+		struct walk_dir *d;
+
+		while (!w->dirs && w->busy)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (!w->dirs)
+			break;
+
+		d = w->dirs;
+		w->dirs = d->next;
+		w->busy++;
+		pthread_mutex_unlock(&w->lock);
+
+		if (walk_dir(w, d->path)) {
+			pthread_mutex_lock(&w->lock);
+			w->err = -1;
+			pthread_mutex_unlock(&w->lock);
+		}
+		free(d);
+
+		pthread_mutex_lock(&w->lock);
+		w->busy--;
+		if (!w->busy && !w->dirs)
+			pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+int input_list_add_dir(struct input_list *list, const char *path,
+		int n_threads)
+{
+	pthread_t threads[MAX_WALKERS];
+	struct walk w = {
+		.list = list,
+	};
+	size_t len = strlen(path);
+	char *root;
+	int i, n = 0;
+
+	/* "dir/" and "dir" are the same, but "/" has to stay as it is */
+	root = strdup(path);
+	if (!root) {
+		fprintf(stderr, "Couldn't alloc space for '%s'\n", path);
+		return -1;
+	}
+	while (len > 1 && root[len - 1] == '/')
+		root[--len] = '\0';
+	w.rel_off = root[len - 1] == '/' ? len : len + 1;
+
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.cond, NULL);
+
+	w.err = walk_push(&w, root, NULL);
+
+	if (n_threads > MAX_WALKERS)
+		n_threads = MAX_WALKERS;
+	for (i = 1; i < n_threads; i++) {
+		if (pthread_create(&threads[n], NULL, walk_main, &w))
+			break;
+		n++;
+	}
+	/* This thread helps too, so there's always at least one walker */
+	walk_main(&w);
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&w.cond);
+	pthread_mutex_destroy(&w.lock);
+	free(root);
+
+	return w.err;
+}
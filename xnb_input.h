@@ -0,0 +1,64 @@
+/* Input file lists
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#ifndef __XNB_INPUT_H__
+#define __XNB_INPUT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * The files to decode, and what happened to each. Names can be added while
+ * other threads are already working through the list: entries never move
+ * once added, so they stay valid until the list is destroyed.
+ */
+struct input_file {
+	const char *name;
+	/*
+	 * The name to export it under, below an output prefix. For files found
+	 * in a directory, this is the path relative to that directory.
+	 */
+	const char *rel;
+	/* Messages from decoding it, buffered so they can be printed in order */
+	char *out;
+	size_t out_len;
+	int res;
+	bool done;
+};
+
+struct input_list;
+
+struct input_list *input_list_create(void);
+void input_list_destroy(struct input_list *list);
+
+/* Add a copy of name. Returns 0 on success */
+int input_list_add(struct input_list *list, const char *name);
+/*
+ * Walk the tree under the directory path with n_threads threads, adding
+ * each .xnb file as it's found. Symlinks to files are followed, but not
+ * symlinks to directories. Returns 0 if the whole tree could be read.
+ */
+int input_list_add_dir(struct input_list *list, const char *path,
+		int n_threads);
+/*
+ * Read names separated by delim from fd until EOF, adding each one as soon
+ * as it's complete. Empty names are skipped, and with '\n' so is a trailing
+ * '\r'. A whole regular file is read into one buffer, which the names are
+ * then used straight from. Returns 0 on success.
+ */
+int input_list_read(struct input_list *list, int fd, char delim);
+/* No more names will be added */
+void input_list_finish(struct input_list *list);
+
+/*
+ * Wait until there are more than n entries, or the list is finished.
+ * Returns the number of entries.
+ */
+int input_list_wait(struct input_list *list, int n);
+/* The number of entries so far, and whether there will be any more */
+int input_list_count(struct input_list *list, bool *finished);
+/* Entry idx, which must be less than a count returned already */
+struct input_file *input_list_get(struct input_list *list, int idx);
+
+#endif /* __XNB_INPUT_H__ */
@@ -0,0 +1,740 @@
+/* Asynchronous file I/O
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "xnb_io.h"
+#include "xnb_stats.h"
+
+/* fds at or above this just get blocking writes */
+#define IO_MAX_FDS  4096
+/* Threads for the fallback backend */
+#define IO_THREADS  8
+/*
+ * Writes are copied, so this bounds how much memory the copies can take,
+ * with no single write bigger than IO_WRITE_CHUNK.
+ */
+#define IO_WRITE_BYTES (8 << 20)
+#define IO_WRITE_CHUNK (1 << 20)
+
+enum io_op {
+	IO_OP_READ,
+	IO_OP_WRITE,
+};
+
+/* An output file with writes in flight */
+struct io_file {
+	struct xnb_io *io;
+	int fd;
+	off_t offset;
+	int pending;
+	bool closing;
+	int err;
+	char name[];
+};
+
+struct io_req {
+	enum io_op op;
+	int fd;
+	struct iovec iov;
+	off_t off;
+	/* What it's part of. One or the other */
+	struct io_file *file;
+	struct io_read *rd;
+	/* Bytes done, or -errno */
+	ssize_t res;
+	/* Size of data[] */
+	size_t copied;
+	struct io_req *next;
+	/* Writes keep their own copy of the data here */
+	uint8_t data[];
+};
+
+struct uring {
+	int fd;
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+struct io_threads {
+	pthread_t threads[IO_THREADS];
+	int n_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	/* Submitted, oldest first */
+	struct io_req *queue;
+	struct io_req **queue_tail;
+	/* Finished, in any order */
+	struct io_req *finished;
+	bool stopping;
+};
+
+struct xnb_io {
+	enum xnb_io_backend backend;
+	unsigned int depth;
+	unsigned int inflight;
+	/* Bytes in the copies held by writes in flight */
+	size_t copied;
+	int failed;
+	struct uring ring;
+	struct io_threads pool;
+};
+
+/* Which engine each fd belongs to, so that export_write() can find it */
+static struct io_file *fd_files[IO_MAX_FDS];
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit,
+		unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+			NULL, 0);
+}
+
+static void uring_destroy(struct uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	if (ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+}
+
+static int uring_init(struct uring *ring, unsigned int depth)
+{
+	struct io_uring_params p;
+	uint8_t *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = uring_setup(depth, &p);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) &&
+			ring->cq_size > ring->sq_size)
+		ring->sq_size = ring->cq_size;
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		ring->sq_ptr = NULL;
+		goto fail;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			ring->cq_ptr = NULL;
+			goto fail;
+		}
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto fail;
+	}
+
+	sq = ring->sq_ptr;
+	ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+
+	cq = ring->cq_ptr;
+	ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+
+fail:
+	uring_destroy(ring);
+	return -1;
+}
+
+/* The caller makes sure there's room, by limiting what's in flight */
+static int uring_submit(struct uring *ring, struct io_req *req)
+{
+	unsigned int tail = *ring->sq_tail;
+	unsigned int idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	int res;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = req->op == IO_OP_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+	sqe->fd = req->fd;
+	sqe->addr = (uintptr_t)&req->iov;
+	sqe->len = 1;
+	sqe->off = req->off;
+	sqe->user_data = (uintptr_t)req;
+
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	do {
+		res = uring_enter(ring->fd, 1, 0, 0);
+	} while (res < 0 && errno == EINTR);
+
+	return res < 0 ? -1 : 0;
+}
+
+/* Collect finished requests onto *done, waiting for at least one if wait */
+static int uring_reap(struct uring *ring, bool wait, struct io_req **done)
+{
+	unsigned int head, tail;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	while (head == tail && wait) {
+		if (uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+				errno != EINTR) {
+			fprintf(stderr, "io_uring wait failed: %s\n", strerror(errno));
+			return -1;
+		}
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	}
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		struct io_req *req = (struct io_req *)(uintptr_t)cqe->user_data;
+
+		req->res = cqe->res;
+		req->next = *done;
+		*done = req;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static void *io_thread_main(void *data)
+{
+	struct io_threads *pool = data;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		struct io_req *req;
+		ssize_t n;
+
+		while (!pool->queue && !pool->stopping)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (!pool->queue)
+			break;
+
+		req = pool->queue;
+		pool->queue = req->next;
+		if (!pool->queue)
+			pool->queue_tail = &pool->queue;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (req->op == IO_OP_READ)
+			n = pread(req->fd, req->iov.iov_base, req->iov.iov_len,
+					req->off);
+		else
+			n = pwrite(req->fd, req->iov.iov_base, req->iov.iov_len,
+					req->off);
+		req->res = n < 0 ? -errno : n;
+
+		pthread_mutex_lock(&pool->lock);
+		req->next = pool->finished;
+		pool->finished = req;
+		pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+static void threads_destroy(struct io_threads *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->n_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+static int threads_init(struct io_threads *pool, unsigned int depth)
+{
+	int i, n = depth < IO_THREADS ? depth : IO_THREADS;
+
+	memset(pool, 0, sizeof(*pool));
+	pool->queue_tail = &pool->queue;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (i = 0; i < n; i++) {
+		int res = pthread_create(&pool->threads[i], NULL, io_thread_main,
+				pool);
+		if (res) {
+			fprintf(stderr, "Couldn't start I/O thread: %s\n",
+					strerror(res));
+			break;
+		}
+		pool->n_threads++;
+	}
+
+	if (!pool->n_threads) {
+		threads_destroy(pool);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void threads_submit(struct io_threads *pool, struct io_req *req)
+{
+	pthread_mutex_lock(&pool->lock);
+	req->next = NULL;
+	*pool->queue_tail = req;
+	pool->queue_tail = &req->next;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void threads_reap(struct io_threads *pool, bool wait,
+		struct io_req **done)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (wait && !pool->finished)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	*done = pool->finished;
+	pool->finished = NULL;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+struct xnb_io *io_create(enum xnb_io_backend backend, unsigned int depth)
+{
+	struct xnb_io *io = calloc(1, sizeof(*io));
+	if (!io) {
+		fprintf(stderr, "Couldn't alloc I/O engine\n");
+		return NULL;
+	}
+
+	if (depth < 1)
+		depth = 1;
+	io->depth = depth;
+
+	if (backend != XNB_IO_THREADS) {
+		if (!uring_init(&io->ring, depth)) {
+			io->backend = XNB_IO_URING;
+			return io;
+		} else if (backend == XNB_IO_URING) {
+			fprintf(stderr, "Couldn't set up io_uring: %s\n",
+					strerror(errno));
+			free(io);
+			return NULL;
+		}
+	}
+
+	if (threads_init(&io->pool, depth)) {
+		free(io);
+		return NULL;
+	}
+	io->backend = XNB_IO_THREADS;
+
+	return io;
+}
+
+const char *io_backend_name(const struct xnb_io *io)
+{
+	return io->backend == XNB_IO_URING ? "io_uring" : "threads";
+}
+
+static int submit(struct xnb_io *io, struct io_req *req)
+{
+	if (io->backend == XNB_IO_URING) {
+		if (uring_submit(&io->ring, req)) {
+			fprintf(stderr, "io_uring submit failed: %s\n",
+					strerror(errno));
+			return -1;
+		}
+	} else {
+		threads_submit(&io->pool, req);
+	}
+
+	return 0;
+}
+
+/* All of its writes are done. Returns 0 if they all succeeded */
+static int finish_file(struct io_file *file)
+{
+	struct xnb_io *io = file->io;
+	int res = 0;
+
+	if (close(file->fd) && !file->err)
+		file->err = errno;
+	if (file->err) {
+		fprintf(stderr, "Couldn't write '%s': %s\n", file->name,
+				strerror(file->err));
+		io->failed++;
+		res = -1;
+	}
+	free(file);
+
+	return res;
+}
+
+static void complete(struct xnb_io *io, struct io_req *req)
+{
+	/* Short, but not finished. Carry on from where it got to */
+	if (req->res > 0 && (size_t)req->res < req->iov.iov_len) {
+		req->iov.iov_base = (uint8_t *)req->iov.iov_base + req->res;
+		req->iov.iov_len -= req->res;
+		req->off += req->res;
+		if (req->rd)
+			req->rd->done += req->res;
+		if (!submit(io, req))
+			return;
+		req->res = -EIO;
+	}
+
+	io->inflight--;
+	io->copied -= req->copied;
+
+	if (req->rd) {
+		struct io_read *rd = req->rd;
+
+		if (req->res < 0)
+			rd->err = -req->res;
+		else
+			rd->done += req->res;
+		/* Nothing left (or it shrank under us) */
+		rd->size = rd->done;
+		rd->complete = true;
+		close(rd->fd);
+		rd->fd = -1;
+	} else {
+		struct io_file *file = req->file;
+
+		if (req->res < 0 && !file->err)
+			file->err = -req->res;
+		else if (req->res == 0 && req->iov.iov_len && !file->err)
+			file->err = EIO;
+		file->pending--;
+		if (file->closing && !file->pending)
+			finish_file(file);
+	}
+
+	free(req);
+}
+
+/* Handle whatever has finished, waiting for something if wait */
+static int reap(struct xnb_io *io, bool wait)
+{
+	struct io_req *done = NULL;
+
+	if (!io->inflight)
+		return 0;
+
+	if (io->backend == XNB_IO_URING) {
+		if (uring_reap(&io->ring, wait, &done))
+			return -1;
+	} else {
+		threads_reap(&io->pool, wait, &done);
+	}
+
+	while (done) {
+		struct io_req *next = done->next;
+		complete(io, done);
+		done = next;
+	}
+
+	return 0;
+}
+
+/* Make room for one more request, copying size bytes */
+static int reserve(struct xnb_io *io, size_t size)
+{
+	while (io->inflight >= io->depth ||
+			(io->inflight && io->copied + size > IO_WRITE_BYTES)) {
+		if (reap(io, true))
+			return -1;
+	}
+	io->inflight++;
+	io->copied += size;
+
+	return 0;
+}
+
+int io_attach(struct xnb_io *io, int fd, const char *name)
+{
+	struct io_file *file;
+
+	if (fd < 0 || fd >= IO_MAX_FDS)
+		return -1;
+
+	file = calloc(1, sizeof(*file) + strlen(name) + 1);
+	if (!file) {
+		fprintf(stderr, "Couldn't alloc I/O file\n");
+		return -1;
+	}
+	file->io = io;
+	file->fd = fd;
+	strcpy(file->name, name);
+	__atomic_store_n(&fd_files[fd], file, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static struct io_file *file_for_fd(int fd)
+{
+	if (fd < 0 || fd >= IO_MAX_FDS)
+		return NULL;
+
+	return __atomic_load_n(&fd_files[fd], __ATOMIC_ACQUIRE);
+}
+
+struct xnb_io *io_for_fd(int fd)
+{
+	struct io_file *file = file_for_fd(fd);
+
+	return file ? file->io : NULL;
+}
+
+static int write_chunk(struct xnb_io *io, struct io_file *file,
+		const void *buf, size_t len)
+{
+	struct io_req *req;
+
+	/* Wait before allocating, so the wait can free something first */
+	if (reserve(io, len))
+		return -1;
+
+	req = malloc(sizeof(*req) + len);
+	if (!req) {
+		fprintf(stderr, "Couldn't alloc write of %zu bytes\n", len);
+		io->inflight--;
+		io->copied -= len;
+		return -1;
+	}
+	memcpy(req->data, buf, len);
+	req->op = IO_OP_WRITE;
+	req->fd = file->fd;
+	req->iov.iov_base = req->data;
+	req->iov.iov_len = len;
+	req->off = file->offset;
+	req->copied = len;
+	req->file = file;
+	req->rd = NULL;
+
+	if (submit(io, req)) {
+		io->inflight--;
+		io->copied -= len;
+		free(req);
+		return -1;
+	}
+
+	file->offset += len;
+	file->pending++;
+	stats_add_written(len);
+
+	return 0;
+}
+
+int io_write(struct xnb_io *io, int fd, const void *buf, size_t len)
+{
+	struct io_file *file = file_for_fd(fd);
+	const uint8_t *p = buf;
+
+	while (len) {
+		size_t n = len < IO_WRITE_CHUNK ? len : IO_WRITE_CHUNK;
+
+		/* Keep the order of errors the same as for a blocking write */
+		if (file->err) {
+			fprintf(stderr, "Write failed: %s\n", strerror(file->err));
+			return -1;
+		}
+
+		if (write_chunk(io, file, p, n))
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+int io_close(struct xnb_io *io, int fd)
+{
+	struct io_file *file = file_for_fd(fd);
+	int res;
+
+	if (!file || file->io != io)
+		return close(fd);
+
+	/* The fd can't be reused until it's really closed */
+	__atomic_store_n(&fd_files[fd], NULL, __ATOMIC_RELEASE);
+
+	/* Anything which fails later is counted by io_drain() */
+	res = file->err ? -1 : 0;
+	file->closing = true;
+	if (!file->pending && finish_file(file))
+		res = -1;
+
+	return res;
+}
+
+int io_drain(struct xnb_io *io)
+{
+	int failed;
+
+	while (io->inflight) {
+		if (reap(io, true))
+			break;
+	}
+
+	failed = io->failed;
+	io->failed = 0;
+	return failed;
+}
+
+void io_destroy(struct xnb_io *io)
+{
+	if (!io)
+		return;
+
+	io_drain(io);
+	if (io->backend == XNB_IO_URING)
+		uring_destroy(&io->ring);
+	else
+		threads_destroy(&io->pool);
+	free(io);
+}
+
+struct io_read *io_read_file(struct xnb_io *io, const char *path)
+{
+	struct io_read *rd;
+	struct io_req *req;
+	struct stat st;
+	int err;
+
+	rd = calloc(1, sizeof(*rd));
+	if (!rd) {
+		fprintf(stderr, "Couldn't alloc read of '%s'\n", path);
+		return NULL;
+	}
+
+	/* Leave it to the caller to say why it couldn't be opened */
+	rd->fd = open(path, O_RDONLY);
+	if (rd->fd < 0 || fstat(rd->fd, &st))
+		goto fail;
+
+	rd->size = st.st_size;
+	/* Always allocate something, so data is never NULL */
+	rd->data = malloc(rd->size ? rd->size : 1);
+	req = malloc(sizeof(*req));
+	if (!rd->data || !req) {
+		fprintf(stderr, "Couldn't alloc %zu bytes for '%s'\n", rd->size,
+				path);
+		free(req);
+		goto fail;
+	}
+
+	if (!rd->size) {
+		free(req);
+		close(rd->fd);
+		rd->fd = -1;
+		rd->complete = true;
+		return rd;
+	}
+
+	req->op = IO_OP_READ;
+	req->fd = rd->fd;
+	req->iov.iov_base = rd->data;
+	req->iov.iov_len = rd->size;
+	req->off = 0;
+	req->copied = 0;
+	req->file = NULL;
+	req->rd = rd;
+
+	if (reserve(io, 0)) {
+		free(req);
+		goto fail;
+	}
+	if (submit(io, req)) {
+		io->inflight--;
+		free(req);
+		goto fail;
+	}
+
+	return rd;
+
+fail:
+	err = errno;
+	if (rd->fd >= 0)
+		close(rd->fd);
+	free(rd->data);
+	free(rd);
+	errno = err;
+	return NULL;
+}
+
+int io_read_wait(struct xnb_io *io, struct io_read *rd)
+{
+	while (!rd->complete) {
+		if (reap(io, true))
+			return -1;
+	}
+
+	return rd->err ? -1 : 0;
+}
+
+void io_read_free(struct io_read *rd)
+{
+	if (!rd)
+		return;
+
+	free(rd->data);
+	free(rd);
+}
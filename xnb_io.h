@@ -0,0 +1,82 @@
+/* Asynchronous file I/O
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#ifndef __XNB_IO_H__
+#define __XNB_IO_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Keeps many reads and writes in flight from a single thread, so that
+ * decoding and exporting overlap with the I/O instead of waiting on it.
+ * Uses io_uring if the kernel has it, or a few threads doing blocking
+ * pread()/pwrite() if not.
+ *
+ * An engine must only be used by one thread at a time.
+ */
+enum xnb_io_backend {
+	/* io_uring if possible, otherwise threads */
+	XNB_IO_AUTO,
+	XNB_IO_URING,
+	XNB_IO_THREADS,
+};
+
+struct xnb_io;
+
+/* Allow up to depth operations in flight. Returns NULL on error */
+struct xnb_io *io_create(enum xnb_io_backend backend, unsigned int depth);
+/* Finishes everything still in flight first */
+void io_destroy(struct xnb_io *io);
+const char *io_backend_name(const struct xnb_io *io);
+
+/*
+ * Writing. Once fd is attached, io_write() queues writes to it one after
+ * another, and io_close() closes it when they're all done, without waiting.
+ * Errors are kept per file, reported by name when the file is finished, and
+ * counted for io_drain(). Only a limited range of fds can be attached.
+ */
+int io_attach(struct xnb_io *io, int fd, const char *name);
+/* The engine fd is attached to, or NULL */
+struct xnb_io *io_for_fd(int fd);
+/*
+ * buf is copied, so can be reused straight away. Waits for earlier writes if
+ * the copies in flight would take too much memory. Returns 0 on success.
+ */
+int io_write(struct xnb_io *io, int fd, const void *buf, size_t len);
+/*
+ * Closes fd straight away if it isn't attached. Returns -1 if a write to it
+ * has already failed, but writes still in flight are only checked by
+ * io_drain().
+ */
+int io_close(struct xnb_io *io, int fd);
+/*
+ * Wait for everything in flight. Returns the number of files which
+ * couldn't be written since the last call.
+ */
+int io_drain(struct xnb_io *io);
+
+/* Reading whole files, in the background */
+struct io_read {
+	uint8_t *data;
+	size_t size;
+	/* Private */
+	size_t done;
+	int fd;
+	int err;
+	bool complete;
+};
+
+/* Start reading path. Returns NULL, quietly, if it can't be opened */
+struct io_read *io_read_file(struct xnb_io *io, const char *path);
+/*
+ * Wait for rd to finish. Returns 0 if the whole file was read, otherwise
+ * rd->err says why not.
+ */
+int io_read_wait(struct xnb_io *io, struct io_read *rd);
+/* rd must have finished */
+void io_read_free(struct io_read *rd);
+
+#endif /* __XNB_IO_H__ */
@@ -0,0 +1,113 @@
+/* LZ4 decompression for (MonoGame) XNB containers
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ *
+ * Each sequence is a token byte (literal length << 4 | match length - 4),
+ * extra length bytes for either if they're 15, the literals, and a 16-bit
+ * little-endian match offset. The last sequence is literals only.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "xnb_lz4.h"
+
+#define LZ4_MIN_MATCH 4
+/* Copies are done in chunks of this many bytes when there's room */
+#define LZ4_CHUNK 16
+
+static inline int read_length(const uint8_t **ipp, const uint8_t *iend,
+		size_t *len)
+{
+	const uint8_t *ip = *ipp;
+	uint8_t b;
+
+	do {
+		if (ip >= iend)
+			return -1;
+		b = *ip++;
+		*len += b;
+	} while (b == 255);
+
+	*ipp = ip;
+	return 0;
+}
+
+/* Copy len bytes in whole chunks; the caller guarantees the overshoot fits */
+static inline void wild_copy(uint8_t *d, const uint8_t *s, size_t len)
+{
+	uint8_t *end = d + len;
+
+	do {
+		memcpy(d, s, LZ4_CHUNK);
+		d += LZ4_CHUNK;
+		s += LZ4_CHUNK;
+	} while (d < end);
+}
+
+int lz4_decompress(const uint8_t *src, size_t src_len,
+		uint8_t *dst, size_t dst_len)
+{
+	const uint8_t *ip = src, *iend = src + src_len;
+	uint8_t *op = dst, *oend = dst + dst_len;
+
+	while (ip < iend) {
+		unsigned int token = *ip++;
+		size_t lit = token >> 4, ml = token & 0xf, off;
+
+		if (lit == 15 && read_length(&ip, iend, &lit))
+			goto truncated;
+		if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+			goto truncated;
+
+		if ((size_t)(iend - ip) >= lit + LZ4_CHUNK &&
+				(size_t)(oend - op) >= lit + LZ4_CHUNK)
+			wild_copy(op, ip, lit);
+		else
+			memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+
+		/* The final sequence has no match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			goto truncated;
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (off == 0 || off > (size_t)(op - dst)) {
+			fprintf(stderr, "LZ4: Bad match offset %zu\n", off);
+			return -1;
+		}
+
+		if (ml == 15 && read_length(&ip, iend, &ml))
+			goto truncated;
+		ml += LZ4_MIN_MATCH;
+		if (ml > (size_t)(oend - op)) {
+			fprintf(stderr, "LZ4: Match overruns output\n");
+			return -1;
+		}
+
+		if (off >= LZ4_CHUNK && (size_t)(oend - op) >= ml + LZ4_CHUNK) {
+			wild_copy(op, op - off, ml);
+			op += ml;
+		} else {
+			const uint8_t *s = op - off;
+			uint8_t *end = op + ml;
+			while (op < end)
+				*op++ = *s++;
+		}
+	}
+
+	if (op != oend) {
+		fprintf(stderr, "LZ4: Decompressed %zu bytes, expected %zu\n",
+				(size_t)(op - dst), dst_len);
+		return -1;
+	}
+
+	return 0;
+
+truncated:
+	fprintf(stderr, "LZ4: Truncated input\n");
+	return -1;
+}
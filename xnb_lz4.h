@@ -0,0 +1,19 @@
+/* LZ4 decompression for (MonoGame) XNB containers
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#ifndef __XNB_LZ4_H__
+#define __XNB_LZ4_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Decompress a raw LZ4 block stream (no frame header), as written by
+ * MonoGame. dst must be exactly the decompressed size from the header.
+ * Returns 0 on success, -1 on error.
+ */
+int lz4_decompress(const uint8_t *src, size_t src_len,
+		uint8_t *dst, size_t dst_len);
+
+#endif /* __XNB_LZ4_H__ */
@@ -0,0 +1,717 @@
+/* LZX decompression for XNB containers
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ *
+ * Based on the LZX decoder from libmspack (Stuart Caie) by way of
+ * MonoGame's LzxDecoder. XNA always uses a 64KiB window, and splits the
+ * stream into frames of (usually) 32KiB, each with its own small header:
+ *
+ *   [0xFF frame_size_hi frame_size_lo] block_size_hi block_size_lo
+ *
+ * The whole decompressed output is kept in the destination buffer, so
+ * that's used directly as the LZX window; matches just copy from earlier
+ * in the output and there's no wraparound to deal with.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xnb_lzx.h"
+
+#define LZX_MIN_MATCH              2
+#define LZX_NUM_CHARS              256
+#define LZX_NUM_PRIMARY_LENGTHS    7
+#define LZX_NUM_SECONDARY_LENGTHS  249
+
+#define LZX_PRETREE_MAXSYMBOLS     20
+#define LZX_PRETREE_TABLEBITS      6
+#define LZX_MAINTREE_MAXSYMBOLS    (LZX_NUM_CHARS + 50 * 8)
+#define LZX_MAINTREE_TABLEBITS     12
+#define LZX_LENGTH_MAXSYMBOLS      (LZX_NUM_SECONDARY_LENGTHS + 1)
+#define LZX_LENGTH_TABLEBITS       12
+#define LZX_ALIGNED_MAXSYMBOLS     8
+#define LZX_ALIGNED_TABLEBITS      7
+#define LZX_LENTABLE_SAFETY        64
+
+/* XNA content is always compressed with a 2^16 byte window */
+#define LZX_POSN_SLOTS             32
+#define LZX_MAIN_ELEMENTS          (LZX_NUM_CHARS + (LZX_POSN_SLOTS << 3))
+#define LZX_FRAME_SIZE             0x8000
+
+/* Intel E8 translation only applies to the first 32768 frames */
+#define LZX_E8_MAX_FRAMES          32768
+
+#define TABLE_SIZE(bits, syms) ((1 << (bits)) + ((syms) << 1))
+
+enum lzx_block_type {
+	LZX_BLOCK_INVALID      = 0,
+	LZX_BLOCK_VERBATIM     = 1,
+	LZX_BLOCK_ALIGNED      = 2,
+	LZX_BLOCK_UNCOMPRESSED = 3,
+};
+
+struct lzx_frame {
+	size_t start;
+	size_t size;
+	int intel_started;
+};
+
+struct lzx_state {
+	uint32_t R0, R1, R2;
+
+	int header_read;
+	int32_t intel_filesize;
+	int intel_started;
+
+	enum lzx_block_type block_type;
+	uint32_t block_length;
+	uint32_t block_remaining;
+
+	/* Only tracked if the stream asks for E8 translation */
+	struct lzx_frame *frames;
+	size_t n_frames;
+	size_t frames_alloc;
+
+	uint8_t pretree_len[LZX_PRETREE_MAXSYMBOLS + LZX_LENTABLE_SAFETY];
+	uint16_t pretree_table[TABLE_SIZE(LZX_PRETREE_TABLEBITS,
+			LZX_PRETREE_MAXSYMBOLS)];
+	uint8_t maintree_len[LZX_MAINTREE_MAXSYMBOLS + LZX_LENTABLE_SAFETY];
+	uint16_t maintree_table[TABLE_SIZE(LZX_MAINTREE_TABLEBITS,
+			LZX_MAINTREE_MAXSYMBOLS)];
+	uint8_t length_len[LZX_LENGTH_MAXSYMBOLS + LZX_LENTABLE_SAFETY];
+	uint16_t length_table[TABLE_SIZE(LZX_LENGTH_TABLEBITS,
+			LZX_LENGTH_MAXSYMBOLS)];
+	uint8_t aligned_len[LZX_ALIGNED_MAXSYMBOLS + LZX_LENTABLE_SAFETY];
+	uint16_t aligned_table[TABLE_SIZE(LZX_ALIGNED_TABLEBITS,
+			LZX_ALIGNED_MAXSYMBOLS)];
+};
+
+static uint8_t extra_bits[52];
+static uint32_t position_base[51];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void lzx_init_tables(void)
+{
+	int i, j;
+
+	for (i = 0, j = 0; i < 52; i += 2) {
+		extra_bits[i] = j;
+		extra_bits[i + 1] = j;
+		if (i != 0 && j < 17)
+			j++;
+	}
+
+	for (i = 0, j = 0; i < 51; i++) {
+		position_base[i] = j;
+		j += 1 << extra_bits[i];
+	}
+}
+
+/*
+ * Bitstream: 16-bit little-endian words, read most significant bit first.
+ * Reads past the end of the input return zeroes, and are counted so that
+ * we can tell a little lookahead apart from a truncated stream.
+ */
+struct lzx_bits {
+	const uint8_t *p;
+	const uint8_t *end;
+	uint32_t buf;
+	int left;
+	int overrun;
+};
+
+static void bits_init(struct lzx_bits *b, const uint8_t *p, const uint8_t *end)
+{
+	b->p = p;
+	b->end = end;
+	b->buf = 0;
+	b->left = 0;
+	b->overrun = 0;
+}
+
+static inline void bits_ensure(struct lzx_bits *b, int n)
+{
+	while (b->left < n) {
+		uint32_t w = 0;
+		if (b->end - b->p >= 2) {
+			w = b->p[0] | (b->p[1] << 8);
+			b->p += 2;
+		} else {
+			if (b->p < b->end)
+				w = b->p[0];
+			b->p = b->end;
+			b->overrun += 2;
+		}
+		b->buf |= w << (16 - b->left);
+		b->left += 16;
+	}
+}
+
+static inline uint32_t bits_peek(struct lzx_bits *b, int n)
+{
+	return b->buf >> (32 - n);
+}
+
+static inline void bits_remove(struct lzx_bits *b, int n)
+{
+	b->buf <<= n;
+	b->left -= n;
+}
+
+static inline uint32_t bits_read(struct lzx_bits *b, int n)
+{
+	uint32_t v;
+
+	if (!n)
+		return 0;
+	bits_ensure(b, n);
+	v = bits_peek(b, n);
+	bits_remove(b, n);
+	return v;
+}
+
+/*
+ * Build a fast lookup table for a canonical Huffman code. Codes of up to
+ * nbits are looked up directly; longer ones continue as a binary tree in
+ * the space after the direct entries.
+ * Returns 0 on success, -1 if the lengths don't describe a valid code.
+ */
+static int make_decode_table(unsigned int nsyms, unsigned int nbits,
+		const uint8_t *length, uint16_t *table)
+{
+	uint32_t pos = 0;
+	uint32_t table_mask = 1 << nbits;
+	uint32_t bit_mask = table_mask >> 1;
+	uint32_t next_symbol = bit_mask;
+	uint32_t leaf, fill, sym;
+	unsigned int bit_num;
+
+	for (bit_num = 1; bit_num <= nbits; bit_num++) {
+		for (sym = 0; sym < nsyms; sym++) {
+			if (length[sym] != bit_num)
+				continue;
+			leaf = pos;
+			pos += bit_mask;
+			if (pos > table_mask)
+				return -1;
+			for (fill = bit_mask; fill-- > 0; )
+				table[leaf++] = sym;
+		}
+		bit_mask >>= 1;
+	}
+
+	if (pos == table_mask)
+		return 0;
+
+	for (sym = pos; sym < table_mask; sym++)
+		table[sym] = 0xFFFF;
+
+	pos <<= 16;
+	table_mask <<= 16;
+	bit_mask = 1 << 15;
+
+	for (bit_num = nbits + 1; bit_num <= 16; bit_num++) {
+		for (sym = 0; sym < nsyms; sym++) {
+			if (length[sym] != bit_num)
+				continue;
+			leaf = pos >> 16;
+			for (fill = 0; fill < bit_num - nbits; fill++) {
+				if (table[leaf] == 0xFFFF) {
+					if ((next_symbol << 1) + 1 >=
+							TABLE_SIZE(nbits, nsyms))
+						return -1;
+					table[next_symbol << 1] = 0xFFFF;
+					table[(next_symbol << 1) + 1] = 0xFFFF;
+					table[leaf] = next_symbol++;
+				}
+				leaf = table[leaf] << 1;
+				if ((pos >> (15 - fill)) & 1)
+					leaf++;
+			}
+			table[leaf] = sym;
+			pos += bit_mask;
+			if (pos > table_mask)
+				return -1;
+		}
+		bit_mask >>= 1;
+	}
+
+	if (pos == table_mask)
+		return 0;
+
+	/*
+	 * An empty code is fine, but it could still be used, so make every
+	 * lookup give symbol 0, which has length 0 and so uses no bits
+	 */
+	for (sym = 0; sym < nsyms; sym++)
+		if (length[sym])
+			return -1;
+	memset(table, 0, sizeof(*table) << nbits);
+
+	return 0;
+}
+
+/* Returns the decoded symbol, or -1 on error */
+static inline int read_huffsym(struct lzx_bits *b, const uint16_t *table,
+		const uint8_t *length, unsigned int nsyms, unsigned int nbits)
+{
+	uint32_t sym, i;
+
+	bits_ensure(b, 16);
+	sym = table[bits_peek(b, nbits)];
+	if (sym >= nsyms) {
+		i = 1 << (32 - nbits);
+		do {
+			i >>= 1;
+			if (!i || (sym << 1) + 1 >= TABLE_SIZE(nbits, nsyms))
+				return -1;
+			sym = table[(sym << 1) | ((b->buf & i) ? 1 : 0)];
+		} while (sym >= nsyms);
+	}
+	bits_remove(b, length[sym]);
+
+	return sym;
+}
+
+/* Read the delta-coded lengths for symbols [first, last) */
+static int read_lengths(struct lzx_state *lzx, struct lzx_bits *b,
+		uint8_t *lens, unsigned int first, unsigned int last)
+{
+	unsigned int x;
+	int y, z;
+
+	for (x = 0; x < LZX_PRETREE_MAXSYMBOLS; x++)
+		lzx->pretree_len[x] = bits_read(b, 4);
+
+	if (make_decode_table(LZX_PRETREE_MAXSYMBOLS, LZX_PRETREE_TABLEBITS,
+				lzx->pretree_len, lzx->pretree_table))
+		return -1;
+
+#define PRETREE_SYM() read_huffsym(b, lzx->pretree_table, lzx->pretree_len, \
+		LZX_PRETREE_MAXSYMBOLS, LZX_PRETREE_TABLEBITS)
+
+	for (x = first; x < last; ) {
+		z = PRETREE_SYM();
+		if (z < 0) {
+			return -1;
+		} else if (z == 17) {
+			y = bits_read(b, 4) + 4;
+			if (x + y > last + LZX_LENTABLE_SAFETY)
+				return -1;
+			while (y--)
+				lens[x++] = 0;
+		} else if (z == 18) {
+			y = bits_read(b, 5) + 20;
+			if (x + y > last + LZX_LENTABLE_SAFETY)
+				return -1;
+			while (y--)
+				lens[x++] = 0;
+		} else if (z == 19) {
+			y = bits_read(b, 1) + 4;
+			if (x + y > last + LZX_LENTABLE_SAFETY)
+				return -1;
+			z = PRETREE_SYM();
+			if (z < 0)
+				return -1;
+			z = lens[x] - z;
+			if (z < 0)
+				z += 17;
+			while (y--)
+				lens[x++] = z;
+		} else {
+			z = lens[x] - z;
+			if (z < 0)
+				z += 17;
+			lens[x++] = z;
+		}
+	}
+
+#undef PRETREE_SYM
+
+	return 0;
+}
+
+static int read_block_header(struct lzx_state *lzx, struct lzx_bits *b)
+{
+	uint32_t i, j;
+	uint8_t r[12];
+
+	/* Uncompressed blocks are padded back to a 16-bit boundary */
+	if (lzx->block_type == LZX_BLOCK_UNCOMPRESSED) {
+		if ((lzx->block_length & 1) && b->p < b->end)
+			b->p++;
+		bits_init(b, b->p, b->end);
+	}
+
+	lzx->block_type = bits_read(b, 3);
+	i = bits_read(b, 16);
+	j = bits_read(b, 8);
+	lzx->block_remaining = lzx->block_length = (i << 8) | j;
+
+	switch (lzx->block_type) {
+	case LZX_BLOCK_ALIGNED:
+		for (i = 0; i < 8; i++)
+			lzx->aligned_len[i] = bits_read(b, 3);
+		if (make_decode_table(LZX_ALIGNED_MAXSYMBOLS,
+					LZX_ALIGNED_TABLEBITS, lzx->aligned_len,
+					lzx->aligned_table)) {
+			fprintf(stderr, "LZX: Bad aligned offset tree\n");
+			return -1;
+		}
+		/* Fallthrough - the rest is the same as verbatim */
+	case LZX_BLOCK_VERBATIM:
+		if (read_lengths(lzx, b, lzx->maintree_len, 0, LZX_NUM_CHARS) ||
+				read_lengths(lzx, b, lzx->maintree_len, LZX_NUM_CHARS,
+					LZX_MAIN_ELEMENTS) ||
+				make_decode_table(LZX_MAINTREE_MAXSYMBOLS,
+					LZX_MAINTREE_TABLEBITS, lzx->maintree_len,
+					lzx->maintree_table)) {
+			fprintf(stderr, "LZX: Bad main tree\n");
+			return -1;
+		}
+		if (lzx->maintree_len[0xE8])
+			lzx->intel_started = 1;
+
+		if (read_lengths(lzx, b, lzx->length_len, 0,
+					LZX_NUM_SECONDARY_LENGTHS) ||
+				make_decode_table(LZX_LENGTH_MAXSYMBOLS,
+					LZX_LENGTH_TABLEBITS, lzx->length_len,
+					lzx->length_table)) {
+			fprintf(stderr, "LZX: Bad length tree\n");
+			return -1;
+		}
+		break;
+	case LZX_BLOCK_UNCOMPRESSED:
+		lzx->intel_started = 1;
+		/* Skip 1-16 bits of padding to get back to the byte stream */
+		bits_ensure(b, 16);
+		if (b->left > 16)
+			b->p -= 2;
+		b->buf = 0;
+		b->left = 0;
+		if (b->end - b->p < (long)sizeof(r)) {
+			fprintf(stderr, "LZX: Truncated uncompressed block\n");
+			return -1;
+		}
+		memcpy(r, b->p, sizeof(r));
+		b->p += sizeof(r);
+		lzx->R0 = r[0] | (r[1] << 8) | (r[2] << 16) | ((uint32_t)r[3] << 24);
+		lzx->R1 = r[4] | (r[5] << 8) | (r[6] << 16) | ((uint32_t)r[7] << 24);
+		lzx->R2 = r[8] | (r[9] << 8) | (r[10] << 16) | ((uint32_t)r[11] << 24);
+		break;
+	default:
+		fprintf(stderr, "LZX: Bad block type %d\n", lzx->block_type);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Decode matches and literals from a verbatim or aligned block into
+ * dst[*posp...], until at least run bytes have been produced. The last match
+ * may run past that, which is fine as long as it stays inside the block.
+ */
+static int decode_run(struct lzx_state *lzx, struct lzx_bits *b,
+		uint8_t *dst, size_t dst_len, size_t *posp, uint32_t run)
+{
+	const int aligned = lzx->block_type == LZX_BLOCK_ALIGNED;
+	uint32_t R0 = lzx->R0, R1 = lzx->R1, R2 = lzx->R2;
+	size_t pos = *posp, end = pos + run;
+
+	while (pos < end) {
+		int main_element, length_footer, extra;
+		uint32_t match_length, match_offset;
+
+		main_element = read_huffsym(b, lzx->maintree_table,
+				lzx->maintree_len, LZX_MAINTREE_MAXSYMBOLS,
+				LZX_MAINTREE_TABLEBITS);
+		if (main_element < 0) {
+			fprintf(stderr, "LZX: Bad main tree symbol\n");
+			return -1;
+		}
+
+		if (main_element < LZX_NUM_CHARS) {
+			dst[pos++] = main_element;
+			continue;
+		}
+
+		main_element -= LZX_NUM_CHARS;
+		match_length = main_element & LZX_NUM_PRIMARY_LENGTHS;
+		if (match_length == LZX_NUM_PRIMARY_LENGTHS) {
+			length_footer = read_huffsym(b, lzx->length_table,
+					lzx->length_len, LZX_LENGTH_MAXSYMBOLS,
+					LZX_LENGTH_TABLEBITS);
+			if (length_footer < 0) {
+				fprintf(stderr, "LZX: Bad length tree symbol\n");
+				return -1;
+			}
+			match_length += length_footer;
+		}
+		match_length += LZX_MIN_MATCH;
+
+		match_offset = main_element >> 3;
+		if (match_offset > 2) {
+			extra = extra_bits[match_offset];
+			if (!aligned) {
+				if (match_offset != 3)
+					match_offset = position_base[match_offset] - 2 +
+						bits_read(b, extra);
+				else
+					match_offset = 1;
+			} else {
+				match_offset = position_base[match_offset] - 2;
+				if (extra >= 3) {
+					int sym;
+					match_offset += bits_read(b, extra - 3) << 3;
+					sym = read_huffsym(b, lzx->aligned_table,
+							lzx->aligned_len, LZX_ALIGNED_MAXSYMBOLS,
+							LZX_ALIGNED_TABLEBITS);
+					if (sym < 0) {
+						fprintf(stderr, "LZX: Bad aligned tree symbol\n");
+						return -1;
+					}
+					match_offset += sym;
+				} else if (extra > 0) {
+					match_offset += bits_read(b, extra);
+				} else {
+					match_offset = 1;
+				}
+			}
+			R2 = R1;
+			R1 = R0;
+			R0 = match_offset;
+		} else if (match_offset == 0) {
+			match_offset = R0;
+		} else if (match_offset == 1) {
+			match_offset = R1;
+			R1 = R0;
+			R0 = match_offset;
+		} else {
+			match_offset = R2;
+			R2 = R0;
+			R0 = match_offset;
+		}
+
+		if (match_offset == 0 || match_offset > pos ||
+				match_length > dst_len - pos) {
+			fprintf(stderr, "LZX: Match out of range\n");
+			return -1;
+		}
+
+		if (match_offset == 1) {
+			memset(dst + pos, dst[pos - 1], match_length);
+		} else if (match_offset >= match_length) {
+			memcpy(dst + pos, dst + pos - match_offset, match_length);
+		} else {
+			uint8_t *d = dst + pos;
+			const uint8_t *s = d - match_offset;
+			uint32_t i;
+			for (i = 0; i < match_length; i++)
+				d[i] = s[i];
+		}
+		pos += match_length;
+	}
+
+	if (pos - *posp > lzx->block_remaining) {
+		fprintf(stderr, "LZX: Match overran block\n");
+		return -1;
+	}
+	lzx->block_remaining -= pos - *posp;
+	lzx->R0 = R0;
+	lzx->R1 = R1;
+	lzx->R2 = R2;
+	*posp = pos;
+
+	return 0;
+}
+
+/* Decode one XNB frame, until dst is filled up to frame_end */
+static int decode_frame(struct lzx_state *lzx, struct lzx_bits *b,
+		uint8_t *dst, size_t dst_len, size_t *posp, size_t frame_end)
+{
+	size_t pos = *posp;
+
+	if (!lzx->header_read) {
+		if (bits_read(b, 1)) {
+			uint32_t hi = bits_read(b, 16);
+			uint32_t lo = bits_read(b, 16);
+			lzx->intel_filesize = (hi << 16) | lo;
+		}
+		lzx->header_read = 1;
+	}
+
+	while (pos < frame_end) {
+		uint32_t run;
+
+		if (lzx->block_remaining == 0) {
+			if (read_block_header(lzx, b))
+				return -1;
+			continue;
+		}
+
+		run = lzx->block_remaining;
+		if (run > frame_end - pos)
+			run = frame_end - pos;
+
+		if (lzx->block_type == LZX_BLOCK_UNCOMPRESSED) {
+			if ((size_t)(b->end - b->p) < run) {
+				fprintf(stderr, "LZX: Truncated uncompressed block\n");
+				return -1;
+			}
+			memcpy(dst + pos, b->p, run);
+			b->p += run;
+			pos += run;
+			lzx->block_remaining -= run;
+		} else if (decode_run(lzx, b, dst, dst_len, &pos, run)) {
+			return -1;
+		}
+	}
+
+	/* A little lookahead past the end is normal, more means corruption */
+	if (b->overrun > 4) {
+		fprintf(stderr, "LZX: Frame overran its input\n");
+		return -1;
+	}
+
+	*posp = pos;
+	return 0;
+}
+
+static int record_frame(struct lzx_state *lzx, size_t start, size_t size)
+{
+	struct lzx_frame *f;
+
+	if (lzx->n_frames == lzx->frames_alloc) {
+		size_t n = lzx->frames_alloc ? lzx->frames_alloc * 2 : 64;
+		f = realloc(lzx->frames, sizeof(*f) * n);
+		if (!f)
+			return -1;
+		lzx->frames = f;
+		lzx->frames_alloc = n;
+	}
+
+	f = &lzx->frames[lzx->n_frames++];
+	f->start = start;
+	f->size = size;
+	f->intel_started = lzx->intel_started;
+	return 0;
+}
+
+/*
+ * Undo the E8 (x86 CALL) translation. This has to wait until everything
+ * has been decoded, because later matches refer to the untranslated data.
+ */
+static void intel_e8_decode(struct lzx_state *lzx, uint8_t *dst)
+{
+	size_t i;
+
+	for (i = 0; i < lzx->n_frames && i < LZX_E8_MAX_FRAMES; i++) {
+		struct lzx_frame *f = &lzx->frames[i];
+		uint8_t *data = dst + f->start;
+		uint8_t *dataend = data + f->size - 10;
+		int32_t curpos = f->start;
+		int32_t filesize = lzx->intel_filesize;
+
+		if (!f->intel_started || f->size <= 10)
+			continue;
+
+		while (data < dataend) {
+			int32_t abs_off, rel_off;
+
+			if (*data++ != 0xE8) {
+				curpos++;
+				continue;
+			}
+			abs_off = data[0] | (data[1] << 8) | (data[2] << 16) |
+				((uint32_t)data[3] << 24);
+			if (abs_off >= -curpos && abs_off < filesize) {
+				rel_off = (abs_off >= 0) ? abs_off - curpos :
+					abs_off + filesize;
+				data[0] = rel_off;
+				data[1] = rel_off >> 8;
+				data[2] = rel_off >> 16;
+				data[3] = rel_off >> 24;
+			}
+			data += 4;
+			curpos += 5;
+		}
+	}
+}
+
+int lzx_decompress(const uint8_t *src, size_t src_len,
+		uint8_t *dst, size_t dst_len)
+{
+	struct lzx_state *lzx;
+	struct lzx_bits bits;
+	size_t in = 0, frame_start = 0, pos = 0;
+	int res = -1;
+
+	pthread_once(&tables_once, lzx_init_tables);
+
+	lzx = calloc(1, sizeof(*lzx));
+	if (!lzx) {
+		fprintf(stderr, "LZX: Couldn't alloc decoder state\n");
+		return -1;
+	}
+	lzx->R0 = lzx->R1 = lzx->R2 = 1;
+
+	while (in + 2 <= src_len) {
+		uint32_t block_size, frame_size = LZX_FRAME_SIZE;
+		uint8_t hi = src[in], lo = src[in + 1];
+
+		if (hi == 0xFF) {
+			if (in + 5 > src_len)
+				break;
+			frame_size = (lo << 8) | src[in + 2];
+			block_size = (src[in + 3] << 8) | src[in + 4];
+			in += 5;
+		} else {
+			block_size = (hi << 8) | lo;
+			in += 2;
+		}
+
+		if (!block_size || !frame_size)
+			break;
+
+		if (block_size > src_len - in) {
+			fprintf(stderr, "LZX: Truncated frame\n");
+			goto done;
+		}
+		if (frame_size > dst_len - frame_start) {
+			fprintf(stderr, "LZX: Frame overruns decompressed size\n");
+			goto done;
+		}
+
+		bits_init(&bits, src + in, src + in + block_size);
+		if (decode_frame(lzx, &bits, dst, dst_len, &pos,
+					frame_start + frame_size))
+			goto done;
+
+		if (lzx->intel_filesize &&
+				record_frame(lzx, frame_start, frame_size)) {
+			fprintf(stderr, "LZX: Couldn't alloc frame list\n");
+			goto done;
+		}
+
+		in += block_size;
+		frame_start += frame_size;
+	}
+
+	if (frame_start != dst_len || pos != dst_len) {
+		fprintf(stderr, "LZX: Decompressed %zu bytes, expected %zu\n",
+				pos, dst_len);
+		goto done;
+	}
+
+	if (lzx->intel_filesize)
+		intel_e8_decode(lzx, dst);
+
+	res = 0;
+
+done:
+	free(lzx->frames);
+	free(lzx);
+	return res;
+}
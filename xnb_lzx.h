@@ -0,0 +1,20 @@
+/* LZX decompression for XNB containers
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#ifndef __XNB_LZX_H__
+#define __XNB_LZX_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Decompress the LZX stream which follows the header of a compressed XNB
+ * file. dst must be exactly the decompressed size from the header, and is
+ * also used as the LZX window, so no other buffers are needed.
+ * Returns 0 on success, -1 on error.
+ */
+int lzx_decompress(const uint8_t *src, size_t src_len,
+		uint8_t *dst, size_t dst_len);
+
+#endif /* __XNB_LZX_H__ */
@@ -3,10 +3,17 @@
  */
 
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "xnb_adpcm.h"
+#include "xnb_audio.h"
 #include "xnb_object.h"
+#include "xnb_pool.h"
 
 struct waveformatex {
   uint16_t wFormatTag;
@@ -21,11 +28,15 @@ struct waveformatex {
 struct xnb_obj_sound_effect {
 	struct xnb_object_head head;
 
+	/*
+	 * format and data point straight into the input buffer, which must
+	 * outlive the object
+	 */
 	uint32_t format_size;
 	/* A struct waveformatex, possibly extended */
-	uint8_t *format;
+	const uint8_t *format;
 	uint32_t data_size;
-	uint8_t *data;
+	struct xnb_blob data;
 	/* In bytes */
 	int32_t loop_start;
 	int32_t loop_length;
@@ -33,236 +44,466 @@ struct xnb_obj_sound_effect {
 	int32_t	duration;
 };
 
-static void dump_waveformatex(struct waveformatex *format)
+static void dump_waveformatex(struct waveformatex *format, FILE *out)
 {
-	printf("[WAVEFORMATEX]\n");
-	printf("wFormatTag: 0x%x\n", format->wFormatTag);
-	printf("nChannels: %d\n", format->nChannels);
-	printf("nSamplesPerSec: %d\n", format->nSamplesPerSec);
-	printf("nAvgBytesPerSec %d\n", format->nAvgBytesPerSec);
-	printf("nBlockAlign %d\n", format->nBlockAlign);
-	printf("wBitsPerSample %d\n", format->wBitsPerSample);
-	printf("cbSize %d\n", format->cbSize);
-	printf("--------------\n");
+	fprintf(out, "[WAVEFORMATEX]\n");
+	fprintf(out, "wFormatTag: 0x%x\n", format->wFormatTag);
+	fprintf(out, "nChannels: %d\n", format->nChannels);
+	fprintf(out, "nSamplesPerSec: %d\n", format->nSamplesPerSec);
+	fprintf(out, "nAvgBytesPerSec %d\n", format->nAvgBytesPerSec);
+	fprintf(out, "nBlockAlign %d\n", format->nBlockAlign);
+	fprintf(out, "wBitsPerSample %d\n", format->wBitsPerSample);
+	fprintf(out, "cbSize %d\n", format->cbSize);
+	fprintf(out, "--------------\n");
 }
 
-static int sound_effect_export(struct xnb_object_head *obj,
-		char *basename)
+/* format may be shorter than a full waveformatex, and isn't aligned */
+static void get_waveformatex(struct xnb_obj_sound_effect *eff,
+		struct waveformatex *fmt)
 {
-	FILE *fp;
-	char filename[MAX_NAME_LEN];
-	uint32_t u32buf;
-	uint16_t u16buf;
-	size_t wrote;
-	struct xnb_obj_sound_effect *eff = (struct xnb_obj_sound_effect *)obj;
-	struct waveformatex *fmt = (struct waveformatex *)eff->format;
+	size_t size = eff->format_size;
+
+	memset(fmt, 0, sizeof(*fmt));
+	if (size > sizeof(*fmt))
+		size = sizeof(*fmt);
+	memcpy(fmt, eff->format, size);
+}
+
+#define WAV_HEADER_SIZE 44
+
+static void build_wav_header(uint8_t *hdr, struct waveformatex *fmt,
+		uint32_t data_size)
+{
+	memcpy(hdr, "RIFF", 4);
+	/* ChunkSize, including the pad byte after an odd-sized data chunk */
+	put_le32(hdr + 4, WAV_HEADER_SIZE - 8 + data_size + (data_size & 1));
+	memcpy(hdr + 8, "WAVE", 4);
+	memcpy(hdr + 12, "fmt ", 4);
+	/* SubChunk1Size */
+	put_le32(hdr + 16, 16);
+	/* AudioFormat */
+	put_le16(hdr + 20, fmt->wFormatTag);
+	put_le16(hdr + 22, fmt->nChannels);
+	put_le32(hdr + 24, fmt->nSamplesPerSec);
+	/* ByteRate */
+	put_le32(hdr + 28, fmt->nAvgBytesPerSec);
+	put_le16(hdr + 32, fmt->nBlockAlign);
+	put_le16(hdr + 34, fmt->wBitsPerSample);
+	memcpy(hdr + 36, "data", 4);
+	/* SubChunk2Size */
+	put_le32(hdr + 40, data_size);
+}
+
+/* Where 16-bit PCM goes: straight to the file, or through a converter */
+struct pcm_sink {
+	int fd;
+	struct audio_conv *conv;
+	int channels;
+};
+
+static int pcm_sink_write(struct pcm_sink *sink, const void *pcm,
+		size_t frames)
+{
+	if (sink->conv)
+		return audio_conv_write(sink->conv, sink->fd, pcm, frames);
+	return export_write(sink->fd, pcm, frames * sink->channels * 2);
+}
+
+/* Roughly how much PCM each thread decodes before it's written out */
+#define ADPCM_THREAD_BYTES (1 << 20)
+
+/*
+ * Consecutive ADPCM blocks, one pool job per block, decoded a round at a
+ * time. The pool lasts for the whole export: its workers wait in
+ * adpcm_more() while each round is written out, then carry on with the next.
+ */
+struct adpcm_round {
+	const struct adpcm_format *fmt;
+	const uint8_t *src;
+	size_t src_len;
+	int16_t *dst;
+	/* The block decoded into the start of dst */
+	size_t first;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Jobs (blocks) handed to the pool, and finished, so far */
+	int published;
+	int completed;
+	bool finished;
+	int failed;
+};
+
+static void adpcm_round_job(void *arg, int worker, int job)
+{
+	struct adpcm_round *r = arg;
+	size_t offset = (size_t)job * r->fmt->block_align;
+	size_t len = r->src_len - offset;
+	int16_t *dst = r->dst +
+		(job - r->first) * r->fmt->frames_per_block * r->fmt->channels;
+	int failed = 0;
+
+	if (len > r->fmt->block_align)
+		len = r->fmt->block_align;
+
+	if (adpcm_decode_block(r->fmt, r->src + offset, len, dst))
+		failed = 1;
+
+	pthread_mutex_lock(&r->lock);
+	r->failed |= failed;
+	if (++r->completed == r->published)
+		pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* Wait for write_adpcm_data() to publish the next round */
+static int adpcm_more(void *arg, int n_jobs)
+{
+	struct adpcm_round *r = arg;
+	int total;
+
+	pthread_mutex_lock(&r->lock);
+	while (r->published == n_jobs && !r->finished)
+		pthread_cond_wait(&r->cond, &r->lock);
+	total = r->published;
+	pthread_mutex_unlock(&r->lock);
+
+	return total;
+}
+
+/*
+ * Decode ADPCM data to 16-bit PCM and pass it to sink, a batch of blocks at
+ * a time. Blocks are independent, so each batch is spread over threads.
+ */
+static int write_adpcm_data(struct pcm_sink *sink,
+		const struct adpcm_format *fmt,
+		const struct xnb_blob *data, int threads)
+{
+	size_t frame_bytes = (size_t)fmt->channels * 2;
+	size_t block_bytes = fmt->frames_per_block * frame_bytes;
+	size_t n_blocks = (data->size + fmt->block_align - 1) / fmt->block_align;
+	size_t per_round, done = 0;
+	struct xnb_pool *pool = NULL;
+	struct adpcm_round r = {
+		.fmt = fmt,
+		.src = data->data,
+		.src_len = data->size,
+	};
 	int res = -1;
 
-	assert(obj->type == XNB_OBJ_SOUND_EFFECT);
-	snprintf(filename, MAX_NAME_LEN, "%s.wav", basename);
-	fp = fopen(filename, "w");
-	if (!fp) {
-		fprintf(stderr, "Couldn't open file\n");
+	if (!data->data) {
+		fprintf(stderr, "Payload wasn't loaded (metadata-only read)\n");
 		return res;
 	}
 
-	wrote = fputs("RIFF", fp);
-	if (wrote == EOF) {
-		fprintf(stderr, "Couldn't write RIFF\n");
-		goto done;
+	if (threads < 1)
+		threads = 1;
+	per_round = ADPCM_THREAD_BYTES / block_bytes + 1;
+	per_round *= threads;
+	if (per_round > n_blocks)
+		per_round = n_blocks;
+	if (n_blocks > INT_MAX) {
+		fprintf(stderr, "Too many ADPCM blocks\n");
+		return res;
 	}
 
-	u32buf = 36 + eff->data_size;
-	wrote = fwrite(&u32buf, sizeof(u32buf), 1, fp);
-	if (wrote != 1) {
-		fprintf(stderr, "Couldn't write ChunkSize\n");
-		goto done;
+	r.dst = malloc(per_round * block_bytes);
+	if (!r.dst && per_round) {
+		fprintf(stderr, "Couldn't allocate PCM buffer\n");
+		return res;
 	}
+	pthread_mutex_init(&r.lock, NULL);
+	pthread_cond_init(&r.cond, NULL);
 
-	wrote = fputs("WAVE", fp);
-	if (wrote == EOF) {
-		fprintf(stderr, "Couldn't write WAVE\n");
-		goto done;
+	if (threads > 1 && per_round > 1) {
+		pool = pool_create_stream(threads, adpcm_round_job, adpcm_more, &r);
+		if (!pool)
+			goto done;
 	}
 
-	wrote = fputs("fmt ", fp);
-	if (wrote == EOF) {
-		fprintf(stderr, "Couldn't write fmt\n");
-		goto done;
+	while (done < n_blocks) {
+		size_t n = n_blocks - done < per_round ? n_blocks - done : per_round;
+		size_t frames, i;
+
+		pthread_mutex_lock(&r.lock);
+		r.first = done;
+		r.published = done + n;
+		if (pool) {
+			pthread_cond_broadcast(&r.cond);
+			while (r.completed < r.published)
+				pthread_cond_wait(&r.cond, &r.lock);
+		}
+		pthread_mutex_unlock(&r.lock);
+
+		if (!pool) {
+			for (i = done; i < done + n; i++)
+				adpcm_round_job(&r, 0, i);
+		}
+		if (r.failed) {
+			fprintf(stderr, "Couldn't decode ADPCM block\n");
+			goto done;
+		}
+
+		/* Only the very last block can be short */
+		frames = (n - 1) * fmt->frames_per_block;
+		frames += adpcm_block_frames(fmt,
+				data->size - (done + n - 1) * fmt->block_align);
+		if (pcm_sink_write(sink, r.dst, frames))
+			goto done;
+
+		done += n;
 	}
 
-	u32buf = 16;
-	wrote = fwrite(&u32buf, sizeof(u32buf), 1, fp);
-	if (wrote != 1) {
-		fprintf(stderr, "Couldn't write SubChunk1Size\n");
-		goto done;
-	}
+	res = 0;
 
-	u16buf = 1;
-	wrote = fwrite(&u16buf, sizeof(u16buf), 1, fp);
-	if (wrote != 1) {
-		fprintf(stderr, "Couldn't write AudioFormat\n");
-		goto done;
+done:
+	if (pool) {
+		pthread_mutex_lock(&r.lock);
+		r.finished = true;
+		pthread_cond_broadcast(&r.cond);
+		pthread_mutex_unlock(&r.lock);
+		pool_join(pool);
 	}
+	pthread_cond_destroy(&r.cond);
+	pthread_mutex_destroy(&r.lock);
+	free(r.dst);
+	return res;
+}
 
-	u16buf = fmt->nChannels;
-	wrote = fwrite(&u16buf, sizeof(u16buf), 1, fp);
-	if (wrote != 1) {
-		fprintf(stderr, "Couldn't write NumChannels\n");
-		goto done;
-	}
+/* Frames of PCM that size bytes of ADPCM will decode to */
+static size_t adpcm_total_frames(const struct adpcm_format *fmt, size_t size)
+{
+	size_t full = size / fmt->block_align;
 
-	u32buf = fmt->nSamplesPerSec;
-	wrote = fwrite(&u32buf, sizeof(u32buf), 1, fp);
-	if (wrote != 1) {
-		fprintf(stderr, "Couldn't write SampleRate\n");
-		goto done;
-	}
+	return full * fmt->frames_per_block +
+		adpcm_block_frames(fmt, size % fmt->block_align);
+}
 
-	u32buf = fmt->nAvgBytesPerSec;
-	wrote = fwrite(&u32buf, sizeof(u32buf), 1, fp);
-	if (wrote != 1) {
-		fprintf(stderr, "Couldn't write ByteRate\n");
-		goto done;
+/* Send the source PCM through the converter, a piece at a time */
+static int write_pcm_data(struct pcm_sink *sink, const struct xnb_blob *data)
+{
+	size_t frame_bytes = sink->channels * 2;
+	size_t frames = data->size / frame_bytes;
+
+	if (!data->data) {
+		fprintf(stderr, "Payload wasn't loaded (metadata-only read)\n");
+		return -1;
 	}
 
-	u16buf = fmt->nBlockAlign;
-	wrote = fwrite(&u16buf, sizeof(u16buf), 1, fp);
-	if (wrote != 1) {
-		fprintf(stderr, "Couldn't write BlockAlign\n");
-		goto done;
+	return pcm_sink_write(sink, data->data, frames);
+}
+
+/*
+ * Work out whether the export options need a conversion, and if so set up
+ * the converter and change format to describe its output
+ */
+static int setup_conversion(const struct xnb_export_opts *opts,
+		struct waveformatex *format, uint64_t in_frames,
+		struct audio_conv **conv)
+{
+	struct audio_conv_params p = {
+		.in_rate = format->nSamplesPerSec,
+		.in_channels = format->nChannels,
+		.in_frames = in_frames,
+		.out_rate = opts->sample_rate ? opts->sample_rate :
+			format->nSamplesPerSec,
+		.out_channels = opts->channels ? opts->channels : format->nChannels,
+		.out_format = opts->sample_format,
+	};
+	int bytes = p.out_format == AUDIO_F32 ? 4 : 2;
+
+	*conv = NULL;
+	if (p.out_rate == p.in_rate && p.out_channels == p.in_channels &&
+			p.out_format == AUDIO_S16)
+		return 0;
+
+	if (format->wBitsPerSample != 16) {
+		fprintf(stderr, "Can't convert %d-bit audio\n",
+				format->wBitsPerSample);
+		return -1;
 	}
 
-	u16buf = fmt->wBitsPerSample;
-	wrote = fwrite(&u16buf, sizeof(u16buf), 1, fp);
-	if (wrote != 1) {
-		fprintf(stderr, "Couldn't write BitsPerSample\n");
-		goto done;
+	*conv = audio_conv_create(&p);
+	if (!*conv)
+		return -1;
+
+	format->wFormatTag = p.out_format == AUDIO_F32 ?
+		WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+	format->nChannels = p.out_channels;
+	format->nSamplesPerSec = p.out_rate;
+	format->wBitsPerSample = bytes * 8;
+	format->nBlockAlign = p.out_channels * bytes;
+	format->nAvgBytesPerSec = p.out_rate * format->nBlockAlign;
+
+	return 0;
+}
+
+static int sound_effect_export(struct xnb_object_head *obj,
+		const struct xnb_export_opts *opts, char *basename)
+{
+	uint8_t hdr[WAV_HEADER_SIZE];
+	struct xnb_obj_sound_effect *eff = (struct xnb_obj_sound_effect *)obj;
+	struct waveformatex format;
+	struct adpcm_format adpcm;
+	struct pcm_sink sink = { 0 };
+	bool decode = false;
+	uint64_t in_frames = 0, data_size;
+	int fd, res = -1;
+
+	assert(obj->type == XNB_OBJ_SOUND_EFFECT);
+	get_waveformatex(eff, &format);
+
+	switch (format.wFormatTag) {
+	case WAVE_FORMAT_PCM:
+		if (format.nBlockAlign)
+			in_frames = eff->data_size / format.nBlockAlign;
+		break;
+	case WAVE_FORMAT_ADPCM:
+	case WAVE_FORMAT_IMA_ADPCM:
+		if (adpcm_parse_format(eff->format, eff->format_size, &adpcm)) {
+			fprintf(stderr, "Unsupported ADPCM format\n");
+			return res;
+		}
+		/* Decoded to 16-bit PCM */
+		decode = true;
+		format.wFormatTag = WAVE_FORMAT_PCM;
+		format.wBitsPerSample = 16;
+		format.nBlockAlign = format.nChannels * 2;
+		format.nAvgBytesPerSec = format.nSamplesPerSec * format.nBlockAlign;
+		in_frames = adpcm_total_frames(&adpcm, eff->data_size);
+		break;
+	default:
+		fprintf(stderr, "Can't export audio format 0x%x\n",
+				format.wFormatTag);
+		return res;
 	}
 
-	wrote = fputs("data", fp);
-	if (wrote == EOF) {
-		fprintf(stderr, "Couldn't write 'data'\n");
+	sink.channels = format.nChannels;
+	if (setup_conversion(opts, &format, in_frames, &sink.conv))
+		return res;
+
+	if (sink.conv)
+		data_size = audio_conv_out_frames(sink.conv) * format.nBlockAlign;
+	else if (decode)
+		data_size = in_frames * format.nBlockAlign;
+	else
+		data_size = eff->data_size;
+	if (data_size > UINT32_MAX - WAV_HEADER_SIZE - 1) {
+		fprintf(stderr, "Audio is too big for a WAV file\n");
 		goto done;
 	}
+	build_wav_header(hdr, &format, data_size);
 
-	u32buf = eff->data_size;
-	wrote = fwrite(&u32buf, sizeof(u32buf), 1, fp);
-	if (wrote != 1) {
-		fprintf(stderr, "Couldn't write SubChunk2Size\n");
+	fd = export_create(opts, basename, "wav");
+	if (fd < 0)
 		goto done;
+	sink.fd = fd;
+
+	if (export_write(fd, hdr, sizeof(hdr))) {
+		fprintf(stderr, "Couldn't write WAV header\n");
+		goto close;
 	}
 
-	wrote = fwrite(eff->data, 1, eff->data_size, fp);
-	if (wrote != eff->data_size) {
+	if (decode)
+		res = write_adpcm_data(&sink, &adpcm, &eff->data, opts->threads);
+	else if (sink.conv)
+		res = write_pcm_data(&sink, &eff->data);
+	else
+		res = export_write_blob(fd, &eff->data);
+	if (!res && sink.conv)
+		res = audio_conv_finish(sink.conv, fd);
+	/* RIFF chunks are padded to an even length */
+	if (!res && (data_size & 1))
+		res = export_write(fd, "", 1);
+	if (res) {
 		fprintf(stderr, "Couldn't write Data\n");
-		goto done;
+		goto close;
 	}
 
 	res = 0;
 
+close:
+	res = export_close(opts, fd, res);
 done:
-	fclose(fp);
+	audio_conv_destroy(sink.conv);
 	return res;
 }
 
-static void sound_effect_print(struct xnb_object_head *obj)
+static void sound_effect_print(struct xnb_object_head *obj, FILE *out)
 {
 	struct xnb_obj_sound_effect *eff = (struct xnb_obj_sound_effect *)obj;
 	struct waveformatex format;
 	if (obj == NULL)
-		return
+		return;
 	assert(obj->type == XNB_OBJ_SOUND_EFFECT);
 
-	memcpy(&format, eff->format, sizeof(format));
+	get_waveformatex(eff, &format);
 
-	printf("[SoundEffect]\n");
-	printf("Format Size: %d\n", eff->format_size);
-	dump_waveformatex(&format);
-	printf("Data Size: %d\n", eff->data_size);
-	printf("Loop Start: %d\n", eff->loop_start);
-	printf("Loop Length: %d\n", eff->loop_length);
-	printf("Duration: %d\n", eff->duration);
-	printf("-------------\n");
+	fprintf(out, "[SoundEffect]\n");
+	fprintf(out, "Format Size: %d\n", eff->format_size);
+	dump_waveformatex(&format, out);
+	fprintf(out, "Data Size: %d\n", eff->data_size);
+	fprintf(out, "Loop Start: %d\n", eff->loop_start);
+	fprintf(out, "Loop Length: %d\n", eff->loop_length);
+	fprintf(out, "Duration: %d\n", eff->duration);
+	fprintf(out, "-------------\n");
 
 }
 
-static void sound_effect_destroy(struct xnb_object_head *obj)
-{
-	struct xnb_obj_sound_effect *eff = (struct xnb_obj_sound_effect *)obj;
-	if (obj == NULL)
-		return
-	assert(obj->type == XNB_OBJ_SOUND_EFFECT);
-
-	free(eff->data);
-	free(eff->format);
-	free(eff);
-}
-
-static struct xnb_object_head *sound_effect_read(FILE *fp)
+static struct xnb_object_head *sound_effect_read(struct xnb_container *cont,
+		const struct type_reader_desc *rdr, struct xnb_cursor *cur)
 {
 	struct xnb_obj_sound_effect *eff;
-	size_t read;
+	int res;
 
-	eff = malloc(sizeof(*eff));
+	eff = arena_zalloc(cont->arena, sizeof(*eff));
 	if (!eff) {
 		fprintf(stderr, "Couldn't alloc effect structure\n");
 		return NULL;
 	}
-	memset(eff, 0, sizeof(*eff));
 	eff->head.type = XNB_OBJ_SOUND_EFFECT;
 	eff->head.reader = &sound_effect_reader;
 
-	read = fread(&eff->format_size, sizeof(eff->format_size), 1, fp);
-	if (read != 1) {
+	res = cursor_read(cur, &eff->format_size, sizeof(eff->format_size));
+	if (res) {
 		fprintf(stderr, "Couldn't read format size\n");
 		goto fail;
 	}
 
-	eff->format = malloc(eff->format_size);
+	eff->format = cursor_view(cur, eff->format_size);
 	if (!eff->format) {
-		fprintf(stderr, "Couldn't alloc format structure\n");
-		goto fail;
-	}
-
-	read = fread(eff->format, 1, eff->format_size, fp);
-	if (read != eff->format_size) {
 		fprintf(stderr, "Couldn't read format structure\n");
 		goto fail;
 	}
 
-	read = fread(&eff->data_size, sizeof(eff->data_size), 1, fp);
-	if (read != 1) {
+	res = cursor_read(cur, &eff->data_size, sizeof(eff->data_size));
+	if (res) {
 		fprintf(stderr, "Couldn't read data size\n");
 		goto fail;
 	}
 
-	eff->data = malloc(eff->data_size);
-	if (!eff->data) {
-		fprintf(stderr, "Couldn't alloc data space\n");
-		goto fail;
-	}
-
-	read = fread(eff->data, 1, eff->data_size, fp);
-	if (read != eff->data_size) {
+	if (cont->read_flags & XNB_READ_METADATA)
+		res = cursor_skip_blob(cur, eff->data_size, &eff->data);
+	else
+		res = cursor_blob(cur, eff->data_size, &eff->data);
+	if (res) {
 		fprintf(stderr, "Couldn't read data\n");
 		goto fail;
 	}
 
-	read = fread(&eff->loop_start, sizeof(eff->loop_start), 1, fp);
-	if (read != 1) {
+	res = cursor_read(cur, &eff->loop_start, sizeof(eff->loop_start));
+	if (res) {
 		fprintf(stderr, "Couldn't read loop start\n");
 		goto fail;
 	}
 
-	read = fread(&eff->loop_length, sizeof(eff->loop_length), 1, fp);
-	if (read != 1) {
+	res = cursor_read(cur, &eff->loop_length, sizeof(eff->loop_length));
+	if (res) {
 		fprintf(stderr, "Couldn't read loop length\n");
 		goto fail;
 	}
 
-	read = fread(&eff->duration, sizeof(eff->duration), 1, fp);
-	if (read != 1) {
+	res = cursor_read(cur, &eff->duration, sizeof(eff->duration));
+	if (res) {
 		fprintf(stderr, "Couldn't read duration\n");
 		goto fail;
 	}
@@ -270,9 +511,6 @@ static struct xnb_object_head *sound_effect_read(FILE *fp)
 	return (struct xnb_object_head *)eff;
 
 fail:
-	free(eff->data);
-	free(eff->format);
-	free(eff);
 	return NULL;
 }
 
@@ -280,7 +518,6 @@ const struct xnb_object_reader sound_effect_reader = {
 	.name = "Microsoft.Xna.Framework.Content.SoundEffectReader",
 	.type = XNB_OBJ_SOUND_EFFECT,
 	.deserialize = sound_effect_read,
-	.destroy = sound_effect_destroy,
 	.print = sound_effect_print,
 	.export = sound_effect_export,
 };
@@ -0,0 +1,308 @@
+/* XNB SpriteFont object implementation
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SPRITE_FONT_SSE2 1
+#endif
+
+#include "xnb_object.h"
+
+/* Per-glyph rectangles, one array per field */
+struct glyph_rects {
+	int32_t *x;
+	int32_t *y;
+	int32_t *width;
+	int32_t *height;
+};
+
+struct xnb_obj_sprite_font {
+	struct xnb_object_head head;
+
+	struct xnb_object_head *texture;
+	uint32_t glyph_count;
+	/* Everything below is glyph_count long, in the same order */
+	uint32_t *chars;
+	struct glyph_rects bounds;
+	struct glyph_rects cropping;
+	/* Kerning is left side bearing, width, right side bearing */
+	float *left_bearing;
+	float *width;
+	float *right_bearing;
+
+	int32_t line_spacing;
+	float spacing;
+	bool has_default_char;
+	uint32_t default_char;
+};
+
+/*
+ * Split n packed records of fields 32-bit values into one array per field.
+ * Rectangles are exactly one vector each, so four at a time they're just a
+ * 4x4 transpose.
+ */
+static void unpack_fields(const uint8_t *src, uint32_t n, int fields,
+		void **dst)
+{
+	uint32_t i = 0;
+	int f;
+
+#ifdef SPRITE_FONT_SSE2
+	if (fields == 4) {
+		for (; i + 4 <= n; i += 4) {
+			const float *s = (const float *)(src + i * 16);
+			__m128 r0 = _mm_loadu_ps(s);
+			__m128 r1 = _mm_loadu_ps(s + 4);
+			__m128 r2 = _mm_loadu_ps(s + 8);
+			__m128 r3 = _mm_loadu_ps(s + 12);
+			_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+			_mm_storeu_ps((float *)dst[0] + i, r0);
+			_mm_storeu_ps((float *)dst[1] + i, r1);
+			_mm_storeu_ps((float *)dst[2] + i, r2);
+			_mm_storeu_ps((float *)dst[3] + i, r3);
+		}
+	}
+#endif
+	for (; i < n; i++)
+		for (f = 0; f < fields; f++)
+			memcpy((uint32_t *)dst[f] + i, src + (i * fields + f) * 4, 4);
+}
+
+static int alloc_fields(struct xnb_arena *arena, uint32_t n, int fields,
+		void **dst)
+{
+	int f;
+
+	for (f = 0; f < fields; f++) {
+		dst[f] = arena_alloc(arena, (size_t)n * 4);
+		if (!dst[f] && n)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Read a List<Rectangle> in one go, and split it into rects */
+static int read_rects(struct xnb_container *cont, struct xnb_cursor *cur,
+		uint32_t count, struct glyph_rects *rects)
+{
+	void *fields[4];
+	const uint8_t *data;
+	uint32_t n;
+
+	if (read_packed_list(cont, cur, "Rectangle", &data, &n))
+		return -1;
+	if (n != count) {
+		fprintf(stderr, "Expected %d rectangles, got %d\n", count, n);
+		return -1;
+	}
+
+	if (alloc_fields(cont->arena, n, 4, fields))
+		return -1;
+	unpack_fields(data, n, 4, fields);
+
+	rects->x = fields[0];
+	rects->y = fields[1];
+	rects->width = fields[2];
+	rects->height = fields[3];
+
+	return 0;
+}
+
+static struct xnb_object_head *sprite_font_read(struct xnb_container *cont,
+		const struct type_reader_desc *rdr, struct xnb_cursor *cur)
+{
+	struct xnb_obj_sprite_font *font;
+	const uint8_t *data;
+	void *fields[4];
+	uint32_t n;
+	int res;
+
+	font = arena_zalloc(cont->arena, sizeof(*font));
+	if (!font) {
+		fprintf(stderr, "Couldn't alloc sprite font structure\n");
+		return NULL;
+	}
+	font->head.type = XNB_OBJ_SPRITE_FONT;
+	font->head.reader = &sprite_font_reader;
+
+	res = read_nested_object(cont, cur, &font->texture);
+	if (res || !font->texture || font->texture->type != XNB_OBJ_TEXTURE_2D) {
+		fprintf(stderr, "Couldn't read texture\n");
+		goto fail;
+	}
+
+	/* The glyph count comes from the first list, the rest must match */
+	res = read_packed_list(cont, cur, "Rectangle", &data, &n);
+	if (res || alloc_fields(cont->arena, n, 4, fields)) {
+		fprintf(stderr, "Couldn't read glyph bounds\n");
+		goto fail;
+	}
+	unpack_fields(data, n, 4, fields);
+	font->glyph_count = n;
+	font->bounds.x = fields[0];
+	font->bounds.y = fields[1];
+	font->bounds.width = fields[2];
+	font->bounds.height = fields[3];
+
+	res = read_rects(cont, cur, font->glyph_count, &font->cropping);
+	if (res) {
+		fprintf(stderr, "Couldn't read glyph cropping\n");
+		goto fail;
+	}
+
+	res = read_char_list(cont, cur, &font->chars, &n);
+	if (res || n != font->glyph_count) {
+		fprintf(stderr, "Couldn't read characters\n");
+		goto fail;
+	}
+
+	res = cursor_read(cur, &font->line_spacing, sizeof(font->line_spacing));
+	if (res) {
+		fprintf(stderr, "Couldn't read line spacing\n");
+		goto fail;
+	}
+
+	res = cursor_read(cur, &font->spacing, sizeof(font->spacing));
+	if (res) {
+		fprintf(stderr, "Couldn't read spacing\n");
+		goto fail;
+	}
+
+	res = read_packed_list(cont, cur, "Vector3", &data, &n);
+	if (res || n != font->glyph_count ||
+			alloc_fields(cont->arena, n, 3, fields)) {
+		fprintf(stderr, "Couldn't read kerning\n");
+		goto fail;
+	}
+	unpack_fields(data, n, 3, fields);
+	font->left_bearing = fields[0];
+	font->width = fields[1];
+	font->right_bearing = fields[2];
+
+	res = read_nullable_char(cont, cur, &font->default_char,
+			&font->has_default_char);
+	if (res) {
+		fprintf(stderr, "Couldn't read default character\n");
+		goto fail;
+	}
+
+	return (struct xnb_object_head *)font;
+
+fail:
+	return NULL;
+}
+
+/*
+ * Glyph metrics file, all little-endian:
+ *   "XFNT", version, glyph count, line spacing, spacing (float),
+ *   default char (or 0xffffffff)
+ * then an array of glyph count values for each of:
+ *   char, bounds x, y, width, height, cropping x, y, width, height,
+ *   left bearing, width, right bearing (floats)
+ */
+#define METRICS_VERSION     1
+#define METRICS_HEADER_SIZE 24
+
+static int write_metrics(struct xnb_obj_sprite_font *font, int fd)
+{
+	uint8_t hdr[METRICS_HEADER_SIZE];
+	size_t len = (size_t)font->glyph_count * 4;
+	const void *arrays[] = {
+		font->chars,
+		font->bounds.x, font->bounds.y,
+		font->bounds.width, font->bounds.height,
+		font->cropping.x, font->cropping.y,
+		font->cropping.width, font->cropping.height,
+		font->left_bearing, font->width, font->right_bearing,
+	};
+	uint32_t spacing;
+	size_t i;
+
+	memcpy(&spacing, &font->spacing, sizeof(spacing));
+
+	memcpy(hdr, "XFNT", 4);
+	put_le32(hdr + 4, METRICS_VERSION);
+	put_le32(hdr + 8, font->glyph_count);
+	put_le32(hdr + 12, font->line_spacing);
+	put_le32(hdr + 16, spacing);
+	put_le32(hdr + 20, font->has_default_char ? font->default_char :
+			0xffffffff);
+
+	if (export_write(fd, hdr, sizeof(hdr)))
+		return -1;
+
+	/* Already stored this way, so each is a single write */
+	for (i = 0; i < sizeof(arrays) / sizeof(arrays[0]); i++)
+		if (export_write(fd, arrays[i], len))
+			return -1;
+
+	return 0;
+}
+
+static int sprite_font_export(struct xnb_object_head *obj,
+		const struct xnb_export_opts *opts, char *basename)
+{
+	struct xnb_obj_sprite_font *font = (struct xnb_obj_sprite_font *)obj;
+	int fd, res;
+
+	assert(obj->type == XNB_OBJ_SPRITE_FONT);
+
+	res = export_object(font->texture, opts, basename);
+	if (res) {
+		fprintf(stderr, "Couldn't export font atlas\n");
+		return res;
+	}
+
+	fd = export_create(opts, basename, "glyphs");
+	if (fd < 0)
+		return -1;
+
+	res = write_metrics(font, fd);
+	if (res)
+		fprintf(stderr, "Couldn't write glyph metrics\n");
+
+	res = export_close(opts, fd, res);
+	return res;
+}
+
+static void sprite_font_print(struct xnb_object_head *obj, FILE *out)
+{
+	struct xnb_obj_sprite_font *font = (struct xnb_obj_sprite_font *)obj;
+	uint32_t i;
+	if (obj == NULL)
+		return;
+	assert(obj->type == XNB_OBJ_SPRITE_FONT);
+
+	fprintf(out, "[SpriteFont]\n");
+	fprintf(out, "Glyph Count: %d\n", font->glyph_count);
+	fprintf(out, "Line Spacing: %d\n", font->line_spacing);
+	fprintf(out, "Spacing: %g\n", font->spacing);
+	if (font->has_default_char)
+		fprintf(out, "Default Character: U+%04X\n", font->default_char);
+	else
+		fprintf(out, "Default Character: none\n");
+	fprintf(out, "Characters:");
+	for (i = 0; i < font->glyph_count; i++) {
+		if (i == 16) {
+			fprintf(out, " ...");
+			break;
+		}
+		fprintf(out, " U+%04X", font->chars[i]);
+	}
+	fprintf(out, "\n");
+	dump_object(font->texture, out);
+}
+
+const struct xnb_object_reader sprite_font_reader = {
+	.name = "Microsoft.Xna.Framework.Content.SpriteFontReader",
+	.type = XNB_OBJ_SPRITE_FONT,
+	.deserialize = sprite_font_read,
+	.print = sprite_font_print,
+	.export = sprite_font_export,
+};
@@ -0,0 +1,392 @@
+/* XNB Texture2D object implementation
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xnb_bcn.h"
+#include "xnb_object.h"
+#include "xnb_png.h"
+
+/* XNA 4.0 SurfaceFormat */
+enum surface_format {
+	SURFACE_COLOR         = 0,
+	SURFACE_BGR565        = 1,
+	SURFACE_BGRA5551      = 2,
+	SURFACE_BGRA4444      = 3,
+	SURFACE_DXT1          = 4,
+	SURFACE_DXT3          = 5,
+	SURFACE_DXT5          = 6,
+	SURFACE_ALPHA8        = 12,
+};
+
+/* Sanity limit - 32 levels is already a 4 gigapixel texture */
+#define MAX_MIP_LEVELS 32
+
+struct xnb_obj_texture2d {
+	struct xnb_object_head head;
+
+	int32_t surface_format;
+	uint32_t width;
+	uint32_t height;
+	uint32_t mip_count;
+	/* Each level's data, pointing into the input buffer */
+	struct xnb_blob *mips;
+};
+
+/* DDS_PIXELFORMAT flags */
+#define DDPF_ALPHAPIXELS 0x1
+#define DDPF_ALPHA       0x2
+#define DDPF_FOURCC      0x4
+#define DDPF_RGB         0x40
+
+/* How to describe each surface format we can export in a DDS header */
+static const struct dds_format {
+	int32_t surface_format;
+	const char *name;
+	uint32_t flags;
+	char fourcc[4];
+	uint32_t bits;
+	uint32_t r_mask, g_mask, b_mask, a_mask;
+	/* For compressed formats, bytes per 4x4 block. Otherwise 0 */
+	uint32_t block_size;
+} dds_formats[] = {
+	{ SURFACE_COLOR, "Color", DDPF_RGB | DDPF_ALPHAPIXELS, "", 32,
+		0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000, 0 },
+	{ SURFACE_BGR565, "Bgr565", DDPF_RGB, "", 16,
+		0xf800, 0x07e0, 0x001f, 0, 0 },
+	{ SURFACE_BGRA5551, "Bgra5551", DDPF_RGB | DDPF_ALPHAPIXELS, "", 16,
+		0x7c00, 0x03e0, 0x001f, 0x8000, 0 },
+	{ SURFACE_BGRA4444, "Bgra4444", DDPF_RGB | DDPF_ALPHAPIXELS, "", 16,
+		0x0f00, 0x00f0, 0x000f, 0xf000, 0 },
+	{ SURFACE_DXT1, "Dxt1", DDPF_FOURCC, "DXT1", 0, 0, 0, 0, 0, 8 },
+	{ SURFACE_DXT3, "Dxt3", DDPF_FOURCC, "DXT3", 0, 0, 0, 0, 0, 16 },
+	{ SURFACE_DXT5, "Dxt5", DDPF_FOURCC, "DXT5", 0, 0, 0, 0, 0, 16 },
+	{ SURFACE_ALPHA8, "Alpha8", DDPF_ALPHA, "", 8, 0, 0, 0, 0xff, 0 },
+};
+
+static const struct dds_format *find_dds_format(int32_t surface_format)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(dds_formats) / sizeof(dds_formats[0]); i++)
+		if (dds_formats[i].surface_format == surface_format)
+			return &dds_formats[i];
+
+	return NULL;
+}
+
+/* DDS_HEADER flags */
+#define DDSD_CAPS        0x1
+#define DDSD_HEIGHT      0x2
+#define DDSD_WIDTH       0x4
+#define DDSD_PITCH       0x8
+#define DDSD_PIXELFORMAT 0x1000
+#define DDSD_MIPMAPCOUNT 0x20000
+#define DDSD_LINEARSIZE  0x80000
+/* DDS_HEADER caps */
+#define DDSCAPS_COMPLEX  0x8
+#define DDSCAPS_TEXTURE  0x1000
+#define DDSCAPS_MIPMAP   0x400000
+
+/* "DDS " + DDS_HEADER */
+#define DDS_HEADER_SIZE (4 + 124)
+
+static void build_dds_header(uint8_t *hdr, struct xnb_obj_texture2d *tex,
+		const struct dds_format *fmt)
+{
+	uint32_t flags = DDSD_CAPS | DDSD_HEIGHT | DDSD_WIDTH | DDSD_PIXELFORMAT;
+	uint32_t caps = DDSCAPS_TEXTURE;
+	uint32_t pitch;
+
+	if (fmt->block_size) {
+		flags |= DDSD_LINEARSIZE;
+		pitch = tex->mip_count ? tex->mips[0].size : 0;
+	} else {
+		flags |= DDSD_PITCH;
+		pitch = (tex->width * fmt->bits + 7) / 8;
+	}
+
+	if (tex->mip_count > 1) {
+		flags |= DDSD_MIPMAPCOUNT;
+		caps |= DDSCAPS_COMPLEX | DDSCAPS_MIPMAP;
+	}
+
+	memset(hdr, 0, DDS_HEADER_SIZE);
+	memcpy(hdr, "DDS ", 4);
+	put_le32(hdr + 4, 124);
+	put_le32(hdr + 8, flags);
+	put_le32(hdr + 12, tex->height);
+	put_le32(hdr + 16, tex->width);
+	put_le32(hdr + 20, pitch);
+	put_le32(hdr + 28, tex->mip_count);
+
+	/* DDS_PIXELFORMAT */
+	put_le32(hdr + 76, 32);
+	put_le32(hdr + 80, fmt->flags);
+	memcpy(hdr + 84, fmt->fourcc, 4);
+	put_le32(hdr + 88, fmt->bits);
+	put_le32(hdr + 92, fmt->r_mask);
+	put_le32(hdr + 96, fmt->g_mask);
+	put_le32(hdr + 100, fmt->b_mask);
+	put_le32(hdr + 104, fmt->a_mask);
+
+	put_le32(hdr + 108, caps);
+}
+
+static int texture2d_export_dds(struct xnb_object_head *obj,
+		const struct xnb_export_opts *opts, char *basename)
+{
+	uint8_t hdr[DDS_HEADER_SIZE];
+	struct xnb_obj_texture2d *tex = (struct xnb_obj_texture2d *)obj;
+	const struct dds_format *fmt;
+	uint32_t i;
+	int fd, res = -1;
+
+	assert(obj->type == XNB_OBJ_TEXTURE_2D);
+
+	fmt = find_dds_format(tex->surface_format);
+	if (!fmt) {
+		fprintf(stderr, "Can't export surface format %d\n",
+				tex->surface_format);
+		return res;
+	}
+	build_dds_header(hdr, tex, fmt);
+
+	fd = export_create(opts, basename, "dds");
+	if (fd < 0)
+		return res;
+
+	if (export_write(fd, hdr, sizeof(hdr))) {
+		fprintf(stderr, "Couldn't write DDS header\n");
+		goto done;
+	}
+
+	/* DDS stores the mip chain exactly as XNB does */
+	for (i = 0; i < tex->mip_count; i++) {
+		if (export_write_blob(fd, &tex->mips[i])) {
+			fprintf(stderr, "Couldn't write mip level %d\n", i);
+			goto done;
+		}
+	}
+
+	res = 0;
+
+done:
+	res = export_close(opts, fd, res);
+	return res;
+}
+
+/*
+ * Decode the top mip level to RGBA8, 4 rows at a time, and write it either
+ * raw or as a PNG
+ */
+static int texture2d_export_pixels(struct xnb_obj_texture2d *tex,
+		const struct xnb_export_opts *opts, char *basename)
+{
+	enum xnb_texture_format format = opts->texture_format;
+	struct png_writer png;
+	enum bcn_format bcn = BCN_BC1;
+	const struct xnb_blob *mip;
+	const uint8_t *src;
+	size_t stride, src_row, need;
+	uint8_t *rows = NULL;
+	uint32_t y;
+	int fd, res = -1;
+
+	switch (tex->surface_format) {
+	case SURFACE_COLOR:
+		src_row = (size_t)tex->width * 4;
+		need = src_row * tex->height;
+		/* Pretend it's in rows of 4 like the compressed formats */
+		src_row *= 4;
+		break;
+	case SURFACE_DXT1:
+	case SURFACE_DXT3:
+	case SURFACE_DXT5:
+		bcn = tex->surface_format == SURFACE_DXT1 ? BCN_BC1 :
+			tex->surface_format == SURFACE_DXT3 ? BCN_BC2 : BCN_BC3;
+		src_row = (size_t)((tex->width + 3) / 4) * bcn_block_size(bcn);
+		need = src_row * ((tex->height + 3) / 4);
+		break;
+	default:
+		fprintf(stderr, "Can't decode surface format %d to RGBA\n",
+				tex->surface_format);
+		return res;
+	}
+
+	if (!tex->mip_count || !tex->width || !tex->height) {
+		fprintf(stderr, "Texture is empty\n");
+		return res;
+	}
+	mip = &tex->mips[0];
+	if (!mip->data || mip->size < need) {
+		fprintf(stderr, "Mip level 0 is too small (%zu < %zu)\n",
+				mip->size, need);
+		return res;
+	}
+	src = mip->data;
+
+	stride = (size_t)tex->width * 4;
+	if (tex->surface_format != SURFACE_COLOR) {
+		rows = malloc(stride * 4);
+		if (!rows) {
+			fprintf(stderr, "Couldn't allocate row buffer\n");
+			return res;
+		}
+	}
+
+	fd = export_create(opts, basename,
+			format == XNB_TEXTURE_PNG ? "png" : "rgba");
+	if (fd < 0)
+		goto done;
+
+	if (format == XNB_TEXTURE_PNG && png_begin(&png, fd, tex->width,
+				tex->height)) {
+		fprintf(stderr, "Couldn't write PNG header\n");
+		goto close;
+	}
+
+	for (y = 0; y < tex->height; y += 4, src += src_row) {
+		uint32_t n = tex->height - y < 4 ? tex->height - y : 4;
+		const uint8_t *out = src;
+
+		if (rows) {
+			bcn_decode_row(bcn, src, tex->width, n, rows, stride);
+			out = rows;
+		}
+
+		if (format == XNB_TEXTURE_PNG)
+			res = png_write_rows(&png, out, stride, n);
+		else
+			res = export_write(fd, out, stride * n);
+		if (res) {
+			fprintf(stderr, "Couldn't write rows %d-%d\n", y, y + n - 1);
+			goto close;
+		}
+	}
+
+	res = format == XNB_TEXTURE_PNG ? png_end(&png) : 0;
+
+close:
+	res = export_close(opts, fd, res);
+done:
+	free(rows);
+	return res;
+}
+
+static int texture2d_export(struct xnb_object_head *obj,
+		const struct xnb_export_opts *opts, char *basename)
+{
+	struct xnb_obj_texture2d *tex = (struct xnb_obj_texture2d *)obj;
+
+	assert(obj->type == XNB_OBJ_TEXTURE_2D);
+
+	if (opts->texture_format == XNB_TEXTURE_DDS)
+		return texture2d_export_dds(obj, opts, basename);
+
+	return texture2d_export_pixels(tex, opts, basename);
+}
+
+static void texture2d_print(struct xnb_object_head *obj, FILE *out)
+{
+	struct xnb_obj_texture2d *tex = (struct xnb_obj_texture2d *)obj;
+	const struct dds_format *fmt;
+	uint32_t i;
+	if (obj == NULL)
+		return;
+	assert(obj->type == XNB_OBJ_TEXTURE_2D);
+
+	fmt = find_dds_format(tex->surface_format);
+
+	fprintf(out, "[Texture2D]\n");
+	fprintf(out, "Surface Format: %d (%s)\n", tex->surface_format,
+			fmt ? fmt->name : "unknown");
+	fprintf(out, "Width: %d\n", tex->width);
+	fprintf(out, "Height: %d\n", tex->height);
+	fprintf(out, "Mip Count: %d\n", tex->mip_count);
+	for (i = 0; i < tex->mip_count; i++)
+		fprintf(out, "Mip %d Size: %zu\n", i, tex->mips[i].size);
+	fprintf(out, "-------------\n");
+}
+
+static struct xnb_object_head *texture2d_read(struct xnb_container *cont,
+		const struct type_reader_desc *rdr, struct xnb_cursor *cur)
+{
+	struct xnb_obj_texture2d *tex;
+	uint32_t i;
+	int res;
+
+	tex = arena_zalloc(cont->arena, sizeof(*tex));
+	if (!tex) {
+		fprintf(stderr, "Couldn't alloc texture structure\n");
+		return NULL;
+	}
+	tex->head.type = XNB_OBJ_TEXTURE_2D;
+	tex->head.reader = &texture2d_reader;
+
+	res = cursor_read(cur, &tex->surface_format, sizeof(tex->surface_format));
+	if (res) {
+		fprintf(stderr, "Couldn't read surface format\n");
+		goto fail;
+	}
+
+	res = cursor_read(cur, &tex->width, sizeof(tex->width));
+	if (res) {
+		fprintf(stderr, "Couldn't read width\n");
+		goto fail;
+	}
+
+	res = cursor_read(cur, &tex->height, sizeof(tex->height));
+	if (res) {
+		fprintf(stderr, "Couldn't read height\n");
+		goto fail;
+	}
+
+	res = cursor_read(cur, &tex->mip_count, sizeof(tex->mip_count));
+	if (res || tex->mip_count > MAX_MIP_LEVELS) {
+		fprintf(stderr, "Couldn't read mip count\n");
+		goto fail;
+	}
+
+	tex->mips = arena_zalloc(cont->arena, sizeof(*tex->mips) * tex->mip_count);
+	if (!tex->mips) {
+		fprintf(stderr, "Couldn't alloc mip levels\n");
+		goto fail;
+	}
+
+	for (i = 0; i < tex->mip_count; i++) {
+		uint32_t size;
+
+		res = cursor_read(cur, &size, sizeof(size));
+		if (res) {
+			fprintf(stderr, "Couldn't read mip %d size\n", i);
+			goto fail;
+		}
+
+		if (cont->read_flags & XNB_READ_METADATA)
+			res = cursor_skip_blob(cur, size, &tex->mips[i]);
+		else
+			res = cursor_blob(cur, size, &tex->mips[i]);
+		if (res) {
+			fprintf(stderr, "Couldn't read mip %d data\n", i);
+			goto fail;
+		}
+	}
+
+	return (struct xnb_object_head *)tex;
+
+fail:
+	return NULL;
+}
+
+const struct xnb_object_reader texture2d_reader = {
+	.name = "Microsoft.Xna.Framework.Content.Texture2DReader",
+	.type = XNB_OBJ_TEXTURE_2D,
+	.deserialize = texture2d_read,
+	.print = texture2d_print,
+	.export = texture2d_export,
+};
@@ -2,23 +2,33 @@
  * Copyright Brian Starkey 2014 <stark3y@gmail.com>
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
 
 #include "xnb_object.h"
+#include "xnb_stats.h"
 
 /* Add to this for new object types */
 const struct xnb_object_reader *readers[] = {
 	&sound_effect_reader,
+	&texture2d_reader,
+	&sprite_font_reader,
 	NULL,
 };
 
-void dump_object(struct xnb_object_head *obj)
+void dump_object(struct xnb_object_head *obj, FILE *out)
 {
 	assert(obj != NULL);
 	assert(obj->reader != NULL);
-	obj->reader->print(obj);
+	obj->reader->print(obj, out);
 }
 
 void destroy_object(struct xnb_object_head *obj)
@@ -26,32 +36,429 @@ void destroy_object(struct xnb_object_head *obj)
 	if (obj == NULL)
 		return;
 	assert(obj->reader != NULL);
-	obj->reader->destroy(obj);
+	if (obj->reader->destroy)
+		obj->reader->destroy(obj);
+}
+
+/*
+ * Registry of readers[], keyed on type name. It's built once, and only read
+ * after that, so it can be shared by every thread.
+ */
+#define REGISTRY_SIZE 256
+
+static struct registry_entry {
+	const char *name;
+	uint32_t hash;
+	const struct xnb_object_reader *reader;
+} registry[REGISTRY_SIZE];
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
+
+static uint32_t name_hash(const char *name, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static void registry_init(void)
+{
+	int i;
+
+	for (i = 0; readers[i]; i++) {
+		const char *name = readers[i]->name;
+		uint32_t hash = name_hash(name, strlen(name));
+		uint32_t slot = hash % REGISTRY_SIZE;
+
+		while (registry[slot].name)
+			slot = (slot + 1) % REGISTRY_SIZE;
+		registry[slot].name = name;
+		registry[slot].hash = hash;
+		registry[slot].reader = readers[i];
+	}
 }
 
-struct xnb_object_head *read_object(struct type_reader_desc *rdr, FILE *fp)
+static const struct xnb_object_reader *registry_lookup(const char *name,
+		size_t len)
 {
-	int i = 0;
-	while (readers[i]) {
-		const struct xnb_object_reader *reader = readers[i];
-		if (!strcmp(reader->name, rdr->name))
-			return reader->deserialize(fp);
-		i++;
+	uint32_t hash = name_hash(name, len);
+	uint32_t slot = hash % REGISTRY_SIZE;
+
+	while (registry[slot].name) {
+		struct registry_entry *e = &registry[slot];
+		if (e->hash == hash && !strncmp(e->name, name, len) &&
+				e->name[len] == '\0')
+			return e->reader;
+		slot = (slot + 1) % REGISTRY_SIZE;
 	}
-	fprintf(stderr, "Unsupported reader '%s'\n", rdr->name);
+
 	return NULL;
 }
 
-int export_object(struct xnb_object_head *obj, char *basename)
+/*
+ * Strip assembly qualifications out of a type name, including those of any
+ * generic arguments:
+ *   Foo`1[[Bar, Asm, Version=...]], Asm, Version=... -> Foo`1[[Bar]]
+ * At even bracket depths a comma starts an assembly name, which runs to the
+ * closing bracket (or the end). At odd depths it separates type arguments.
+ */
+static size_t normalize_type_name(const char *in, char *out, size_t size)
 {
-	assert(obj != NULL);
-	assert(obj->reader != NULL);
+	size_t n = 0;
+	int depth = 0;
+
+	while (*in && n < size - 1) {
+		char c = *in++;
+
+		if (c == ',' && !(depth & 1)) {
+			int skip_depth = depth;
+			if (!depth)
+				break;
+			/* Leave the closing bracket for the main loop */
+			for (; *in; in++) {
+				if (*in == '[') {
+					depth++;
+				} else if (*in == ']') {
+					if (depth == skip_depth)
+						break;
+					depth--;
+				}
+			}
+			continue;
+		}
+
+		if (c == '[')
+			depth++;
+		else if (c == ']')
+			depth--;
+		else if (c == ' ' && n && out[n - 1] == ',')
+			continue;
+		out[n++] = c;
+	}
+	out[n] = '\0';
+
+	return n;
+}
+
+int bind_reader(struct xnb_container *cont, struct type_reader_desc *rdr)
+{
+	size_t len = strlen(rdr->name);
+	char *name, *generic;
+
+	pthread_once(&registry_once, registry_init);
 
+	rdr->plan = NULL;
+	rdr->reader = NULL;
+	rdr->type_name = NULL;
+	/* Normalizing only ever makes it shorter */
+	name = arena_alloc(cont->arena, len + 1);
+	if (!name)
+		return -1;
+	len = normalize_type_name(rdr->name, name, len + 1);
+	rdr->type_name = name;
+	rdr->reader = registry_lookup(name, len);
+
+	/* Generic readers are registered without their type arguments */
+	if (!rdr->reader && (generic = strchr(name, '[')))
+		rdr->reader = registry_lookup(name, generic - name);
+
+	/* Anything else might be a primitive or collection reader */
+	if (!rdr->reader && !generic_bind(cont, rdr, name))
+		rdr->reader = &generic_reader;
+
+	return rdr->reader ? 0 : -1;
+}
+
+struct xnb_object_head *read_object(struct xnb_container *cont,
+		struct type_reader_desc *rdr, struct xnb_cursor *cur)
+{
+	struct xnb_object_head *obj;
+	struct stats_timer t;
+	size_t start = cur->pos;
+
+	if (!rdr->reader) {
+		fprintf(stderr, "Unsupported reader '%s'\n", rdr->name);
+		return NULL;
+	}
+
+	stats_start(&t);
+	obj = rdr->reader->deserialize(cont, rdr, cur);
+	if (obj) {
+		stats_end_read(&t, rdr->reader);
+		obj->src = cur->base + start;
+		obj->src_len = cur->pos - start;
+		obj->type_name = rdr->type_name;
+	}
+
+	return obj;
+}
+
+/* Deeper than any real asset, but well short of running out of stack */
+#define MAX_NESTING 64
+
+int read_nested_object(struct xnb_container *cont, struct xnb_cursor *cur,
+		struct xnb_object_head **obj)
+{
+	int type_idx = cursor_read_7bit(cur);
+
+	*obj = NULL;
+	if (type_idx < 0) {
+		fprintf(stderr, "Couldn't read nested object type\n");
+		return -1;
+	} else if (type_idx > cont->type_reader_count) {
+		fprintf(stderr, "Bad nested object type %d\n", type_idx);
+		return -1;
+	} else if (type_idx == 0) {
+		return 0;
+	}
+
+	if (cont->depth >= MAX_NESTING) {
+		fprintf(stderr, "Objects are nested too deeply\n");
+		return -1;
+	}
+
+	cont->depth++;
+	*obj = read_object(cont, &cont->readers[type_idx - 1], cur);
+	cont->depth--;
+
+	return *obj ? 0 : -1;
+}
+
+static int run_export(struct xnb_object_head *obj,
+		const struct xnb_export_opts *opts, char *basename)
+{
 	if (obj->reader->export) {
-		return obj->reader->export(obj, basename);
+		uint64_t written = stats_thread_written();
+		struct stats_timer t;
+		int res;
+
+		stats_start(&t);
+		res = obj->reader->export(obj, opts, basename);
+		stats_end_export(&t, obj->reader, written);
+
+		return res;
 	} else {
 		fprintf(stderr, "No exporter found for reader '%s'\n",
 				obj->reader->name);
 		return -ENOENT;
 	}
 }
+
+/*
+ * Export a copy of an object which might already have been exported, linking
+ * to the earlier files if it has been.
+ */
+static int dedupe_export(struct xnb_object_head *obj,
+		const struct xnb_export_opts *opts, char *basename)
+{
+	struct xnb_export_opts dopts = *opts;
+	struct xnb_output_list outputs = { 0 };
+	struct dedupe_entry *claim;
+	int i, res;
+
+	res = dedupe_begin(opts->dedupe, obj, basename, opts->outputs, &claim);
+	if (res > 0)
+		return 0;
+
+	/* The files have to be complete before they can be cloned */
+	if (dedupe_reflinks(opts->dedupe))
+		dopts.io = NULL;
+	dopts.outputs = &outputs;
+	res = run_export(obj, &dopts, basename);
+	dedupe_finish(opts->dedupe, claim, basename, &outputs, res);
+
+	for (i = 0; opts->outputs && i < outputs.count; i++) {
+		if (output_list_add(opts->outputs, outputs.names[i])) {
+			fprintf(stderr, "Couldn't record output '%s'\n",
+					outputs.names[i]);
+			res = -1;
+			break;
+		}
+	}
+	output_list_free(&outputs);
+
+	return res;
+}
+
+int export_object(struct xnb_object_head *obj,
+		const struct xnb_export_opts *opts, char *basename)
+{
+	assert(obj != NULL);
+	assert(obj->reader != NULL);
+
+	if (opts->dedupe && !opts->sink)
+		return dedupe_export(obj, opts, basename);
+
+	return run_export(obj, opts, basename);
+}
+
+int output_list_add(struct xnb_output_list *list, const char *name)
+{
+	if (list->count == list->cap) {
+		int cap = list->cap ? list->cap * 2 : 4;
+		char **names = realloc(list->names, sizeof(*names) * cap);
+		if (!names)
+			return -1;
+		list->names = names;
+		list->cap = cap;
+	}
+
+	list->names[list->count] = strdup(name);
+	if (!list->names[list->count])
+		return -1;
+	list->count++;
+
+	return 0;
+}
+
+void output_list_free(struct xnb_output_list *list)
+{
+	int i;
+
+	for (i = 0; i < list->count; i++)
+		free(list->names[i]);
+	free(list->names);
+	list->names = NULL;
+	list->count = list->cap = 0;
+}
+
+int export_create(const struct xnb_export_opts *opts, const char *basename,
+		const char *ext)
+{
+	char filename[MAX_NAME_LEN];
+	int fd;
+
+	snprintf(filename, MAX_NAME_LEN, "%s.%s", basename, ext);
+	/* It might be hardlinked to another file, which mustn't change too */
+	if (opts->dedupe && !opts->sink)
+		unlink(filename);
+
+	if (opts->sink)
+		fd = opts->sink->create(opts->sink, filename);
+	else
+		fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't open '%s' for writing: %s\n", filename,
+				strerror(errno));
+		return -1;
+	}
+
+	if (opts->io && !opts->sink)
+		io_attach(opts->io, fd, filename);
+
+	if (opts->outputs && output_list_add(opts->outputs, filename)) {
+		fprintf(stderr, "Couldn't record output '%s'\n", filename);
+		export_close(opts, fd, -1);
+		return -1;
+	}
+
+	return fd;
+}
+
+int export_close(const struct xnb_export_opts *opts, int fd, int res)
+{
+	int ret;
+
+	if (opts->sink)
+		ret = opts->sink->close(opts->sink, fd, res != 0);
+	else if (opts->io)
+		ret = io_close(opts->io, fd);
+	else
+		ret = close(fd);
+
+	return res ? res : ret;
+}
+
+int export_write(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	struct xnb_io *io = io_for_fd(fd);
+
+	if (io)
+		return io_write(io, fd, buf, len);
+
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Write failed: %s\n", strerror(errno));
+			return -1;
+		}
+		stats_add_written(n);
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Try copy_file_range(), then sendfile(), and if neither can do it (or the
+ * blob isn't in a file at all) fall back to writing from memory. Returns the
+ * number of bytes copied by the kernel, or -1 on a hard error.
+ */
+static ssize_t kernel_copy(int fd, const struct xnb_blob *blob)
+{
+	off_t off_in = blob->offset;
+	size_t done = 0;
+	int use_sendfile = 0;
+
+	if (blob->fd < 0)
+		return 0;
+
+	while (done < blob->size) {
+		ssize_t n;
+		if (!use_sendfile)
+			n = copy_file_range(blob->fd, &off_in, fd, NULL,
+					blob->size - done, 0);
+		else
+			n = sendfile(fd, blob->fd, &off_in, blob->size - done);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (done == 0 && !use_sendfile &&
+					(errno == EXDEV || errno == EINVAL ||
+					 errno == ENOSYS || errno == EOPNOTSUPP ||
+					 errno == EBADF)) {
+				use_sendfile = 1;
+				continue;
+			}
+			if (done == 0 && (errno == EINVAL || errno == ENOSYS))
+				return 0;
+			fprintf(stderr, "Copy failed: %s\n", strerror(errno));
+			return -1;
+		} else if (n == 0) {
+			/* Source is shorter than we thought - write the rest */
+			break;
+		}
+		done += n;
+	}
+
+	return done;
+}
+
+int export_write_blob(int fd, const struct xnb_blob *blob)
+{
+	ssize_t copied = 0;
+
+	/* Queued writes would race with the kernel's copy */
+	if (!io_for_fd(fd))
+		copied = kernel_copy(fd, blob);
+	if (copied < 0)
+		return -1;
+	stats_add_written(copied);
+
+	if (!blob->data && (size_t)copied != blob->size) {
+		fprintf(stderr, "Payload wasn't loaded (metadata-only read)\n");
+		return -1;
+	}
+
+	return export_write(fd, blob->data + copied, blob->size - copied);
+}
@@ -2,39 +2,188 @@
  * Copyright Brian Starkey 2014 <stark3y@gmail.com>
  */
 
+#ifndef __XNB_OBJECT_H__
+#define __XNB_OBJECT_H__
+
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
+#include "xnb_audio.h"
+#include "xnb_container.h"
+#include "xnb_cursor.h"
+#include "xnb_dedupe.h"
+#include "xnb_io.h"
+
 #define MAX_NAME_LEN 256
 
 struct xnb_object_reader;
 /* Add to these for new objects */
 extern const struct xnb_object_reader sound_effect_reader;
+extern const struct xnb_object_reader texture2d_reader;
+extern const struct xnb_object_reader sprite_font_reader;
+/* Primitives and collections, driven by a parse plan. Not in the registry */
+extern const struct xnb_object_reader generic_reader;
 enum xnb_object_type {
 	XNB_OBJ_SOUND_EFFECT,
+	XNB_OBJ_TEXTURE_2D,
+	XNB_OBJ_SPRITE_FONT,
+	XNB_OBJ_GENERIC,
 };
 
 /* Put this at the top of any specific object structures */
 struct xnb_object_head {
 	enum xnb_object_type type;
 	const struct xnb_object_reader *reader;
+	/* The bytes it was read from, and their type, filled in by read_object() */
+	const uint8_t *src;
+	size_t src_len;
+	const char *type_name;
+};
+
+/* How exported objects should be written, from the command line */
+enum xnb_texture_format {
+	XNB_TEXTURE_DDS,
+	/* Level 0 decoded to RGBA8, no header */
+	XNB_TEXTURE_RGBA,
+	/* Level 0 decoded to RGBA8 */
+	XNB_TEXTURE_PNG,
+};
+
+/* Files created by an export, for callers that want to know */
+struct xnb_output_list {
+	char **names;
+	int count;
+	int cap;
+};
+
+/* Add a copy of name. Returns 0 on success */
+int output_list_add(struct xnb_output_list *list, const char *name);
+void output_list_free(struct xnb_output_list *list);
+
+/*
+ * Somewhere other than the filesystem for exported files to go. Exporters
+ * don't use this directly, export_create() and export_close() do.
+ */
+struct xnb_sink {
+	/*
+	 * Returns an fd to write the file called name to, sequentially, or -1
+	 * on error. It's only valid until close().
+	 */
+	int (*create)(struct xnb_sink *sink, const char *name);
+	/* If failed is set, the file is incomplete and should be dropped */
+	int (*close)(struct xnb_sink *sink, int fd, bool failed);
+};
+
+struct xnb_export_opts {
+	enum xnb_texture_format texture_format;
+	/* Audio conversion. 0 keeps the source's rate or channel count */
+	uint32_t sample_rate;
+	int channels;
+	enum audio_sample_format sample_format;
+	/* Threads an exporter may use for decoding a single object */
+	int threads;
+	/* If set, export_create() records each file it creates here */
+	struct xnb_output_list *outputs;
+	/* If set, files are written here instead of to the filesystem */
+	struct xnb_sink *sink;
+	/* If set (and there's no sink), files are written through this */
+	struct xnb_io *io;
+	/* If set (and there's no sink), identical objects are only written once */
+	struct xnb_dedupe *dedupe;
 };
 
 struct type_reader_desc {
-	char name[MAX_NAME_LEN];
+	char *name;
 	int32_t version;
+	/* Filled in by bind_reader(), NULL if we don't support it */
+	const struct xnb_object_reader *reader;
+	/* name, without any assembly names. Filled in by bind_reader() */
+	const char *type_name;
+	/* How generic_reader decodes this type, allocated from the arena */
+	const struct xnb_plan *plan;
 };
 
 struct xnb_object_reader {
 	char name[MAX_NAME_LEN];
 	enum xnb_object_type type;
-	struct xnb_object_head *(*deserialize)(FILE *fp);
+	struct xnb_object_head *(*deserialize)(struct xnb_container *cont,
+			const struct type_reader_desc *rdr, struct xnb_cursor *cur);
+	/* Optional, for anything not allocated from the container's arena */
 	void (*destroy)(struct xnb_object_head *obj);
-	void (*print)(struct xnb_object_head *obj);
-	int (*export)(struct xnb_object_head *obj, char *basename);
+	void (*print)(struct xnb_object_head *obj, FILE *out);
+	int (*export)(struct xnb_object_head *obj,
+			const struct xnb_export_opts *opts, char *basename);
 };
 
-void dump_object(struct xnb_object_head *obj);
+void dump_object(struct xnb_object_head *obj, FILE *out);
 void destroy_object(struct xnb_object_head *obj);
-struct xnb_object_head *read_object(struct type_reader_desc *rdr, FILE *fp);
-int export_object(struct xnb_object_head *obj, char *basename);
+/*
+ * Look up the reader for rdr->name in the registry, ignoring assembly
+ * qualifications, falling back to generic_reader if it can build a plan for
+ * it. Returns 0 if one was found.
+ */
+int bind_reader(struct xnb_container *cont, struct type_reader_desc *rdr);
+struct xnb_object_head *read_object(struct xnb_container *cont,
+		struct type_reader_desc *rdr, struct xnb_cursor *cur);
+/*
+ * Read an object preceded by its 7-bit type id, as nested objects are.
+ * *obj is set to NULL for a null reference. Returns 0 on success.
+ */
+int read_nested_object(struct xnb_container *cont, struct xnb_cursor *cur,
+		struct xnb_object_head **obj);
+
+/*
+ * Build rdr->plan from name (with the assembly names stripped) if it's a
+ * reader generic_reader can handle. Returns 0 if so.
+ */
+int generic_bind(struct xnb_container *cont, struct type_reader_desc *rdr,
+		const char *name);
+
+/*
+ * For readers with nested collections, using generic_reader's plans. Each
+ * reads the type id as well as the collection.
+ */
+/* A List<elem_type> of fixed-size elements, as a view of the packed data */
+int read_packed_list(struct xnb_container *cont, struct xnb_cursor *cur,
+		const char *elem_type, const uint8_t **data, uint32_t *count);
+/* A List<Char>, decoded to code points allocated from the arena */
+int read_char_list(struct xnb_container *cont, struct xnb_cursor *cur,
+		uint32_t **chars, uint32_t *count);
+int read_nullable_char(struct xnb_container *cont, struct xnb_cursor *cur,
+		uint32_t *ch, bool *has_value);
+
+int export_object(struct xnb_object_head *obj,
+		const struct xnb_export_opts *opts, char *basename);
+
+/* Helpers for exporters */
+/* Create "basename.ext" for writing. Returns an fd, or -1 on error */
+int export_create(const struct xnb_export_opts *opts, const char *basename,
+		const char *ext);
+/*
+ * Finish a file from export_create(). res is the result of writing it, and
+ * if it's nonzero the file is known to be incomplete. Returns 0 if both
+ * writing and closing the file succeeded.
+ */
+int export_close(const struct xnb_export_opts *opts, int fd, int res);
+/* Write all of buf. Returns 0 on success */
+int export_write(int fd, const void *buf, size_t len);
+/* Write a blob, letting the kernel do the copy when it's file-backed */
+int export_write_blob(int fd, const struct xnb_blob *blob);
+
+/* For building little-endian file headers */
+static inline void put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static inline void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+#endif /* __XNB_OBJECT_H__ */
@@ -0,0 +1,198 @@
+/* Minimal streaming PNG writer
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xnb_object.h"
+#include "xnb_png.h"
+
+/* Largest stored deflate block */
+#define STORED_MAX 65535
+/* Most bytes adler32 can sum before the 32-bit accumulators could overflow */
+#define ADLER_NMAX 5552
+#define ADLER_MOD 65521
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+	uint32_t i, j, c;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *p, size_t len)
+{
+	crc = ~crc;
+	while (len--)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void adler_update(struct png_writer *png, const uint8_t *p, size_t len)
+{
+	uint32_t a = png->adler_a, b = png->adler_b;
+
+	while (len) {
+		size_t n = len < ADLER_NMAX ? len : ADLER_NMAX;
+		len -= n;
+		while (n--) {
+			a += *p++;
+			b += a;
+		}
+		a %= ADLER_MOD;
+		b %= ADLER_MOD;
+	}
+
+	png->adler_a = a;
+	png->adler_b = b;
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/*
+ * buf holds 8 bytes of space, then len bytes of chunk data, then 4 more
+ * bytes of space for the CRC
+ */
+static int write_chunk(int fd, const char *type, uint8_t *buf, size_t len)
+{
+	put_be32(buf, len);
+	memcpy(buf + 4, type, 4);
+	put_be32(buf + 8 + len, crc32_update(0, buf + 4, len + 4));
+
+	return export_write(fd, buf, len + 12);
+}
+
+int png_begin(struct png_writer *png, int fd, uint32_t width,
+		uint32_t height)
+{
+	static const uint8_t signature[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+	};
+	uint8_t ihdr[8 + 13 + 4];
+	uint8_t idat[8 + 2 + 4];
+
+	/* Keep a row (plus its filter byte) inside a single stored block */
+	if (!width || !height || width > (STORED_MAX - 1) / 4) {
+		fprintf(stderr, "Can't write a %ux%u PNG\n", width, height);
+		return -1;
+	}
+
+	pthread_once(&crc_once, crc_init);
+
+	png->fd = fd;
+	png->width = width;
+	png->height = height;
+	png->rows_written = 0;
+	png->adler_a = 1;
+	png->adler_b = 0;
+
+	if (export_write(fd, signature, sizeof(signature)))
+		return -1;
+
+	put_be32(ihdr + 8, width);
+	put_be32(ihdr + 12, height);
+	/* 8-bit, RGBA, deflate, adaptive filtering, no interlace */
+	ihdr[16] = 8;
+	ihdr[17] = 6;
+	ihdr[18] = 0;
+	ihdr[19] = 0;
+	ihdr[20] = 0;
+	if (write_chunk(fd, "IHDR", ihdr, 13))
+		return -1;
+
+	/* zlib header: deflate, 32K window, no dictionary, fastest */
+	idat[8] = 0x78;
+	idat[9] = 0x01;
+	return write_chunk(fd, "IDAT", idat, 2);
+}
+
+int png_write_rows(struct png_writer *png, const uint8_t *rows,
+		size_t stride, uint32_t n)
+{
+	size_t row_len = (size_t)png->width * 4 + 1;
+	uint32_t per_block = STORED_MAX / row_len;
+	uint32_t y = 0;
+	uint8_t *buf, *p;
+	size_t len;
+	int res;
+
+	if (n > png->height - png->rows_written) {
+		fprintf(stderr, "Too many rows for PNG\n");
+		return -1;
+	}
+
+	/* Each stored block holds as many whole rows as will fit */
+	len = (size_t)n * row_len + ((n + per_block - 1) / per_block) * 5;
+	buf = malloc(len + 12);
+	if (!buf) {
+		fprintf(stderr, "Couldn't allocate PNG row buffer\n");
+		return -1;
+	}
+
+	p = buf + 8;
+	while (y < n) {
+		uint32_t block_rows = n - y < per_block ? n - y : per_block;
+		uint16_t block_len = block_rows * row_len;
+		uint32_t i;
+
+		/* Not final, stored */
+		*p++ = 0;
+		put_le16(p, block_len);
+		put_le16(p + 2, ~block_len);
+		p += 4;
+
+		for (i = 0; i < block_rows; i++, y++) {
+			/* Filter type None */
+			*p = 0;
+			memcpy(p + 1, rows + y * stride, row_len - 1);
+			adler_update(png, p, row_len);
+			p += row_len;
+		}
+	}
+
+	res = write_chunk(png->fd, "IDAT", buf, len);
+	free(buf);
+	if (!res)
+		png->rows_written += n;
+
+	return res;
+}
+
+int png_end(struct png_writer *png)
+{
+	uint8_t idat[8 + 5 + 4 + 4];
+	uint8_t iend[8 + 4];
+
+	if (png->rows_written != png->height) {
+		fprintf(stderr, "PNG is missing %u rows\n",
+				png->height - png->rows_written);
+		return -1;
+	}
+
+	/* An empty final block, then the zlib trailer */
+	idat[8] = 1;
+	put_le16(idat + 9, 0);
+	put_le16(idat + 11, 0xffff);
+	put_be32(idat + 13, (png->adler_b << 16) | png->adler_a);
+	if (write_chunk(png->fd, "IDAT", idat, 9))
+		return -1;
+
+	return write_chunk(png->fd, "IEND", iend, 0);
+}
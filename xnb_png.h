@@ -0,0 +1,35 @@
+/* Minimal streaming PNG writer
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#ifndef __XNB_PNG_H__
+#define __XNB_PNG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Writes 8-bit RGBA images a few rows at a time, so the whole image never
+ * needs to be in memory. The image data is stored, not compressed - it's
+ * meant for handing pixels to other tools, not for distribution.
+ */
+struct png_writer {
+	int fd;
+	uint32_t width;
+	uint32_t height;
+	uint32_t rows_written;
+	/* Running zlib checksum of the image data */
+	uint32_t adler_a;
+	uint32_t adler_b;
+};
+
+/* Write the PNG signature and header to fd. Returns 0 on success */
+int png_begin(struct png_writer *png, int fd, uint32_t width,
+		uint32_t height);
+/* Append n rows of RGBA8 pixels, stride bytes apart */
+int png_write_rows(struct png_writer *png, const uint8_t *rows,
+		size_t stride, uint32_t n);
+/* Finish off the image. All of the rows must have been written */
+int png_end(struct png_writer *png);
+
+#endif /* __XNB_PNG_H__ */
@@ -0,0 +1,254 @@
+/* Work-stealing thread pool
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xnb_pool.h"
+
+/* Jobs [head, tail) belonging to one worker */
+struct pool_deque {
+	pthread_mutex_t lock;
+	int head;
+	int tail;
+};
+
+struct pool_worker {
+	struct xnb_pool *pool;
+	int idx;
+	pthread_t thread;
+	struct pool_deque deque;
+};
+
+struct xnb_pool {
+	pool_job_fn fn;
+	pool_more_fn more;
+	void *arg;
+	/*
+	 * Jobs [next, total) haven't been given to anyone yet. Only used when
+	 * streaming, when one worker at a time asks more() for new ones.
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int next;
+	int total;
+	bool fetching;
+	bool finished;
+	/* Fixed before any thread starts */
+	int n_deques;
+	/* Number of threads actually running */
+	int n_workers;
+	struct pool_worker *workers;
+};
+
+/* Take the next job from our own slice, or -1 if it's empty */
+static int pool_pop(struct pool_deque *dq)
+{
+	int job = -1;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->head < dq->tail)
+		job = dq->head++;
+	pthread_mutex_unlock(&dq->lock);
+
+	return job;
+}
+
+/*
+ * Move the back half of a victim's slice onto our own deque.
+ * Returns 0 if nobody has any work left.
+ */
+static int pool_steal(struct pool_worker *self)
+{
+	struct xnb_pool *pool = self->pool;
+	int i;
+
+	for (i = 1; i < pool->n_deques; i++) {
+		struct pool_worker *victim =
+			&pool->workers[(self->idx + i) % pool->n_deques];
+		int head, tail, n;
+
+		pthread_mutex_lock(&victim->deque.lock);
+		n = victim->deque.tail - victim->deque.head;
+		if (n <= 0) {
+			pthread_mutex_unlock(&victim->deque.lock);
+			continue;
+		}
+		/* Leave the victim the front, which it will want next */
+		n = (n + 1) / 2;
+		tail = victim->deque.tail;
+		head = tail - n;
+		victim->deque.tail = head;
+		pthread_mutex_unlock(&victim->deque.lock);
+
+		pthread_mutex_lock(&self->deque.lock);
+		self->deque.head = head;
+		self->deque.tail = tail;
+		pthread_mutex_unlock(&self->deque.lock);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Give ourselves a share of the jobs nobody has taken yet, waiting for more
+ * if there aren't any. Returns 0 once there will never be any more.
+ */
+static int pool_claim(struct pool_worker *self)
+{
+	struct xnb_pool *pool = self->pool;
+	int n, ret = 0;
+
+	if (!pool->more)
+		return 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->next == pool->total && !pool->finished) {
+		if (pool->fetching) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+
+		/* Nobody else is asking, so it's our turn */
+		pool->fetching = true;
+		n = pool->total;
+		pthread_mutex_unlock(&pool->lock);
+		n = pool->more(pool->arg, n);
+		pthread_mutex_lock(&pool->lock);
+		pool->fetching = false;
+		if (n > pool->total)
+			pool->total = n;
+		else
+			pool->finished = true;
+		pthread_cond_broadcast(&pool->cond);
+	}
+
+	n = pool->total - pool->next;
+	if (n > 0) {
+		/* Leave some for everyone else, they can steal the rest */
+		n = (n + pool->n_deques - 1) / pool->n_deques;
+
+		pthread_mutex_lock(&self->deque.lock);
+		self->deque.head = pool->next;
+		self->deque.tail = pool->next + n;
+		pthread_mutex_unlock(&self->deque.lock);
+
+		pool->next += n;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return ret;
+}
+
+static void *pool_worker_main(void *data)
+{
+	struct pool_worker *self = data;
+	struct xnb_pool *pool = self->pool;
+
+	do {
+		do {
+			int job;
+			while ((job = pool_pop(&self->deque)) >= 0)
+				pool->fn(pool->arg, self->idx, job);
+		} while (pool_steal(self));
+	} while (pool_claim(self));
+
+	return NULL;
+}
+
+static struct xnb_pool *pool_start(int n_workers, int n_jobs, pool_job_fn fn,
+		pool_more_fn more, void *arg)
+{
+	struct xnb_pool *pool;
+	int i;
+
+	if (n_workers < 1)
+		n_workers = 1;
+
+	pool = malloc(sizeof(*pool));
+	if (!pool) {
+		fprintf(stderr, "Couldn't alloc pool\n");
+		return NULL;
+	}
+	memset(pool, 0, sizeof(*pool));
+	pool->fn = fn;
+	pool->more = more;
+	pool->arg = arg;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	pool->workers = malloc(sizeof(*pool->workers) * n_workers);
+	if (!pool->workers) {
+		fprintf(stderr, "Couldn't alloc pool workers\n");
+		goto fail;
+	}
+
+	/* Hand out the jobs before any thread starts stealing */
+	pool->n_deques = n_workers;
+	for (i = 0; i < n_workers; i++) {
+		struct pool_worker *w = &pool->workers[i];
+		w->pool = pool;
+		w->idx = i;
+		pthread_mutex_init(&w->deque.lock, NULL);
+		w->deque.head = (int)((long long)n_jobs * i / n_workers);
+		w->deque.tail = (int)((long long)n_jobs * (i + 1) / n_workers);
+	}
+
+	for (i = 0; i < n_workers; i++) {
+		int res = pthread_create(&pool->workers[i].thread, NULL,
+				pool_worker_main, &pool->workers[i]);
+		if (res) {
+			fprintf(stderr, "Couldn't start worker %d: %s\n", i,
+					strerror(res));
+			break;
+		}
+		pool->n_workers++;
+	}
+
+	if (!pool->n_workers) {
+		for (i = 0; i < n_workers; i++)
+			pthread_mutex_destroy(&pool->workers[i].deque.lock);
+		free(pool->workers);
+		goto fail;
+	}
+
+	return pool;
+
+fail:
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+	return NULL;
+}
+
+struct xnb_pool *pool_create(int n_workers, int n_jobs, pool_job_fn fn,
+		void *arg)
+{
+	return pool_start(n_workers, n_jobs, fn, NULL, arg);
+}
+
+struct xnb_pool *pool_create_stream(int n_workers, pool_job_fn fn,
+		pool_more_fn more, void *arg)
+{
+	return pool_start(n_workers, 0, fn, more, arg);
+}
+
+void pool_join(struct xnb_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->n_workers; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+	for (i = 0; i < pool->n_deques; i++)
+		pthread_mutex_destroy(&pool->workers[i].deque.lock);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool);
+}
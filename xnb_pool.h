@@ -0,0 +1,42 @@
+/* Work-stealing thread pool
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#ifndef __XNB_POOL_H__
+#define __XNB_POOL_H__
+
+struct xnb_pool;
+
+/*
+ * Called once for each job index, from any worker thread. worker is the
+ * index of the calling thread, for per-thread state.
+ */
+typedef void (*pool_job_fn)(void *arg, int worker, int job);
+
+/*
+ * Start n_workers threads to run jobs [0, n_jobs). Each worker starts with
+ * a contiguous slice of the job range and works through it in order, stealing
+ * half of another worker's remaining slice when it runs out.
+ * Returns NULL on error.
+ */
+struct xnb_pool *pool_create(int n_workers, int n_jobs, pool_job_fn fn,
+		void *arg);
+
+/*
+ * For when the jobs aren't all known up front. Called from a worker once all
+ * n_jobs jobs seen so far have been handed out: it should block until there
+ * are more, and return the new total, or n_jobs if there will be no more.
+ */
+typedef int (*pool_more_fn)(void *arg, int n_jobs);
+
+/*
+ * Like pool_create(), but starting with no jobs, and asking more() for them
+ * as the workers run out.
+ */
+struct xnb_pool *pool_create_stream(int n_workers, pool_job_fn fn,
+		pool_more_fn more, void *arg);
+
+/* Wait for all jobs to finish, then free the pool */
+void pool_join(struct xnb_pool *pool);
+
+#endif /* __XNB_POOL_H__ */
@@ -0,0 +1,647 @@
+/* Persistent decoding service
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "xnb_serve.h"
+
+/*
+ * Read one "key value" line into *line, splitting it at the first space.
+ * Returns 1 for a line, 0 for the empty line ending a message, or -1 at EOF.
+ */
+static int read_line(FILE *fp, char **line, size_t *cap, char **value)
+{
+	ssize_t len = getline(line, cap, fp);
+	char *sp;
+
+	if (len < 0)
+		return -1;
+	if (len && (*line)[len - 1] == '\n')
+		(*line)[--len] = '\0';
+	if (!len)
+		return 0;
+
+	sp = strchr(*line, ' ');
+	if (sp) {
+		*sp = '\0';
+		*value = sp + 1;
+	} else {
+		*value = *line + len;
+	}
+
+	return 1;
+}
+
+/* Read n bytes of data into a buffer of *cap bytes, growing it if needed */
+static int read_data(FILE *fp, const char *value, uint8_t **data, size_t *cap,
+		size_t *size)
+{
+	unsigned long long n;
+	char *end;
+
+	errno = 0;
+	n = strtoull(value, &end, 10);
+	if (*end || errno || n > SIZE_MAX - 1) {
+		fprintf(stderr, "Invalid data size '%s'\n", value);
+		return -1;
+	}
+
+	if (n > *cap) {
+		uint8_t *p = realloc(*data, n);
+		if (!p) {
+			fprintf(stderr, "Couldn't alloc %llu bytes for request\n", n);
+			return -1;
+		}
+		*data = p;
+		*cap = n;
+	}
+
+	if (fread(*data, 1, n, fp) != n) {
+		fprintf(stderr, "Short read of request data\n");
+		return -1;
+	}
+	*size = n;
+
+	return 0;
+}
+
+static int parse_action(const char *value)
+{
+	if (!strcmp(value, "list"))
+		return SERVE_LIST;
+	else if (!strcmp(value, "export"))
+		return SERVE_EXPORT;
+	else if (!strcmp(value, "list,export") || !strcmp(value, "export,list"))
+		return SERVE_LIST | SERVE_EXPORT;
+
+	return -1;
+}
+
+static int set_string(char **dst, const char *value)
+{
+	free(*dst);
+	*dst = strdup(value);
+	return *dst ? 0 : -1;
+}
+
+/* Returns 0 on success, 1 at EOF before a request, or -1 on error */
+static int read_request(FILE *fp, struct serve_request *req)
+{
+	char *value;
+	int n_lines = 0;
+	int res;
+
+	free(req->path);
+	free(req->name);
+	free(req->prefix);
+	req->path = req->name = req->prefix = NULL;
+	req->size = 0;
+	req->actions = SERVE_LIST;
+
+	while (1) {
+		const char *key;
+		int err = 0;
+
+		res = read_line(fp, &req->line, &req->line_cap, &value);
+		/* Skip blank lines between messages */
+		if (res == 0 && !n_lines)
+			continue;
+		else if (res <= 0)
+			break;
+
+		key = req->line;
+		n_lines++;
+		if (!strcmp(key, "path"))
+			err = set_string(&req->path, value);
+		else if (!strcmp(key, "name"))
+			err = set_string(&req->name, value);
+		else if (!strcmp(key, "prefix"))
+			err = set_string(&req->prefix, value);
+		else if (!strcmp(key, "action"))
+			req->actions = parse_action(value);
+		else if (!strcmp(key, "data"))
+			err = read_data(fp, value, &req->data, &req->data_cap,
+					&req->size);
+
+		if (err)
+			return -1;
+	}
+
+	if (res < 0)
+		return n_lines ? -1 : 1;
+
+	return 0;
+}
+
+void serve_request_free(struct serve_request *req)
+{
+	free(req->path);
+	free(req->name);
+	free(req->prefix);
+	free(req->data);
+	free(req->line);
+	memset(req, 0, sizeof(*req));
+}
+
+/* Things the handler shouldn't have to check */
+static int check_request(const struct serve_request *req, FILE *out)
+{
+	if (req->actions < 0) {
+		fprintf(out, "Unknown action\n");
+		return -1;
+	} else if (!req->path && !req->name && (req->actions & SERVE_EXPORT)) {
+		fprintf(out, "Exporting data needs a name\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int write_reply(FILE *fp, int status,
+		const struct xnb_output_list *outputs, const char *log,
+		size_t log_len)
+{
+	int i;
+
+	fprintf(fp, "status %d\n", status ? 1 : 0);
+	for (i = 0; i < outputs->count; i++)
+		fprintf(fp, "output %s\n", outputs->names[i]);
+	fprintf(fp, "log %zu\n", log_len);
+	fwrite(log, 1, log_len, fp);
+	fprintf(fp, "\n");
+
+	return fflush(fp) || ferror(fp) ? -1 : 0;
+}
+
+int serve_stream(FILE *in, FILE *out, serve_fn fn, void *arg)
+{
+	struct serve_request req = { 0 };
+	struct xnb_output_list outputs = { 0 };
+	struct xnb_arena *arena;
+	int res;
+
+	arena = arena_create();
+	if (!arena)
+		return -1;
+
+	while (!(res = read_request(in, &req))) {
+		char *log = NULL;
+		size_t log_len = 0;
+		FILE *logf;
+		int status;
+
+		logf = open_memstream(&log, &log_len);
+		if (!logf) {
+			fprintf(stderr, "Couldn't buffer reply\n");
+			res = -1;
+			break;
+		}
+
+		status = check_request(&req, logf);
+		if (!status)
+			status = fn(arg, &req, arena, &outputs, logf);
+		fclose(logf);
+
+		res = write_reply(out, status, &outputs, log, log_len);
+		free(log);
+		output_list_free(&outputs);
+		if (res)
+			break;
+	}
+
+	serve_request_free(&req);
+	arena_destroy(arena);
+
+	return res < 0 ? -1 : 0;
+}
+
+struct serve_conn {
+	struct serve_server *srv;
+	int fd;
+	struct serve_conn *next;
+};
+
+/*
+ * Written to whenever the accept loop has something to look at: a signal
+ * asking it to stop, or a connection closing, freeing up a slot.
+ */
+static int wake_pipe[2] = { -1, -1 };
+
+/* Called from signal handlers, so mustn't do anything else */
+static void serve_wake(void)
+{
+	int err = errno;
+	ssize_t res = write(wake_pipe[1], "", 1);
+
+	/* If the pipe's full, there's already a wakeup waiting */
+	(void)res;
+	errno = err;
+}
+
+static int make_wake_pipe(void)
+{
+	int i;
+
+	if (pipe(wake_pipe))
+		return -1;
+
+	for (i = 0; i < 2; i++) {
+		if (fcntl(wake_pipe[i], F_SETFL, O_NONBLOCK) ||
+				fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC)) {
+			close(wake_pipe[0]);
+			close(wake_pipe[1]);
+			wake_pipe[0] = wake_pipe[1] = -1;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+struct serve_server {
+	serve_fn fn;
+	void *arg;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Open connections */
+	struct serve_conn *conns;
+	int active;
+};
+
+static void *serve_conn_main(void *data)
+{
+	struct serve_conn *conn = data;
+	struct serve_server *srv = conn->srv;
+	struct serve_conn **pp;
+	FILE *in, *out = NULL;
+	int fd;
+
+	fd = dup(conn->fd);
+	if (fd >= 0)
+		out = fdopen(fd, "w");
+
+	/* Reading uses conn->fd itself, so the server can shut it down */
+	in = fdopen(conn->fd, "r");
+	if (in && out)
+		serve_stream(in, out, srv->fn, srv->arg);
+	else
+		fprintf(stderr, "Couldn't open connection streams\n");
+
+	if (out)
+		fclose(out);
+	else if (fd >= 0)
+		close(fd);
+
+	pthread_mutex_lock(&srv->lock);
+	for (pp = &srv->conns; *pp != conn; pp = &(*pp)->next)
+		;
+	*pp = conn->next;
+	if (in)
+		fclose(in);
+	else
+		close(conn->fd);
+	free(conn);
+	srv->active--;
+	pthread_cond_broadcast(&srv->cond);
+	/* Before unlocking, as the server might be about to close the pipe */
+	serve_wake();
+	pthread_mutex_unlock(&srv->lock);
+
+	return NULL;
+}
+
+static volatile sig_atomic_t stopping;
+
+static void on_stop(int sig)
+{
+	stopping = 1;
+	serve_wake();
+}
+
+int serve_socket(const char *path, int max_conns, serve_fn fn, void *arg)
+{
+	struct serve_server srv = {
+		.fn = fn,
+		.arg = arg,
+	};
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct sigaction sa = { .sa_handler = on_stop };
+	struct serve_conn *conn;
+	sigset_t stop_set, old_set;
+	pthread_attr_t attr;
+	struct stat st;
+	int sock, pipe_fds[2], res = -1;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path '%s' is too long\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	/* Left over from a server which didn't exit cleanly */
+	if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		fprintf(stderr, "Couldn't create socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+			listen(sock, 16)) {
+		fprintf(stderr, "Couldn't listen on '%s': %s\n", path,
+				strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	/*
+	 * A client can give up between poll() and accept(), which mustn't
+	 * then block, as it would stop us noticing a signal.
+	 */
+	if (fcntl(sock, F_SETFL, O_NONBLOCK) || make_wake_pipe()) {
+		fprintf(stderr, "Couldn't set up socket: %s\n", strerror(errno));
+		close(sock);
+		unlink(path);
+		return -1;
+	}
+
+	sigemptyset(&sa.sa_mask);
+	sigemptyset(&stop_set);
+	sigaddset(&stop_set, SIGINT);
+	sigaddset(&stop_set, SIGTERM);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	/* A client going away shouldn't take the server with it */
+	signal(SIGPIPE, SIG_IGN);
+
+	pthread_mutex_init(&srv.lock, NULL);
+	pthread_cond_init(&srv.cond, NULL);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	if (max_conns < 1)
+		max_conns = 1;
+
+	while (!stopping) {
+		struct pollfd fds[2] = {
+			{ .fd = wake_pipe[0], .events = POLLIN },
+			{ .fd = sock, .events = POLLIN },
+		};
+		pthread_t thread;
+		char buf[64];
+		bool full;
+		int fd, err;
+
+		/* Only listen for new connections while there's room for them */
+		pthread_mutex_lock(&srv.lock);
+		full = srv.active >= max_conns;
+		pthread_mutex_unlock(&srv.lock);
+
+		if (poll(fds, full ? 1 : 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Couldn't wait for connections: %s\n",
+					strerror(errno));
+			goto done;
+		}
+		if (fds[0].revents) {
+			while (read(wake_pipe[0], buf, sizeof(buf)) > 0)
+				;
+			continue;
+		}
+		if (stopping)
+			break;
+
+		fd = accept(sock, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED ||
+					errno == EAGAIN || errno == EWOULDBLOCK)
+				continue;
+			fprintf(stderr, "Couldn't accept connection: %s\n",
+					strerror(errno));
+			goto done;
+		}
+
+		conn = malloc(sizeof(*conn));
+		if (!conn) {
+			fprintf(stderr, "Couldn't alloc connection\n");
+			close(fd);
+			continue;
+		}
+		conn->srv = &srv;
+		conn->fd = fd;
+
+		/* Signals should interrupt our poll(), not a connection */
+		pthread_mutex_lock(&srv.lock);
+		pthread_sigmask(SIG_BLOCK, &stop_set, &old_set);
+		err = pthread_create(&thread, &attr, serve_conn_main, conn);
+		pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+		if (err) {
+			fprintf(stderr, "Couldn't start connection thread: %s\n",
+					strerror(err));
+			close(fd);
+			free(conn);
+		} else {
+			conn->next = srv.conns;
+			srv.conns = conn;
+			srv.active++;
+		}
+		pthread_mutex_unlock(&srv.lock);
+	}
+	res = 0;
+
+done:
+	close(sock);
+	unlink(path);
+
+	/* Let requests in progress finish, but don't wait on idle clients */
+	pthread_mutex_lock(&srv.lock);
+	for (conn = srv.conns; conn; conn = conn->next)
+		shutdown(conn->fd, SHUT_RD);
+	while (srv.active)
+		pthread_cond_wait(&srv.cond, &srv.lock);
+	pthread_mutex_unlock(&srv.lock);
+
+	pthread_attr_destroy(&attr);
+	pthread_cond_destroy(&srv.cond);
+	pthread_mutex_destroy(&srv.lock);
+	/* A late signal mustn't write to whatever reuses the fd */
+	pipe_fds[0] = wake_pipe[0];
+	pipe_fds[1] = wake_pipe[1];
+	wake_pipe[0] = wake_pipe[1] = -1;
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+	return res;
+}
+
+int serve_connect(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path '%s' is too long\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't create socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		fprintf(stderr, "Couldn't connect to '%s': %s\n", path,
+				strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+pid_t serve_spawn(char *const argv[], FILE **to, FILE **from)
+{
+	int in[2], out[2];
+	pid_t pid;
+
+	if (pipe(in)) {
+		fprintf(stderr, "Couldn't create pipe: %s\n", strerror(errno));
+		return -1;
+	}
+	if (pipe(out)) {
+		fprintf(stderr, "Couldn't create pipe: %s\n", strerror(errno));
+		goto fail_in;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "Couldn't fork: %s\n", strerror(errno));
+		goto fail_out;
+	} else if (pid == 0) {
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		execvp(argv[0], argv);
+		fprintf(stderr, "Couldn't run '%s': %s\n", argv[0],
+				strerror(errno));
+		_exit(127);
+	}
+
+	close(in[0]);
+	close(out[1]);
+	*to = fdopen(in[1], "w");
+	*from = fdopen(out[0], "r");
+	if (!*to || !*from) {
+		fprintf(stderr, "Couldn't open pipes to '%s'\n", argv[0]);
+		if (*to)
+			fclose(*to);
+		else
+			close(in[1]);
+		if (*from)
+			fclose(*from);
+		else
+			close(out[0]);
+		return -1;
+	}
+
+	return pid;
+
+fail_out:
+	close(out[0]);
+	close(out[1]);
+fail_in:
+	close(in[0]);
+	close(in[1]);
+	return -1;
+}
+
+int serve_write_request(FILE *fp, const struct serve_request *req)
+{
+	static const char *actions[] = {
+		[SERVE_LIST] = "list",
+		[SERVE_EXPORT] = "export",
+		[SERVE_LIST | SERVE_EXPORT] = "list,export",
+	};
+
+	if (req->actions < 1 || req->actions > (SERVE_LIST | SERVE_EXPORT)) {
+		fprintf(stderr, "Invalid request actions %d\n", req->actions);
+		return -1;
+	}
+
+	if (req->path)
+		fprintf(fp, "path %s\n", req->path);
+	if (req->name)
+		fprintf(fp, "name %s\n", req->name);
+	if (req->prefix)
+		fprintf(fp, "prefix %s\n", req->prefix);
+	fprintf(fp, "action %s\n", actions[req->actions]);
+	if (!req->path) {
+		fprintf(fp, "data %zu\n", req->size);
+		fwrite(req->data, 1, req->size, fp);
+	}
+	fprintf(fp, "\n");
+
+	return fflush(fp) || ferror(fp) ? -1 : 0;
+}
+
+int serve_read_reply(FILE *fp, struct serve_reply *reply)
+{
+	char *line = NULL, *value;
+	size_t cap = 0, size = 0;
+	int res;
+
+	memset(reply, 0, sizeof(*reply));
+	reply->status = -1;
+
+	while ((res = read_line(fp, &line, &cap, &value)) > 0) {
+		if (!strcmp(line, "status")) {
+			reply->status = atoi(value);
+		} else if (!strcmp(line, "output")) {
+			res = output_list_add(&reply->outputs, value);
+		} else if (!strcmp(line, "log")) {
+			res = read_data(fp, value, (uint8_t **)&reply->log, &size,
+					&reply->log_len);
+		}
+
+		if (res < 0)
+			break;
+	}
+	free(line);
+
+	if (res < 0) {
+		fprintf(stderr, "Couldn't read reply\n");
+		serve_reply_free(reply);
+		return -1;
+	}
+
+	return 0;
+}
+
+void serve_reply_free(struct serve_reply *reply)
+{
+	output_list_free(&reply->outputs);
+	free(reply->log);
+	reply->log = NULL;
+	reply->log_len = 0;
+}
@@ -0,0 +1,92 @@
+/* Persistent decoding service
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#ifndef __XNB_SERVE_H__
+#define __XNB_SERVE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "xnb_arena.h"
+#include "xnb_object.h"
+
+/*
+ * A simple protocol for decoding many files without starting a process for
+ * each one, as used by xnbdec --serve.
+ *
+ * Each message is a series of "key value" lines, ended by an empty line.
+ * Values run to the end of the line, so can contain spaces. A "data N" line
+ * is followed by exactly N bytes of data, then the rest of the lines.
+ * Unknown keys are ignored.
+ *
+ * Requests can have:
+ *   path P       decode the file at P
+ *   data N       decode these N bytes instead
+ *   name NAME    base name for exported files, instead of the path.
+ *                Required for exporting data.
+ *   action A     list, export or list,export. Default is list.
+ *   prefix DIR   output prefix for exported files
+ *
+ * Replies have:
+ *   status N     0 on success
+ *   output PATH  once for each file written
+ *   log N        followed by N bytes of messages, as xnbdec would print them
+ */
+#define SERVE_LIST   (1 << 0)
+#define SERVE_EXPORT (1 << 1)
+
+struct serve_request {
+	char *path;
+	char *name;
+	char *prefix;
+	uint8_t *data;
+	size_t size;
+	int actions;
+	/* Read buffers, kept between requests */
+	size_t data_cap;
+	char *line;
+	size_t line_cap;
+};
+
+struct serve_reply {
+	int status;
+	struct xnb_output_list outputs;
+	char *log;
+	size_t log_len;
+};
+
+/*
+ * Handle one request, writing any messages to out, and adding the files
+ * written to outputs. arena is kept for the life of the connection, so is
+ * already warm. Returns 0 on success.
+ */
+typedef int (*serve_fn)(void *arg, const struct serve_request *req,
+		struct xnb_arena *arena, struct xnb_output_list *outputs, FILE *out);
+
+/* Serve requests read from in, replying on out, until in is closed */
+int serve_stream(FILE *in, FILE *out, serve_fn fn, void *arg);
+/*
+ * Listen on a Unix socket at path, serving up to max_conns connections at
+ * once, until interrupted by SIGINT or SIGTERM.
+ */
+int serve_socket(const char *path, int max_conns, serve_fn fn, void *arg);
+
+/* Client side */
+int serve_connect(const char *path);
+/*
+ * Start argv (an xnbdec --serve command) with pipes to its stdin and
+ * stdout. Returns its pid, or -1 on error.
+ */
+pid_t serve_spawn(char *const argv[], FILE **to, FILE **from);
+int serve_write_request(FILE *fp, const struct serve_request *req);
+/* Returns 0 on success */
+int serve_read_reply(FILE *fp, struct serve_reply *reply);
+void serve_reply_free(struct serve_reply *reply);
+
+/* Free anything in a request read by the server */
+void serve_request_free(struct serve_request *req);
+
+#endif /* __XNB_SERVE_H__ */
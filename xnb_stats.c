@@ -0,0 +1,287 @@
+/* Run statistics
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <time.h>
+
+#include "xnb_object.h"
+#include "xnb_stats.h"
+
+/* More than there are readers */
+#define MAX_READERS 16
+
+bool stats_enabled;
+
+struct phase_stats {
+	uint64_t wall;
+	uint64_t cpu;
+	uint64_t count;
+};
+
+struct reader_stats {
+	const struct xnb_object_reader *reader;
+	struct phase_stats read;
+	struct phase_stats export;
+	uint64_t written;
+};
+
+/* Everything is updated with atomics, as any thread can update it */
+static struct {
+	struct stats_timer start;
+	uint64_t files;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t allocs;
+	uint64_t chunks;
+	uint64_t live_bytes;
+	uint64_t peak_bytes;
+	struct phase_stats phases[STATS_N_PHASES];
+	struct reader_stats readers[MAX_READERS];
+} stats;
+
+static __thread uint64_t thread_written;
+
+static const char *phase_names[STATS_N_PHASES] = {
+	[STATS_OPEN] = "open",
+	[STATS_HEADER] = "header",
+	[STATS_DECOMPRESS] = "decompress",
+	[STATS_OBJECTS] = "objects",
+	[STATS_DUMP] = "dump",
+	[STATS_EXPORT] = "export",
+};
+
+#define ADD(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#define LOAD(p)   __atomic_load_n(p, __ATOMIC_RELAXED)
+
+static uint64_t clock_ns(clockid_t clk)
+{
+	struct timespec ts;
+	clock_gettime(clk, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_now(struct stats_timer *t)
+{
+	t->wall = clock_ns(CLOCK_MONOTONIC);
+	t->cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void stats_enable(void)
+{
+	stats_now(&stats.start);
+	stats_enabled = true;
+}
+
+static void add_time(struct phase_stats *p, const struct stats_timer *t)
+{
+	struct stats_timer end;
+
+	stats_now(&end);
+	ADD(&p->wall, end.wall - t->wall);
+	ADD(&p->cpu, end.cpu - t->cpu);
+	ADD(&p->count, 1);
+}
+
+void stats_end_phase(const struct stats_timer *t, enum stats_phase phase)
+{
+	if (stats_enabled)
+		add_time(&stats.phases[phase], t);
+}
+
+/* Find (or claim) rdr's slot. Slots are never released */
+static struct reader_stats *reader_slot(const struct xnb_object_reader *rdr)
+{
+	int i;
+
+	for (i = 0; i < MAX_READERS; i++) {
+		const struct xnb_object_reader *cur = NULL;
+		struct reader_stats *r = &stats.readers[i];
+
+		if (__atomic_compare_exchange_n(&r->reader, &cur, rdr, false,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || cur == rdr)
+			return r;
+	}
+
+	return NULL;
+}
+
+void stats_end_read(const struct stats_timer *t,
+		const struct xnb_object_reader *rdr)
+{
+	struct reader_stats *r;
+
+	if (!stats_enabled)
+		return;
+
+	r = reader_slot(rdr);
+	if (r)
+		add_time(&r->read, t);
+}
+
+void stats_end_export(const struct stats_timer *t,
+		const struct xnb_object_reader *rdr, uint64_t written_before)
+{
+	struct reader_stats *r;
+
+	if (!stats_enabled)
+		return;
+
+	r = reader_slot(rdr);
+	if (r) {
+		add_time(&r->export, t);
+		ADD(&r->written, thread_written - written_before);
+	}
+}
+
+void stats_add_file(void)
+{
+	if (stats_enabled)
+		ADD(&stats.files, 1);
+}
+
+void stats_add_read(uint64_t bytes)
+{
+	if (stats_enabled)
+		ADD(&stats.bytes_read, bytes);
+}
+
+void stats_add_written(uint64_t bytes)
+{
+	if (stats_enabled) {
+		ADD(&stats.bytes_written, bytes);
+		thread_written += bytes;
+	}
+}
+
+uint64_t stats_thread_written(void)
+{
+	return thread_written;
+}
+
+void stats_add_alloc(size_t size)
+{
+	uint64_t live, peak;
+
+	ADD(&stats.allocs, 1);
+	live = ADD(&stats.live_bytes, size) + size;
+	peak = LOAD(&stats.peak_bytes);
+	while (live > peak && !__atomic_compare_exchange_n(&stats.peak_bytes,
+				&peak, live, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void stats_add_chunk(void)
+{
+	ADD(&stats.chunks, 1);
+}
+
+void stats_release(size_t size)
+{
+	__atomic_fetch_sub(&stats.live_bytes, size, __ATOMIC_RELAXED);
+}
+
+static double secs(uint64_t ns)
+{
+	return ns / 1e9;
+}
+
+static double msecs(uint64_t ns)
+{
+	return ns / 1e6;
+}
+
+void stats_print(FILE *out)
+{
+	struct stats_timer now;
+	int i;
+
+	stats_now(&now);
+
+	fprintf(out, "Statistics\n");
+	fprintf(out, "==========\n");
+	fprintf(out, "Files: %llu\n", (unsigned long long)stats.files);
+	fprintf(out, "Wall time: %.3f ms\n", msecs(now.wall - stats.start.wall));
+	fprintf(out, "Bytes read: %llu\n", (unsigned long long)stats.bytes_read);
+	fprintf(out, "Bytes written: %llu\n",
+			(unsigned long long)stats.bytes_written);
+	fprintf(out, "Allocations: %llu (%llu chunks)\n",
+			(unsigned long long)stats.allocs,
+			(unsigned long long)stats.chunks);
+	fprintf(out, "Peak allocated: %llu bytes\n",
+			(unsigned long long)stats.peak_bytes);
+	fprintf(out, "\n");
+
+	fprintf(out, "%-12s %10s %12s %12s\n", "Phase", "Count", "Wall (ms)",
+			"CPU (ms)");
+	for (i = 0; i < STATS_N_PHASES; i++) {
+		struct phase_stats *p = &stats.phases[i];
+		fprintf(out, "%-12s %10llu %12.3f %12.3f\n", phase_names[i],
+				(unsigned long long)p->count, msecs(p->wall), msecs(p->cpu));
+	}
+	fprintf(out, "\n");
+
+	/* Times include any nested objects */
+	fprintf(out, "%-50s %8s %10s %10s %8s %10s %10s %12s\n", "Reader",
+			"Read", "Wall (ms)", "CPU (ms)", "Exported", "Wall (ms)",
+			"CPU (ms)", "Written");
+	for (i = 0; i < MAX_READERS && stats.readers[i].reader; i++) {
+		struct reader_stats *r = &stats.readers[i];
+		fprintf(out, "%-50s %8llu %10.3f %10.3f %8llu %10.3f %10.3f %12llu\n",
+				r->reader->name,
+				(unsigned long long)r->read.count, msecs(r->read.wall),
+				msecs(r->read.cpu),
+				(unsigned long long)r->export.count, msecs(r->export.wall),
+				msecs(r->export.cpu), (unsigned long long)r->written);
+	}
+}
+
+static void print_phase_json(const struct phase_stats *p, FILE *out)
+{
+	fprintf(out, "{ \"count\": %llu, \"wall_s\": %.6f, \"cpu_s\": %.6f }",
+			(unsigned long long)p->count, secs(p->wall), secs(p->cpu));
+}
+
+void stats_print_json(FILE *out)
+{
+	struct stats_timer now;
+	int i;
+
+	stats_now(&now);
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"files\": %llu,\n", (unsigned long long)stats.files);
+	fprintf(out, "  \"wall_s\": %.6f,\n", secs(now.wall - stats.start.wall));
+	fprintf(out, "  \"bytes_read\": %llu,\n",
+			(unsigned long long)stats.bytes_read);
+	fprintf(out, "  \"bytes_written\": %llu,\n",
+			(unsigned long long)stats.bytes_written);
+	fprintf(out, "  \"allocations\": %llu,\n",
+			(unsigned long long)stats.allocs);
+	fprintf(out, "  \"chunks\": %llu,\n", (unsigned long long)stats.chunks);
+	fprintf(out, "  \"peak_bytes\": %llu,\n",
+			(unsigned long long)stats.peak_bytes);
+
+	fprintf(out, "  \"phases\": {\n");
+	for (i = 0; i < STATS_N_PHASES; i++) {
+		fprintf(out, "    \"%s\": ", phase_names[i]);
+		print_phase_json(&stats.phases[i], out);
+		fprintf(out, "%s\n", i == STATS_N_PHASES - 1 ? "" : ",");
+	}
+	fprintf(out, "  },\n");
+
+	/* Reader names don't need any escaping */
+	fprintf(out, "  \"readers\": [");
+	for (i = 0; i < MAX_READERS && stats.readers[i].reader; i++) {
+		struct reader_stats *r = &stats.readers[i];
+		fprintf(out, "%s\n    { \"name\": \"%s\", \"read\": ", i ? "," : "",
+				r->reader->name);
+		print_phase_json(&r->read, out);
+		fprintf(out, ", \"export\": ");
+		print_phase_json(&r->export, out);
+		fprintf(out, ", \"bytes_written\": %llu }",
+				(unsigned long long)r->written);
+	}
+	fprintf(out, "\n  ]\n}\n");
+}
@@ -0,0 +1,72 @@
+/* Run statistics
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ */
+
+#ifndef __XNB_STATS_H__
+#define __XNB_STATS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct xnb_object_reader;
+
+/*
+ * Counters for where a run spends its time, for --stats. There's one set for
+ * the whole process, shared by every thread and arena. Everything is a no-op
+ * until stats_enable() is called, and all of it can be called from any
+ * thread.
+ */
+enum stats_phase {
+	/* Opening and mapping input files */
+	STATS_OPEN,
+	/* Container header and reader table */
+	STATS_HEADER,
+	STATS_DECOMPRESS,
+	/* Top-level objects */
+	STATS_OBJECTS,
+	STATS_DUMP,
+	STATS_EXPORT,
+	STATS_N_PHASES,
+};
+
+extern bool stats_enabled;
+
+/* Wall and CPU (for the calling thread) time at the start of something */
+struct stats_timer {
+	uint64_t wall;
+	uint64_t cpu;
+};
+
+void stats_enable(void);
+void stats_now(struct stats_timer *t);
+
+static inline void stats_start(struct stats_timer *t)
+{
+	if (stats_enabled)
+		stats_now(t);
+}
+
+void stats_end_phase(const struct stats_timer *t, enum stats_phase phase);
+/* Times are inclusive of any nested objects */
+void stats_end_read(const struct stats_timer *t,
+		const struct xnb_object_reader *rdr);
+void stats_end_export(const struct stats_timer *t,
+		const struct xnb_object_reader *rdr, uint64_t written_before);
+
+void stats_add_file(void);
+void stats_add_read(uint64_t bytes);
+void stats_add_written(uint64_t bytes);
+/* Bytes written so far by the calling thread */
+uint64_t stats_thread_written(void);
+
+/* For the arena allocator */
+void stats_add_alloc(size_t size);
+void stats_add_chunk(void);
+void stats_release(size_t size);
+
+void stats_print(FILE *out);
+void stats_print_json(FILE *out);
+
+#endif /* __XNB_STATS_H__ */
@@ -0,0 +1,202 @@
+/* XNB decoding client
+ * Copyright Brian Starkey 2014 <stark3y@gmail.com>
+ *
+ * Sends files to xnbdec --serve, either one already listening on a socket,
+ * or one started just for this run.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "xnb.h"
+
+void print_usage(int argc, char *argv[])
+{
+ printf("Usage: %s [OPTION]... [ACTION]... FILE...\n"
+ "\n"
+ "Decode XNB container FILE(s) using xnbdec --serve\n"
+ "\n"
+ " Options:\n"
+ " -S  --socket=PATH Connect to xnbdec --serve=PATH. Otherwise, start\n"
+ "         xnbdec --serve and talk to it over a pipe.\n"
+ " -x  --xnbdec=PATH The xnbdec to start, if there's no socket\n"
+ " -d  --data Send the files' contents, not their paths, so the server\n"
+ "         doesn't need to be able to read them\n"
+ " -q  --quiet Don't print the server's messages\n"
+ "\n"
+ " Actions:\n"
+ " -l --list Print information about the container\n"
+ "         (this is the default action if another is not specified)\n"
+ " -e --export Export the container's object(s) to file(s)\n"
+ " -o --output-prefix=dir Prepend this path to all output filenames\n",
+ argv[0]);
+}
+
+static int read_whole_file(const char *path, struct serve_request *req)
+{
+	struct xnb_mapping map;
+
+	if (map_file(path, &map)) {
+		fprintf(stderr, "Opening '%s' for reading failed\n", path);
+		return -1;
+	}
+
+	if (map.size > req->data_cap) {
+		uint8_t *p = realloc(req->data, map.size);
+		if (!p) {
+			fprintf(stderr, "Couldn't alloc space for '%s'\n", path);
+			unmap_file(&map);
+			return -1;
+		}
+		req->data = p;
+		req->data_cap = map.size;
+	}
+	memcpy(req->data, map.addr, map.size);
+	req->size = map.size;
+	unmap_file(&map);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"socket",  required_argument, NULL, 'S' },
+		{"xnbdec",  required_argument, NULL, 'x' },
+		{"data",    no_argument,       NULL, 'd' },
+		{"quiet",   no_argument,       NULL, 'q' },
+		{"list",    no_argument,       NULL, 'l' },
+		{"export",  no_argument,       NULL, 'e' },
+		{"output-prefix", required_argument, NULL, 'o' },
+		{ NULL, 0, NULL, 0 },
+	};
+	struct serve_request req = { 0 };
+	char *server_argv[] = { "xnbdec", "--serve", NULL };
+	const char *socket_path = NULL;
+	bool data = false, quiet = false;
+	FILE *to = NULL, *from = NULL;
+	pid_t pid = -1;
+	int failed = 0;
+	int opt, i, res = 1;
+
+	while ((opt = getopt_long(argc, argv, "S:x:dqleo:", long_options,
+					NULL)) != -1) {
+		switch (opt) {
+		case 'S':
+			socket_path = optarg;
+			break;
+		case 'x':
+			server_argv[0] = optarg;
+			break;
+		case 'd':
+			data = true;
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		case 'l':
+			req.actions |= SERVE_LIST;
+			break;
+		case 'e':
+			req.actions |= SERVE_EXPORT;
+			break;
+		case 'o':
+			req.prefix = optarg;
+			break;
+		default:
+			print_usage(argc, argv);
+			return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		print_usage(argc, argv);
+		return 1;
+	}
+
+	if (!req.actions)
+		req.actions = SERVE_LIST;
+
+	if (socket_path) {
+		int fd = serve_connect(socket_path);
+		if (fd < 0)
+			return 1;
+
+		to = fdopen(fd, "w");
+		if (!to) {
+			close(fd);
+		} else {
+			fd = dup(fd);
+			from = fd >= 0 ? fdopen(fd, "r") : NULL;
+			if (fd >= 0 && !from)
+				close(fd);
+		}
+	} else {
+		pid = serve_spawn(server_argv, &to, &from);
+		if (pid < 0)
+			return 1;
+	}
+	if (!to || !from) {
+		fprintf(stderr, "Couldn't open connection to the server\n");
+		goto done;
+	}
+
+	for (i = optind; i < argc; i++) {
+		struct serve_reply reply;
+		int j;
+
+		if (data) {
+			if (read_whole_file(argv[i], &req)) {
+				failed++;
+				continue;
+			}
+			req.path = NULL;
+			req.name = argv[i];
+		} else {
+			req.path = argv[i];
+		}
+
+		if (serve_write_request(to, &req) || serve_read_reply(from, &reply)) {
+			fprintf(stderr, "Lost connection to the server\n");
+			goto done;
+		}
+
+		if (!quiet) {
+			fwrite(reply.log, 1, reply.log_len, stdout);
+			for (j = 0; j < reply.outputs.count; j++)
+				printf("Wrote %s\n", reply.outputs.names[j]);
+		}
+		if (reply.status) {
+			fprintf(stderr, "Couldn't decode '%s'\n", argv[i]);
+			failed++;
+		}
+		serve_reply_free(&reply);
+	}
+
+	if (failed)
+		fprintf(stderr, "%d of %d file(s) failed\n", failed, argc - optind);
+	res = failed ? 1 : 0;
+
+done:
+	/* Closing our end tells a spawned server to exit */
+	if (to)
+		fclose(to);
+	if (from)
+		fclose(from);
+	if (pid > 0) {
+		int status;
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+				WEXITSTATUS(status))
+			res = 1;
+	}
+	free(req.data);
+
+	return res;
+}
@@ -2,89 +2,137 @@
  * Copyright Brian Starkey 2014 <stark3y@gmail.com>
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#include "xnb_object.h"
+#include "xnb.h"
+#include "xnb_bcn.h"
+#include "xnb_cache.h"
+#include "xnb_hash.h"
+#include "xnb_input.h"
+#include "xnb_io.h"
+#include "xnb_pool.h"
+#include "xnb_serve.h"
+#include "xnb_stats.h"
 
 enum actions {
 	ACTION_LIST =   (1 << 0),
 	ACTION_EXPORT = (1 << 1),
+	ACTION_SELF_TEST = (1 << 2),
+};
+
+/* Reads and writes each I/O engine can have in flight */
+#define IO_DEPTH   64
+/*
+ * Files read ahead of the one being decoded, when decoding one at a time,
+ * up to a total of READ_AHEAD_BYTES
+ */
+#define READ_AHEAD       16
+#define READ_AHEAD_BYTES (64 << 20)
+
+enum stats_format {
+	STATS_NONE,
+	STATS_TEXT,
+	STATS_JSON,
 };
 
+/*
+ * Filled in by parse_options(), and read-only after that, so that it can be
+ * shared between worker threads.
+ */
 struct exec_context {
 	bool quiet;
+	enum stats_format stats;
 	int actions;
+	int jobs;
 	char *basename;
 	char *output_prefix;
-	int n_input_files;
-	char **input_files;
+	/* Name of the archive to export into, rather than separate files */
+	char *archive;
+	bool use_cache;
+	/* Opened in main() if exporting to an output prefix */
+	struct xnb_cache *cache;
+	struct xnb_export_opts export_opts;
+	struct input_list *inputs;
+	/*
+	 * true if names are still being added to inputs while decoding, so
+	 * the total isn't known
+	 */
+	bool streamed;
+	/* Where to read the list of inputs from, for --file */
+	int list_fd;
+	char list_delim;
+	/* Inputs to add as they're found, when some of them are directories */
+	char **paths;
+	int n_paths;
+	bool serve;
+	/* Unix socket to listen on for --serve, or NULL for stdin/stdout */
+	char *serve_path;
+	/* Use an I/O engine for batch runs, rather than blocking I/O */
+	bool use_io;
+	enum xnb_io_backend io_backend;
+	/* Link identical exported objects together, rather than rewriting them */
+	bool dedupe;
+	enum xnb_link_mode link_mode;
 };
 
 struct exec_context ctx = {
 	.quiet = false,
+	.stats = STATS_NONE,
 	.actions = 0,
+	.jobs = 1,
 	.basename = NULL,
 	.output_prefix = NULL,
-	.n_input_files = 0,
-	.input_files = NULL,
+	.archive = NULL,
+	.use_cache = true,
+	.cache = NULL,
+	.export_opts = {
+		.texture_format = XNB_TEXTURE_DDS,
+		.sample_rate = 0,
+		.channels = 0,
+		.sample_format = AUDIO_S16,
+		.threads = 1,
+	},
+	.inputs = NULL,
+	.streamed = false,
+	.list_fd = -1,
+	.list_delim = '\n',
+	.paths = NULL,
+	.n_paths = 0,
+	.serve = false,
+	.serve_path = NULL,
+	.use_io = false,
+	.io_backend = XNB_IO_AUTO,
+	.dedupe = false,
+	.link_mode = XNB_LINK_HARD,
 };
 
-/* Returns the number of filenames found, or < 0 on error */
-int read_file_list(char *filename, char ***file_list)
-{
-	FILE *fp;
-	char buf[MAX_NAME_LEN];
-	int n_files = 0;
-	int res = 0;
-
-	fp = fopen(filename, "r");
-	if (!fp) {
-		fprintf(stderr, "Couldn't open '%s' for reading\n", filename);
-		return -1;
-	}
-
-	/* One pass to count files */
-	while (fgets(buf, MAX_NAME_LEN, fp)) {
-		n_files++;
-	}
-	*file_list = malloc(sizeof(**file_list) * n_files);
-	if (!*file_list) {
-		fprintf(stderr, "Couldn't allocate space for input files\n");
-		res = -1;
-		goto done;
-	}
-
-	/* Second pass to read them */
-	fseek(fp, 0, SEEK_SET);
-	n_files = 0;
-	while (fgets(buf, MAX_NAME_LEN, fp)) {
-		char *infile = malloc(strlen(buf));;
-		(*file_list)[n_files] = infile;
-		strncpy(infile, buf, strlen(buf) - 1);
-		infile[strlen(buf) - 1] = '\0';
-		n_files++;
-	}
-
-done:
-	fclose(fp);
-	return res < 0 ? res : n_files;
-
-}
-
 /*
  * Usage: xnbdec [OPTION]... [ACTION]... FILE...
  *
- * Decode XNB container FILE(s)
+ * Decode XNB container FILE(s), or a list of them from standard input. If
+ * FILE is a directory, the .xnb files under it are decoded as they're found.
  *
  * Options:
  * -f  --file FILE should be treated as a list of input files, one per line.
+ *         With no FILE, or "-", the list is read from standard input, and
+ *         decoding starts while it's still being read.
+ * -0  --null Names in the input list are separated by NUL characters (as
+ *         from find -print0) instead of newlines. Implies --file.
  * -q  --quiet Suppress output
+ * -j  --jobs=N Decode up to N files in parallel (0 means one per CPU)
  *
  * Actions:
  * -l --list Print information about the container
@@ -92,17 +140,58 @@ done:
  * -e --export[=basename] Export the container's object(s) to file(s), using
  *         basename as the base filename if specified. Note that basename may
  *         not be specified if there are multiple input files.
- * -o --output-prefix=dir Prepend this path to all output filenames
+ * -o --output-prefix=dir Prepend this path to all output filenames,
+ *         creating it and any directories under it as needed. Files found
+ *         in a directory keep their place relative to it. A manifest of
+ *         what was exported is kept there, and inputs which haven't
+ *         changed since are skipped entirely.
+ * --no-cache Export everything, ignoring (and rewriting) the manifest
+ * -a --archive=name Export everything into one indexed archive, called name
+ *         (under the output prefix, if there is one), instead of separate
+ *         files. The manifest isn't used.
+ * -t --texture-format=dds|rgba|png Format for exported textures. rgba and
+ *         png decode the top mip level to 8-bit RGBA. Default is dds.
+ * -r --rate=HZ Resample exported audio to HZ
+ * -s --sample-format=s16|f32 Sample format for exported audio. Default is s16.
+ * -c --channels=mono|stereo|N Mix exported audio to this many channels
+ * --dedupe[=hardlink|reflink] Export each distinct object only once. Later
+ *         objects identical to one already exported get links to its files,
+ *         and the bytes saved are reported at the end. Hardlinks (the
+ *         default) share one inode, so editing one file changes them all.
+ *         Reflinks don't, but need a filesystem which supports them.
+ *
+ * --stats[=text|json] Print where the time went to stderr at the end of the
+ *         run: time per phase, bytes, allocations and a per-reader breakdown
+ * --self-test Check the vectorized decoders against the reference ones
+ * --serve[=socket] Instead of decoding FILEs, keep running and decode files
+ *         as requested over stdin/stdout, or a Unix socket, so that callers
+ *         don't pay for starting a process each time. Requests choose
+ *         their own output prefix, so -o, --archive, --no-cache, --io and
+ *         --dedupe can't be used with it, but the other options apply to
+ *         every request. See xnb_serve.h for the protocol, and xnbclient
+ *         for a client.
+ * --io[=sync|auto|uring|threads] How to read and write files. sync (the
+ *         default) does one blocking read or write at a time. The others
+ *         keep many in flight, using io_uring, a pool of I/O threads, or
+ *         io_uring if the kernel has it and threads if not (the default
+ *         with no argument). Without --jobs, the next few files are read
+ *         while one is decoded.
  */
 void print_usage(int argc, char *argv[])
 {
  printf("Usage: %s [OPTION]... [ACTION]... [FILE]...\n"
  "\n"
- "Decode XNB container FILE(s) or standard input\n"
+ "Decode XNB container FILE(s), or a list of them from standard input. If\n"
+ "FILE is a directory, the .xnb files under it are decoded as they're found.\n"
  "\n"
  " Options:\n"
  " -f  --file FILE should be treated as a list of input files, one per line.\n"
+ "         With no FILE, or \"-\", the list is read from standard input, and\n"
+ "         decoding starts while it's still being read.\n"
+ " -0  --null Names in the input list are separated by NUL characters (as\n"
+ "         from find -print0) instead of newlines. Implies --file.\n"
  " -q  --quiet Suppress output\n"
+ " -j  --jobs=N Decode up to N files in parallel (0 means one per CPU)\n"
  "\n"
  " Actions:\n"
  " -l --list Print information about the container\n"
@@ -110,16 +199,74 @@ void print_usage(int argc, char *argv[])
  " -e --export[=basename] Export the container's object(s) to file(s), using\n"
  "         basename as the base filename if specified. Note that basename\n"
  "         may not be specified if there are multiple input files.\n"
- " -o --output-prefix=dir Prepend this path to all output filenames\n",
+ " -o --output-prefix=dir Prepend this path to all output filenames,\n"
+ "         creating it and any directories under it as needed. Files found\n"
+ "         in a directory keep their place relative to it. A manifest of\n"
+ "         what was exported is kept there, and inputs which haven't\n"
+ "         changed since are skipped entirely.\n"
+ " --no-cache Export everything, ignoring (and rewriting) the manifest\n"
+ " -a --archive=name Export everything into one indexed archive, called name\n"
+ "         (under the output prefix, if there is one), instead of separate\n"
+ "         files. The manifest isn't used.\n"
+ " -t --texture-format=dds|rgba|png Format for exported textures. rgba and\n"
+ "         png decode the top mip level to 8-bit RGBA. Default is dds.\n"
+ " -r --rate=HZ Resample exported audio to HZ\n"
+ " -s --sample-format=s16|f32 Sample format for exported audio. Default is s16.\n"
+ " -c --channels=mono|stereo|N Mix exported audio to this many channels\n"
+ " --dedupe[=hardlink|reflink] Export each distinct object only once. Later\n"
+ "         objects identical to one already exported get links to its files,\n"
+ "         and the bytes saved are reported at the end. Hardlinks (the\n"
+ "         default) share one inode, so editing one file changes them all.\n"
+ "         Reflinks don't, but need a filesystem which supports them.\n"
+ "\n"
+ " --stats[=text|json] Print where the time went to stderr at the end of the\n"
+ "         run: time per phase, bytes, allocations and a per-reader breakdown\n"
+ " --self-test Check the vectorized decoders against the reference ones\n"
+ " --serve[=socket] Instead of decoding FILEs, keep running and decode files\n"
+ "         as requested over stdin/stdout, or a Unix socket, so that callers\n"
+ "         don't pay for starting a process each time. Requests choose\n"
+ "         their own output prefix, so -o, --archive, --no-cache, --io and\n"
+ "         --dedupe can't be used with it, but the other options apply to\n"
+ "         every request. See xnb_serve.h for the protocol, and xnbclient\n"
+ "         for a client.\n"
+ " --io[=sync|auto|uring|threads] How to read and write files. sync (the\n"
+ "         default) does one blocking read or write at a time. The others\n"
+ "         keep many in flight, using io_uring, a pool of I/O threads, or\n"
+ "         io_uring if the kernel has it and threads if not (the default\n"
+ "         with no argument). Without --jobs, the next few files are read\n"
+ "         while one is decoded.\n",
  argv[0]);
 }
 
+/* Long-only options */
+enum {
+	OPT_SELF_TEST = 256,
+	OPT_NO_CACHE,
+	OPT_STATS,
+	OPT_SERVE,
+	OPT_IO,
+	OPT_DEDUPE,
+};
+
 static struct option long_options[] = {
 	{"file",    no_argument,       NULL, 'f' },
+	{"null",    no_argument,       NULL, '0' },
 	{"quiet",   no_argument,       NULL, 'q' },
+	{"jobs",    required_argument, NULL, 'j' },
 	{"list",    no_argument,       NULL, 'l' },
 	{"export",  optional_argument, NULL, 'e' },
 	{"output-prefix", required_argument, NULL, 'o' },
+	{"archive", required_argument,     NULL, 'a' },
+	{"texture-format", required_argument, NULL, 't' },
+	{"rate",    required_argument, NULL, 'r' },
+	{"sample-format", required_argument, NULL, 's' },
+	{"channels", required_argument, NULL, 'c' },
+	{"self-test", no_argument,         NULL, OPT_SELF_TEST },
+	{"no-cache", no_argument,          NULL, OPT_NO_CACHE },
+	{"stats",   optional_argument,     NULL, OPT_STATS },
+	{"serve",   optional_argument,     NULL, OPT_SERVE },
+	{"io",      optional_argument,     NULL, OPT_IO },
+	{"dedupe",  optional_argument,     NULL, OPT_DEDUPE },
 	{ "", 0, NULL, 0 },
 };
 
@@ -128,9 +275,10 @@ int parse_options(int argc, char *argv[])
 	bool input_list = false;
 	int opt_index;
 	int opt;
+	char *end;
 
 	while (1) {
-		opt = getopt_long(argc, argv, ":fqle::o:", long_options, &opt_index);
+		opt = getopt_long(argc, argv, ":f0qj:le::o:a:t:r:s:c:", long_options, &opt_index);
 		if (opt == -1)
 			break;
 
@@ -138,9 +286,24 @@ int parse_options(int argc, char *argv[])
 		case 'f':
 			input_list = true;
 			break;
+		case '0':
+			input_list = true;
+			ctx.list_delim = '\0';
+			break;
 		case 'q':
 			ctx.quiet = true;
 			break;
+		case 'j':
+			ctx.jobs = strtol(optarg, &end, 10);
+			if (*end || ctx.jobs < 0) {
+				fprintf(stderr, "Invalid job count '%s'\n", optarg);
+				return -1;
+			}
+			if (ctx.jobs == 0)
+				ctx.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+			if (ctx.jobs < 1)
+				ctx.jobs = 1;
+			break;
 		case 'l':
 			ctx.actions |= ACTION_LIST;
 			break;
@@ -151,6 +314,97 @@ int parse_options(int argc, char *argv[])
 		case 'o':
 			ctx.output_prefix = optarg;
 			break;
+		case 'a':
+			ctx.archive = optarg;
+			break;
+		case 't':
+			if (!strcmp(optarg, "dds")) {
+				ctx.export_opts.texture_format = XNB_TEXTURE_DDS;
+			} else if (!strcmp(optarg, "rgba")) {
+				ctx.export_opts.texture_format = XNB_TEXTURE_RGBA;
+			} else if (!strcmp(optarg, "png")) {
+				ctx.export_opts.texture_format = XNB_TEXTURE_PNG;
+			} else {
+				fprintf(stderr, "Unknown texture format '%s'\n", optarg);
+				return -1;
+			}
+			break;
+		case 'r':
+			ctx.export_opts.sample_rate = strtoul(optarg, &end, 10);
+			if (*end || !ctx.export_opts.sample_rate) {
+				fprintf(stderr, "Invalid sample rate '%s'\n", optarg);
+				return -1;
+			}
+			break;
+		case 's':
+			if (!strcmp(optarg, "s16")) {
+				ctx.export_opts.sample_format = AUDIO_S16;
+			} else if (!strcmp(optarg, "f32")) {
+				ctx.export_opts.sample_format = AUDIO_F32;
+			} else {
+				fprintf(stderr, "Unknown sample format '%s'\n", optarg);
+				return -1;
+			}
+			break;
+		case 'c':
+			if (!strcmp(optarg, "mono")) {
+				ctx.export_opts.channels = 1;
+			} else if (!strcmp(optarg, "stereo")) {
+				ctx.export_opts.channels = 2;
+			} else {
+				ctx.export_opts.channels = strtol(optarg, &end, 10);
+				if (*end || ctx.export_opts.channels < 1) {
+					fprintf(stderr, "Invalid channel layout '%s'\n", optarg);
+					return -1;
+				}
+			}
+			break;
+		case OPT_SELF_TEST:
+			ctx.actions |= ACTION_SELF_TEST;
+			break;
+		case OPT_NO_CACHE:
+			ctx.use_cache = false;
+			break;
+		case OPT_STATS:
+			if (!optarg || !strcmp(optarg, "text")) {
+				ctx.stats = STATS_TEXT;
+			} else if (!strcmp(optarg, "json")) {
+				ctx.stats = STATS_JSON;
+			} else {
+				fprintf(stderr, "Unknown stats format '%s'\n", optarg);
+				return -1;
+			}
+			break;
+		case OPT_SERVE:
+			ctx.serve = true;
+			ctx.serve_path = optarg;
+			break;
+		case OPT_IO:
+			ctx.use_io = true;
+			if (!optarg || !strcmp(optarg, "auto")) {
+				ctx.io_backend = XNB_IO_AUTO;
+			} else if (!strcmp(optarg, "uring")) {
+				ctx.io_backend = XNB_IO_URING;
+			} else if (!strcmp(optarg, "threads")) {
+				ctx.io_backend = XNB_IO_THREADS;
+			} else if (!strcmp(optarg, "sync")) {
+				ctx.use_io = false;
+			} else {
+				fprintf(stderr, "Unknown I/O method '%s'\n", optarg);
+				return -1;
+			}
+			break;
+		case OPT_DEDUPE:
+			ctx.dedupe = true;
+			if (!optarg || !strcmp(optarg, "hardlink")) {
+				ctx.link_mode = XNB_LINK_HARD;
+			} else if (!strcmp(optarg, "reflink")) {
+				ctx.link_mode = XNB_LINK_REFLINK;
+			} else {
+				fprintf(stderr, "Unknown link type '%s'\n", optarg);
+				return -1;
+			}
+			break;
 		case ':':
 			fprintf(stderr, "Missing argument\n");
 			return -1;
@@ -164,267 +418,621 @@ int parse_options(int argc, char *argv[])
 		ctx.actions |= ACTION_LIST;
 	}
 
-	if (optind < argc) {
-		ctx.n_input_files = argc - optind;
-		if (input_list) {
-			if (ctx.n_input_files != 1) {
-				fprintf(stderr,
-						"Only a single input file may be used with --file\n");
-				return -1;
-			}
-			ctx.n_input_files = read_file_list(argv[optind], &ctx.input_files);
-			if (ctx.n_input_files < 0) {
-				return -1;
-			}
+	if (ctx.serve && (input_list || optind < argc)) {
+		fprintf(stderr, "Input files can't be given with --serve\n");
+		return -1;
+	}
+
+	/* These are all set up per run, which a server never finishes */
+	if (ctx.serve && (ctx.output_prefix || ctx.archive || !ctx.use_cache ||
+				ctx.use_io || ctx.dedupe)) {
+		fprintf(stderr, "-o, --archive, --no-cache, --io and --dedupe "
+				"can't be used with --serve\n");
+		return -1;
+	}
+
+	ctx.inputs = input_list_create();
+	if (!ctx.inputs)
+		return -1;
+
+	if (input_list) {
+		const char *list = optind < argc ? argv[optind] : "-";
+
+		if (argc - optind > 1) {
+			fprintf(stderr,
+					"Only a single input file may be used with --file\n");
+			return -1;
+		}
+
+		if (!strcmp(list, "-")) {
+			ctx.list_fd = STDIN_FILENO;
 		} else {
-			int i;
-			ctx.input_files =
-				malloc(sizeof(*ctx.input_files) * ctx.n_input_files);
-			if (!ctx.input_files) {
-				fprintf(stderr,
-						"Couldn't allocate space for input filenames\n");
-				ctx.n_input_files = 0;
+			ctx.list_fd = open(list, O_RDONLY);
+			if (ctx.list_fd < 0) {
+				fprintf(stderr, "Couldn't open '%s' for reading\n", list);
+				return -1;
 			}
-			for (i = 0; i < ctx.n_input_files; i++) {
-				char *infile = argv[optind + i];
-				ctx.input_files[i] = malloc(strlen(infile) + 1);
-				if (!ctx.input_files[i]) {
-					fprintf(stderr, "Couldn't allocate input filename\n");
-					ctx.n_input_files = i;
-				}
-				strcpy(ctx.input_files[i], infile);
+		}
+	} else {
+		struct stat st;
+		int i;
+
+		/* Directories can take a while to walk, so do it while decoding */
+		for (i = optind; i < argc; i++) {
+			if (!stat(argv[i], &st) && S_ISDIR(st.st_mode)) {
+				ctx.paths = &argv[optind];
+				ctx.n_paths = argc - optind;
+				return 0;
 			}
 		}
+
+		for (i = optind; i < argc; i++) {
+			if (input_list_add(ctx.inputs, argv[i]))
+				return -1;
+		}
+		input_list_finish(ctx.inputs);
 	}
 
 	return 0;
 }
 
-struct xnb_header {
-	char magic[3];
-	char platform;
-	uint8_t version;
-#define FLAG_HIDEF      0x01
-#define FLAG_COMPRESSED 0x80
-	uint8_t flags;
-	uint32_t file_size;
-	uint32_t decompressed_size;
-} __attribute__((packed)) ;
-
-struct xnb_container {
-	struct xnb_header hdr;
-	int32_t type_reader_count;
-	struct type_reader_desc *readers;
-	int32_t shared_resource_count;
-	struct xnb_object_head *primary_asset;
-	struct xnb_object_head **shared_resources;
-};
-
-/* Modified from MS Document XNB Format.docx
- * http://xbox.create.msdn.com/en-US/sample/xnb_format
+/*
+ * Anything which changes what gets exported has to be part of the cache key,
+ * or changing it wouldn't re-export anything
  */
-int Read7BitEncodedInt(FILE *fp)
+static uint64_t export_opts_hash(const struct exec_context *ectx)
 {
-    int result = 0;
-    int bitsRead = 0;
-    char value;
-	size_t read;
-
-    do
-    {
-        read = fread(&value, 1, 1, fp);
-		if (read != 1)
-			return -1;
-        result |= (value & 0x7f) << bitsRead;
-        bitsRead += 7;
-    }
-    while (value & 0x80);
+	const struct xnb_export_opts *opts = &ectx->export_opts;
+	char buf[MAX_NAME_LEN + 64];
+	int len;
 
-    return result;
-}
+	len = snprintf(buf, sizeof(buf), "%d %u %d %d %s",
+			opts->texture_format, opts->sample_rate, opts->channels,
+			opts->sample_format, ectx->basename ? ectx->basename : "");
+	if (len >= (int)sizeof(buf))
+		len = sizeof(buf) - 1;
 
-void dump_header(struct xnb_header *hdr)
-{
-	printf("[XNB Container Header]\n");
-	printf("Magic: %.*s\n", 4, hdr->magic);
-	printf("Version: %d\n", hdr->version);
-	printf("Flags: 0x%02x\n", hdr->flags);
-	printf("File Size: %d (0x%08x)\n", hdr->file_size, hdr->file_size);
-	if (hdr->flags & FLAG_COMPRESSED)
-		printf("Decompressed Size: %d (0x%08x)\n", hdr->decompressed_size,
-				hdr->decompressed_size);
-	printf("----------------------\n");
+	return xxh64(buf, len, 0);
 }
 
-void dump_reader(struct type_reader_desc *rdr)
+/* Create any missing directories in path, as mkdir -p would for its parent */
+static int make_parents(char *path)
 {
-	printf("[Type Reader]\n");
-	printf("Name: %s\n", rdr->name);
-	printf("Version: %d\n", rdr->version);
-	printf("-------------\n");
+	char *slash = strrchr(path, '/');
+	int res = 0;
+
+	if (!slash || slash == path)
+		return 0;
+
+	/* Usually the directory is there already, so try the whole thing first */
+	*slash = '\0';
+	if (!mkdir(path, 0755) || errno == EEXIST) {
+		res = 0;
+	} else if (errno == ENOENT) {
+		res = make_parents(path);
+		if (!res && mkdir(path, 0755) && errno != EEXIST)
+			res = -1;
+	} else {
+		res = -1;
+	}
+	*slash = '/';
+
+	return res;
 }
 
-void dump_container(struct xnb_container *cont)
+/*
+ * Decode the container at cur, then list/export it, writing messages to out
+ * and errors to err_out. infile is used in messages. The exported files are
+ * named after outname, under the output prefix, unless there's a basename.
+ */
+static int process_container(const struct exec_context *ectx,
+		const struct xnb_export_opts *opts, const char *infile,
+		const char *outname, struct xnb_cursor *cur,
+		struct xnb_arena *arena, FILE *out, FILE *err_out)
 {
-	int i;
-	printf("XNB Container\n");
-	printf("=============\n");
-	dump_header(&cont->hdr);
-	printf("\n");
-	for (i = 0; i < cont->type_reader_count; i++) {
-		dump_reader(&cont->readers[i]);
-	}
-	printf("\n");
-	printf("Shared resource count: %d\n", cont->shared_resource_count);
-
-	printf("Primary Asset:\n");
-	if (cont->primary_asset) {
-		dump_object(cont->primary_asset);
-	} else {
-		printf("[NULL]\n");
+	struct xnb_container *cont;
+	struct stats_timer t;
+	unsigned int flags = 0;
+	int res = 0;
+
+	/* Listing only needs sizes, so don't bother with the payloads */
+	if (!(ectx->actions & ACTION_EXPORT))
+		flags |= XNB_READ_METADATA;
+
+	cont = read_container(cur, arena, flags);
+	if (!cont) {
+		fprintf(err_out, "Couldn't decode '%s'\n", infile);
+		return -1;
+	}
+
+	if ((ectx->actions & ACTION_LIST) && !ectx->quiet) {
+		stats_start(&t);
+		dump_container(cont, out);
+		stats_end_phase(&t, STATS_DUMP);
 	}
 
-	if (cont->shared_resource_count) {
-		printf("Shared Assets:\n");
-		for (i = 0; i < cont->shared_resource_count; i++) {
-			if (cont->shared_resources[i]) {
-				dump_object(cont->shared_resources[i]);
+	if (ectx->actions & ACTION_EXPORT) {
+		char filename[MAX_NAME_LEN];
+		const char *prefix = ectx->output_prefix;
+		const char *p;
+		int j, err;
+
+		/* Names in an archive are relative to it */
+		if (ectx->archive)
+			prefix = NULL;
+
+		stats_start(&t);
+
+		p = ectx->basename;
+		if (!p) {
+			p = outname;
+		}
+
+		if (prefix) {
+			snprintf(filename, MAX_NAME_LEN, "%s/%s", prefix, p);
+			if (make_parents(filename)) {
+				fprintf(err_out, "Couldn't create the directory for '%s': %s\n",
+						filename, strerror(errno));
+				destroy_container(cont);
+				return -1;
+			}
+		}
+
+		if (cont->primary_asset) {
+			if (prefix) {
+				snprintf(filename, MAX_NAME_LEN, "%s/%s", prefix, p);
+			} else {
+				snprintf(filename, MAX_NAME_LEN, "%s", p);
+			}
+
+			if (!ectx->quiet)
+				fprintf(out, "Exporting primary asset to (base): %s\n",
+						filename);
+
+			err = export_object(cont->primary_asset, opts, filename);
+			if (err) {
+				fprintf(err_out, "Couldn't export primary asset of '%s'\n",
+						infile);
+				res = err;
+			}
+		}
+		for (j = 0; j < cont->shared_resource_count; j++) {
+			if (!cont->shared_resources[j])
+				continue;
+
+			if (prefix) {
+				snprintf(filename, MAX_NAME_LEN, "%s/%s_shared_%d",
+						prefix, p, j + 1);
 			} else {
-				printf("[NULL]\n");
+				snprintf(filename, MAX_NAME_LEN, "%s_shared_%d", p, j + 1);
+			}
+
+			if (!ectx->quiet)
+				fprintf(out, "Exporting shared resource %i to (base): %s\n",
+						j + 1, filename);
+
+			err = export_object(cont->shared_resources[j], opts,
+					filename);
+			if (err) {
+				fprintf(err_out, "Couldn't export shared resource %d of '%s'\n",
+						j, infile);
+				res = err;
 			}
 		}
+		stats_end_phase(&t, STATS_EXPORT);
 	}
+	destroy_container(cont);
+
+	return res;
 }
 
-int read_header(struct xnb_header *hdr, FILE *fp)
+/*
+ * Decode (and list/export) a single input file, writing messages to out.
+ * If io is set, exports are written through it. If rd is set, it's the file,
+ * already being read by io.
+ */
+int process_file(const struct exec_context *ectx, int idx,
+		struct xnb_arena *arena, struct xnb_io *io, struct io_read *rd,
+		FILE *out)
 {
-	size_t read, size;
-	char magic[] = "XNB";
+	const struct input_file *f = input_list_get(ectx->inputs, idx);
+	const char *infile = f->name;
+	/*
+	 * Files found by walking a directory keep their place in it under the
+	 * output prefix or in an archive. Otherwise outputs go next to the input
+	 */
+	const char *outname = ectx->output_prefix || ectx->archive ?
+		f->rel : f->name;
+	struct xnb_export_opts opts = ectx->export_opts;
+	struct xnb_output_list outputs = { 0 };
+	struct cache_key key = { 0 };
+	struct xnb_mapping map;
+	struct xnb_cursor cur;
+	struct stats_timer t;
+	const uint8_t *data;
+	size_t size;
+	bool cacheable = false;
+	int res = 0;
 
-	size = sizeof(*hdr) - sizeof(hdr->decompressed_size);
-	read = fread(hdr, size, 1, fp);
-	if (read != 1)
-		return -1;
+	stats_add_file();
+	opts.io = io;
 
-	if (memcmp(hdr->magic, magic, 3))
-		return -1;
+	/* Most of the time, a stat() is all it takes to skip the file */
+	if (ectx->cache && !cache_stat(infile, &key)) {
+		cacheable = true;
+		if (ectx->use_cache && cache_lookup(ectx->cache, infile, &key))
+			goto unchanged;
+	}
 
-	if (hdr->flags & FLAG_COMPRESSED) {
-		size = sizeof(hdr->decompressed_size);
-		read = fread(&hdr->decompressed_size, size, 1, fp);
-		if (read != 1)
+	stats_start(&t);
+	if (rd) {
+		if (io_read_wait(io, rd)) {
+			fprintf(stderr, "Couldn't read '%s': %s\n", infile,
+					strerror(rd->err));
+			if (cacheable)
+				cache_remove(ectx->cache, infile);
+			return -1;
+		}
+		data = rd->data;
+		size = rd->size;
+	} else {
+		if (map_file(infile, &map)) {
+			fprintf(stderr, "Opening '%s' for reading failed\n", infile);
+			if (cacheable)
+				cache_remove(ectx->cache, infile);
 			return -1;
+		}
+		data = map.addr;
+		size = map.size;
+	}
+	stats_end_phase(&t, STATS_OPEN);
+
+	/* If only the mtime changed, the contents will still match */
+	if (cacheable) {
+		key.size = size;
+		key.hash = xxh64(data, size, 0);
+		key.has_hash = true;
+		if (ectx->use_cache && cache_lookup(ectx->cache, infile, &key)) {
+			if (!rd)
+				unmap_file(&map);
+			goto unchanged;
+		}
+		opts.outputs = &outputs;
+	}
+
+	if (!ectx->quiet && ectx->streamed)
+		fprintf(out, "Loading file %i: %s\n", idx + 1, infile);
+	else if (!ectx->quiet)
+		fprintf(out, "Loading file %i/%i: %s\n", idx + 1,
+				input_list_count(ectx->inputs, NULL), infile);
+
+	if (rd) {
+		cursor_init(&cur, data, size);
 	} else {
-		hdr->decompressed_size = hdr->file_size;
+		if (!(ectx->actions & ACTION_EXPORT))
+			map_advise_sparse(&map);
+		cursor_init_mapping(&cur, &map);
+	}
+	res = process_container(ectx, &opts, infile, outname, &cur, arena, out,
+			stderr);
+
+	if (!rd)
+		unmap_file(&map);
+	/*
+	 * Wait for the writes, so that if any fail, it's this file that did.
+	 * Its outputs also have to be written before they go in the manifest.
+	 */
+	if (io && io_drain(io))
+		res = -1;
+	if (cacheable) {
+		if (!res)
+			cache_update(ectx->cache, infile, &key, &outputs);
+		else
+			cache_remove(ectx->cache, infile);
 	}
+	output_list_free(&outputs);
+
+	return res;
 
+unchanged:
+	if (!ectx->quiet && ectx->streamed)
+		fprintf(out, "Skipping unchanged file %i: %s\n", idx + 1, infile);
+	else if (!ectx->quiet)
+		fprintf(out, "Skipping unchanged file %i/%i: %s\n", idx + 1,
+				input_list_count(ectx->inputs, NULL), infile);
 	return 0;
 }
 
-void destroy_container(struct xnb_container *cont)
+/*
+ * One request for --serve. Everything but what to do and where to put it
+ * comes from the command line.
+ */
+static int serve_request(void *arg, const struct serve_request *req,
+		struct xnb_arena *arena, struct xnb_output_list *outputs, FILE *out)
 {
-	int i;
-	for (i = 0; i < cont->shared_resource_count; i++) {
-		destroy_object(cont->shared_resources[i]);
+	struct exec_context ectx = *(const struct exec_context *)arg;
+	struct xnb_export_opts opts = ectx.export_opts;
+	const char *infile = req->path;
+	struct xnb_mapping map;
+	struct xnb_cursor cur;
+	struct stats_timer t;
+	int res;
+
+	ectx.actions = 0;
+	if (req->actions & SERVE_LIST)
+		ectx.actions |= ACTION_LIST;
+	if (req->actions & SERVE_EXPORT)
+		ectx.actions |= ACTION_EXPORT;
+	ectx.output_prefix = req->prefix;
+	ectx.basename = req->name;
+	opts.outputs = outputs;
+
+	stats_add_file();
+
+	if (!infile) {
+		cursor_init(&cur, req->data, req->size);
+		infile = req->name ? req->name : "data";
+		return process_container(&ectx, &opts, infile, infile, &cur, arena,
+				out, out);
+	}
+
+	stats_start(&t);
+	if (map_file(infile, &map)) {
+		fprintf(out, "Opening '%s' for reading failed\n", infile);
+		return -1;
 	}
-	destroy_object(cont->primary_asset);
-	free(cont->readers);
-	free(cont);
+	stats_end_phase(&t, STATS_OPEN);
+
+	if (!(ectx.actions & ACTION_EXPORT))
+		map_advise_sparse(&map);
+
+	cursor_init_mapping(&cur, &map);
+	res = process_container(&ectx, &opts, infile, infile, &cur, arena, out,
+			out);
+	unmap_file(&map);
+
+	return res;
 }
 
-struct xnb_container *read_container(FILE *fp)
+/*
+ * Output from each file is buffered until all of the files before it have
+ * been printed, so that the output order doesn't depend on the scheduling.
+ */
+struct batch {
+	const struct exec_context *ectx;
+	/* One per worker */
+	struct xnb_arena **arenas;
+	struct xnb_io **ios;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void batch_job(void *arg, int worker, int job)
 {
-	int res, i;
-	struct xnb_container *cont = malloc(sizeof(*cont));
-	if (!cont)
-		return NULL;
-	memset(cont, 0, sizeof(*cont));
+	struct batch *b = arg;
+	struct input_file *f = input_list_get(b->ectx->inputs, job);
+	FILE *out;
+	int res;
 
-	res = read_header(&cont->hdr, fp);
-	if (res) {
-		fprintf(stderr, "Couldn't read header\n");
-		goto fail;
+	out = open_memstream(&f->out, &f->out_len);
+	if (!out) {
+		fprintf(stderr, "Couldn't buffer output for '%s'\n", f->name);
+		res = -1;
+	} else {
+		res = process_file(b->ectx, job, b->arenas[worker],
+				b->ios ? b->ios[worker] : NULL, NULL, out);
+		fclose(out);
 	}
 
-	if (cont->hdr.flags & FLAG_COMPRESSED) {
-		fprintf(stderr, "Compressed files not supported\n");
-		goto fail;
+	pthread_mutex_lock(&b->lock);
+	f->res = res;
+	f->done = true;
+	pthread_cond_broadcast(&b->cond);
+	pthread_mutex_unlock(&b->lock);
+}
+
+static int batch_more(void *arg, int n_jobs)
+{
+	struct batch *b = arg;
+
+	return input_list_wait(b->ectx->inputs, n_jobs);
+}
+
+/* Returns the number of files which failed */
+int run_batch(const struct exec_context *ectx)
+{
+	struct xnb_pool *pool;
+	struct batch b = {
+		.ectx = ectx,
+	};
+	int i, n, n_workers, failed = 0;
+
+	n_workers = ectx->jobs;
+	if (!ectx->streamed) {
+		n = input_list_count(ectx->inputs, NULL);
+		if (n_workers > n)
+			n_workers = n;
 	}
 
-	cont->type_reader_count = Read7BitEncodedInt(fp);
-	if (cont->type_reader_count < 0) {
-		fprintf(stderr, "Couldn't get type reader count\n");
-		goto fail;
+	b.arenas = calloc(n_workers, sizeof(*b.arenas));
+	if (!b.arenas) {
+		fprintf(stderr, "Couldn't allocate space for workers\n");
+		return -1;
 	}
+	pthread_mutex_init(&b.lock, NULL);
+	pthread_cond_init(&b.cond, NULL);
 
-	cont->readers = malloc(sizeof(*cont->readers) * cont->type_reader_count);
-	if (!cont->readers) {
-		fprintf(stderr, "Out-of-memory allocating readers\n");
-		goto fail;
+	/* Each worker writes through its own engine */
+	if (ectx->use_io) {
+		b.ios = calloc(n_workers, sizeof(*b.ios));
+		if (!b.ios) {
+			fprintf(stderr, "Couldn't allocate space for workers\n");
+			failed = -1;
+			goto done;
+		}
 	}
 
-	for (i = 0; i < cont->type_reader_count; i++) {
-		int read;
-		struct type_reader_desc *r = &cont->readers[i];
-		read = Read7BitEncodedInt(fp);
-		if (read < 0) {
-			fprintf(stderr, "Couldn't read name of reader %d\n", i);
-			goto fail;
-		} else if (read > 255) {
-			read = 255;
+	for (i = 0; i < n_workers; i++) {
+		b.arenas[i] = arena_create();
+		if (!b.arenas[i]) {
+			failed = -1;
+			goto done;
+		}
+		if (b.ios) {
+			b.ios[i] = io_create(ectx->io_backend, IO_DEPTH);
+			if (!b.ios[i]) {
+				failed = -1;
+				goto done;
+			}
 		}
-		fgets(r->name, read + 1, fp);
-		read = fread(&r->version, sizeof(r->version), 1, fp);
-		if (read != 1) {
-			fprintf(stderr, "Couldn't read version of reader %d\n", i);
-			goto fail;
+	}
+
+	/* Workers pick up new names as soon as they're added */
+	pool = pool_create_stream(n_workers, batch_job, batch_more, &b);
+	if (!pool) {
+		failed = -1;
+		goto done;
+	}
+
+	for (i = 0; i < input_list_wait(ectx->inputs, i); i++) {
+		struct input_file *f = input_list_get(ectx->inputs, i);
+
+		pthread_mutex_lock(&b.lock);
+		while (!f->done)
+			pthread_cond_wait(&b.cond, &b.lock);
+		pthread_mutex_unlock(&b.lock);
+
+		if (f->out) {
+			fwrite(f->out, 1, f->out_len, stdout);
+			free(f->out);
+			f->out = NULL;
 		}
+		if (f->res)
+			failed++;
 	}
 
-	cont->shared_resource_count = Read7BitEncodedInt(fp);
-	if (cont->shared_resource_count < 0) {
-		fprintf(stderr, "Couldn't read shared resource count\n");
-		goto fail;
+	pool_join(pool);
+
+done:
+	for (i = 0; i < n_workers; i++) {
+		arena_destroy(b.arenas[i]);
+		if (b.ios)
+			io_destroy(b.ios[i]);
 	}
+	pthread_cond_destroy(&b.cond);
+	pthread_mutex_destroy(&b.lock);
+	free(b.ios);
+	free(b.arenas);
+	return failed;
+}
+
+/*
+ * Decode the files one at a time. With an I/O engine, the next few files are
+ * read while each one is decoded, and its exports are written while it's
+ * still being decoded. Returns the number of files which failed.
+ */
+int run_sequential(const struct exec_context *ectx)
+{
+	struct io_read *ahead[READ_AHEAD] = { NULL };
+	size_t ahead_size[READ_AHEAD] = { 0 };
+	size_t ahead_bytes = 0;
+	struct xnb_arena *arena;
+	struct xnb_io *io = NULL;
+	bool read_ahead;
+	int i, next = 0, failed = 0;
+
+	arena = arena_create();
+	if (!arena)
+		return -1;
 
-	i = Read7BitEncodedInt(fp);
-	if (i < 0) {
-		fprintf(stderr, "Couldn't read primary asset type\n");
-		goto fail;
-	} else if (i > 0) {
-		cont->primary_asset = read_object(&cont->readers[i - 1], fp);
-		if (!cont->primary_asset) {
-			fprintf(stderr, "Couldn't read primary asset\n");
-			goto fail;
+	if (ectx->use_io) {
+		io = io_create(ectx->io_backend, IO_DEPTH);
+		if (!io) {
+			arena_destroy(arena);
+			return -1;
 		}
 	}
 
-	for (i = 0; i < cont->shared_resource_count; i++) {
-		int type_idx = Read7BitEncodedInt(fp);
-		if (type_idx < 0) {
-			fprintf(stderr, "Couldn't read shared asset %d type\n",
-					type_idx);
-			goto fail;
-		} else if (type_idx > 0) {
-			cont->shared_resources[i] =
-				read_object(&cont->readers[type_idx - 1], fp);
-			if (!cont->shared_resources[i]) {
-				fprintf(stderr, "Couldn't read shared asset %d\n", type_idx);
-				goto fail;
+	/* Reading ahead is wasted if most of the files turn out unchanged */
+	read_ahead = io && !(ectx->cache && ectx->use_cache);
+
+	for (i = 0; i < input_list_wait(ectx->inputs, i); i++) {
+		struct io_read *rd;
+
+		/* Only the names we already have, so as not to hold this one up */
+		if (read_ahead) {
+			int avail = input_list_count(ectx->inputs, NULL);
+
+			/* The file needed now is always read, however big */
+			for (; next < avail && next < i + READ_AHEAD &&
+					(next == i || ahead_bytes < READ_AHEAD_BYTES);
+					next++) {
+				const char *name = input_list_get(ectx->inputs, next)->name;
+				rd = io_read_file(io, name);
+				ahead[next % READ_AHEAD] = rd;
+				ahead_size[next % READ_AHEAD] = rd ? rd->size : 0;
+				ahead_bytes += ahead_size[next % READ_AHEAD];
 			}
 		}
+
+		/* If it couldn't be opened, process_file() will say so */
+		rd = ahead[i % READ_AHEAD];
+		ahead[i % READ_AHEAD] = NULL;
+		ahead_bytes -= ahead_size[i % READ_AHEAD];
+		ahead_size[i % READ_AHEAD] = 0;
+
+		if (process_file(ectx, i, arena, io, rd, stdout))
+			failed++;
+
+		if (rd) {
+			io_read_wait(io, rd);
+			io_read_free(rd);
+		}
 	}
 
-	return cont;
+	io_destroy(io);
+	arena_destroy(arena);
 
-fail:
-	destroy_container(cont);
-	return NULL;
+	return failed;
 }
 
-int main(int argc, char *argv[])
+/* Adds the inputs from a list or directories, while they're being decoded */
+static void *read_inputs_main(void *data)
 {
+	struct exec_context *ectx = data;
+	intptr_t res = 0;
 	int i;
+
+	if (!ectx->paths) {
+		res = input_list_read(ectx->inputs, ectx->list_fd, ectx->list_delim);
+		input_list_finish(ectx->inputs);
+		return (void *)res;
+	}
+
+	/* In the order given, with each directory's files in the place of it */
+	for (i = 0; i < ectx->n_paths; i++) {
+		const char *path = ectx->paths[i];
+		struct stat st;
+
+		if (!stat(path, &st) && S_ISDIR(st.st_mode)) {
+			if (input_list_add_dir(ectx->inputs, path, ectx->jobs))
+				res = -1;
+		} else if (input_list_add(ectx->inputs, path)) {
+			res = -1;
+			break;
+		}
+	}
+	input_list_finish(ectx->inputs);
+
+	return (void *)res;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t reader;
+	bool reading = false;
+	int n = 0;
+	int failed = 0;
 	int res = 0;
 
 	res = parse_options(argc, argv);
@@ -437,80 +1045,138 @@ int main(int argc, char *argv[])
 		goto exit;
 	}
 
-	for (i = 0; i < ctx.n_input_files; i++) {
-		struct xnb_container *cont;
-		FILE *fp;
+	if (ctx.stats != STATS_NONE)
+		stats_enable();
 
-		if (!ctx.quiet)
-			printf("Loading file %i/%i: %s\n", i + 1, ctx.n_input_files,
-					ctx.input_files[i]);
+	if (ctx.actions & ACTION_SELF_TEST) {
+		res = bcn_self_test() ? 1 : 0;
+		goto exit;
+	}
 
-		fp = fopen(ctx.input_files[i], "r");
-		if (!fp) {
-			fprintf(stderr, "Opening '%s' for reading failed\n",
-					ctx.input_files[i]);
-			continue;
-		}
+	if (ctx.serve && ctx.serve_path) {
+		/* Up to --jobs connections are served in parallel */
+		res = serve_socket(ctx.serve_path, ctx.jobs, serve_request, &ctx);
+		res = res ? 1 : 0;
+		goto exit;
+	} else if (ctx.serve) {
+		/* One request at a time, so let the exporter use the threads */
+		ctx.export_opts.threads = ctx.jobs;
+		res = serve_stream(stdin, stdout, serve_request, &ctx) ? 1 : 0;
+		goto exit;
+	}
+
+	if ((ctx.actions & ACTION_EXPORT) && ctx.archive) {
+		char path[MAX_NAME_LEN];
 
-		cont = read_container(fp);
-		fclose(fp);
-		if (!cont) {
-			continue;
+		if (ctx.output_prefix)
+			snprintf(path, MAX_NAME_LEN, "%s/%s", ctx.output_prefix,
+					ctx.archive);
+		else
+			snprintf(path, MAX_NAME_LEN, "%s", ctx.archive);
+
+		ctx.export_opts.sink = archive_sink_create(path);
+		if (!ctx.export_opts.sink) {
+			res = 1;
+			goto exit;
+		}
+	} else if ((ctx.actions & ACTION_EXPORT) && ctx.output_prefix) {
+		ctx.cache = cache_open(ctx.output_prefix, export_opts_hash(&ctx));
+		if (!ctx.cache) {
+			res = 1;
+			goto exit;
 		}
+	}
 
-		if ((ctx.actions & ACTION_LIST) & !ctx.quiet)
-			dump_container(cont);
+	/* Archives are written in full anyway, so there's nothing to link */
+	if ((ctx.actions & ACTION_EXPORT) && ctx.dedupe && !ctx.archive) {
+		ctx.export_opts.dedupe = dedupe_create(ctx.link_mode);
+		if (!ctx.export_opts.dedupe) {
+			res = 1;
+			goto exit;
+		}
+	}
 
-		if (ctx.actions * ACTION_EXPORT) {
-			char filename[MAX_NAME_LEN];
-			char *p;
-			int j;
+	/*
+	 * A list in a regular file is quick to read in full, and then we know
+	 * how many there are. Anything else is read as it arrives.
+	 */
+	if (ctx.list_fd >= 0) {
+		struct stat st;
 
-			p = ctx.basename;
-			if (!p) {
-				p = ctx.input_files[i];
+		if (!fstat(ctx.list_fd, &st) && S_ISREG(st.st_mode)) {
+			if (input_list_read(ctx.inputs, ctx.list_fd, ctx.list_delim)) {
+				res = 1;
+				goto exit;
 			}
+			input_list_finish(ctx.inputs);
+		} else {
+			ctx.streamed = true;
+		}
+	} else if (ctx.paths) {
+		ctx.streamed = true;
+	}
 
-			if (cont->primary_asset) {
-				if (ctx.output_prefix) {
-					snprintf(filename, MAX_NAME_LEN, "%s/%s",
-							ctx.output_prefix, p);
-				} else {
-					snprintf(filename, MAX_NAME_LEN, "%s", p);
-				}
+	if (!ctx.streamed)
+		n = input_list_count(ctx.inputs, NULL);
 
-				if (!ctx.quiet)
-					printf("Exporting primary asset to (base): %s\n",
-							filename);
+	/* With a single file, let the exporter use the threads instead */
+	if (n == 1)
+		ctx.export_opts.threads = ctx.jobs;
+	else
+		ctx.export_opts.threads = 1;
 
-				res = export_object(cont->primary_asset, filename);
-				if (res)
-					fprintf(stderr, "Couldn't export primary asset\n");
-			}
-			for (j = 0; j < cont->shared_resource_count; j++) {
-				if (ctx.output_prefix) {
-					snprintf(filename, MAX_NAME_LEN, "%s/%s_shared_%d",
-							ctx.output_prefix, p, j + 1);
-				} else {
-					snprintf(filename, MAX_NAME_LEN, "%s_shared_%d", p, j + 1);
-				}
+	if (ctx.streamed) {
+		res = pthread_create(&reader, NULL, read_inputs_main, &ctx);
+		if (res) {
+			fprintf(stderr, "Couldn't start reading the inputs: %s\n",
+					strerror(res));
+			res = 1;
+			goto exit;
+		}
+		reading = true;
+	}
 
-				if (!ctx.quiet)
-					printf("Exporting shared resource %i to (base): %s\n",
-							j + 1, filename);
+	if (ctx.jobs > 1 && (ctx.streamed || n > 1))
+		failed = run_batch(&ctx);
+	else if (ctx.streamed || n)
+		failed = run_sequential(&ctx);
 
-				res = export_object(cont->shared_resources[j], filename);
-				if (res)
-					fprintf(stderr, "Couldn't export shared resource %d\n", j);
-			}
-		}
-		destroy_container(cont);
+	if (reading) {
+		void *ret;
+
+		pthread_join(reader, &ret);
+		reading = false;
+		if (ret)
+			res = 1;
+	}
+
+	if (ctx.export_opts.dedupe && !ctx.quiet)
+		dedupe_print(ctx.export_opts.dedupe, stdout);
+
+	if (failed < 0) {
+		res = 1;
+	} else if (failed) {
+		fprintf(stderr, "%d of %d file(s) failed\n", failed,
+				input_list_count(ctx.inputs, NULL));
+		res = 1;
 	}
 
 exit:
-	for (i = 0; i < ctx.n_input_files; i++) {
-		free(ctx.input_files[i]);
+	if (ctx.export_opts.sink && archive_sink_finish(ctx.export_opts.sink)) {
+		fprintf(stderr, "Couldn't finish the archive\n");
+		res = 1;
+	}
+	if (ctx.cache && cache_close(ctx.cache)) {
+		fprintf(stderr, "Couldn't save the cache manifest\n");
+		res = 1;
 	}
-	free(ctx.input_files);
+	if (ctx.stats == STATS_TEXT)
+		stats_print(stderr);
+	else if (ctx.stats == STATS_JSON)
+		stats_print_json(stderr);
+	if (ctx.list_fd > STDIN_FILENO)
+		close(ctx.list_fd);
+	dedupe_destroy(ctx.export_opts.dedupe);
+	input_list_destroy(ctx.inputs);
 	return res;
 }